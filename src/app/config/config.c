@@ -360,6 +360,7 @@ static const config_var_t option_vars_[] = {
   V(CircuitsAvailableTimeout,    INTERVAL, "0"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-1.0"), /*negative:'Use default'*/
+  V(CircuitPriorityBuckets,      BOOL,     "0"),
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
 #if defined(HAVE_MODULE_RELAY) || defined(TOR_UNIT_TESTS)
   /* The unit tests expect the ClientOnly default to be 0. */
@@ -531,6 +532,7 @@ static const config_var_t option_vars_[] = {
   VAR_D("HSLayer3Nodes",         ROUTERSET,  HSLayer3Nodes,  NULL),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
   V_IMMUTABLE(KeepBindCapabilities,        AUTOBOOL, "auto"),
+  V(KernelTLS,                   BOOL,     "0"),
   VAR("Log",                     LINELIST, Logs,             NULL),
   V(LogMessageDomains,           BOOL,     "0"),
   V(LogTimeGranularity,          MSEC_INTERVAL, "1 second"),
@@ -629,6 +631,7 @@ static const config_var_t option_vars_[] = {
   V(SafeSocks,                   BOOL,     "0"),
   V(ServerDNSAllowBrokenConfig,  BOOL,     "1"),
   V(ServerDNSAllowNonRFC953Hostnames, BOOL,"0"),
+  V(ServerDNSCacheMaxSize,       MEMUNIT,  "0"),
   V(ServerDNSDetectHijacking,    BOOL,     "1"),
   V(ServerDNSRandomizeCase,      BOOL,     "1"),
   V(ServerDNSResolvConfFile,     FILENAME,   NULL),
@@ -640,6 +643,7 @@ static const config_var_t option_vars_[] = {
   OBSOLETE("SchedulerMaxFlushCells__"),
   V(KISTSchedRunInterval,        MSEC_INTERVAL, "0 msec"),
   V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
+  V(KISTAdaptiveSampling,        BOOL,     "0"),
   V(Schedulers,                  CSV,      "KIST,KISTLite,Vanilla"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   OBSOLETE("SocksListenAddress"),
@@ -4031,6 +4035,10 @@ options_validate_cb(const void *old_options_, void *options_, char **msg)
                         "testing Tor network!");
   }
 
+  /* The sandbox doesn't let OpenSSL set the kernel TLS socket options. */
+  if (options->KernelTLS && options->Sandbox)
+    REJECT("KernelTLS is not compatible with Sandbox.");
+
   if (options_validate_scheduler(options, msg) < 0) {
     return -1;
   }
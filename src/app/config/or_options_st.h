@@ -393,6 +393,9 @@ struct or_options_t {
                        * descriptor? Remember to publish them independently. */
   int KeepalivePeriod; /**< How often do we send padding cells to keep
                         * connections alive? */
+  /** Boolean: should we let the kernel encrypt and decrypt TLS records,
+   * when it can? */
+  int KernelTLS;
   int SocksTimeout; /**< How long do we let a socks connection wait
                      * unattached before we fail it? */
   int LearnCircuitBuildTimeout; /**< If non-zero, we attempt to learn a value
@@ -639,6 +642,9 @@ struct or_options_t {
                                 * with weird characters. */
   /** If true, we try resolving hostnames with weird characters. */
   int ServerDNSAllowNonRFC953Hostnames;
+  /** If nonzero, the most memory we let the exit DNS cache use, in
+   * bytes. */
+  uint64_t ServerDNSCacheMaxSize;
 
   /** If true, we try to download extra-info documents (and we serve them,
    * if we are a cache).  For authorities, this is always true. */
@@ -852,6 +858,10 @@ struct or_options_t {
    */
   double CircuitPriorityHalflife;
 
+  /** If true, new channels keep their active circuits in buckets of
+   * similar weighted cell counts rather than in a heap ordered by count. */
+  int CircuitPriorityBuckets;
+
   /** Set to true if the TestingTorNetwork configuration option is set.
    * This is used so that options_validate() has a chance to realize that
    * the defaults have changed. */
@@ -1017,6 +1027,11 @@ struct or_options_t {
   /** A multiplier for the KIST per-socket limit calculation. */
   double KISTSockBufSizeFactor;
 
+  /** If true, KIST reuses its last reading of a socket's TCP info for a few
+   * runs while the socket isn't congested, rather than asking the kernel
+   * again on every run. */
+  int KISTAdaptiveSampling;
+
   /** The list of scheduler type string ordered by priority that is first one
    * has to be tried first. Default: KIST,KISTLite,Vanilla */
   struct smartlist_t *Schedulers;
@@ -404,6 +404,7 @@ dumpstats(int severity)
 
   cpuworker_log_onionskin_overhead(severity, ONION_HANDSHAKE_TYPE_TAP, "TAP");
   cpuworker_log_onionskin_overhead(severity, ONION_HANDSHAKE_TYPE_NTOR,"ntor");
+  cpuworker_log_onionskin_batching(severity);
 
   if (now - time_of_process_start >= 0)
     elapsed = now - time_of_process_start;
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+
+# Copyright (c) 2021, The Tor Project, Inc.
+# See LICENSE for licensing information
+
+"""Turn a text geoip or geoip6 file into the binary format that Tor can
+   map into memory instead of parsing.
+
+   Usage: geoip-compile.py INPUT OUTPUT
+
+   INPUT is a text file in the format that mmdb-convert.py writes; to start
+   from a MaxMind database, run mmdb-convert.py on it first.  Whether INPUT
+   is an IPv4 or an IPv6 file is decided from its contents.
+
+   The binary format is described in geoip_load_binary_file() in
+   src/lib/geoip/geoip.c.  The output records the SHA1 digest of INPUT, so
+   that relays report the same GeoIP digest whichever one they load.
+"""
+
+import hashlib
+import socket
+import struct
+import sys
+
+MAGIC = b"TORGEOIP"
+VERSION = 1
+
+
+def parse_line(line):
+    """Return (family, low, high, country) for a line of a text geoip file,
+       with low and high as big-endian bytes, or None if the line has no
+       entry."""
+    line = line.strip()
+    if not line or line.startswith("#"):
+        return None
+    fields = [f.strip('"') for f in line.split(",")]
+    if len(fields) < 3 or len(fields[2]) != 2:
+        raise ValueError("Bad line: %r" % line)
+    low, high, country = fields[0], fields[1], fields[2]
+    if ":" in low:
+        return (6, socket.inet_pton(socket.AF_INET6, low),
+                socket.inet_pton(socket.AF_INET6, high), country)
+    return (4, struct.pack("!I", int(low)), struct.pack("!I", int(high)),
+            country)
+
+
+def compile_geoip(text):
+    """Return the binary form of the text geoip file <text>, as bytes."""
+    entries = []
+    family = None
+    for line in text.decode("ascii").splitlines():
+        entry = parse_line(line)
+        if entry is None:
+            continue
+        if family is None:
+            family = entry[0]
+        elif entry[0] != family:
+            raise ValueError("File mixes IPv4 and IPv6 entries")
+        if entry[1] > entry[2]:
+            raise ValueError("Range ends before it starts: %r" % line)
+        entries.append(entry[1:])
+    if family is None:
+        raise ValueError("File has no entries")
+
+    entries.sort()
+    for prev, cur in zip(entries, entries[1:]):
+        if cur[0] <= prev[1]:
+            raise ValueError("Overlapping ranges")
+
+    countries = sorted(set(e[2] for e in entries))
+    country_idx = dict((c, i) for i, c in enumerate(countries))
+
+    out = [MAGIC,
+           struct.pack("!BBHI", VERSION, family, len(countries),
+                       len(entries)),
+           hashlib.sha1(text).digest(),
+           b"\0" * 4]
+    out.extend(c.encode("ascii") for c in countries)
+    for low, high, country in entries:
+        out.append(low + high + struct.pack("!H", country_idx[country]))
+    return b"".join(out)
+
+
+def main(argv):
+    if len(argv) != 3:
+        sys.stderr.write(__doc__)
+        return 1
+    with open(argv[1], "rb") as f:
+        text = f.read()
+    try:
+        binary = compile_geoip(text)
+    except ValueError as e:
+        sys.stderr.write("%s: %s\n" % (argv[1], e))
+        return 1
+    with open(argv[2], "wb") as f:
+        f.write(binary)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -97,6 +97,83 @@ relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in)
   crypto_cipher_crypt_inplace(cipher, (char*) in, CELL_PAYLOAD_SIZE);
 }
 
+/** Apply <b>cipher</b> to the payloads of the <b>n_cells</b> cells in
+ * <b>cells</b>, in order and in place.
+ *
+ * This gives the same result as calling relay_crypt_one_payload() on each
+ * cell in turn: since the cipher is a stream cipher, processing a batch of
+ * cells with one key before moving to the next key is equivalent to
+ * alternating keys cell by cell, but keeps a single cipher context hot.
+ */
+void
+relay_crypt_payloads(crypto_cipher_t *cipher, cell_t **cells, size_t n_cells)
+{
+  size_t i;
+
+  for (i = 0; i < n_cells; ++i) {
+    crypto_cipher_crypt_inplace(cipher, (char*) cells[i]->payload,
+                                CELL_PAYLOAD_SIZE);
+  }
+}
+
+/** Do the en/decryption of the <b>n_cells</b> cells in <b>cells</b>, all
+ * arriving on <b>or_circ</b> in direction <b>cell_direction</b>: encrypt one
+ * layer if they are headed toward the origin, else decrypt one layer.
+ *
+ * This only applies the cipher. Cells headed away from the origin must
+ * still be checked one at a time, in order, with relay_cell_is_recognized()
+ * since a recognized cell updates the running digest; that check doesn't
+ * depend on the cipher state so it can be done after the whole batch has
+ * been crypted.
+ */
+void
+relay_crypt_cells(or_circuit_t *or_circ, cell_t **cells, size_t n_cells,
+                  cell_direction_t cell_direction)
+{
+  relay_crypto_t *crypto;
+
+  tor_assert(or_circ);
+  tor_assert(cells || n_cells == 0);
+  tor_assert(cell_direction == CELL_DIRECTION_IN ||
+             cell_direction == CELL_DIRECTION_OUT);
+
+  crypto = &or_circ->crypto;
+  if (cell_direction == CELL_DIRECTION_IN) {
+    relay_crypt_payloads(crypto->b_crypto, cells, n_cells);
+  } else {
+    relay_crypt_payloads(crypto->f_crypto, cells, n_cells);
+  }
+}
+
+/** Return 1 iff <b>cell</b>, already crypted by relay_crypt_cells() on
+ * <b>or_circ</b> in direction <b>cell_direction</b>, is for us. If so, the
+ * forward digest of the circuit is updated with it; otherwise the digest
+ * and the cell are left untouched. Return 0 if the cell must be relayed. */
+int
+relay_cell_is_recognized(or_circuit_t *or_circ, cell_t *cell,
+                         cell_direction_t cell_direction)
+{
+  relay_header_t rh;
+
+  tor_assert(or_circ);
+  tor_assert(cell);
+
+  /* We're in the middle: only cells going away from the origin can be for
+   * us. */
+  if (cell_direction != CELL_DIRECTION_OUT) {
+    return 0;
+  }
+
+  relay_header_unpack(&rh, cell->payload);
+  if (rh.recognized == 0) {
+    /* it's possibly recognized. have to check digest to be sure. */
+    if (relay_digest_matches(or_circ->crypto.f_digest, cell)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 /** Return the sendme_digest within the <b>crypto</b> object. */
 uint8_t *
 relay_crypto_get_sendme_digest(relay_crypto_t *crypto)
@@ -186,23 +263,18 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
              "Incoming cell at client not recognized. Closing.");
       return -1;
     } else {
-      relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
       /* We're in the middle. Encrypt one layer. */
-      relay_crypt_one_payload(crypto->b_crypto, cell->payload);
+      relay_crypt_cells(TO_OR_CIRCUIT(circ), &cell, 1, cell_direction);
     }
   } else /* cell_direction == CELL_DIRECTION_OUT */ {
     /* We're in the middle. Decrypt one layer. */
-    relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
 
-    relay_crypt_one_payload(crypto->f_crypto, cell->payload);
+    relay_crypt_cells(or_circ, &cell, 1, cell_direction);
 
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(crypto->f_digest, cell)) {
-        *recognized = 1;
-        return 0;
-      }
+    if (relay_cell_is_recognized(or_circ, cell, cell_direction)) {
+      *recognized = 1;
+      return 0;
     }
   }
   return 0;
@@ -219,19 +291,45 @@ void
 relay_encrypt_cell_outbound(cell_t *cell,
                             origin_circuit_t *circ,
                             crypt_path_t *layer_hint)
+{
+  relay_encrypt_cells_outbound(&cell, 1, circ, layer_hint);
+}
+
+/**
+ * Encrypt the <b>n_cells</b> cells in <b>cells</b> that we are creating, and
+ * sending outbound on <b>circ</b> until the hop corresponding to
+ * <b>layer_hint</b>, in that order.
+ *
+ * Each hop's layer is applied to the whole batch before moving to the next
+ * hop. Every cell must count against the package window of <b>layer_hint</b>
+ * (see sendme_record_sending_cell_digest_in_batch()), which the caller
+ * decrements once the cells are queued.
+ *
+ * The integrity field and recognized field of the cells' relay headers must
+ * be set to zero.
+ */
+void
+relay_encrypt_cells_outbound(cell_t **cells, size_t n_cells,
+                             origin_circuit_t *circ,
+                             crypt_path_t *layer_hint)
 {
   crypt_path_t *thishop; /* counter for repeated crypts */
-  cpath_set_cell_forward_digest(layer_hint, cell);
+  size_t i;
 
-  /* Record cell digest as the SENDME digest if need be. */
-  sendme_record_sending_cell_digest(TO_CIRCUIT(circ), layer_hint);
+  for (i = 0; i < n_cells; ++i) {
+    cpath_set_cell_forward_digest(layer_hint, cells[i]);
+
+    /* Record cell digest as the SENDME digest if need be. */
+    sendme_record_sending_cell_digest_in_batch(TO_CIRCUIT(circ), layer_hint,
+                                               (int) i);
+  }
 
   thishop = layer_hint;
   /* moving from farthest to nearest hop */
   do {
     tor_assert(thishop);
-    log_debug(LD_OR,"encrypting a layer of the relay cell.");
-    cpath_crypt_cell(thishop, cell->payload, false);
+    log_debug(LD_OR,"encrypting a layer of %d relay cell(s).", (int)n_cells);
+    cpath_crypt_cells(thishop, cells, n_cells, false);
 
     thishop = thishop->prev;
   } while (thishop != circ->cpath->prev);
@@ -248,13 +346,36 @@ void
 relay_encrypt_cell_inbound(cell_t *cell,
                            or_circuit_t *or_circ)
 {
-  relay_set_digest(or_circ->crypto.b_digest, cell);
+  relay_encrypt_cells_inbound(&cell, 1, or_circ);
+}
+
+/**
+ * Encrypt the <b>n_cells</b> cells in <b>cells</b> that we are creating, and
+ * sending on <b>or_circ</b> to the origin, in that order.
+ *
+ * Every cell must count against the package window of the circuit (see
+ * sendme_record_sending_cell_digest_in_batch()), which the caller decrements
+ * once the cells are queued.
+ *
+ * The integrity field and recognized field of the cells' relay headers must
+ * be set to zero.
+ */
+void
+relay_encrypt_cells_inbound(cell_t **cells, size_t n_cells,
+                            or_circuit_t *or_circ)
+{
+  size_t i;
+
+  for (i = 0; i < n_cells; ++i) {
+    relay_set_digest(or_circ->crypto.b_digest, cells[i]);
 
-  /* Record cell digest as the SENDME digest if need be. */
-  sendme_record_sending_cell_digest(TO_CIRCUIT(or_circ), NULL);
+    /* Record cell digest as the SENDME digest if need be. */
+    sendme_record_sending_cell_digest_in_batch(TO_CIRCUIT(or_circ), NULL,
+                                               (int) i);
+  }
 
   /* encrypt one layer */
-  relay_crypt_one_payload(or_circ->crypto.b_crypto, cell->payload);
+  relay_crypt_payloads(or_circ->crypto.b_crypto, cells, n_cells);
 }
 
 /**
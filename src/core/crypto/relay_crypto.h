@@ -23,6 +23,16 @@ void relay_encrypt_cell_outbound(cell_t *cell, origin_circuit_t *or_circ,
                             crypt_path_t *layer_hint);
 void relay_encrypt_cell_inbound(cell_t *cell, or_circuit_t *or_circ);
 
+void relay_crypt_cells(or_circuit_t *or_circ, cell_t **cells, size_t n_cells,
+                       cell_direction_t cell_direction);
+int relay_cell_is_recognized(or_circuit_t *or_circ, cell_t *cell,
+                             cell_direction_t cell_direction);
+void relay_encrypt_cells_outbound(cell_t **cells, size_t n_cells,
+                                  origin_circuit_t *circ,
+                                  crypt_path_t *layer_hint);
+void relay_encrypt_cells_inbound(cell_t **cells, size_t n_cells,
+                                 or_circuit_t *or_circ);
+
 void relay_crypto_clear(relay_crypto_t *crypto);
 
 void relay_crypto_assert_ok(const relay_crypto_t *crypto);
@@ -34,6 +44,8 @@ void relay_crypto_record_sendme_digest(relay_crypto_t *crypto,
 
 void
 relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in);
+void
+relay_crypt_payloads(crypto_cipher_t *cipher, cell_t **cells, size_t n_cells);
 
 void
 relay_set_digest(crypto_digest_t *digest, cell_t *cell);
@@ -684,6 +684,13 @@ connection_new(int type, int socket_family)
   }
 }
 
+/** Allocation size for the chunks of an OR connection's outbuf.  We hand
+ * each chunk to the TLS library in a single write, which turns it into one
+ * TLS record: with the 4KB default, a busy connection sends four small
+ * records (and makes four TLS write calls) where one would do.  16KB is the
+ * largest record payload TLS allows. */
+#define OR_CONN_OUTBUF_CHUNK_SIZE (16*1024)
+
 /** Initializes conn. (you must call connection_add() to link it into the main
  * array).
  *
@@ -734,6 +741,8 @@ connection_init(time_t now, connection_t *conn, int type, int socket_family)
     /* listeners never use their buf */
     conn->inbuf = buf_new();
     conn->outbuf = buf_new();
+    if (type == CONN_TYPE_OR || type == CONN_TYPE_EXT_OR)
+      buf_set_default_chunk_size(conn->outbuf, OR_CONN_OUTBUF_CHUNK_SIZE);
   }
 
   conn->timestamp_created = now;
@@ -4224,7 +4233,9 @@ connection_fetch_from_buf_http(connection_t *conn,
 int
 connection_wants_to_flush(connection_t *conn)
 {
-  return connection_get_outbuf_len(conn) > 0;
+  return connection_get_outbuf_len(conn) > 0 ||
+    (conn->type == CONN_TYPE_DIR &&
+     connection_dirserv_sendfile_pending(TO_DIR_CONN(conn)));
 }
 
 /** Are there too many bytes on edge connection <b>conn</b>'s outbuf to
@@ -4459,6 +4470,13 @@ connection_handle_write_impl(connection_t *conn, int force)
     CONN_LOG_PROTECT(conn,
                      result = buf_flush_to_socket(conn->outbuf, conn->s,
                                                   max_to_write));
+    if (result >= 0 && conn->type == CONN_TYPE_DIR &&
+        result < max_to_write && !buf_datalen(conn->outbuf)) {
+      /* Directory bodies can go straight from their files to the socket. */
+      int r = connection_dirserv_sendfile_some(TO_DIR_CONN(conn),
+                                               max_to_write - result);
+      result = r < 0 ? r : result + r;
+    }
     if (result < 0) {
       if (CONN_IS_EDGE(conn))
         connection_edge_end_errno(TO_EDGE_CONN(conn));
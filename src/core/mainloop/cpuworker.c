@@ -17,6 +17,7 @@
  *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
  *  </ul>
  **/
+#define CPUWORKER_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/circuitlist.h"
@@ -76,6 +77,9 @@ static threadpool_t *threadpool = NULL;
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
 
+/** Largest number of onionskins that we put in a single cpuworker job. */
+#define CPUWORKER_MAX_BATCH 8
+
 /** Initialize the cpuworker subsystem. It is OK to call this more than once
  * during Tor's lifetime.
  */
@@ -160,14 +164,44 @@ typedef struct cpuworker_reply_t {
   uint8_t rend_auth_material[DIGEST_LEN];
 } cpuworker_reply_t;
 
-typedef struct cpuworker_job_u_t {
+/** One onionskin of a cpuworker job, with the circuit that it is for. */
+typedef struct cpuworker_onion_t {
   or_circuit_t *circ;
   union {
     cpuworker_request_t request;
     cpuworker_reply_t reply;
   } u;
+} cpuworker_onion_t;
+
+/** A job for the cpuworkers: one or more onionskins, which a worker
+ * processes back to back and answers with a single reply. */
+typedef struct cpuworker_job_t {
+  /** Number of onionskins in <b>onions</b>. */
+  int n_onions;
+  cpuworker_onion_t onions[FLEXIBLE_ARRAY_MEMBER];
 } cpuworker_job_t;
 
+/** Return a new job with room for <b>n_onions</b> onionskins. */
+static cpuworker_job_t *
+cpuworker_job_new(int n_onions)
+{
+  cpuworker_job_t *job;
+
+  tor_assert(n_onions > 0 && n_onions <= CPUWORKER_MAX_BATCH);
+  job = tor_malloc_zero(offsetof(cpuworker_job_t, onions) +
+                        n_onions * sizeof(cpuworker_onion_t));
+  return job;
+}
+
+/** Wipe and free <b>job</b>. */
+static void
+cpuworker_job_free(cpuworker_job_t *job, int wipe_byte)
+{
+  memwipe(job, wipe_byte, offsetof(cpuworker_job_t, onions) +
+          job->n_onions * sizeof(cpuworker_onion_t));
+  tor_free(job);
+}
+
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
 {
@@ -215,6 +249,11 @@ static uint64_t onionskins_usec_internal[MAX_ONION_HANDSHAKE_TYPE+1];
  */
 static uint64_t onionskins_usec_roundtrip[MAX_ONION_HANDSHAKE_TYPE+1];
 
+/** How many jobs have the cpuworkers answered, and how many onionskins did
+ * those jobs hold? */
+static uint64_t onion_jobs_n_answered = 0;
+static uint64_t onion_jobs_n_onionskins = 0;
+
 /** If any onionskin takes longer than this, we clip them to this
  * time. (microseconds) */
 #define MAX_BELIEVABLE_ONIONSKIN_DELAY (2*1000*1000)
@@ -307,19 +346,50 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
-/** Handle a reply from the worker threads. */
+/** Log how many onionskins the cpuworker jobs have held on average. */
+void
+cpuworker_log_onionskin_batching(int severity)
+{
+  if (!onion_jobs_n_answered)
+    return;
+
+  log_fn(severity, LD_OR,
+         "Cpuworkers have answered %"PRIu64" onionskins in %"PRIu64" jobs "
+         "(%.2f onionskins per job).",
+         onion_jobs_n_onionskins, onion_jobs_n_answered,
+         ((double)onion_jobs_n_onionskins) / onion_jobs_n_answered);
+}
+
+/** Fill <b>out</b> with statistics about the onionskins that the
+ * cpuworkers processed. */
+void
+cpuworker_get_onion_stats(cpuworker_onion_stats_t *out)
+{
+  int type;
+
+  tor_assert(out);
+  memset(out, 0, sizeof(*out));
+  out->n_jobs = onion_jobs_n_answered;
+  out->n_onionskins = onion_jobs_n_onionskins;
+  for (type = 0; type <= MAX_ONION_HANDSHAKE_TYPE; ++type) {
+    if (!onionskins_n_processed[type])
+      continue;
+    out->usec_worker[type] = (uint32_t)
+      (onionskins_usec_internal[type] / onionskins_n_processed[type]);
+    out->usec_roundtrip[type] = (uint32_t)
+      (onionskins_usec_roundtrip[type] / onionskins_n_processed[type]);
+  }
+}
+
+/** Handle the answer of the worker threads to one onionskin of a job. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_reply(cpuworker_onion_t *onion)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
-  tor_assert(total_pending_tasks > 0);
-  --total_pending_tasks;
-
   /* Could avoid this, but doesn't matter. */
-  memcpy(&rpl, &job->u.reply, sizeof(rpl));
+  memcpy(&rpl, &onion->u.reply, sizeof(rpl));
 
   tor_assert(rpl.magic == CPUWORKER_REPLY_MAGIC);
 
@@ -347,16 +417,16 @@ cpuworker_onion_handshake_replyfn(void *work_)
     }
   }
 
-  circ = job->circ;
+  circ = onion->circ;
 
   log_debug(LD_OR,
             "Unpacking cpuworker reply %p, circ=%p, success=%d",
-            job, circ, rpl.success);
+            onion, circ, rpl.success);
 
   if (circ->base_.magic == DEAD_CIRCUIT_MAGIC) {
     /* The circuit was supposed to get freed while the reply was
      * pending. Instead, it got left for us to free so that we wouldn't freak
-     * out when the job->circ field wound up pointing to nothing. */
+     * out when the onion->circ field wound up pointing to nothing. */
     log_debug(LD_OR, "Circuit died while reply was pending. Freeing memory.");
     circ->base_.magic = 0;
     tor_free(circ);
@@ -364,6 +434,7 @@ cpuworker_onion_handshake_replyfn(void *work_)
   }
 
   circ->workqueue_entry = NULL;
+  circ->workqueue_entry_is_batch = 0;
 
   if (TO_CIRCUIT(circ)->marked_for_close) {
     /* We already marked this circuit; we can't call it open. */
@@ -391,24 +462,41 @@ cpuworker_onion_handshake_replyfn(void *work_)
 
  done_processing:
   memwipe(&rpl, 0, sizeof(rpl));
-  memwipe(job, 0, sizeof(*job));
-  tor_free(job);
-  queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
-static workqueue_reply_t
-cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+/** Handle a reply from the worker threads. */
+static void
+cpuworker_onion_handshake_replyfn(void *work_)
 {
-  worker_state_t *state = state_;
   cpuworker_job_t *job = work_;
+  int i;
+
+  tor_assert(job->n_onions > 0);
+  tor_assert(total_pending_tasks >= job->n_onions);
+  total_pending_tasks -= job->n_onions;
+
+  ++onion_jobs_n_answered;
+  onion_jobs_n_onionskins += job->n_onions;
+
+  for (i = 0; i < job->n_onions; ++i) {
+    cpuworker_onion_handshake_reply(&job->onions[i]);
+  }
+
+  cpuworker_job_free(job, 0);
+  queue_pending_tasks();
+}
 
-  /* variables for onion processing */
-  server_onion_keys_t *onion_keys = state->onion_keys;
+/** Process the onionskin of <b>onion</b> with <b>onion_keys</b>, and replace
+ * its request with our reply. Return 0 on success, or -1 if the request
+ * makes no sense, in which case the worker should shut down. */
+static int
+cpuworker_onion_handshake(server_onion_keys_t *onion_keys,
+                          cpuworker_onion_t *onion)
+{
   cpuworker_request_t req;
   cpuworker_reply_t rpl;
 
-  memcpy(&req, &job->u.request, sizeof(req));
+  memcpy(&req, &onion->u.request, sizeof(req));
 
   tor_assert(req.magic == CPUWORKER_REQUEST_MAGIC);
   memset(&rpl, 0, sizeof(rpl));
@@ -446,7 +534,7 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
       cell_out->cell_type = CELL_CREATED_FAST; break;
     default:
       tor_assert(0);
-      return WQ_RPL_SHUTDOWN;
+      return -1;
     }
     rpl.success = 1;
   }
@@ -463,28 +551,169 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
       rpl.n_usec = (uint32_t) usec;
   }
 
-  memcpy(&job->u.reply, &rpl, sizeof(rpl));
+  memcpy(&onion->u.reply, &rpl, sizeof(rpl));
 
   memwipe(&req, 0, sizeof(req));
   memwipe(&rpl, 0, sizeof(req));
+  return 0;
+}
+
+/** Implementation function for onion handshake requests. */
+static workqueue_reply_t
+cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  cpuworker_job_t *job = work_;
+  int i;
+
+  /* The onionskins of a job are processed back to back, so that the job
+   * pays the cost of the queue and of the reply only once. */
+  for (i = 0; i < job->n_onions; ++i) {
+    if (cpuworker_onion_handshake(state->onion_keys, &job->onions[i]) < 0)
+      return WQ_RPL_SHUTDOWN;
+  }
   return WQ_RPL_REPLY;
 }
 
+/** Return how many onionskins we should put in the next job, given that
+ * we may have <b>n_free</b> more onionskins in the workers' queue,
+ * <b>n_waiting</b> onionskins wait in the onion queue, and the workers
+ * already have <b>n_in_flight</b> onionskins. Return 0 if we shouldn't
+ * queue a job now. */
+STATIC int
+cpuworker_next_batch_size(int n_free, int n_waiting, int n_in_flight)
+{
+  int n = MIN(MIN(n_free, n_waiting), CPUWORKER_MAX_BATCH);
+
+  if (n <= 0)
+    return 0;
+  /* When the queue is long enough to fill a whole batch but there isn't
+   * room for one yet, wait for more replies instead of sending the workers
+   * one onionskin every time a slot frees up: that is how the batches stay
+   * full under load. The workers still have work queued in the
+   * meantime. */
+  if (n < CPUWORKER_MAX_BATCH && n < n_waiting && n_in_flight > 0)
+    return 0;
+  return n;
+}
+
+/** Prepare <b>onionskin</b> for the circuit <b>circ</b> as the
+ * <b>idx</b>th onionskin of <b>job</b>, and take ownership of it.
+ *
+ * Return 0 on success, or -1 if the circuit can't take an answer anymore. */
+static int
+cpuworker_job_add_onion(cpuworker_job_t *job, int idx, or_circuit_t *circ,
+                        create_cell_t *onionskin)
+{
+  cpuworker_request_t *req = &job->onions[idx].u.request;
+
+  if (!circ->p_chan) {
+    log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+    tor_free(onionskin);
+    return -1;
+  }
+
+  if (!channel_is_client(circ->p_chan))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  job->onions[idx].circ = circ;
+  req->magic = CPUWORKER_REQUEST_MAGIC;
+  req->timed = should_time_request(onionskin->handshake_type);
+
+  memcpy(&req->create_cell, onionskin, sizeof(create_cell_t));
+
+  tor_free(onionskin);
+
+  if (req->timed)
+    tor_gettimeofday(&req->started_at);
+
+  return 0;
+}
+
+/** Hand <b>job</b> to the cpuworkers. Return 0 on success, or -1 on failure,
+ * in which case <b>job</b> is freed. */
+static int
+cpuworker_job_queue(cpuworker_job_t *job)
+{
+  workqueue_entry_t *queue_entry;
+  int i;
+
+  tor_assert(job->n_onions > 0);
+
+  total_pending_tasks += job->n_onions;
+  queue_entry = cpuworker_queue_work(WQ_PRI_HIGH,
+                                     cpuworker_onion_handshake_threadfn,
+                                     cpuworker_onion_handshake_replyfn,
+                                     job);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    total_pending_tasks -= job->n_onions;
+    cpuworker_job_free(job, 0);
+    return -1;
+  }
+
+  for (i = 0; i < job->n_onions; ++i) {
+    log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
+              job, queue_entry, job->onions[i].circ);
+    job->onions[i].circ->workqueue_entry = queue_entry;
+    job->onions[i].circ->workqueue_entry_is_batch = (job->n_onions > 1);
+  }
+
+  return 0;
+}
+
+/** Return the number of onionskins of any type in the onion queue. */
+static int
+onion_num_pending_all(void)
+{
+  int n = 0, type;
+
+  for (type = 0; type <= MAX_ONION_HANDSHAKE_TYPE; ++type)
+    n += onion_num_pending(type);
+  return n;
+}
+
 /** Take pending tasks from the queue and assign them to cpuworkers. */
 static void
 queue_pending_tasks(void)
 {
   or_circuit_t *circ;
   create_cell_t *onionskin = NULL;
+  cpuworker_job_t *job;
+  int n_waiting, n;
 
   while (total_pending_tasks < max_pending_tasks) {
-    circ = onion_next_task(&onionskin);
+    n_waiting = onion_num_pending_all();
 
-    if (!circ)
+    n = cpuworker_next_batch_size(max_pending_tasks - total_pending_tasks,
+                                  n_waiting, total_pending_tasks);
+    if (n == 0)
       return;
 
-    if (assign_onionskin_to_cpuworker(circ, onionskin) < 0)
-      log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+    job = cpuworker_job_new(n);
+    while (job->n_onions < n) {
+      circ = onion_next_task(&onionskin);
+      if (!circ)
+        break;
+
+      if (cpuworker_job_add_onion(job, job->n_onions, circ, onionskin) < 0) {
+        log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+        continue;
+      }
+      ++job->n_onions;
+    }
+
+    if (job->n_onions == 0) {
+      /* Every circuit we took was gone; try again with the rest. */
+      cpuworker_job_free(job, 0);
+      if (!circ)
+        return;
+      continue;
+    }
+    if (cpuworker_job_queue(job) < 0)
+      return;
+    if (!circ)
+      return;
   }
 }
 
@@ -513,10 +742,7 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
   cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
 
   tor_assert(threadpool);
 
@@ -526,53 +752,32 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return -1;
   }
 
-  if (total_pending_tasks >= max_pending_tasks) {
+  /* Older onionskins may be waiting even though the workers have room:
+   * queue_pending_tasks() holds them back to fill a batch. This one goes
+   * behind them, so that it doesn't jump the queue or skip the queue's
+   * CoDel and per-source fairness. */
+  if (total_pending_tasks >= max_pending_tasks ||
+      onion_num_pending_all() > 0) {
     log_debug(LD_OR,"No idle cpuworkers. Queuing.");
     if (onion_pending_add(circ, onionskin) < 0) {
       tor_free(onionskin);
       return -1;
     }
+    queue_pending_tasks();
     return 0;
   }
 
-  if (!channel_is_client(circ->p_chan))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
-
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
-
-  tor_free(onionskin);
-
-  if (should_time)
-    tor_gettimeofday(&req.started_at);
-
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
-
-  ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
-                                      WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
+  /* The workers have room and nothing waits: answer this one right away.
+   * Batches only form in queue_pending_tasks(), out of the onionskins that
+   * had to wait. */
+  job = cpuworker_job_new(1);
+  if (cpuworker_job_add_onion(job, 0, circ, onionskin) < 0) {
+    cpuworker_job_free(job, 0);
     return -1;
   }
+  job->n_onions = 1;
 
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
-
-  circ->workqueue_entry = queue_entry;
-
-  return 0;
+  return cpuworker_job_queue(job);
 }
 
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
@@ -584,11 +789,17 @@ cpuworker_cancel_circ_handshake(or_circuit_t *circ)
   if (circ->workqueue_entry == NULL)
     return;
 
+  if (circ->workqueue_entry_is_batch) {
+    /* Other circuits wait on the same job: let it run. If this circuit gets
+     * freed in the meantime, cpuworker_onion_handshake_reply() will free
+     * what is left of it, as it does for jobs that were already running. */
+    return;
+  }
+
   job = workqueue_entry_cancel(circ->workqueue_entry);
   if (job) {
     /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
+    cpuworker_job_free(job, 0xe0);
     tor_assert(total_pending_tasks > 0);
     --total_pending_tasks;
     /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
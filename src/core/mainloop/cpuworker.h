@@ -31,7 +31,28 @@ uint64_t estimated_usec_for_onionskins(uint32_t n_requests,
                                        uint16_t onionskin_type);
 void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
+void cpuworker_log_onionskin_batching(int severity);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+/** Statistics about the onionskins that the cpuworkers processed. */
+typedef struct cpuworker_onion_stats_t {
+  /** Number of jobs that the cpuworkers answered. */
+  uint64_t n_jobs;
+  /** Number of onionskins in those jobs. */
+  uint64_t n_onionskins;
+  /** Indexed by handshake type: average time, in microseconds, that a
+   * worker spent on one onionskin of that type, and average time between
+   * the moment we queued it and the moment we got the answer. */
+  uint32_t usec_worker[MAX_ONION_HANDSHAKE_TYPE+1];
+  uint32_t usec_roundtrip[MAX_ONION_HANDSHAKE_TYPE+1];
+} cpuworker_onion_stats_t;
+
+void cpuworker_get_onion_stats(cpuworker_onion_stats_t *out);
+
+#ifdef CPUWORKER_PRIVATE
+STATIC int cpuworker_next_batch_size(int n_free, int n_waiting,
+                                     int n_in_flight);
+#endif
+
 #endif /* !defined(TOR_CPUWORKER_H) */
 
@@ -16,18 +16,42 @@
 
 /** A cell as packed for writing to the network. */
 struct packed_cell_t {
-  /** Next cell queued on this circuit. */
-  TOR_SIMPLEQ_ENTRY(packed_cell_t) next;
   char body[CELL_MAX_NETWORK_SIZE]; /**< Cell as packed for network. */
   uint32_t inserted_timestamp; /**< Time (in timestamp units) when this cell
                                 * was inserted */
 };
 
+/** How many cells does each block of a cell_queue_t hold? */
+#define CELL_QUEUE_BLOCK_LEN 16
+
+/** A fixed-size block of cells in a cell_queue_t.  The insertion timestamps
+ * are copied next to the cell pointers, so that we can look at the age of a
+ * queue without touching the cells themselves. */
+typedef struct cell_queue_block_t {
+  /** Next block in the queue, or NULL if this is the last one. */
+  struct cell_queue_block_t *next;
+  /** Insertion time of each cell in <b>cells</b>. */
+  uint32_t inserted_timestamps[CELL_QUEUE_BLOCK_LEN];
+  /** The cells in this block. */
+  packed_cell_t *cells[CELL_QUEUE_BLOCK_LEN];
+} cell_queue_block_t;
+
 /** A queue of cells on a circuit, waiting to be added to the
- * or_connection_t's outbuf. */
+ * or_connection_t's outbuf.
+ *
+ * The queue is a list of blocks of cells.  We append at index
+ * <b>tail_idx</b> of the last block, and pop at index <b>head_idx</b> of
+ * the first one; a block is freed as soon as all its cells are popped.  An
+ * empty queue holds no block. */
 struct cell_queue_t {
-  /** Linked list of packed_cell_t*/
-  TOR_SIMPLEQ_HEAD(cell_simpleq_t, packed_cell_t) head;
+  /** First block of the queue, or NULL if the queue is empty. */
+  cell_queue_block_t *head;
+  /** Last block of the queue, or NULL if the queue is empty. */
+  cell_queue_block_t *tail;
+  /** Index in <b>head</b> of the first cell in the queue. */
+  uint16_t head_idx;
+  /** Index in <b>tail</b> just past the last cell in the queue. */
+  uint16_t tail_idx;
   int n; /**< The number of cells in the queue. */
 };
 
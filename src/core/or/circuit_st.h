@@ -119,6 +119,11 @@ struct circuit_t {
    * circuit-level sendme cells to indicate that we're willing to accept
    * more. */
   int deliver_window;
+  /** Congestion control state for the cells we package on this circuit as
+   * an exit, or NULL if we use a fixed package window. Only set once the
+   * client negotiated it with a CC_NEGOTIATE_EXP cell. Always NULL on origin
+   * circuits, which keep theirs in the crypt_path_t of their last hop. */
+  congestion_control_t *ccontrol;
   /**
    * How many cells do we have until we need to send one that contains
    * sufficient randomness?  Used to ensure that authenticated SENDME cells
@@ -135,6 +140,8 @@ struct circuit_t {
    * set to 100 (CIRCWINDOW_INCREMENT) which means we don't allow more than
    * 1000/100 = 10 outstanding SENDME cells worth of data. Meaning that this
    * list can not contain more than 10 digests of DIGEST_LEN bytes (20).
+   * With congestion control, the window can grow up to CC_CWND_MAX_MAX
+   * cells, so this list can hold up to CC_CWND_MAX_MAX/100 digests.
    *
    * At position i in the list, the digest corresponds to the
    * (CIRCWINDOW_INCREMENT * i)-nth cell received since we expect a SENDME to
@@ -143,7 +150,8 @@ struct circuit_t {
    * For example, position 2 (starting at 0) means that we've received 300
    * cells so the 300th cell digest is kept at index 2.
    *
-   * At maximum, this list contains 200 bytes plus the smartlist overhead. */
+   * Without congestion control, this list contains at most 200 bytes plus
+   * the smartlist overhead. */
   smartlist_t *sendme_last_digests;
 
   /** Temporary field used during circuits_handle_oom. */
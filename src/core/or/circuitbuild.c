@@ -41,6 +41,7 @@
 #include "core/or/circuitlist.h"
 #include "core/or/circuitstats.h"
 #include "core/or/circuituse.h"
+#include "core/or/congestion_control_common.h"
 #include "core/or/circuitpadding.h"
 #include "core/or/command.h"
 #include "core/or/connection_edge.h"
@@ -1049,6 +1050,7 @@ circuit_build_no_more_hops(origin_circuit_t *circ)
 
   log_info(LD_CIRC,"circuit built!");
   circuit_reset_failure_count(0);
+  congestion_control_negotiate_origin_circuit(circ);
 
   if (circ->build_state->onehop_tunnel || circ->has_opened) {
     control_event_bootstrap(BOOTSTRAP_STATUS_REQUESTING_STATUS, 0);
@@ -63,7 +63,9 @@
 #include "core/or/circuituse.h"
 #include "core/or/circuitstats.h"
 #include "core/or/circuitpadding.h"
+#include "core/or/congestion_control_common.h"
 #include "core/or/crypt_path.h"
+#include "core/or/dos.h"
 #include "core/or/extendinfo.h"
 #include "core/or/trace_probes_circuit.h"
 #include "core/mainloop/connection.h"
@@ -104,7 +106,7 @@
 
 #include "core/or/ocirc_event.h"
 
-#include "ht.h"
+#include "ext/siphash.h"
 
 #include "core/or/cpath_build_state_st.h"
 #include "core/or/crypt_path_reference_st.h"
@@ -177,57 +179,177 @@ CONST_TO_ORIGIN_CIRCUIT(const circuit_t *x)
   return DOWNCAST(origin_circuit_t, x);
 }
 
-/** A map from channel and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
+/** An entry in the map from channel and circuit ID to circuit.  (Lookup
+ * performance is very important here, since we need to do it every time a
+ * cell arrives.)  An entry with a NULL <b>circuit</b> is a placeholder for a
+ * circuit ID that we can't reuse yet; an entry with a NULL <b>chan</b> is an
+ * empty slot of the table. */
 typedef struct chan_circid_circuit_map_t {
-  HT_ENTRY(chan_circid_circuit_map_t) node;
   channel_t *chan;
-  circid_t circ_id;
   circuit_t *circuit;
+  circid_t circ_id;
   /* For debugging 12184: when was this placeholder item added? */
   time_t made_placeholder_at;
 } chan_circid_circuit_map_t;
 
-/** Helper for hash tables: compare the channel and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
+/** Map from [chan,circid] to circuit: an open-addressing hash table with
+ * linear probing, so that a lookup usually reads a single cache line, and
+ * never follows a pointer.  The number of slots is zero or a power of two,
+ * and the table is never more than half full. */
+static chan_circid_circuit_map_t *chan_circid_map = NULL;
+/** Number of slots in chan_circid_map. */
+static unsigned chan_circid_map_n_slots = 0;
+/** Number of entries, circuits and placeholders, in chan_circid_map. */
+static unsigned chan_circid_map_n_entries = 0;
+
+/** The most recently returned entry from circuit_get_by_circid_chan;
+ * used to improve performance when many cells arrive in a row from the
+ * same circuit.  Since entries move when the table changes, we reset it
+ * whenever we resize the table or remove an entry from it.
  */
-static inline int
-chan_circid_entries_eq_(chan_circid_circuit_map_t *a,
-                        chan_circid_circuit_map_t *b)
-{
-  return a->chan == b->chan && a->circ_id == b->circ_id;
-}
+static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
+
+/** The smallest number of slots that chan_circid_map shrinks to. */
+#define CHAN_CIRCID_MAP_MIN_SLOTS 64
 
-/** Helper: return a hash based on circuit ID and the pointer value of
- * chan in <b>a</b>. */
+/** Helper: return a hash based on circuit ID <b>circ_id</b> and the pointer
+ * value of <b>chan</b>. */
 static inline unsigned int
-chan_circid_entry_hash_(chan_circid_circuit_map_t *a)
+chan_circid_entry_hash_(const channel_t *chan, circid_t circ_id)
 {
   /* Try to squeze the siphash input into 8 bytes to save any extra siphash
-   * rounds.  This hash function is in the critical path. */
-  uintptr_t chan = (uintptr_t) (void*) a->chan;
+   * rounds.  This hash function is in the critical path.  We still want a
+   * keyed hash: the other side of a channel picks the circuit IDs, and must
+   * not be able to make us probe a long run of slots. */
+  uintptr_t chanp = (uintptr_t) (const void*) chan;
   uint32_t array[2];
-  array[0] = a->circ_id;
+  array[0] = circ_id;
   /* The low bits of the channel pointer are uninteresting, since the channel
    * is a pretty big structure. */
-  array[1] = (uint32_t) (chan >> 6);
+  array[1] = (uint32_t) (chanp >> 6);
   return (unsigned) siphash24g(array, sizeof(array));
 }
 
-/** Map from [chan,circid] to circuit. */
-static HT_HEAD(chan_circid_map, chan_circid_circuit_map_t)
-     chan_circid_map = HT_INITIALIZER();
-HT_PROTOTYPE(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_);
-HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
-             tor_reallocarray_, tor_free_);
+/** Return the entry of chan_circid_map for <b>chan</b> and <b>circ_id</b>,
+ * or NULL if there is none. */
+static chan_circid_circuit_map_t *
+chan_circid_map_find(const channel_t *chan, circid_t circ_id)
+{
+  unsigned mask, idx;
+  if (!chan_circid_map_n_entries)
+    return NULL;
+  mask = chan_circid_map_n_slots - 1;
+  idx = chan_circid_entry_hash_(chan, circ_id) & mask;
+  while (chan_circid_map[idx].chan) {
+    if (chan_circid_map[idx].chan == chan &&
+        chan_circid_map[idx].circ_id == circ_id)
+      return &chan_circid_map[idx];
+    idx = (idx + 1) & mask;
+  }
+  return NULL;
+}
 
-/** The most recently returned entry from circuit_get_by_circid_chan;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
+/** Return the first empty slot of chan_circid_map on the probe sequence of
+ * <b>chan</b> and <b>circ_id</b>. */
+static inline chan_circid_circuit_map_t *
+chan_circid_map_get_free_slot(const channel_t *chan, circid_t circ_id)
+{
+  const unsigned mask = chan_circid_map_n_slots - 1;
+  unsigned idx = chan_circid_entry_hash_(chan, circ_id) & mask;
+  while (chan_circid_map[idx].chan)
+    idx = (idx + 1) & mask;
+  return &chan_circid_map[idx];
+}
+
+/** Reallocate chan_circid_map with <b>n_slots</b> slots, and move every
+ * entry to its new place.  Invalidates every pointer into the table. */
+static void
+chan_circid_map_resize(unsigned n_slots)
+{
+  chan_circid_circuit_map_t *old_map = chan_circid_map;
+  const unsigned old_n_slots = chan_circid_map_n_slots;
+  unsigned i;
+
+  tor_assert(n_slots >= chan_circid_map_n_entries * 2);
+  chan_circid_map = tor_calloc(n_slots, sizeof(chan_circid_circuit_map_t));
+  chan_circid_map_n_slots = n_slots;
+  for (i = 0; i < old_n_slots; ++i) {
+    if (old_map[i].chan) {
+      *chan_circid_map_get_free_slot(old_map[i].chan, old_map[i].circ_id) =
+        old_map[i];
+    }
+  }
+  tor_free(old_map);
+  _last_circid_chan_ent = NULL;
+}
+
+/** Add a new entry, which must not exist yet, for <b>chan</b> and
+ * <b>circ_id</b> to chan_circid_map, and return it. */
+static chan_circid_circuit_map_t *
+chan_circid_map_insert(channel_t *chan, circid_t circ_id)
+{
+  chan_circid_circuit_map_t *ent;
+
+  tor_assert(chan);
+  if ((chan_circid_map_n_entries + 1) * 2 > chan_circid_map_n_slots) {
+    chan_circid_map_resize(chan_circid_map_n_slots ?
+                           chan_circid_map_n_slots * 2 :
+                           CHAN_CIRCID_MAP_MIN_SLOTS);
+  }
+  ent = chan_circid_map_get_free_slot(chan, circ_id);
+  memset(ent, 0, sizeof(*ent));
+  ent->chan = chan;
+  ent->circ_id = circ_id;
+  ++chan_circid_map_n_entries;
+  return ent;
+}
+
+/** Remove <b>ent</b>, which must be an entry of chan_circid_map, from the
+ * table.  Entries after it on its probe run may move to fill the hole, so
+ * this invalidates every pointer into the table. */
+static void
+chan_circid_map_remove(chan_circid_circuit_map_t *ent)
+{
+  const unsigned mask = chan_circid_map_n_slots - 1;
+  unsigned hole = (unsigned) (ent - chan_circid_map);
+  unsigned idx = hole;
+
+  /* Walk the rest of the run, and move back into the hole every entry that
+   * could not be found from its home slot anymore. */
+  for (;;) {
+    unsigned home;
+    idx = (idx + 1) & mask;
+    if (!chan_circid_map[idx].chan)
+      break;
+    home = chan_circid_entry_hash_(chan_circid_map[idx].chan,
+                                   chan_circid_map[idx].circ_id) & mask;
+    if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+      chan_circid_map[hole] = chan_circid_map[idx];
+      hole = idx;
+    }
+  }
+  memset(&chan_circid_map[hole], 0, sizeof(chan_circid_circuit_map_t));
+  --chan_circid_map_n_entries;
+  _last_circid_chan_ent = NULL;
+
+  if (chan_circid_map_n_slots > CHAN_CIRCID_MAP_MIN_SLOTS &&
+      chan_circid_map_n_entries * 8 < chan_circid_map_n_slots)
+    chan_circid_map_resize(chan_circid_map_n_slots / 2);
+}
+
+/** Free chan_circid_map.  Every entry must be a placeholder by now. */
+static void
+chan_circid_map_free_all(void)
+{
+  unsigned i;
+  for (i = 0; i < chan_circid_map_n_slots; ++i) {
+    if (chan_circid_map[i].chan)
+      tor_assert(chan_circid_map[i].circuit == NULL);
+  }
+  tor_free(chan_circid_map);
+  chan_circid_map_n_slots = chan_circid_map_n_entries = 0;
+  _last_circid_chan_ent = NULL;
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
@@ -238,7 +360,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
                                circid_t id,
                                channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
   channel_t *old_chan, **chan_ptr;
   circid_t old_id, *circid_ptr;
@@ -282,11 +403,9 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     }
 
     /* we may need to remove it from the conn-circid map */
-    search.circ_id = old_id;
-    search.chan = old_chan;
-    found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+    found = chan_circid_map_find(old_chan, old_id);
     if (found) {
-      tor_free(found);
+      chan_circid_map_remove(found);
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
         --(old_chan->num_n_circuits);
@@ -306,18 +425,13 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     return;
 
   /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.chan = chan;
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  found = chan_circid_map_find(chan, id);
   if (found) {
     found->circuit = circ;
     found->made_placeholder_at = 0;
   } else {
-    found = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    found->circ_id = id;
-    found->chan = chan;
+    found = chan_circid_map_insert(chan, id);
     found->circuit = circ;
-    HT_INSERT(chan_circid_map, &chan_circid_map, found);
   }
 
   /*
@@ -354,14 +468,10 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
 void
 channel_mark_circid_unusable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_map_find(chan, id);
 
   if (ent && ent->circuit) {
     /* we have a problem. */
@@ -372,12 +482,9 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     if (!ent->made_placeholder_at)
       ent->made_placeholder_at = approx_time();
   } else {
-    ent = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    ent->chan = chan;
-    ent->circ_id = id;
+    ent = chan_circid_map_insert(chan, id);
     /* leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
-    HT_INSERT(chan_circid_map, &chan_circid_map, ent);
   }
 }
 
@@ -387,22 +494,17 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
 void
 channel_mark_circid_usable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_map_find(chan, id);
   if (ent && ent->circuit) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
     return;
   }
-  if (_last_circid_chan_ent == ent)
-    _last_circid_chan_ent = NULL;
-  tor_free(ent);
+  if (ent)
+    chan_circid_map_remove(ent);
 }
 
 /** Called to indicate that a DESTROY is pending on <b>chan</b> with
@@ -1105,6 +1207,7 @@ or_circuit_new(circid_t p_circ_id, channel_t *p_chan)
   cell_queue_init(&circ->p_chan_cells);
 
   init_circuit_base(TO_CIRCUIT(circ));
+  dos_stream_init_circ_tbf(circ);
 
   tor_trace(TR_SUBSYS(circuit), TR_EV(new_or), circ);
   return circ;
@@ -1247,6 +1350,7 @@ circuit_free_(circuit_t *circ)
     SMARTLIST_FOREACH(circ->sendme_last_digests, uint8_t *, d, tor_free(d));
     smartlist_free(circ->sendme_last_digests);
   }
+  congestion_control_free(circ->ccontrol);
 
   log_info(LD_CIRC, "Circuit %u (id: %" PRIu32 ") has been freed.",
            n_circ_id,
@@ -1339,19 +1443,7 @@ circuit_free_all(void)
   smartlist_free(circuits_pending_other_guards);
   circuits_pending_other_guards = NULL;
 
-  {
-    chan_circid_circuit_map_t **elt, **next, *c;
-    for (elt = HT_START(chan_circid_map, &chan_circid_map);
-         elt;
-         elt = next) {
-      c = *elt;
-      next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
-
-      tor_assert(c->circuit == NULL);
-      tor_free(c);
-    }
-  }
-  HT_CLEAR(chan_circid_map, &chan_circid_map);
+  chan_circid_map_free_all();
 }
 
 /** Release a crypt_path_reference_t*, which may be NULL. */
@@ -1459,7 +1551,6 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
   if (_last_circid_chan_ent &&
@@ -1467,9 +1558,7 @@ circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
       chan == _last_circid_chan_ent->chan) {
     found = _last_circid_chan_ent;
   } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+    found = chan_circid_map_find(chan, circ_id);
     _last_circid_chan_ent = found;
   }
   if (found && found->circuit) {
@@ -1568,14 +1657,9 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
-
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  found = chan_circid_map_find(chan, circ_id);
 
   if (! found || found->circuit)
     return 0;
@@ -2515,15 +2599,15 @@ STATIC uint32_t
 circuit_max_queued_cell_age(const circuit_t *c, uint32_t now)
 {
   uint32_t age = 0;
-  packed_cell_t *cell;
+  uint32_t inserted;
 
-  if (NULL != (cell = TOR_SIMPLEQ_FIRST(&c->n_chan_cells.head)))
-    age = now - cell->inserted_timestamp;
+  if (cell_queue_get_oldest_timestamp(&c->n_chan_cells, &inserted))
+    age = now - inserted;
 
   if (! CIRCUIT_IS_ORIGIN(c)) {
     const or_circuit_t *orcirc = CONST_TO_OR_CIRCUIT(c);
-    if (NULL != (cell = TOR_SIMPLEQ_FIRST(&orcirc->p_chan_cells.head))) {
-      uint32_t age2 = now - cell->inserted_timestamp;
+    if (cell_queue_get_oldest_timestamp(&orcirc->p_chan_cells, &inserted)) {
+      uint32_t age2 = now - inserted;
       if (age2 > age)
         return age2;
     }
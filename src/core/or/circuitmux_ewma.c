@@ -22,6 +22,14 @@
  * that has elapsed since the tick.  We do re-scale the circuits on the
  * circuitmux periodically, so that we don't overflow double.
  *
+ * Two variants of the policy share this code.  ewma_policy keeps the active
+ * circuits of a circuitmux in a heap, and re-scales all of them every tick.
+ * ewma_bucket_policy keeps them in EWMA_N_BUCKETS buckets of exponentially
+ * growing width, and lets cell counts grow for up to ewma_max_lazy_ticks
+ * ticks before re-scaling, so that picking and updating a circuit take
+ * constant time.  The price is that circuits whose counts are within a
+ * factor of 2^(1/EWMA_BUCKETS_PER_OCTAVE) of each other are served in FIFO
+ * order rather than strictly by count.
  *
  * This module should be used through the interfaces in circuitmux.c, which it
  * implements.
@@ -39,6 +47,7 @@
 #include "core/or/circuitmux_ewma.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/intmath/bits.h"
 #include "feature/nodelist/networkstatus.h"
 #include "app/config/or_options_st.h"
 
@@ -59,12 +68,17 @@
 /** The natural logarithm of 0.5. */
 #define LOG_ONEHALF -0.69314718055994529
 
+/** With ewma_bucket_policy, by how much (as a power of 2) do we let the
+ * weight of a new cell grow before we re-scale every active circuit? */
+#define EWMA_MAX_LAZY_LOG2 16
+
 /*** Static declarations for circuitmux_ewma.c ***/
 
 static void add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static int compare_cell_ewma_counts(const void *p1, const void *p2);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
 static inline double get_scale_factor(unsigned from_tick, unsigned to_tick);
+static cell_ewma_t * get_first_cell_ewma(ewma_policy_data_t *pol);
 static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol);
 static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
@@ -74,6 +88,8 @@ static void scale_active_circuits(ewma_policy_data_t *pol,
 /*** Circuitmux policy methods ***/
 
 static circuitmux_policy_data_t * ewma_alloc_cmux_data(circuitmux_t *cmux);
+static circuitmux_policy_data_t *
+ewma_bucket_alloc_cmux_data(circuitmux_t *cmux);
 static void ewma_free_cmux_data(circuitmux_t *cmux,
                                 circuitmux_policy_data_t *pol_data);
 static circuitmux_policy_circ_data_t *
@@ -116,6 +132,15 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
  */
 static double ewma_scale_factor = 0.1;
 
+/** With ewma_bucket_policy, how many ticks may go by before we re-scale the
+ * cell counts of the active circuits on a circuitmux?  Computed from
+ * ewma_scale_factor so that the weight of a new cell never exceeds
+ * 2^EWMA_MAX_LAZY_LOG2. */
+static unsigned ewma_max_lazy_ticks = 1;
+
+/** True iff new channels should use ewma_bucket_policy. */
+static int ewma_use_buckets = 0;
+
 /*** EWMA circuitmux_policy_t method table ***/
 
 circuitmux_policy_t ewma_policy = {
@@ -131,6 +156,19 @@ circuitmux_policy_t ewma_policy = {
   /*.cmp_cmux =*/ ewma_cmp_cmux
 };
 
+circuitmux_policy_t ewma_bucket_policy = {
+  /*.alloc_cmux_data =*/ ewma_bucket_alloc_cmux_data,
+  /*.free_cmux_data =*/ ewma_free_cmux_data,
+  /*.alloc_circ_data =*/ ewma_alloc_circ_data,
+  /*.free_circ_data =*/ ewma_free_circ_data,
+  /*.notify_circ_active =*/ ewma_notify_circ_active,
+  /*.notify_circ_inactive =*/ ewma_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL, /* EWMA doesn't need this */
+  /*.notify_xmit_cells =*/ ewma_notify_xmit_cells,
+  /*.pick_active_circuit =*/ ewma_pick_active_circuit,
+  /*.cmp_cmux =*/ ewma_cmp_cmux
+};
+
 /** Have we initialized the ewma tick-counting logic? */
 static int ewma_ticks_initialized = 0;
 /** At what monotime_coarse_t did the current tick begin? */
@@ -172,7 +210,29 @@ ewma_alloc_cmux_data(circuitmux_t *cmux)
 }
 
 /**
- * Free an ewma_policy_data_t allocated with ewma_alloc_cmux_data()
+ * Allocate an ewma_policy_data_t that keeps its active circuits in buckets,
+ * and upcast it to a circuitmux_policy_data_t; this is called when setting
+ * the policy on a circuitmux_t to ewma_bucket_policy.
+ */
+
+static circuitmux_policy_data_t *
+ewma_bucket_alloc_cmux_data(circuitmux_t *cmux)
+{
+  ewma_policy_data_t *pol = NULL;
+
+  tor_assert(cmux);
+
+  pol = tor_malloc_zero(sizeof(*pol));
+  pol->base_.magic = EWMA_POL_DATA_MAGIC;
+  pol->buckets = tor_calloc(EWMA_N_BUCKETS, sizeof(cell_ewma_t *));
+  pol->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
+
+  return TO_CMUX_POL_DATA(pol);
+}
+
+/**
+ * Free an ewma_policy_data_t allocated with ewma_alloc_cmux_data() or
+ * ewma_bucket_alloc_cmux_data()
  */
 
 static void
@@ -187,6 +247,7 @@ ewma_free_cmux_data(circuitmux_t *cmux,
   pol = TO_EWMA_POL_DATA(pol_data);
 
   smartlist_free(pol->active_circuit_pqueue);
+  tor_free(pol->buckets);
   memwipe(pol, 0xda, sizeof(ewma_policy_data_t));
   tor_free(pol);
 }
@@ -338,6 +399,25 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
 
   /* Rescale the EWMAs if needed */
   tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
+  cell_ewma = &(cdata->cell_ewma);
+
+  if (pol->buckets) {
+    /* We only re-scale the buckets once in a while, and count the cells
+     * sent in the meantime as if they had been sent that much later. */
+    unsigned lag = tick - pol->active_circuit_pqueue_last_recalibrated;
+    if (lag >= ewma_max_lazy_ticks) {
+      scale_active_circuits(pol, tick);
+      lag = 0;
+    }
+    ewma_increment = ((double)(n_cells)) *
+      pow(ewma_scale_factor, -(lag + fractional_tick));
+    /* Re-scaling may have split the first bucket, so we can't tell in
+     * advance which circuit is first: just move this one. */
+    remove_cell_ewma(pol, cell_ewma);
+    cell_ewma->cell_count += ewma_increment;
+    add_cell_ewma(pol, cell_ewma);
+    return;
+  }
 
   if (tick != pol->active_circuit_pqueue_last_recalibrated) {
     scale_active_circuits(pol, tick);
@@ -348,7 +428,6 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
     ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
 
   /* Do the adjustment */
-  cell_ewma = &(cdata->cell_ewma);
   cell_ewma->cell_count += ewma_increment;
 
   /*
@@ -379,9 +458,9 @@ ewma_pick_active_circuit(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  if (smartlist_len(pol->active_circuit_pqueue) > 0) {
-    /* Get the head of the queue */
-    cell_ewma = smartlist_get(pol->active_circuit_pqueue, 0);
+  /* Get the head of the queue */
+  cell_ewma = get_first_cell_ewma(pol);
+  if (cell_ewma) {
     circ = cell_ewma_to_circuit(cell_ewma);
   }
 
@@ -410,18 +489,27 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 
   if (p1 != p2) {
     /* Get the head cell_ewma_t from each queue */
-    if (smartlist_len(p1->active_circuit_pqueue) > 0) {
-      ce1 = smartlist_get(p1->active_circuit_pqueue, 0);
-    }
-
-    if (smartlist_len(p2->active_circuit_pqueue) > 0) {
-      ce2 = smartlist_get(p2->active_circuit_pqueue, 0);
-    }
+    ce1 = get_first_cell_ewma(p1);
+    ce2 = get_first_cell_ewma(p2);
 
     /* Got both of them? */
     if (ce1 != NULL && ce2 != NULL) {
-      /* Pick whichever one has the better best circuit */
-      return compare_cell_ewma_counts(ce1, ce2);
+      unsigned t1 = p1->active_circuit_pqueue_last_recalibrated;
+      unsigned t2 = p2->active_circuit_pqueue_last_recalibrated;
+      double c1, c2;
+      if (t1 == t2) {
+        /* Pick whichever one has the better best circuit */
+        return compare_cell_ewma_counts(ce1, ce2);
+      }
+      /* The counts are scaled to different ticks: bring the older one up
+       * to date before comparing them. */
+      c1 = ce1->cell_count;
+      c2 = ce2->cell_count;
+      if ((int)(t2 - t1) > 0)
+        c1 *= get_scale_factor(t1, t2);
+      else
+        c2 *= get_scale_factor(t2, t1);
+      return (c1 > c2) - (c1 < c2);
     } else {
       if (ce1 != NULL) {
         /* We only have a circuit on cmux_1, so prefer it */
@@ -610,12 +698,24 @@ cmux_ewma_set_options(const or_options_t *options,
   halflife /= EWMA_TICK_LEN;
   /* compute per-tick scale factor. */
   ewma_scale_factor = exp(LOG_ONEHALF / halflife);
+  /* The weight of a cell sent N ticks after the last re-scaling is
+   * 2^(N/halflife): keep it below 2^EWMA_MAX_LAZY_LOG2. */
+  ewma_max_lazy_ticks = (unsigned) MAX(1.0,
+                          MIN(floor(EWMA_MAX_LAZY_LOG2 * halflife), 1000.0));
+  ewma_use_buckets = options ? options->CircuitPriorityBuckets : 0;
   log_info(LD_OR,
            "Enabled cell_ewma algorithm because of value in %s; "
            "scale factor is %f per %d seconds",
            source, ewma_scale_factor, EWMA_TICK_LEN);
 }
 
+/** Return the circuitmux policy that new channels should use. */
+circuitmux_policy_t *
+cmux_ewma_get_policy(void)
+{
+  return ewma_use_buckets ? &ewma_bucket_policy : &ewma_policy;
+}
+
 /** Return the multiplier necessary to convert the value of a cell sent in
  * 'from_tick' to one sent in 'to_tick'. */
 static inline double
@@ -637,6 +737,76 @@ scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick)
   ewma->last_adjusted_tick = cur_tick;
 }
 
+/** Return the index of the bucket of ewma_bucket_policy that holds the
+ * circuits whose cell count is <b>cell_count</b>. */
+STATIC int
+cell_ewma_get_bucket_idx(double cell_count)
+{
+  /* 2^(1/4), 2^(1/2) and 2^(3/4): the boundaries within an octave. */
+  static const double sub_octave[EWMA_BUCKETS_PER_OCTAVE - 1] = {
+    1.18920711500272106, 1.41421356237309505, 1.68179283050742909
+  };
+  double mantissa;
+  int exponent, idx, i;
+
+  if (!(cell_count >= ldexp(1.0, EWMA_BUCKET_MIN_LOG2)))
+    return 0;
+
+  /* cell_count is mantissa * 2^exponent, with mantissa in [0.5, 1). */
+  mantissa = 2 * frexp(cell_count, &exponent);
+  idx = 1 + (exponent - 1 - EWMA_BUCKET_MIN_LOG2) * EWMA_BUCKETS_PER_OCTAVE;
+  for (i = 0; i < EWMA_BUCKETS_PER_OCTAVE - 1; ++i) {
+    if (mantissa >= sub_octave[i])
+      ++idx;
+  }
+  return MIN(idx, EWMA_N_BUCKETS - 1);
+}
+
+/** Append <b>ewma</b> to the bucket of <b>pol</b> that matches its cell
+ * count. */
+static void
+bucket_add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
+{
+  int idx = cell_ewma_get_bucket_idx(ewma->cell_count);
+  cell_ewma_t *head = pol->buckets[idx];
+
+  if (head) {
+    ewma->bucket_next = head;
+    ewma->bucket_prev = head->bucket_prev;
+    head->bucket_prev->bucket_next = ewma;
+    head->bucket_prev = ewma;
+  } else {
+    ewma->bucket_next = ewma->bucket_prev = ewma;
+    pol->buckets[idx] = ewma;
+    pol->bucket_bitmap[idx / 64] |= UINT64_C(1) << (idx % 64);
+  }
+  ewma->heap_index = idx;
+  ++pol->n_bucketed;
+}
+
+/** Remove <b>ewma</b> from its bucket in <b>pol</b>. */
+static void
+bucket_remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
+{
+  int idx = ewma->heap_index;
+
+  tor_assert(idx >= 0 && idx < EWMA_N_BUCKETS);
+
+  if (ewma->bucket_next == ewma) {
+    tor_assert(pol->buckets[idx] == ewma);
+    pol->buckets[idx] = NULL;
+    pol->bucket_bitmap[idx / 64] &= ~(UINT64_C(1) << (idx % 64));
+  } else {
+    ewma->bucket_prev->bucket_next = ewma->bucket_next;
+    ewma->bucket_next->bucket_prev = ewma->bucket_prev;
+    if (pol->buckets[idx] == ewma)
+      pol->buckets[idx] = ewma->bucket_next;
+  }
+  ewma->bucket_next = ewma->bucket_prev = NULL;
+  ewma->heap_index = -1;
+  --pol->n_bucketed;
+}
+
 /** Adjust the cell count of every active circuit on <b>chan</b> so
  * that they are scaled with respect to <b>cur_tick</b> */
 static void
@@ -645,12 +815,44 @@ scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
   double factor;
 
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
 
   factor =
     get_scale_factor(
       pol->active_circuit_pqueue_last_recalibrated,
       cur_tick);
+
+  if (pol->buckets) {
+    /* Scaling every count by the same factor moves them all by about the
+     * same number of buckets, but not exactly: empty the buckets, then put
+     * every circuit back where it now belongs. */
+    smartlist_t *active = smartlist_new();
+    int i;
+    for (i = 0; i < EWMA_N_BUCKETS; ++i) {
+      cell_ewma_t *head = pol->buckets[i], *e;
+      if (!head)
+        continue;
+      e = head;
+      do {
+        smartlist_add(active, e);
+        e = e->bucket_next;
+      } while (e != head);
+      pol->buckets[i] = NULL;
+    }
+    memset(pol->bucket_bitmap, 0, sizeof(pol->bucket_bitmap));
+    pol->n_bucketed = 0;
+    SMARTLIST_FOREACH_BEGIN(active, cell_ewma_t *, e) {
+      tor_assert(e->last_adjusted_tick ==
+                 pol->active_circuit_pqueue_last_recalibrated);
+      e->cell_count *= factor;
+      e->last_adjusted_tick = cur_tick;
+      bucket_add_cell_ewma(pol, e);
+    } SMARTLIST_FOREACH_END(e);
+    smartlist_free(active);
+    pol->active_circuit_pqueue_last_recalibrated = cur_tick;
+    return;
+  }
+
+  tor_assert(pol->active_circuit_pqueue);
   /** Ordinarily it isn't okay to change the value of an element in a heap,
    * but it's okay here, since we are preserving the order. */
   SMARTLIST_FOREACH_BEGIN(
@@ -670,7 +872,6 @@ static void
 add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index == -1);
 
@@ -678,6 +879,12 @@ add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
       ewma,
       pol->active_circuit_pqueue_last_recalibrated);
 
+  if (pol->buckets) {
+    bucket_add_cell_ewma(pol, ewma);
+    return;
+  }
+
+  tor_assert(pol->active_circuit_pqueue);
   smartlist_pqueue_add(pol->active_circuit_pqueue,
                        compare_cell_ewma_counts,
                        offsetof(cell_ewma_t, heap_index),
@@ -689,16 +896,46 @@ static void
 remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index != -1);
 
+  if (pol->buckets) {
+    bucket_remove_cell_ewma(pol, ewma);
+    return;
+  }
+
+  tor_assert(pol->active_circuit_pqueue);
   smartlist_pqueue_remove(pol->active_circuit_pqueue,
                           compare_cell_ewma_counts,
                           offsetof(cell_ewma_t, heap_index),
                           ewma);
 }
 
+/** Return the first cell_ewma_t in pol's priority queue of active
+ * circuits, or NULL if there is none. */
+static cell_ewma_t *
+get_first_cell_ewma(ewma_policy_data_t *pol)
+{
+  tor_assert(pol);
+
+  if (pol->buckets) {
+    int i;
+    for (i = 0; i < EWMA_N_BUCKETS / 64; ++i) {
+      uint64_t bits = pol->bucket_bitmap[i];
+      if (bits) {
+        /* bits & -bits keeps only the lowest bit that is set. */
+        return pol->buckets[i * 64 + tor_log2(bits & (~bits + 1))];
+      }
+    }
+    return NULL;
+  }
+
+  tor_assert(pol->active_circuit_pqueue);
+  if (smartlist_len(pol->active_circuit_pqueue) == 0)
+    return NULL;
+  return smartlist_get(pol->active_circuit_pqueue, 0);
+}
+
 /** Remove and return the first cell_ewma_t from pol's priority queue of
  * active circuits.  Requires that the priority queue is nonempty. */
 static cell_ewma_t *
@@ -719,4 +956,5 @@ void
 circuitmux_ewma_free_all(void)
 {
   ewma_ticks_initialized = 0;
+  ewma_use_buckets = 0;
 }
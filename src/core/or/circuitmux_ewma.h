@@ -14,10 +14,13 @@
 
 /* The public EWMA policy callbacks object. */
 extern circuitmux_policy_t ewma_policy;
+/* The same policy, keeping active circuits in buckets rather than a heap. */
+extern circuitmux_policy_t ewma_bucket_policy;
 
 /* Externally visible EWMA functions */
 void cmux_ewma_set_options(const or_options_t *options,
                            const networkstatus_t *consensus);
+circuitmux_policy_t *cmux_ewma_get_policy(void);
 
 void circuitmux_ewma_free_all(void);
 
@@ -29,6 +32,16 @@ typedef struct cell_ewma_t cell_ewma_t;
 typedef struct ewma_policy_data_t ewma_policy_data_t;
 typedef struct ewma_policy_circ_data_t ewma_policy_circ_data_t;
 
+/** Number of priority buckets used by ewma_bucket_policy. */
+#define EWMA_N_BUCKETS 256
+/** How many buckets ewma_bucket_policy uses for each doubling of the cell
+ * count.  Circuits whose counts are within a factor of 2^(1/this) of each
+ * other may be served in either order. */
+#define EWMA_BUCKETS_PER_OCTAVE 4
+/** Base-2 logarithm of the cell count at which the first bucket ends: every
+ * count below 2^this is in bucket 0. */
+#define EWMA_BUCKET_MIN_LOG2 (-16)
+
 /**
  * The cell_ewma_t structure keeps track of how many cells a circuit has
  * transferred recently.  It keeps an EWMA (exponentially weighted moving
@@ -49,8 +62,13 @@ struct cell_ewma_t {
    * channel. */
   unsigned int is_for_p_chan : 1;
   /** The position of the circuit within the OR connection's priority
-   * queue. */
+   * queue, or -1 if it is not in it.  With ewma_bucket_policy, this is the
+   * index of the bucket that holds the circuit. */
   int heap_index;
+  /** With ewma_bucket_policy, the circuits after and before this one in
+   * its bucket. */
+  cell_ewma_t *bucket_next;
+  cell_ewma_t *bucket_prev;
 };
 
 struct ewma_policy_data_t {
@@ -70,6 +88,19 @@ struct ewma_policy_data_t {
    * or_connection_t before that.
    */
   unsigned int active_circuit_pqueue_last_recalibrated;
+
+  /**
+   * With ewma_bucket_policy, active circuits are kept here instead of in
+   * active_circuit_pqueue, which is NULL.  Bucket i holds the circuits whose
+   * cell count is about 2^(i/EWMA_BUCKETS_PER_OCTAVE) times the smallest
+   * count we tell apart; each bucket is a circular list in FIFO order, and
+   * this points to its first element.
+   */
+  cell_ewma_t **buckets;
+  /** Bit i of this bitmap is set iff buckets[i] is not empty. */
+  uint64_t bucket_bitmap[EWMA_N_BUCKETS / 64];
+  /** Number of circuits in buckets. */
+  int n_bucketed;
 };
 
 struct ewma_policy_circ_data_t {
@@ -132,6 +163,7 @@ TO_EWMA_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
 
 STATIC unsigned cell_ewma_get_current_tick_and_fraction(double *remainder_out);
 STATIC void cell_ewma_initialize_ticks(void);
+STATIC int cell_ewma_get_bucket_idx(double cell_count);
 
 #endif /* defined(CIRCUITMUX_EWMA_PRIVATE) */
 
@@ -0,0 +1,592 @@
+/* Copyright (c) 2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file compiled_policy.c
+ * \brief Compile address policies into a lookup table.
+ *
+ * Matching an address and port against an addr_policy_t list means walking
+ * the list until the first entry whose prefix and port range both match.
+ * That's fine for the policies we look at once, but an exit looks its own
+ * exit policy up for every stream it opens, and a ReducedExitPolicy with
+ * some local rejects is well over a hundred entries long.
+ *
+ * Here we turn a policy into an immutable table instead.  For each address
+ * family, we cut the address space at the first address of every entry's
+ * prefix and at the address just past its end.  Every entry either covers
+ * all of the resulting ranges or none of them, so we can walk the policy
+ * once per range, ahead of time, and store the outcome as a sorted list of
+ * port segments.  Looking up an address:port is then two binary searches.
+ *
+ * The compiled table only answers questions about a known IPv4 or IPv6
+ * address and a known port; everything else still needs the policy itself.
+ *
+ * Clients have the same problem with the short_policy_t port lists from
+ * microdescriptors, which they check against every candidate exit when
+ * they pick exits and attach streams.  We compile those into a two-level
+ * bitmap of ports, and since a few hundred distinct port lists cover the
+ * whole network, we share one compiled bitmap between all the identical
+ * lists.
+ **/
+
+#include "core/or/or.h"
+#include "core/or/compiled_policy.h"
+
+#include "core/or/addr_policy_st.h"
+
+#include "ext/siphash.h"
+#include "ext/ht.h"
+
+/** Length of the longest address key we compile: an IPv6 address.  IPv4
+ * keys use the first four bytes, and leave the rest zeroed. */
+#define POLICY_KEY_LEN 16
+
+/** An address, as a big-endian byte string that sorts in address order. */
+typedef struct policy_key_t {
+  uint8_t b[POLICY_KEY_LEN];
+} policy_key_t;
+
+/** A single policy entry, seen as a range of address keys. */
+typedef struct policy_rule_t {
+  policy_key_t lo; /**< First address that the entry's prefix covers. */
+  policy_key_t hi; /**< Last address that the entry's prefix covers. */
+  uint16_t prt_min; /**< Lowest port that the entry covers. */
+  uint16_t prt_max; /**< Highest port that the entry covers. */
+  unsigned int accept : 1; /**< True iff this is an accept entry. */
+} policy_rule_t;
+
+/** A port segment: the first port of the segment in the upper bits, and 1
+ * in the low bit iff the policy accepts the ports in the segment. */
+typedef uint32_t policy_port_seg_t;
+#define PORT_SEG(port, accept) \
+  ((((policy_port_seg_t)(port)) << 1) | ((accept) ? 1 : 0))
+#define PORT_SEG_PORT(seg) ((seg) >> 1)
+#define PORT_SEG_ACCEPTS(seg) ((seg) & 1)
+
+/** A range of addresses that every entry of the policy treats alike. The
+ * range ends where the next one starts. */
+typedef struct policy_addr_range_t {
+  policy_key_t start; /**< First address in the range. */
+  int first_seg; /**< Index of this range's first port segment. */
+  int n_segs; /**< Number of port segments for this range. */
+} policy_addr_range_t;
+
+/** The compiled form of a policy for a single address family. */
+typedef struct compiled_policy_table_t {
+  /** Address ranges, sorted by start.  The first one always starts at the
+   * zero address. */
+  policy_addr_range_t *ranges;
+  int n_ranges;
+  /** Port segments for all the ranges.  Each range's segments are sorted
+   * by port, and the first one always starts at port 0. */
+  policy_port_seg_t *segs;
+  int n_segs;
+} compiled_policy_table_t;
+
+/** An address policy, compiled for fast lookups.  Once built, it never
+ * changes. */
+struct compiled_addr_policy_t {
+  compiled_policy_table_t ipv4;
+  compiled_policy_table_t ipv6;
+};
+
+/** Return the number of bytes in an address key for <b>family</b>. */
+static inline size_t
+family_key_len(sa_family_t family)
+{
+  return family == AF_INET ? 4 : POLICY_KEY_LEN;
+}
+
+/** Set <b>key_out</b> to the key for <b>addr</b>, which must be an IPv4 or
+ * IPv6 address. */
+static void
+policy_key_from_addr(policy_key_t *key_out, const tor_addr_t *addr)
+{
+  memset(key_out, 0, sizeof(*key_out));
+  if (tor_addr_family(addr) == AF_INET) {
+    set_uint32(key_out->b, tor_addr_to_ipv4n(addr));
+  } else {
+    memcpy(key_out->b, tor_addr_to_in6_addr8(addr), POLICY_KEY_LEN);
+  }
+}
+
+/** Compare two address keys, qsort-style. */
+static int
+policy_key_compare(const void *a, const void *b)
+{
+  return fast_memcmp(a, b, sizeof(policy_key_t));
+}
+
+/** Add one to the <b>key_len</b>-byte <b>key</b>.  Return 0 on success, or
+ * -1 if it wrapped around, which means that it was the last address. */
+static int
+policy_key_increment(policy_key_t *key, size_t key_len)
+{
+  size_t i = key_len;
+  while (i--) {
+    if (++key->b[i])
+      return 0;
+  }
+  return -1;
+}
+
+/** Compare two ports, qsort-style. */
+static int
+port_compare(const void *a, const void *b)
+{
+  const uint32_t *pa = a, *pb = b;
+  return (*pa > *pb) - (*pa < *pb);
+}
+
+/** Set <b>rule_out</b> to describe the policy entry <b>p</b>, whose family
+ * must have keys of <b>key_len</b> bytes.  Mask bits are handled the same
+ * way tor_addr_compare_masked() handles them: anything longer than the
+ * address counts as the whole address. */
+static void
+policy_rule_init(policy_rule_t *rule_out, const addr_policy_t *p,
+                 size_t key_len)
+{
+  int bits = p->maskbits;
+  size_t i;
+
+  if (bits > (int)(key_len * 8))
+    bits = (int)(key_len * 8);
+
+  memset(rule_out, 0, sizeof(*rule_out));
+  policy_key_from_addr(&rule_out->lo, &p->addr);
+  for (i = 0; i < key_len; ++i) {
+    int byte_bits = bits - (int)(i * 8);
+    uint8_t mask;
+    if (byte_bits >= 8)
+      mask = 0xff;
+    else if (byte_bits <= 0)
+      mask = 0;
+    else
+      mask = (uint8_t)(0xff << (8 - byte_bits));
+    rule_out->lo.b[i] &= mask;
+    rule_out->hi.b[i] = rule_out->lo.b[i] | (uint8_t)~mask;
+  }
+  rule_out->prt_min = p->prt_min;
+  rule_out->prt_max = p->prt_max;
+  rule_out->accept = (p->policy_type == ADDR_POLICY_ACCEPT);
+}
+
+/** Append <b>seg</b> to the port segments of <b>table</b>, which currently
+ * have room for *<b>cap</b> entries. */
+static void
+table_add_seg(compiled_policy_table_t *table, int *cap,
+              policy_port_seg_t seg)
+{
+  if (table->n_segs == *cap) {
+    *cap = *cap ? *cap * 2 : 16;
+    table->segs = tor_reallocarray(table->segs, *cap, sizeof(*table->segs));
+  }
+  table->segs[table->n_segs++] = seg;
+}
+
+/** Compile the entries of <b>policy</b> that belong to <b>family</b> into
+ * <b>table</b>.  Entries of any other family never match an address of
+ * <b>family</b>, so they don't contribute. */
+static void
+compiled_policy_table_build(compiled_policy_table_t *table,
+                            const smartlist_t *policy, sa_family_t family)
+{
+  const size_t key_len = family_key_len(family);
+  policy_rule_t *rules = NULL;
+  policy_key_t *starts = NULL;
+  uint32_t *ports = NULL;
+  const policy_rule_t **matching = NULL;
+  int n_rules = 0, n_starts = 0, i, j, seg_cap = 0;
+
+  if (policy) {
+    rules = tor_calloc(smartlist_len(policy) + 1, sizeof(policy_rule_t));
+    SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, p) {
+      if (tor_addr_family(&p->addr) != family)
+        continue;
+      policy_rule_init(&rules[n_rules++], p, key_len);
+    } SMARTLIST_FOREACH_END(p);
+  }
+
+  /* Every range starts at one of these: the zero address, the start of an
+   * entry's prefix, or the address right after the end of one. */
+  starts = tor_calloc(2 * n_rules + 1, sizeof(policy_key_t));
+  ++n_starts; /* The zero address. */
+  for (i = 0; i < n_rules; ++i) {
+    starts[n_starts++] = rules[i].lo;
+    starts[n_starts] = rules[i].hi;
+    if (policy_key_increment(&starts[n_starts], key_len) == 0)
+      ++n_starts;
+  }
+  qsort(starts, n_starts, sizeof(policy_key_t), policy_key_compare);
+
+  table->ranges = tor_calloc(n_starts, sizeof(policy_addr_range_t));
+  ports = tor_calloc(2 * n_rules + 1, sizeof(uint32_t));
+  matching = tor_calloc(n_rules + 1, sizeof(policy_rule_t *));
+
+  for (i = 0; i < n_starts; ++i) {
+    const policy_key_t *start = &starts[i];
+    policy_addr_range_t *range, *prev;
+    int n_matching = 0, n_ports = 0, k;
+
+    if (i && tor_memeq(start, &starts[i-1], sizeof(policy_key_t)))
+      continue;
+
+    /* No prefix begins or ends inside this range, so an entry that covers
+     * its first address covers all of it. */
+    for (j = 0; j < n_rules; ++j) {
+      if (policy_key_compare(&rules[j].lo, start) <= 0 &&
+          policy_key_compare(start, &rules[j].hi) <= 0) {
+        matching[n_matching++] = &rules[j];
+      }
+    }
+
+    /* Likewise, cut the ports wherever one of those entries starts or
+     * stops covering them. */
+    ports[n_ports++] = 0;
+    for (j = 0; j < n_matching; ++j) {
+      ports[n_ports++] = matching[j]->prt_min;
+      if (matching[j]->prt_max < 65535)
+        ports[n_ports++] = matching[j]->prt_max + 1;
+    }
+    qsort(ports, n_ports, sizeof(uint32_t), port_compare);
+
+    range = &table->ranges[table->n_ranges];
+    range->start = *start;
+    range->first_seg = table->n_segs;
+    for (j = 0; j < n_ports; ++j) {
+      const uint32_t port = ports[j];
+      unsigned accept = 1; /* Anything no entry mentions gets accepted. */
+      if (j && port == ports[j-1])
+        continue;
+      for (k = 0; k < n_matching; ++k) {
+        if (port >= matching[k]->prt_min && port <= matching[k]->prt_max) {
+          accept = matching[k]->accept;
+          break;
+        }
+      }
+      if (range->n_segs &&
+          PORT_SEG_ACCEPTS(table->segs[table->n_segs-1]) == accept)
+        continue;
+      table_add_seg(table, &seg_cap, PORT_SEG(port, accept));
+      ++range->n_segs;
+    }
+
+    /* If this range behaves just like the one before it, fold them. */
+    prev = table->n_ranges ? &table->ranges[table->n_ranges-1] : NULL;
+    if (prev && prev->n_segs == range->n_segs &&
+        fast_memeq(&table->segs[prev->first_seg],
+                   &table->segs[range->first_seg],
+                   range->n_segs * sizeof(policy_port_seg_t))) {
+      table->n_segs -= range->n_segs;
+      memset(range, 0, sizeof(*range));
+      continue;
+    }
+    ++table->n_ranges;
+  }
+
+  tor_free(rules);
+  tor_free(starts);
+  tor_free(ports);
+  tor_free(matching);
+}
+
+/** Release all storage held in <b>table</b>. */
+static void
+compiled_policy_table_clear(compiled_policy_table_t *table)
+{
+  tor_free(table->ranges);
+  tor_free(table->segs);
+  memset(table, 0, sizeof(*table));
+}
+
+/** Compile the address policy <b>policy</b> (which may be NULL, meaning
+ * "accept everything") and return a newly allocated
+ * compiled_addr_policy_t.  It answers the same as
+ * compare_tor_addr_to_addr_policy() on <b>policy</b> for every known IPv4 or
+ * IPv6 address and nonzero port, and it does not refer to <b>policy</b>
+ * once built.
+ *
+ * This costs time quadratic in the length of the policy, so do it when the
+ * policy changes, not when it's used. */
+compiled_addr_policy_t *
+addr_policy_compile(const smartlist_t *policy)
+{
+  compiled_addr_policy_t *compiled = tor_malloc_zero(sizeof(*compiled));
+  compiled_policy_table_build(&compiled->ipv4, policy, AF_INET);
+  compiled_policy_table_build(&compiled->ipv6, policy, AF_INET6);
+  return compiled;
+}
+
+/** Release all storage held by <b>compiled</b>. */
+void
+compiled_addr_policy_free_(compiled_addr_policy_t *compiled)
+{
+  if (!compiled)
+    return;
+  compiled_policy_table_clear(&compiled->ipv4);
+  compiled_policy_table_clear(&compiled->ipv6);
+  tor_free(compiled);
+}
+
+/** Decide whether <b>addr</b>:<b>port</b> is accepted or rejected by the
+ * compiled policy <b>compiled</b>.  <b>addr</b> must be a non-null IPv4 or
+ * IPv6 address, and <b>port</b> must be nonzero: callers that can't promise
+ * that should use compare_tor_addr_to_addr_policy() on the policy itself.
+ */
+addr_policy_result_t
+compare_tor_addr_to_compiled_addr_policy(
+                                  const tor_addr_t *addr, uint16_t port,
+                                  const compiled_addr_policy_t *compiled)
+{
+  const compiled_policy_table_t *table;
+  const policy_addr_range_t *range;
+  const policy_port_seg_t *segs;
+  policy_key_t key;
+  int lo, hi;
+
+  tor_assert(compiled);
+  if (BUG(port == 0) || BUG(tor_addr_is_null(addr)))
+    return ADDR_POLICY_REJECTED;
+
+  switch (tor_addr_family(addr)) {
+    case AF_INET:
+      table = &compiled->ipv4;
+      break;
+    case AF_INET6:
+      table = &compiled->ipv6;
+      break;
+    default:
+      tor_assert_nonfatal_unreached_once();
+      return ADDR_POLICY_REJECTED;
+  }
+  policy_key_from_addr(&key, addr);
+
+  /* Find the last range that starts at or before the address. */
+  lo = 0;
+  hi = table->n_ranges - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (policy_key_compare(&table->ranges[mid].start, &key) <= 0)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  range = &table->ranges[lo];
+
+  /* Then the last segment of that range that starts at or below the
+   * port. */
+  segs = &table->segs[range->first_seg];
+  lo = 0;
+  hi = range->n_segs - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (PORT_SEG_PORT(segs[mid]) <= (policy_port_seg_t)port)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return PORT_SEG_ACCEPTS(segs[lo]) ?
+    ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+}
+
+/** Return the number of distinct address ranges that <b>compiled</b> has
+ * for <b>family</b>. */
+size_t
+compiled_addr_policy_get_n_ranges(const compiled_addr_policy_t *compiled,
+                                  sa_family_t family)
+{
+  tor_assert(compiled);
+  if (family == AF_INET)
+    return compiled->ipv4.n_ranges;
+  else if (family == AF_INET6)
+    return compiled->ipv6.n_ranges;
+  return 0;
+}
+
+/** How many ports each block of a compiled short policy covers. */
+#define SHORT_POLICY_BLOCK_PORTS 256
+/** How many blocks it takes to cover every port. */
+#define SHORT_POLICY_N_BLOCKS (65536 / SHORT_POLICY_BLOCK_PORTS)
+/** How many bytes it takes to store a block. */
+#define SHORT_POLICY_BLOCK_BYTES (SHORT_POLICY_BLOCK_PORTS / 8)
+/** A bitmap of the ports in one block, with a set bit for each listed
+ * port. */
+typedef uint8_t short_policy_block_t[SHORT_POLICY_BLOCK_BYTES];
+/** Index of the block that lists none of its ports. */
+#define SHORT_POLICY_BLOCK_NONE 0
+/** Index of the block that lists all of its ports. */
+#define SHORT_POLICY_BLOCK_ALL 1
+
+/** The port ranges of a short_policy_t, compiled into a two-level bitmap.
+ * These are reference-counted, and shared between all the short policies
+ * that list the same port ranges. */
+struct compiled_short_policy_t {
+  HT_ENTRY(compiled_short_policy_t) node;
+  /** How many short policies use this. */
+  int refcnt;
+  /** A copy of the port ranges we compiled: our key in the table. */
+  short_policy_entry_t *entries;
+  int n_entries;
+  /** For each group of SHORT_POLICY_BLOCK_PORTS ports, starting with port
+   * 0, the index of the block in <b>blocks</b> that lists them. */
+  uint16_t block_idx[SHORT_POLICY_N_BLOCKS];
+  /** The blocks themselves.  The first two are SHORT_POLICY_BLOCK_NONE and
+   * SHORT_POLICY_BLOCK_ALL; the rest list some, but not all, of their
+   * ports. */
+  short_policy_block_t *blocks;
+  int n_blocks;
+};
+
+/** Table of all the compiled short policies, keyed on their port ranges. */
+static HT_HEAD(short_policy_map, compiled_short_policy_t)
+  short_policy_root = HT_INITIALIZER();
+
+/** Return true iff <b>a</b> and <b>b</b> list the same port ranges. */
+static inline int
+compiled_short_policy_eq(const compiled_short_policy_t *a,
+                         const compiled_short_policy_t *b)
+{
+  return a->n_entries == b->n_entries &&
+    fast_memeq(a->entries, b->entries,
+               a->n_entries * sizeof(short_policy_entry_t));
+}
+
+/** Return a hashcode for the port ranges of <b>c</b>. */
+static inline unsigned int
+compiled_short_policy_hash(const compiled_short_policy_t *c)
+{
+  return (unsigned) siphash24g(c->entries,
+                               c->n_entries * sizeof(short_policy_entry_t));
+}
+
+HT_PROTOTYPE(short_policy_map, compiled_short_policy_t, node,
+             compiled_short_policy_hash, compiled_short_policy_eq);
+HT_GENERATE2(short_policy_map, compiled_short_policy_t, node,
+             compiled_short_policy_hash, compiled_short_policy_eq, 0.6,
+             tor_reallocarray_, tor_free_);
+
+/** Set every bit from <b>lo</b> through <b>hi</b> in <b>bits</b>. */
+static void
+port_bitmap_set_range(uint8_t *bits, unsigned lo, unsigned hi)
+{
+  for (; lo <= hi && (lo & 7); ++lo)
+    bits[lo >> 3] |= (uint8_t) (1u << (lo & 7));
+  for (; lo + 7 <= hi; lo += 8)
+    bits[lo >> 3] = 0xff;
+  for (; lo <= hi; ++lo)
+    bits[lo >> 3] |= (uint8_t) (1u << (lo & 7));
+}
+
+/** Build the blocks of <b>c</b> from its port ranges. */
+static void
+compiled_short_policy_build(compiled_short_policy_t *c)
+{
+  uint8_t *bits = tor_malloc_zero(65536 / 8);
+  int i, n_mixed = 0;
+
+  for (i = 0; i < c->n_entries; ++i) {
+    port_bitmap_set_range(bits, c->entries[i].min_port,
+                          c->entries[i].max_port);
+  }
+
+  for (i = 0; i < SHORT_POLICY_N_BLOCKS; ++i) {
+    const uint8_t *block = bits + i * SHORT_POLICY_BLOCK_BYTES;
+    if (fast_mem_is_zero((const char *)block, SHORT_POLICY_BLOCK_BYTES))
+      c->block_idx[i] = SHORT_POLICY_BLOCK_NONE;
+    else if (block[0] == 0xff &&
+             fast_memeq(block, block + 1, SHORT_POLICY_BLOCK_BYTES - 1))
+      c->block_idx[i] = SHORT_POLICY_BLOCK_ALL;
+    else
+      c->block_idx[i] = 2 + n_mixed++;
+  }
+
+  c->n_blocks = 2 + n_mixed;
+  c->blocks = tor_calloc(c->n_blocks, SHORT_POLICY_BLOCK_BYTES);
+  memset(c->blocks[SHORT_POLICY_BLOCK_ALL], 0xff, SHORT_POLICY_BLOCK_BYTES);
+  for (i = 0; i < SHORT_POLICY_N_BLOCKS; ++i) {
+    if (c->block_idx[i] > SHORT_POLICY_BLOCK_ALL) {
+      memcpy(c->blocks[c->block_idx[i]],
+             bits + i * SHORT_POLICY_BLOCK_BYTES, SHORT_POLICY_BLOCK_BYTES);
+    }
+  }
+
+  tor_free(bits);
+}
+
+/** Return a compiled form of the port ranges of <b>policy</b>, with a new
+ * reference to it.  Identical port ranges share one compiled form.  Release
+ * the reference with compiled_short_policy_free(). */
+compiled_short_policy_t *
+short_policy_compile(const short_policy_t *policy)
+{
+  compiled_short_policy_t search, *found;
+
+  tor_assert(policy);
+  memset(&search, 0, sizeof(search));
+  search.entries = (short_policy_entry_t *) policy->entries;
+  search.n_entries = policy->n_entries;
+
+  found = HT_FIND(short_policy_map, &short_policy_root, &search);
+  if (!found) {
+    found = tor_malloc_zero(sizeof(compiled_short_policy_t));
+    found->n_entries = policy->n_entries;
+    found->entries = tor_calloc(policy->n_entries + 1,
+                                sizeof(short_policy_entry_t));
+    memcpy(found->entries, policy->entries,
+           policy->n_entries * sizeof(short_policy_entry_t));
+    compiled_short_policy_build(found);
+    HT_INSERT(short_policy_map, &short_policy_root, found);
+  }
+
+  ++found->refcnt;
+  return found;
+}
+
+/** Release a reference to <b>compiled</b>, and free it if that was the last
+ * one. */
+void
+compiled_short_policy_free_(compiled_short_policy_t *compiled)
+{
+  if (!compiled)
+    return;
+  if (--compiled->refcnt > 0)
+    return;
+
+  HT_REMOVE(short_policy_map, &short_policy_root, compiled);
+  tor_free(compiled->entries);
+  tor_free(compiled->blocks);
+  tor_free(compiled);
+}
+
+/** Return true iff one of the port ranges that <b>compiled</b> was built
+ * from includes <b>port</b>. */
+int
+compiled_short_policy_lists_port(const compiled_short_policy_t *compiled,
+                                 uint16_t port)
+{
+  const uint8_t *block =
+    compiled->blocks[compiled->block_idx[port / SHORT_POLICY_BLOCK_PORTS]];
+  const unsigned bit = port % SHORT_POLICY_BLOCK_PORTS;
+  return (block[bit >> 3] >> (bit & 7)) & 1;
+}
+
+/** Return the number of distinct port blocks that <b>compiled</b> stores,
+ * including the two that every compiled short policy has. */
+size_t
+compiled_short_policy_get_n_blocks(const compiled_short_policy_t *compiled)
+{
+  tor_assert(compiled);
+  return compiled->n_blocks;
+}
+
+/** Release all storage held by the compiled short policy table. */
+void
+compiled_policy_free_all(void)
+{
+  if (!HT_EMPTY(&short_policy_root)) {
+    log_warn(LD_MM, "Still had %d compiled short policies at shutdown.",
+             (int)HT_SIZE(&short_policy_root));
+  }
+  HT_CLEAR(short_policy_map, &short_policy_root);
+}
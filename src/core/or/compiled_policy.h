@@ -0,0 +1,41 @@
+/* Copyright (c) 2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file compiled_policy.h
+ * \brief Header file for compiled_policy.c.
+ **/
+
+#ifndef TOR_COMPILED_POLICY_H
+#define TOR_COMPILED_POLICY_H
+
+#include "core/or/policies.h"
+
+typedef struct compiled_addr_policy_t compiled_addr_policy_t;
+
+compiled_addr_policy_t *addr_policy_compile(const smartlist_t *policy);
+void compiled_addr_policy_free_(compiled_addr_policy_t *compiled);
+#define compiled_addr_policy_free(c) \
+  FREE_AND_NULL(compiled_addr_policy_t, compiled_addr_policy_free_, (c))
+
+addr_policy_result_t compare_tor_addr_to_compiled_addr_policy(
+                                  const tor_addr_t *addr, uint16_t port,
+                                  const compiled_addr_policy_t *compiled);
+size_t compiled_addr_policy_get_n_ranges(
+                                  const compiled_addr_policy_t *compiled,
+                                  sa_family_t family);
+
+typedef struct compiled_short_policy_t compiled_short_policy_t;
+
+compiled_short_policy_t *short_policy_compile(const short_policy_t *policy);
+void compiled_short_policy_free_(compiled_short_policy_t *compiled);
+#define compiled_short_policy_free(c) \
+  FREE_AND_NULL(compiled_short_policy_t, compiled_short_policy_free_, (c))
+int compiled_short_policy_lists_port(const compiled_short_policy_t *compiled,
+                                     uint16_t port);
+size_t compiled_short_policy_get_n_blocks(
+                                  const compiled_short_policy_t *compiled);
+
+void compiled_policy_free_all(void);
+
+#endif /* !defined(TOR_COMPILED_POLICY_H) */
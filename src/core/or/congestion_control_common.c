@@ -0,0 +1,394 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_common.c
+ * \brief Congestion control for circuits: the code shared by all the
+ *   algorithms.
+ *
+ * Without congestion control, an endpoint may have at most
+ * CIRCWINDOW_START DATA cells in flight on a circuit, and it gets
+ * CIRCWINDOW_INCREMENT more every time a SENDME arrives. That caps the
+ * throughput of a circuit at CIRCWINDOW_START cells per round-trip time on
+ * long paths, and fills the queues of the relays along short paths.
+ *
+ * When the "cc_alg" consensus parameter asks for it, the two ends of a
+ * circuit instead let an algorithm pick the window size from the round-trip
+ * time of the SENDMEs. This is experimental, and off by default. Once an exit
+ * circuit is built, the client sends a CC_NEGOTIATE_EXP cell to its last hop.
+ * A relay that knows that cell, and whose consensus turns congestion control
+ * on too, answers with CC_NEGOTIATED_EXP. From then on, both ends size their
+ * package windows with the algorithm, and new streams on the circuit may use
+ * XON/XOFF flow control (see congestion_control_flow.c). Other relays drop
+ * the unknown cell, and the circuit keeps its fixed windows.
+ *
+ * The receiving end keeps sending one SENDME every CIRCWINDOW_INCREMENT DATA
+ * cells, exactly as it does today. Larger windows mean more cells queued at
+ * the slowest relay of the path, which closes circuits that have more than
+ * circ_max_cell_queue_size cells queued: we never let the window grow past
+ * half of that consensus parameter.
+ *
+ * The package_window field of the circuit (or cpath hop) keeps saying how
+ * many cells we may still package; sendme.c updates it from the functions of
+ * this module.
+ **/
+
+#define CONGESTION_CONTROL_PRIVATE
+
+#include "core/or/or.h"
+
+#include "app/config/config.h"
+#include "core/or/circuitlist.h"
+#include "core/or/congestion_control_common.h"
+#include "core/or/congestion_control_flow.h"
+#include "core/or/congestion_control_vegas.h"
+#include "core/or/relay.h"
+#include "feature/nodelist/networkstatus.h"
+#include "lib/time/compat_time.h"
+
+#include "core/or/crypt_path_st.h"
+#include "core/or/or_circuit_st.h"
+#include "core/or/origin_circuit_st.h"
+
+/** Consensus parameters; see congestion_control_new_consensus_params(). */
+static uint8_t cc_alg = CC_ALG_DEFAULT;
+static uint32_t cc_cwnd_init = CC_CWND_INIT_DEFAULT;
+static uint32_t cc_cwnd_min = CC_CWND_MIN_DEFAULT;
+static uint32_t cc_cwnd_max = CC_CWND_MAX_DEFAULT;
+static uint32_t cc_cwnd_inc = CC_CWND_INC_DEFAULT;
+static uint8_t cc_ewma_n = CC_EWMA_N_DEFAULT;
+static vegas_params_t cc_vegas_params = {
+  CC_VEGAS_ALPHA_DEFAULT, CC_VEGAS_BETA_DEFAULT,
+  CC_VEGAS_GAMMA_DEFAULT, CC_VEGAS_DELTA_DEFAULT,
+};
+
+/** Update the congestion control parameters from the consensus
+ * <b>ns</b>. Circuits that already exist keep the parameters they were
+ * created with. */
+void
+congestion_control_new_consensus_params(const networkstatus_t *ns)
+{
+  cc_alg = networkstatus_get_param(ns, "cc_alg",
+                                   CC_ALG_DEFAULT, CC_ALG_SENDME,
+                                   CC_ALG_VEGAS);
+  /* Unknown algorithms fall back to fixed windows. */
+  if (cc_alg != CC_ALG_VEGAS)
+    cc_alg = CC_ALG_SENDME;
+
+  cc_cwnd_min = networkstatus_get_param(ns, "cc_cwnd_min",
+                                        CC_CWND_MIN_DEFAULT,
+                                        CC_CWND_MIN_MIN, CC_CWND_MIN_MAX);
+  cc_cwnd_max = networkstatus_get_param(ns, "cc_cwnd_max",
+                                        CC_CWND_MAX_DEFAULT,
+                                        CC_CWND_MAX_MIN, CC_CWND_MAX_MAX);
+  if (cc_cwnd_max < cc_cwnd_min)
+    cc_cwnd_max = cc_cwnd_min;
+  /* A whole window may end up queued at the slowest relay of the path. Keep
+   * room in its circuit queue for as many other cells (END cells, padding,
+   * ...) as there are DATA cells. */
+  cc_cwnd_max = MIN(cc_cwnd_max,
+                    (uint32_t) relay_get_max_circuit_cell_queue_size() / 2);
+  cc_cwnd_min = MIN(cc_cwnd_min, cc_cwnd_max);
+  cc_cwnd_init = networkstatus_get_param(ns, "cc_cwnd_init",
+                                         CC_CWND_INIT_DEFAULT,
+                                         CC_CWND_INIT_MIN, CC_CWND_INIT_MAX);
+  cc_cwnd_init = CLAMP(cc_cwnd_min, cc_cwnd_init, cc_cwnd_max);
+  cc_cwnd_inc = networkstatus_get_param(ns, "cc_cwnd_inc",
+                                        CC_CWND_INC_DEFAULT,
+                                        CC_CWND_INC_MIN, CC_CWND_INC_MAX);
+  cc_ewma_n = networkstatus_get_param(ns, "cc_ewma_n",
+                                      CC_EWMA_N_DEFAULT,
+                                      CC_EWMA_N_MIN, CC_EWMA_N_MAX);
+
+  cc_vegas_params.alpha =
+    networkstatus_get_param(ns, "cc_vegas_alpha", CC_VEGAS_ALPHA_DEFAULT,
+                            0, CC_VEGAS_PARAM_MAX);
+  cc_vegas_params.beta =
+    networkstatus_get_param(ns, "cc_vegas_beta", CC_VEGAS_BETA_DEFAULT,
+                            0, CC_VEGAS_PARAM_MAX);
+  cc_vegas_params.gamma =
+    networkstatus_get_param(ns, "cc_vegas_gamma", CC_VEGAS_GAMMA_DEFAULT,
+                            0, CC_VEGAS_PARAM_MAX);
+  cc_vegas_params.delta =
+    networkstatus_get_param(ns, "cc_vegas_delta", CC_VEGAS_DELTA_DEFAULT,
+                            0, CC_VEGAS_PARAM_MAX);
+  if (cc_vegas_params.beta < cc_vegas_params.alpha)
+    cc_vegas_params.beta = cc_vegas_params.alpha;
+  if (cc_vegas_params.delta < cc_vegas_params.beta)
+    cc_vegas_params.delta = cc_vegas_params.beta;
+
+  flow_control_new_consensus_params(ns);
+}
+
+/** Return true iff the consensus asks new circuits to use congestion
+ * control. */
+bool
+congestion_control_enabled(void)
+{
+  return cc_alg != CC_ALG_SENDME;
+}
+
+/** Return a new congestion control object for a circuit endpoint, or NULL
+ * if the consensus wants us to use fixed SENDME windows. */
+congestion_control_t *
+congestion_control_new(void)
+{
+  congestion_control_t *cc;
+
+  if (!congestion_control_enabled())
+    return NULL;
+
+  cc = tor_malloc_zero(sizeof(*cc));
+  cc->cc_alg = cc_alg;
+  cc->in_slow_start = 1;
+  cc->cwnd = cc_cwnd_init;
+  cc->cwnd_min = cc_cwnd_min;
+  cc->cwnd_max = cc_cwnd_max;
+  cc->cwnd_inc = cc_cwnd_inc;
+  cc->ewma_n = cc_ewma_n;
+  cc->vegas_params = cc_vegas_params;
+  cc->sendme_pending_timestamps = smartlist_new();
+  return cc;
+}
+
+/** Free <b>cc</b> and everything it holds. */
+void
+congestion_control_free_(congestion_control_t *cc)
+{
+  if (!cc)
+    return;
+
+  SMARTLIST_FOREACH(cc->sendme_pending_timestamps, uint64_t *, t,
+                    tor_free(t));
+  smartlist_free(cc->sendme_pending_timestamps);
+  tor_free(cc);
+}
+
+/** Give the circuit endpoint with the package window <b>package_window</b>
+ * a congestion control object in <b>ccontrol</b>, if the consensus asks for
+ * one. The endpoint must not have packaged any DATA cell yet. */
+static void
+congestion_control_init_endpoint(congestion_control_t **ccontrol,
+                                 int *package_window)
+{
+  tor_assert(!*ccontrol);
+
+  *ccontrol = congestion_control_new();
+  if (*ccontrol)
+    *package_window = congestion_control_get_package_window(*ccontrol);
+}
+
+/** Called when the origin circuit <b>circ</b> is built, or extended by one
+ * more hop: its last hop is the one our streams will exit from. If the
+ * consensus turns congestion control on, ask that hop whether it can use it
+ * on this circuit. */
+void
+congestion_control_negotiate_origin_circuit(origin_circuit_t *circ)
+{
+  crypt_path_t *hop = circ->cpath ? circ->cpath->prev : NULL;
+  const uint8_t body[1] = { CC_NEGOTIATE_VERSION };
+
+  /* Only exit circuits carry enough data to need it. */
+  if (!hop || hop->cc_negotiate_sent || !congestion_control_enabled() ||
+      TO_CIRCUIT(circ)->purpose != CIRCUIT_PURPOSE_C_GENERAL)
+    return;
+
+  if (relay_send_command_from_edge(0, TO_CIRCUIT(circ),
+                                   RELAY_COMMAND_CC_NEGOTIATE_EXP,
+                                   (const char *) body, sizeof(body),
+                                   hop) < 0)
+    return;
+  hop->cc_negotiate_sent = 1;
+}
+
+/** Process a CC_NEGOTIATE_EXP cell with the <b>body_len</b> bytes of
+ * <b>body</b>, that the client of <b>circ</b> sent us. If we can, package
+ * the data of the circuit with congestion control from now on, and tell the
+ * client so.
+ *
+ * Return 0 if we accepted the cell, or -1 if we dropped it. */
+int
+congestion_control_process_negotiate(circuit_t *circ, const uint8_t *body,
+                                     size_t body_len)
+{
+  or_circuit_t *or_circ;
+  const uint8_t answer[1] = { CC_NEGOTIATE_VERSION };
+
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Got a CC_NEGOTIATE_EXP cell on an origin circuit. Dropping.");
+    return -1;
+  }
+  or_circ = TO_OR_CIRCUIT(circ);
+
+  /* Without an answer, the client keeps fixed windows: that is what we
+   * want when the consensus turns congestion control off, or when the client
+   * speaks a version we don't know. */
+  if (!congestion_control_enabled()) {
+    log_info(LD_CIRC, "Congestion control is off. Ignoring "
+             "CC_NEGOTIATE_EXP cell.");
+    return -1;
+  }
+  if (body_len < 1 || body[0] != CC_NEGOTIATE_VERSION) {
+    log_info(LD_CIRC, "Unknown CC_NEGOTIATE_EXP version. Ignoring.");
+    return -1;
+  }
+
+  /* We can only switch windows while none of our cells is in flight. */
+  if (or_circ->ccontrol_negotiated ||
+      circ->package_window != circuit_initial_package_window()) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Got a CC_NEGOTIATE_EXP cell on a circuit that already sent data "
+           "or negotiated. Dropping.");
+    return -1;
+  }
+
+  or_circ->ccontrol_negotiated = 1;
+  congestion_control_init_endpoint(&circ->ccontrol, &circ->package_window);
+  relay_send_command_from_edge(0, circ, RELAY_COMMAND_CC_NEGOTIATED_EXP,
+                               (const char *) answer, sizeof(answer), NULL);
+  return 0;
+}
+
+/** Process a CC_NEGOTIATED_EXP cell with the <b>body_len</b> bytes of
+ * <b>body</b>, that arrived on the origin circuit <b>circ</b> from the hop
+ * <b>layer_hint</b>: that hop knows congestion control and XON/XOFF. Use
+ * congestion control towards it, unless some of our cells are already in
+ * flight.
+ *
+ * Return 0 if we accepted the cell, or -1 if we dropped it. */
+int
+congestion_control_process_negotiated(circuit_t *circ,
+                                      crypt_path_t *layer_hint,
+                                      const uint8_t *body, size_t body_len)
+{
+  if (!CIRCUIT_IS_ORIGIN(circ) || !layer_hint ||
+      !layer_hint->cc_negotiate_sent || layer_hint->cc_negotiated) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Got an unexpected CC_NEGOTIATED_EXP cell. Dropping.");
+    return -1;
+  }
+  if (body_len < 1 || body[0] != CC_NEGOTIATE_VERSION) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Got a CC_NEGOTIATED_EXP cell for a version we didn't ask for. "
+           "Dropping.");
+    return -1;
+  }
+
+  layer_hint->cc_negotiated = 1;
+  /* Optimistic data may already be on its way. Then we keep the fixed
+   * window, since we can't time the SENDMEs for these cells. Streams can
+   * still use XON/XOFF. */
+  if (layer_hint->package_window == circuit_initial_package_window()) {
+    congestion_control_init_endpoint(&layer_hint->ccontrol,
+                                     &layer_hint->package_window);
+  }
+  return 0;
+}
+
+/** Return how many more DATA cells <b>cc</b> lets us package right now. This
+ * is what the package_window of the circuit should hold. */
+int
+congestion_control_get_package_window(const congestion_control_t *cc)
+{
+  tor_assert(cc);
+
+  if (cc->inflight >= cc->cwnd)
+    return 0;
+  return (int) (cc->cwnd - cc->inflight);
+}
+
+/** Return true iff, once <b>idx</b> more DATA cells are packaged, the next
+ * one is the cell that will make the other end send a SENDME. This is the
+ * congestion control equivalent of circuit_sendme_cell_is_next(). */
+bool
+congestion_control_sendme_is_next(const congestion_control_t *cc, int idx)
+{
+  tor_assert(cc);
+  tor_assert(idx >= 0);
+
+  /* The other end sends a SENDME every CIRCWINDOW_INCREMENT DATA cells it
+   * receives and every SENDME acknowledges that many cells, so the number of
+   * cells in flight keeps the same count modulo the increment. */
+  return ((cc->inflight + idx + 1) % CIRCWINDOW_INCREMENT) == 0;
+}
+
+/** Note that we just packaged one DATA cell on the circuit of <b>cc</b>. */
+void
+congestion_control_note_cell_sent(congestion_control_t *cc)
+{
+  tor_assert(cc);
+
+  /* Remember when we sent the cells that a SENDME will acknowledge, so that
+   * we can time the round trip. */
+  if (congestion_control_sendme_is_next(cc, 0)) {
+    uint64_t now_usec = monotime_absolute_usec();
+    smartlist_add(cc->sendme_pending_timestamps,
+                  tor_memdup(&now_usec, sizeof(now_usec)));
+  }
+  if (++cc->inflight >= cc->cwnd)
+    cc->cwnd_full = 1;
+}
+
+/** Update the round-trip time estimates of <b>cc</b> for a SENDME that just
+ * arrived at <b>now_usec</b>. Return the new measurement in microseconds, or
+ * 0 if we couldn't take one. */
+STATIC uint64_t
+congestion_control_update_rtt(congestion_control_t *cc, uint64_t now_usec)
+{
+  uint64_t *sent_usec, rtt;
+
+  if (smartlist_len(cc->sendme_pending_timestamps) == 0)
+    return 0;
+
+  sent_usec = smartlist_get(cc->sendme_pending_timestamps, 0);
+  smartlist_del_keeporder(cc->sendme_pending_timestamps, 0);
+  rtt = (now_usec > *sent_usec) ? now_usec - *sent_usec : 0;
+  tor_free(sent_usec);
+
+  /* A monotonic clock with a coarse resolution can give us 0: don't let it
+   * pull the estimates down. */
+  if (rtt == 0)
+    return 0;
+
+  if (cc->ewma_rtt_usec == 0) {
+    cc->ewma_rtt_usec = rtt;
+  } else {
+    /* N-sample EWMA, that is a weight of 2/(N+1) for the new sample. */
+    cc->ewma_rtt_usec = (2 * rtt + (cc->ewma_n - 1) * cc->ewma_rtt_usec) /
+                        (cc->ewma_n + 1);
+  }
+  if (cc->min_rtt_usec == 0 || rtt < cc->min_rtt_usec)
+    cc->min_rtt_usec = rtt;
+
+  return rtt;
+}
+
+/** Process a circuit-level SENDME for the circuit of <b>cc</b>: the other
+ * end got CIRCWINDOW_INCREMENT more of our cells. Update the round-trip
+ * time and let the algorithm adjust the window.
+ *
+ * Return 0 on success, or -1 if the SENDME acknowledges cells that we never
+ * sent, in which case the circuit should be closed. */
+int
+congestion_control_process_sendme(congestion_control_t *cc)
+{
+  tor_assert(cc);
+
+  if (cc->inflight < CIRCWINDOW_INCREMENT)
+    return -1;
+
+  cc->inflight -= CIRCWINDOW_INCREMENT;
+  if (congestion_control_update_rtt(cc, monotime_absolute_usec()) == 0)
+    return 0;
+
+  switch (cc->cc_alg) {
+    case CC_ALG_VEGAS:
+      congestion_control_vegas_process_sendme(cc);
+      break;
+    default:
+      tor_assert_nonfatal_unreached();
+      break;
+  }
+  return 0;
+}
@@ -0,0 +1,83 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_common.h
+ * \brief Header file for congestion_control_common.c.
+ **/
+
+#ifndef TOR_CONGESTION_CONTROL_COMMON_H
+#define TOR_CONGESTION_CONTROL_COMMON_H
+
+#include "core/or/congestion_control_st.h"
+
+/** Largest congestion window that the consensus may ask for, in cells. We
+ * also cap it to half of circ_max_cell_queue_size, so that the circuit queue
+ * of the relays on the path can hold a whole window. */
+#define CC_CWND_MAX_MAX 20000
+
+congestion_control_t *congestion_control_new(void);
+void congestion_control_free_(congestion_control_t *cc);
+#define congestion_control_free(cc) \
+  FREE_AND_NULL(congestion_control_t, congestion_control_free_, (cc))
+
+void congestion_control_negotiate_origin_circuit(origin_circuit_t *circ);
+int congestion_control_process_negotiate(circuit_t *circ,
+                                         const uint8_t *body,
+                                         size_t body_len);
+int congestion_control_process_negotiated(circuit_t *circ,
+                                          crypt_path_t *layer_hint,
+                                          const uint8_t *body,
+                                          size_t body_len);
+
+bool congestion_control_enabled(void);
+void congestion_control_new_consensus_params(const networkstatus_t *ns);
+
+int congestion_control_get_package_window(const congestion_control_t *cc);
+bool congestion_control_sendme_is_next(const congestion_control_t *cc,
+                                       int idx);
+void congestion_control_note_cell_sent(congestion_control_t *cc);
+int congestion_control_process_sendme(congestion_control_t *cc);
+
+#ifdef CONGESTION_CONTROL_PRIVATE
+
+/** Version of the body of the CC_NEGOTIATE_EXP and CC_NEGOTIATED_EXP cells:
+ * one byte, that only says which version this is. */
+#define CC_NEGOTIATE_VERSION 0
+
+/* Default values and bounds of the consensus parameters. */
+#define CC_ALG_DEFAULT CC_ALG_SENDME
+
+#define CC_CWND_INIT_DEFAULT 500
+#define CC_CWND_INIT_MIN (2*CIRCWINDOW_INCREMENT)
+#define CC_CWND_INIT_MAX CC_CWND_MAX_MAX
+
+#define CC_CWND_MIN_DEFAULT (3*CIRCWINDOW_INCREMENT)
+#define CC_CWND_MIN_MIN (2*CIRCWINDOW_INCREMENT)
+#define CC_CWND_MIN_MAX CC_CWND_MAX_MAX
+
+#define CC_CWND_MAX_DEFAULT 10000
+#define CC_CWND_MAX_MIN (2*CIRCWINDOW_INCREMENT)
+
+#define CC_CWND_INC_DEFAULT 50
+#define CC_CWND_INC_MIN 1
+#define CC_CWND_INC_MAX CIRCWINDOW_START_MAX
+
+#define CC_EWMA_N_DEFAULT 3
+#define CC_EWMA_N_MIN 1
+#define CC_EWMA_N_MAX 255
+
+#define CC_VEGAS_ALPHA_DEFAULT 100
+#define CC_VEGAS_BETA_DEFAULT 250
+#define CC_VEGAS_GAMMA_DEFAULT 150
+#define CC_VEGAS_DELTA_DEFAULT 400
+#define CC_VEGAS_PARAM_MAX CIRCWINDOW_START_MAX
+
+#ifdef TOR_UNIT_TESTS
+STATIC uint64_t congestion_control_update_rtt(congestion_control_t *cc,
+                                              uint64_t now_usec);
+#endif
+
+#endif /* defined(CONGESTION_CONTROL_PRIVATE) */
+
+#endif /* !defined(TOR_CONGESTION_CONTROL_COMMON_H) */
@@ -0,0 +1,225 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_flow.c
+ * \brief Stream flow control with XON/XOFF cells.
+ *
+ * Stream-level SENDME windows cap every stream at STREAMWINDOW_START cells
+ * per round trip, whatever the congestion window of its circuit is. Streams
+ * on a circuit with congestion control can instead negotiate XON/XOFF flow
+ * control: the receiving end lets the data flow until the outbuf towards the
+ * application holds too much of it, sends an XOFF cell, and sends an XON
+ * cell once the application caught up. The sending end stops reading from
+ * its edge connection between the two.
+ *
+ * This is experimental, and not in tor-spec.txt: it uses the XOFF_EXP and
+ * XON_EXP relay commands, whose numbers are far from those of the XOFF and
+ * XON cells of the spec. The client asks for it by setting
+ * BEGIN_FLAG_FLOW_CTRL in the BEGIN cell, which it only does once the exit
+ * answered its CC_NEGOTIATE_EXP cell (see congestion_control_common.c). Both
+ * ends then stop using the stream-level package and deliver windows.
+ **/
+
+#define CONGESTION_CONTROL_FLOW_PRIVATE
+
+#include "core/or/or.h"
+
+#include "app/config/config.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "core/or/circuitlist.h"
+#include "core/or/congestion_control_common.h"
+#include "core/or/congestion_control_flow.h"
+#include "core/or/connection_edge.h"
+#include "core/or/relay.h"
+#include "feature/nodelist/networkstatus.h"
+
+#include "core/or/circuit_st.h"
+#include "core/or/crypt_path_st.h"
+#include "core/or/edge_connection_st.h"
+#include "core/or/or_circuit_st.h"
+
+/** Consensus parameters: how many cells of data may wait on the outbuf of a
+ * client (resp. exit) stream before we send an XOFF. */
+static uint32_t xoff_client = CC_XOFF_DEFAULT;
+static uint32_t xoff_exit = CC_XOFF_DEFAULT;
+
+/** Update the flow control parameters from the consensus <b>ns</b>. */
+void
+flow_control_new_consensus_params(const networkstatus_t *ns)
+{
+  xoff_client = networkstatus_get_param(ns, "cc_xoff_client",
+                                        CC_XOFF_DEFAULT,
+                                        CC_XOFF_MIN, CC_XOFF_MAX);
+  xoff_exit = networkstatus_get_param(ns, "cc_xoff_exit",
+                                      CC_XOFF_DEFAULT,
+                                      CC_XOFF_MIN, CC_XOFF_MAX);
+}
+
+/** Return true iff the stream <b>conn</b> uses XON/XOFF flow control
+ * instead of stream-level SENDMEs. */
+bool
+edge_uses_flow_control(const edge_connection_t *conn)
+{
+  tor_assert(conn);
+  return (conn->begincell_flags & BEGIN_FLAG_FLOW_CTRL) != 0;
+}
+
+/** Return the BEGIN cell <b>flags</b> that a stream arriving on <b>circ</b>
+ * keeps. BEGIN_FLAG_FLOW_CTRL is dropped unless the client negotiated
+ * congestion control with us on that circuit: a client that sets it anyway
+ * gets the stream-level windows it would get from any other relay. */
+uint32_t
+flow_control_exit_begin_flags(const circuit_t *circ, uint32_t flags)
+{
+  tor_assert(circ);
+  if (!CIRCUIT_IS_ORCIRC(circ) ||
+      !CONST_TO_OR_CIRCUIT(circ)->ccontrol_negotiated) {
+    flags &= ~BEGIN_FLAG_FLOW_CTRL;
+  }
+  return flags;
+}
+
+/** Return true iff we, as a client, should ask for XON/XOFF flow control on
+ * the stream <b>conn</b> that we are about to open. We only do so when the
+ * exit answered our CC_NEGOTIATE_EXP cell on its circuit. */
+bool
+flow_control_client_should_negotiate(const edge_connection_t *conn)
+{
+  const crypt_path_t *cpath_layer = conn->cpath_layer;
+
+  if (!conn->on_circuit ||
+      conn->on_circuit->purpose != CIRCUIT_PURPOSE_C_GENERAL)
+    return false;
+
+  return cpath_layer && cpath_layer->cc_negotiated;
+}
+
+/** Send the relay command <b>command</b> (XON or XOFF) on the stream
+ * <b>conn</b>. Return 0 on success, -1 if the circuit is gone. */
+static int
+flow_control_send(edge_connection_t *conn, uint8_t command)
+{
+  if (circuit_get_by_edge_conn(conn) == NULL) {
+    /* The destroy may already have arrived and torn down the circuit. */
+    log_info(LD_EDGE, "No circuit associated with edge connection. "
+                      "Skipping sending %s.",
+             command == RELAY_COMMAND_XON_EXP ? "XON" : "XOFF");
+    return -1;
+  }
+  return connection_edge_send_command(conn, command, NULL, 0);
+}
+
+/** Return how many bytes may wait on the outbuf of the stream <b>conn</b>
+ * before we send an XOFF. */
+static size_t
+flow_control_xoff_limit(const edge_connection_t *conn)
+{
+  size_t limit = (conn->base_.type == CONN_TYPE_AP) ? xoff_client :
+                                                        xoff_exit;
+  return limit * RELAY_PAYLOAD_SIZE;
+}
+
+/** Called when data was added to or flushed from the outbuf of the stream
+ * <b>conn</b>, which uses XON/XOFF flow control. Tell the other end to stop
+ * sending when the outbuf holds too much data, and to resume once it is
+ * half empty again. */
+void
+flow_control_decide_xon_xoff(edge_connection_t *conn)
+{
+  size_t outbuf_len = connection_get_outbuf_len(TO_CONN(conn));
+  size_t limit = flow_control_xoff_limit(conn);
+
+  if (!conn->xoff_sent) {
+    if (outbuf_len > limit) {
+      log_debug(LD_EDGE, "Outbuf %"TOR_PRIuSZ", sending XOFF.", outbuf_len);
+      if (flow_control_send(conn, RELAY_COMMAND_XOFF_EXP) == 0)
+        conn->xoff_sent = 1;
+    }
+  } else if (outbuf_len <= limit / 2) {
+    log_debug(LD_EDGE, "Outbuf %"TOR_PRIuSZ", sending XON.", outbuf_len);
+    if (flow_control_send(conn, RELAY_COMMAND_XON_EXP) == 0)
+      conn->xoff_sent = 0;
+  }
+}
+
+/** Return true iff the other end of the stream <b>conn</b> kept sending
+ * data well after we sent it an XOFF. Nothing else bounds the outbuf of a
+ * stream without a deliver window, so the caller should close it.
+ *
+ * An honest peer may have had up to a full congestion window in flight when
+ * our XOFF left, so we allow that much on top of CC_XOFF_OVERRUN_FACTOR
+ * times the XOFF limit. */
+bool
+flow_control_xoff_ignored(edge_connection_t *conn)
+{
+  size_t outbuf_len, max_len;
+
+  tor_assert(conn);
+
+  if (!conn->xoff_sent)
+    return false;
+
+  outbuf_len = connection_get_outbuf_len(TO_CONN(conn));
+  max_len = CC_XOFF_OVERRUN_FACTOR * flow_control_xoff_limit(conn) +
+            CC_CWND_MAX_MAX * RELAY_PAYLOAD_SIZE;
+  if (outbuf_len <= max_len)
+    return false;
+
+  log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+         "Stream outbuf holds %"TOR_PRIuSZ" bytes after we sent an XOFF, "
+         "over our limit of %"TOR_PRIuSZ". Closing.", outbuf_len, max_len);
+  return true;
+}
+
+/** Process an XOFF cell for the stream <b>conn</b>: stop reading from it
+ * until we get an XON.
+ *
+ * Return 0 on success, or a negative circuit end reason if the cell is a
+ * protocol violation. */
+int
+flow_control_process_xoff(edge_connection_t *conn)
+{
+  tor_assert(conn);
+
+  if (!edge_uses_flow_control(conn)) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Got an XOFF on a stream that uses SENDMEs. Closing circuit.");
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+  if (conn->xoff_received) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Got an XOFF on a stream that is already stopped. Dropping.");
+    return 0;
+  }
+
+  conn->xoff_received = 1;
+  connection_stop_reading(TO_CONN(conn));
+  return 0;
+}
+
+/** Process an XON cell for the stream <b>conn</b>.
+ *
+ * Return 1 if the caller should start reading from <b>conn</b> again, 0 if
+ * there is nothing to do, or a negative circuit end reason if the cell is a
+ * protocol violation. */
+int
+flow_control_process_xon(edge_connection_t *conn)
+{
+  tor_assert(conn);
+
+  if (!edge_uses_flow_control(conn)) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Got an XON on a stream that uses SENDMEs. Closing circuit.");
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+  if (!conn->xoff_received) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Got an XON on a stream that isn't stopped. Dropping.");
+    return 0;
+  }
+
+  conn->xoff_received = 0;
+  return 1;
+}
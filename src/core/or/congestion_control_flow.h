@@ -0,0 +1,39 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_flow.h
+ * \brief Header file for congestion_control_flow.c.
+ **/
+
+#ifndef TOR_CONGESTION_CONTROL_FLOW_H
+#define TOR_CONGESTION_CONTROL_FLOW_H
+
+bool edge_uses_flow_control(const edge_connection_t *conn);
+bool flow_control_client_should_negotiate(const edge_connection_t *conn);
+uint32_t flow_control_exit_begin_flags(const circuit_t *circ,
+                                       uint32_t flags);
+
+void flow_control_new_consensus_params(const networkstatus_t *ns);
+
+void flow_control_decide_xon_xoff(edge_connection_t *conn);
+bool flow_control_xoff_ignored(edge_connection_t *conn);
+int flow_control_process_xoff(edge_connection_t *conn);
+int flow_control_process_xon(edge_connection_t *conn);
+
+#ifdef CONGESTION_CONTROL_FLOW_PRIVATE
+
+/** Default number of cells that may wait on the outbuf of a stream before
+ * we send an XOFF, and its bounds. This matches the amount of data that a
+ * stream-level package window lets the other end send us. */
+#define CC_XOFF_DEFAULT STREAMWINDOW_START
+#define CC_XOFF_MIN 1
+#define CC_XOFF_MAX 10000
+
+/** How many times the XOFF limit a stream outbuf may hold, on top of a full
+ * congestion window, before we decide the other end ignores our XOFF. */
+#define CC_XOFF_OVERRUN_FACTOR 4
+
+#endif /* defined(CONGESTION_CONTROL_FLOW_PRIVATE) */
+
+#endif /* !defined(TOR_CONGESTION_CONTROL_FLOW_H) */
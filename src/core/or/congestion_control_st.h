@@ -0,0 +1,83 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_st.h
+ * \brief Structure definitions for circuit congestion control.
+ **/
+
+#ifndef CONGESTION_CONTROL_ST_H
+#define CONGESTION_CONTROL_ST_H
+
+#include "core/or/or.h"
+
+/** Congestion control algorithms that a circuit can use. The numbers are
+ * the values of the "cc_alg" consensus parameter. */
+typedef enum cc_alg_t {
+  /** Fixed SENDME windows: CIRCWINDOW_START cells per circuit. */
+  CC_ALG_SENDME = 0,
+  /** TCP Vegas: keep a small, bounded number of cells queued along the
+   * path, as estimated from the SENDME round-trip time. */
+  CC_ALG_VEGAS = 2,
+} cc_alg_t;
+
+/** Parameters of the Vegas algorithm, all in cells. */
+typedef struct vegas_params_t {
+  /** Below this estimated queue use, grow the window. */
+  uint16_t alpha;
+  /** Above this estimated queue use, shrink the window. */
+  uint16_t beta;
+  /** Leave slow start once the estimated queue use reaches this. */
+  uint16_t gamma;
+  /** Above this estimated queue use, cut the window down to the estimated
+   * bandwidth-delay product plus <b>delta</b>. */
+  uint16_t delta;
+} vegas_params_t;
+
+/** Congestion control state of one end of a circuit: an exit's or_circuit_t
+ * or one hop of a client's cpath.
+ *
+ * We count the DATA cells that we have packaged and for which no SENDME has
+ * acknowledged receipt yet ("inflight"), and we let the algorithm decide how
+ * many such cells we may have at once ("cwnd"). The other end of the circuit
+ * keeps sending a SENDME every CIRCWINDOW_INCREMENT cells: we time those to
+ * measure the round-trip time of the circuit. */
+struct congestion_control_t {
+  /** Which algorithm drives this window (a cc_alg_t). */
+  uint8_t cc_alg;
+  /** True while we are in slow start. */
+  unsigned int in_slow_start : 1;
+  /** True iff the window has been full since the last window update: we
+   * don't grow a window that doesn't limit us. */
+  unsigned int cwnd_full : 1;
+
+  /** Congestion window: how many cells we may have in flight. */
+  uint32_t cwnd;
+  /** Number of DATA cells we packaged and that no SENDME acknowledged. */
+  uint32_t inflight;
+  /** Number of SENDMEs to receive before our next window update, outside of
+   * slow start. We update the window once per window worth of cells. */
+  uint32_t next_cwnd_event;
+
+  /** Exponentially weighted moving average of the round-trip time, in
+   * microseconds. 0 until the first measurement. */
+  uint64_t ewma_rtt_usec;
+  /** Lowest round-trip time we have measured, in microseconds. 0 until the
+   * first measurement. */
+  uint64_t min_rtt_usec;
+
+  /** FIFO of the times, in monotonic microseconds, at which we packaged each
+   * cell that should make the other end send us a SENDME. The head of the
+   * list matches the next SENDME we will receive. */
+  smartlist_t *sendme_pending_timestamps;
+
+  /** Parameters copied from the consensus when this object was created, so
+   * that a circuit keeps a consistent behavior over its lifetime. */
+  uint32_t cwnd_min;
+  uint32_t cwnd_max;
+  uint32_t cwnd_inc;
+  uint8_t ewma_n;
+  vegas_params_t vegas_params;
+};
+
+#endif /* !defined(CONGESTION_CONTROL_ST_H) */
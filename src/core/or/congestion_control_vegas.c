@@ -0,0 +1,82 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_vegas.c
+ * \brief TCP Vegas congestion control for circuits.
+ *
+ * Vegas compares the round-trip time of the circuit with the lowest one we
+ * ever measured on it. The difference tells how many of our cells are
+ * sitting in queues along the path:
+ *
+ *    queue_use = cwnd - cwnd * min_rtt / rtt
+ *
+ * where "cwnd * min_rtt / rtt" is the bandwidth-delay product of the path.
+ * We grow the window while that queue stays small, and shrink it when it
+ * gets large, so that the circuit uses the available bandwidth without
+ * bloating the queues of the relays.
+ **/
+
+#include "core/or/or.h"
+
+#include "core/or/congestion_control_st.h"
+#include "core/or/congestion_control_vegas.h"
+
+/** Return how many SENDMEs acknowledge one window worth of cells on
+ * <b>cc</b>. */
+static uint32_t
+vegas_sendmes_per_cwnd(const congestion_control_t *cc)
+{
+  return MAX(cc->cwnd / CIRCWINDOW_INCREMENT, 1);
+}
+
+/** Update the congestion window of <b>cc</b> for a SENDME that just arrived
+ * and gave us a new round-trip time measurement. */
+void
+congestion_control_vegas_process_sendme(congestion_control_t *cc)
+{
+  const vegas_params_t *params = &cc->vegas_params;
+  uint64_t bdp, queue_use;
+
+  tor_assert(cc);
+  tor_assert(cc->ewma_rtt_usec > 0);
+
+  bdp = (uint64_t) cc->cwnd * cc->min_rtt_usec / cc->ewma_rtt_usec;
+  queue_use = (cc->cwnd > bdp) ? cc->cwnd - bdp : 0;
+
+  if (cc->in_slow_start) {
+    if (queue_use < params->gamma) {
+      /* One increment per SENDME doubles the window every round trip. */
+      if (cc->cwnd_full) {
+        cc->cwnd += CIRCWINDOW_INCREMENT;
+        cc->cwnd_full = 0;
+      }
+    } else {
+      /* The path started queuing: go to congestion avoidance with a window
+       * that leaves about gamma cells queued. */
+      cc->cwnd = (uint32_t) MIN(bdp + params->gamma, UINT32_MAX);
+      cc->in_slow_start = 0;
+      cc->cwnd_full = 0;
+      cc->next_cwnd_event = vegas_sendmes_per_cwnd(cc);
+    }
+  } else if (--cc->next_cwnd_event == 0) {
+    /* Congestion avoidance: adjust once per window. */
+    if (queue_use > params->delta) {
+      cc->cwnd = (uint32_t) MIN(bdp + params->delta, UINT32_MAX);
+      cc->cwnd = (cc->cwnd > cc->cwnd_inc) ? cc->cwnd - cc->cwnd_inc : 0;
+    } else if (queue_use > params->beta) {
+      cc->cwnd = (cc->cwnd > cc->cwnd_inc) ? cc->cwnd - cc->cwnd_inc : 0;
+    } else if (queue_use < params->alpha && cc->cwnd_full) {
+      cc->cwnd += cc->cwnd_inc;
+    }
+    cc->cwnd_full = 0;
+    cc->next_cwnd_event = vegas_sendmes_per_cwnd(cc);
+  }
+
+  cc->cwnd = CLAMP(cc->cwnd_min, cc->cwnd, cc->cwnd_max);
+
+  log_debug(LD_CIRC, "Vegas: cwnd %u, inflight %u, rtt %"PRIu64
+            " (min %"PRIu64") usec, queue use %"PRIu64", slow start %d.",
+            cc->cwnd, cc->inflight, cc->ewma_rtt_usec, cc->min_rtt_usec,
+            queue_use, cc->in_slow_start);
+}
@@ -0,0 +1,16 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_vegas.h
+ * \brief Header file for congestion_control_vegas.c.
+ **/
+
+#ifndef TOR_CONGESTION_CONTROL_VEGAS_H
+#define TOR_CONGESTION_CONTROL_VEGAS_H
+
+#include "core/or/congestion_control_st.h"
+
+void congestion_control_vegas_process_sendme(congestion_control_t *cc);
+
+#endif /* !defined(TOR_CONGESTION_CONTROL_VEGAS_H) */
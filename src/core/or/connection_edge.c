@@ -68,8 +68,10 @@
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
 #include "core/or/circuitpadding.h"
+#include "core/or/congestion_control_flow.h"
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
+#include "core/or/dos.h"
 #include "core/or/extendinfo.h"
 #include "core/or/policies.h"
 #include "core/or/reasons.h"
@@ -3265,6 +3267,10 @@ connection_ap_handshake_send_begin,(entry_connection_t *ap_conn))
 
   /* Set up begin cell flags. */
   edge_conn->begincell_flags = connection_ap_get_begincell_flags(ap_conn);
+  if (!ap_conn->use_begindir &&
+      flow_control_client_should_negotiate(edge_conn)) {
+    edge_conn->begincell_flags |= BEGIN_FLAG_FLOW_CTRL;
+  }
 
   tor_snprintf(payload,RELAY_PAYLOAD_SIZE, "%s:%d",
                (circ->base_.purpose == CIRCUIT_PURPOSE_C_GENERAL ||
@@ -3962,6 +3968,28 @@ handle_hs_exit_conn(circuit_t *circ, edge_connection_t *conn)
   return 0;
 }
 
+/** Apply the stream creation DoS mitigation to a BEGIN or BEGIN_DIR cell for
+ * the stream <b>stream_id</b> on <b>circ</b>. Return 0 if the stream may be
+ * opened, 1 if we refused it and sent an END cell, or -(some circuit end
+ * reason) if we want to tear down <b>circ</b>. */
+static int
+begin_cell_check_stream_dos(or_circuit_t *circ, streamid_t stream_id)
+{
+  switch (dos_stream_new_begin_or_resolve_cell(circ)) {
+    case DOS_STREAM_DEFENSE_REFUSE_STREAM:
+      /* Not END_STREAM_REASON_RESOURCELIMIT: that makes the client stop
+       * using us as an exit altogether. */
+      relay_send_end_cell_from_edge(stream_id, TO_CIRCUIT(circ),
+                                    END_STREAM_REASON_MISC, NULL);
+      return 1;
+    case DOS_STREAM_DEFENSE_CLOSE_CIRCUIT:
+      return -END_CIRC_REASON_RESOURCELIMIT;
+    case DOS_STREAM_DEFENSE_NONE:
+    default:
+      return 0;
+  }
+}
+
 /** A relay 'begin' or 'begin_dir' cell has arrived, and either we are
  * an exit hop for the circuit, or we are the origin and it is a
  * rendezvous begin.
@@ -4083,6 +4111,11 @@ connection_exit_begin_conn(cell_t *cell, circuit_t *circ)
     return 0;
   }
 
+  if (or_circ && (rv = begin_cell_check_stream_dos(or_circ, rh.stream_id))) {
+    tor_free(address);
+    return rv < 0 ? rv : 0;
+  }
+
   if (! options->IPv6Exit) {
     /* I don't care if you prefer IPv6; I can't give you any. */
     bcell.flags &= ~BEGIN_FLAG_IPV6_PREFERRED;
@@ -4105,7 +4138,7 @@ connection_exit_begin_conn(cell_t *cell, circuit_t *circ)
   n_stream->dirreq_id = circ->dirreq_id;
 
   n_stream->base_.purpose = EXIT_PURPOSE_CONNECT;
-  n_stream->begincell_flags = bcell.flags;
+  n_stream->begincell_flags = flow_control_exit_begin_flags(circ, bcell.flags);
   n_stream->stream_id = rh.stream_id;
   n_stream->base_.port = port;
   /* leave n_stream->s at -1, because it's not yet valid */
@@ -4175,6 +4208,9 @@ connection_exit_begin_conn(cell_t *cell, circuit_t *circ)
  * Called when we receive a RELAY_COMMAND_RESOLVE cell 'cell' along the
  * circuit <b>circ</b>;
  * begin resolving the hostname, and (eventually) reply with a RESOLVED cell.
+ *
+ * Return -(some circuit end reason) if we want to tear down <b>circ</b>.
+ * Else return 0.
  */
 int
 connection_exit_begin_resolve(cell_t *cell, or_circuit_t *circ)
@@ -4185,7 +4221,7 @@ connection_exit_begin_resolve(cell_t *cell, or_circuit_t *circ)
   assert_circuit_ok(TO_CIRCUIT(circ));
   relay_header_unpack(&rh, cell->payload);
   if (rh.length > RELAY_PAYLOAD_SIZE)
-    return -1;
+    return -END_CIRC_REASON_TORPROTOCOL;
 
   /* This 'dummy_conn' only exists to remember the stream ID
    * associated with the resolve request; and to make the
@@ -4205,6 +4241,20 @@ connection_exit_begin_resolve(cell_t *cell, or_circuit_t *circ)
 
   dummy_conn->on_circuit = TO_CIRCUIT(circ);
 
+  switch (dos_stream_new_begin_or_resolve_cell(circ)) {
+    case DOS_STREAM_DEFENSE_REFUSE_STREAM:
+      dns_send_resolved_error_cell(dummy_conn, RESOLVED_TYPE_ERROR_TRANSIENT);
+      if (!dummy_conn->base_.marked_for_close)
+        connection_free_(TO_CONN(dummy_conn));
+      return 0;
+    case DOS_STREAM_DEFENSE_CLOSE_CIRCUIT:
+      connection_free_(TO_CONN(dummy_conn));
+      return -END_CIRC_REASON_RESOURCELIMIT;
+    case DOS_STREAM_DEFENSE_NONE:
+    default:
+      break;
+  }
+
   /* send it off to the gethostbyname farm */
   switch (dns_resolve(dummy_conn)) {
     case -1: /* Impossible to resolve; a resolved cell was sent. */
@@ -238,6 +238,11 @@ void half_edge_free_(struct half_edge_t *he);
 /** When this flag is set, if we find both an IPv4 and an IPv6 address,
  * we use the IPv6 address.  Otherwise we use the IPv4 address. */
 #define BEGIN_FLAG_IPV6_PREFERRED (1u<<2)
+/** When this flag is set, both ends of the stream use XON/XOFF cells instead
+ * of stream-level SENDMEs to control its flow. Experimental and not in
+ * tor-spec.txt: only set on circuits that negotiated congestion control. See
+ * congestion_control_flow.c. */
+#define BEGIN_FLAG_FLOW_CTRL      (1u<<3)
 /**@}*/
 
 #ifdef CONNECTION_EDGE_PRIVATE
@@ -30,6 +30,7 @@
 #include "core/crypto/onion_crypto.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
+#include "core/or/congestion_control_common.h"
 #include "core/or/extendinfo.h"
 
 #include "lib/crypt_ops/crypto_dh.h"
@@ -169,6 +170,7 @@ cpath_free(crypt_path_t *victim)
   onion_handshake_state_release(&victim->handshake_state);
   crypto_dh_free(victim->rend_dh_handshake_state);
   extend_info_free(victim->extend_info);
+  congestion_control_free(victim->ccontrol);
 
   memwipe(victim, 0xBB, sizeof(crypt_path_t)); /* poison memory */
   tor_free(victim);
@@ -188,6 +190,20 @@ cpath_crypt_cell(const crypt_path_t *cpath, uint8_t *payload, bool is_decrypt)
   }
 }
 
+/** Encrypt or decrypt the payloads of the <b>n_cells</b> cells in
+ *  <b>cells</b>, in order, using the crypto of <b>cpath</b>. Actual operation
+ *  decided by <b>is_decrypt</b>. */
+void
+cpath_crypt_cells(const crypt_path_t *cpath, cell_t **cells, size_t n_cells,
+                  bool is_decrypt)
+{
+  if (is_decrypt) {
+    relay_crypt_payloads(cpath->pvt_crypto.b_crypto, cells, n_cells);
+  } else {
+    relay_crypt_payloads(cpath->pvt_crypto.f_crypto, cells, n_cells);
+  }
+}
+
 /** Getter for the incoming digest of <b>cpath</b>. */
 struct crypto_digest_t *
 cpath_get_incoming_digest(const crypt_path_t *cpath)
@@ -23,6 +23,9 @@ void cpath_extend_linked_list(crypt_path_t **head_ptr, crypt_path_t *new_hop);
 
 void
 cpath_crypt_cell(const crypt_path_t *cpath, uint8_t *payload, bool is_decrypt);
+void
+cpath_crypt_cells(const crypt_path_t *cpath, cell_t **cells, size_t n_cells,
+                  bool is_decrypt);
 
 struct crypto_digest_t *
 cpath_get_incoming_digest(const crypt_path_t *cpath);
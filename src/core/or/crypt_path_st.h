@@ -79,6 +79,15 @@ struct crypt_path_t {
                        * at this step? */
   int deliver_window; /**< How many cells are we willing to deliver originating
                        * at this step? */
+  /** Congestion control state for the cells we originate ending at this
+   * step, or NULL if we use a fixed package window. Only the last hop of a
+   * circuit can get one, once it answered our CC_NEGOTIATE_EXP cell. */
+  congestion_control_t *ccontrol;
+  /** True iff we sent a CC_NEGOTIATE_EXP cell to this step. */
+  unsigned int cc_negotiate_sent : 1;
+  /** True iff this step answered our CC_NEGOTIATE_EXP cell, and so knows the
+   * experimental congestion control and XON/XOFF cells. */
+  unsigned int cc_negotiated : 1;
 
   /*********************** Private members ****************************/
 
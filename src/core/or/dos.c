@@ -13,6 +13,7 @@
 #include "core/mainloop/connection.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/channel.h"
+#include "core/or/circuitlist.h"
 #include "core/or/connection_or.h"
 #include "core/or/relay.h"
 #include "feature/hs/hs_dos.h"
@@ -23,9 +24,11 @@
 #include "lib/crypt_ops/crypto_rand.h"
 
 #include "core/or/dos.h"
+#include "core/or/dos_prefix.h"
 #include "core/or/dos_sys.h"
 
 #include "core/or/dos_options_st.h"
+#include "core/or/or_circuit_st.h"
 #include "core/or/or_connection_st.h"
 
 /*
@@ -67,6 +70,57 @@ static dos_conn_defense_type_t dos_conn_defense_type;
 /* Keep some stats for the heartbeat so we can report out. */
 static uint64_t conn_num_addr_rejected;
 
+/*
+ * Per-prefix denial of service mitigation.
+ *
+ * Namespace used for this mitigation framework is "dos_prefix_". It counts
+ * circuit creations and new connections per address prefix, in a fixed
+ * amount of memory, so that we notice attackers who spread themselves over
+ * many addresses of one network. See dos_prefix.c.
+ */
+
+/* Is the per-prefix DoS mitigation enabled? It only applies to the
+ * mitigations above that are enabled. */
+static unsigned int dos_prefix_enabled = 0;
+
+/* Consensus parameters. */
+static uint32_t dos_prefix_max_addresses;
+
+/* Busiest prefixes for circuit creations and for new connections. NULL
+ * unless both this mitigation and the corresponding one above are
+ * enabled. */
+static dos_prefix_tracker_t *cc_prefix_tracker = NULL;
+static dos_prefix_tracker_t *conn_prefix_tracker = NULL;
+
+/* Keep some stats for the heartbeat so we can report out. */
+static uint32_t cc_num_marked_prefixes;
+static uint32_t conn_num_marked_prefixes;
+static uint64_t conn_num_prefix_rejected;
+
+/*
+ * Stream creation denial of service mitigation.
+ *
+ * Namespace used for this mitigation framework is "dos_stream_". Every OR
+ * circuit has a token bucket that BEGIN, BEGIN_DIR and RESOLVE cells take
+ * tokens from, so that one circuit can't make an exit open streams (and
+ * launch DNS lookups) as fast as it can send cells.
+ */
+
+/* Is the stream creation DoS mitigation enabled? */
+static unsigned int dos_stream_enabled = 0;
+
+/* Consensus parameters. They can be changed when a new consensus arrives.
+ * They are initialized with the hardcoded default values, since circuits
+ * can be created before this subsystem is initialized. */
+static uint32_t dos_stream_rate = DOS_STREAM_RATE_DEFAULT;
+static uint32_t dos_stream_burst = DOS_STREAM_BURST_DEFAULT;
+static dos_stream_defense_type_t dos_stream_defense_type =
+  DOS_STREAM_DEFENSE_TYPE_DEFAULT;
+
+/* Keep some stats for the heartbeat so we can report out. */
+static uint64_t stream_num_refused;
+static uint64_t stream_num_circ_closed;
+
 /*
  * General interface of the denial of service mitigation subsystem.
  */
@@ -190,6 +244,165 @@ get_param_conn_defense_type(const networkstatus_t *ns)
                                  DOS_CONN_DEFENSE_NONE, DOS_CONN_DEFENSE_MAX);
 }
 
+/* Return true iff the per-prefix mitigation is enabled. We look at the
+ * consensus for this else a default value is returned. */
+MOCK_IMPL(STATIC unsigned int,
+get_param_prefix_enabled, (const networkstatus_t *ns))
+{
+  if (dos_get_options()->DoSPrefixTrackingEnabled != -1) {
+    return dos_get_options()->DoSPrefixTrackingEnabled;
+  }
+  return !!networkstatus_get_param(ns, "DoSPrefixTrackingEnabled",
+                                   DOS_PREFIX_ENABLED_DEFAULT, 0, 1);
+}
+
+/* Return the consensus parameter for how many addresses' worth of circuits
+ * and connections one prefix may make. */
+static uint32_t
+get_param_prefix_max_addresses(const networkstatus_t *ns)
+{
+  if (dos_get_options()->DoSPrefixMaxAddresses) {
+    return dos_get_options()->DoSPrefixMaxAddresses;
+  }
+  return networkstatus_get_param(ns, "DoSPrefixMaxAddresses",
+                                 DOS_PREFIX_MAX_ADDRESSES_DEFAULT,
+                                 1, INT32_MAX);
+}
+
+/* Return true iff the stream creation mitigation is enabled. We look at the
+ * consensus for this else a default value is returned. */
+MOCK_IMPL(STATIC unsigned int,
+get_param_stream_enabled, (const networkstatus_t *ns))
+{
+  if (dos_get_options()->DoSStreamCreationEnabled != -1) {
+    return dos_get_options()->DoSStreamCreationEnabled;
+  }
+  return !!networkstatus_get_param(ns, "DoSStreamCreationEnabled",
+                                   DOS_STREAM_ENABLED_DEFAULT, 0, 1);
+}
+
+/* Return the consensus parameter for the stream creation rate of a
+ * circuit, per second. */
+static uint32_t
+get_param_stream_rate(const networkstatus_t *ns)
+{
+  if (dos_get_options()->DoSStreamCreationRate) {
+    return dos_get_options()->DoSStreamCreationRate;
+  }
+  return networkstatus_get_param(ns, "DoSStreamCreationRate",
+                                 DOS_STREAM_RATE_DEFAULT, 1, INT32_MAX);
+}
+
+/* Return the consensus parameter for the stream creation burst of a
+ * circuit. */
+static uint32_t
+get_param_stream_burst(const networkstatus_t *ns)
+{
+  if (dos_get_options()->DoSStreamCreationBurst) {
+    return dos_get_options()->DoSStreamCreationBurst;
+  }
+  return networkstatus_get_param(ns, "DoSStreamCreationBurst",
+                                 DOS_STREAM_BURST_DEFAULT, 1, INT32_MAX);
+}
+
+/* Return the consensus parameter of the stream creation defense type. */
+static uint32_t
+get_param_stream_defense_type(const networkstatus_t *ns)
+{
+  if (dos_get_options()->DoSStreamCreationDefenseType) {
+    return dos_get_options()->DoSStreamCreationDefenseType;
+  }
+  return networkstatus_get_param(ns, "DoSStreamCreationDefenseType",
+                                 DOS_STREAM_DEFENSE_TYPE_DEFAULT,
+                                 DOS_STREAM_DEFENSE_NONE,
+                                 DOS_STREAM_DEFENSE_MAX);
+}
+
+/* Per-prefix private API. */
+
+/* Allocate or free the prefix trackers according to which mitigations are
+ * enabled, and set their thresholds from the current parameters. */
+static void
+prefix_update_trackers(void)
+{
+  if (dos_prefix_enabled && dos_cc_enabled) {
+    /* An address that uses its whole circuit bucket, and then keeps
+     * creating circuits at the allowed rate, counts at most this much. */
+    const uint64_t per_addr = (uint64_t) dos_cc_circuit_burst +
+      2 * (uint64_t) dos_cc_circuit_rate * DOS_PREFIX_DECAY_PERIOD;
+    if (!cc_prefix_tracker)
+      cc_prefix_tracker = dos_prefix_tracker_new();
+    dos_prefix_tracker_set_threshold(cc_prefix_tracker,
+                                     per_addr * dos_prefix_max_addresses);
+  } else {
+    dos_prefix_tracker_free(cc_prefix_tracker);
+  }
+
+  if (dos_prefix_enabled && dos_conn_enabled) {
+    /* The tracker counts new connections, but the connection mitigation only
+     * has a limit on concurrent ones. We read it as a rate instead: one
+     * address may open DoSConnectionMaxConcurrentCount new connections per
+     * decay period, which counts at most twice that much. */
+    const uint64_t per_addr = 2 * (uint64_t) dos_conn_max_concurrent_count;
+    if (!conn_prefix_tracker)
+      conn_prefix_tracker = dos_prefix_tracker_new();
+    dos_prefix_tracker_set_threshold(conn_prefix_tracker,
+                                     per_addr * dos_prefix_max_addresses);
+  } else {
+    dos_prefix_tracker_free(conn_prefix_tracker);
+  }
+}
+
+/* Free everything for the per-prefix DoS mitigation subsystem. */
+static void
+prefix_free_all(void)
+{
+  dos_prefix_tracker_free(cc_prefix_tracker);
+  dos_prefix_tracker_free(conn_prefix_tracker);
+  dos_prefix_enabled = 0;
+}
+
+/* Return true iff the address of the given client channel belongs to a
+ * prefix marked by the circuit creation prefix tracker. */
+static int
+cc_channel_prefix_is_marked(channel_t *chan)
+{
+  tor_addr_t addr;
+
+  if (cc_prefix_tracker == NULL) {
+    return 0;
+  }
+  if (!channel_is_client(chan) ||
+      !channel_get_addr_if_possible(chan, &addr)) {
+    return 0;
+  }
+  return dos_prefix_tracker_is_marked(cc_prefix_tracker, &addr,
+                                      approx_time());
+}
+
+/* Stream creation private API. */
+
+/* Apply the current stream creation rate and burst to the token bucket of
+ * every existing OR circuit. */
+static void
+stream_update_circuits(void)
+{
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
+    if (CIRCUIT_IS_ORIGIN(circ)) {
+      continue;
+    }
+    token_bucket_ctr_adjust(&TO_OR_CIRCUIT(circ)->stream_limiter,
+                            dos_stream_rate, dos_stream_burst);
+  } SMARTLIST_FOREACH_END(circ);
+}
+
+/* Free everything for the stream creation DoS mitigation subsystem. */
+static void
+stream_free_all(void)
+{
+  dos_stream_enabled = 0;
+}
+
 /* Set circuit creation parameters located in the consensus or their default
  * if none are present. Called at initialization or when the consensus
  * changes. */
@@ -208,6 +421,18 @@ set_dos_parameters(const networkstatus_t *ns)
   dos_conn_enabled = get_param_conn_enabled(ns);
   dos_conn_max_concurrent_count = get_param_conn_max_concurrent_count(ns);
   dos_conn_defense_type = get_param_conn_defense_type(ns);
+
+  /* Per-prefix detection. */
+  dos_prefix_enabled = get_param_prefix_enabled(ns);
+  dos_prefix_max_addresses = get_param_prefix_max_addresses(ns);
+  prefix_update_trackers();
+
+  /* Stream creation detection. */
+  dos_stream_enabled = get_param_stream_enabled(ns);
+  dos_stream_rate = get_param_stream_rate(ns);
+  dos_stream_burst = get_param_stream_burst(ns);
+  dos_stream_defense_type = get_param_stream_defense_type(ns);
+  stream_update_circuits();
 }
 
 /* Free everything for the circuit creation DoS mitigation subsystem. */
@@ -434,6 +659,63 @@ dos_is_enabled(void)
   return (dos_cc_enabled || dos_conn_enabled);
 }
 
+/* Stream creation public API. */
+
+/* Initialize the stream creation token bucket of the given new circuit from
+ * the current parameters. */
+void
+dos_stream_init_circ_tbf(or_circuit_t *circ)
+{
+  tor_assert(circ);
+
+  token_bucket_ctr_init(&circ->stream_limiter, dos_stream_rate,
+                        dos_stream_burst, (uint32_t) approx_time());
+}
+
+/* Called when a BEGIN, BEGIN_DIR or RESOLVE cell is received on the given
+ * circuit. Return the defense type that should be used against the stream
+ * it asks for.
+ *
+ * This is part of the fast path and called a lot. */
+dos_stream_defense_type_t
+dos_stream_new_begin_or_resolve_cell(or_circuit_t *circ)
+{
+  tor_assert(circ);
+
+  /* Skip everything if not enabled. */
+  if (!dos_stream_enabled) {
+    goto end;
+  }
+
+  token_bucket_ctr_refill(&circ->stream_limiter, (uint32_t) approx_time());
+  if (token_bucket_ctr_get(&circ->stream_limiter) > 0) {
+    token_bucket_ctr_dec(&circ->stream_limiter, 1);
+    goto end;
+  }
+
+  /* The circuit is over its stream creation rate. Note it down. */
+  if (dos_stream_defense_type == DOS_STREAM_DEFENSE_REFUSE_STREAM) {
+    stream_num_refused++;
+  } else if (dos_stream_defense_type == DOS_STREAM_DEFENSE_CLOSE_CIRCUIT) {
+    stream_num_circ_closed++;
+  }
+  return dos_stream_defense_type;
+
+ end:
+  return DOS_STREAM_DEFENSE_NONE;
+}
+
+/* Fill <b>stats_out</b> with the statistics of the stream creation DoS
+ * mitigation since startup. */
+void
+dos_stream_get_stats(dos_stream_stats_t *stats_out)
+{
+  tor_assert(stats_out);
+
+  stats_out->n_refused_streams = stream_num_refused;
+  stats_out->n_closed_circuits = stream_num_circ_closed;
+}
+
 /* Circuit creation public API. */
 
 /* Called when a CREATE cell is received from the given channel. */
@@ -459,6 +741,19 @@ dos_cc_new_create_cell(channel_t *chan)
     goto end;
   }
 
+  /* Count the circuit against the prefixes of the address, whether or not
+   * the address itself is in the geoip cache. A prefix stays marked for as
+   * long as it is busy, and for the defense time period after that. */
+  if (cc_prefix_tracker) {
+    const time_t now = approx_time();
+    if (dos_prefix_tracker_note(cc_prefix_tracker, &addr, now,
+                                now + dos_cc_defense_time_period)) {
+      log_debug(LD_DOS, "Detected circuit creation DoS by a network "
+                        "including address: %s", fmt_addr(&addr));
+      cc_num_marked_prefixes++;
+    }
+  }
+
   /* We are only interested in client connection from the geoip cache. */
   entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
   if (entry == NULL) {
@@ -516,7 +811,8 @@ dos_cc_get_defense_type(channel_t *chan)
 
   /* On an OR circuit, we'll check if the previous channel is a marked client
    * connection detected by our DoS circuit creation mitigation subsystem. */
-  if (cc_channel_addr_is_marked(chan)) {
+  if (cc_channel_addr_is_marked(chan) ||
+      cc_channel_prefix_is_marked(chan)) {
     /* We've just assess that this circuit should trigger a defense for the
      * cell it just seen. Note it down. */
     cc_num_rejected_cells++;
@@ -543,6 +839,20 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
     goto end;
   }
 
+  /* Known relays are never counted against their network, see
+   * dos_new_client_conn(), so they must not be refused with it either. */
+  if (nodelist_probably_contains_address(addr)) {
+    goto end;
+  }
+
+  /* Is this address part of a network that opens too many connections? */
+  if (conn_prefix_tracker &&
+      dos_prefix_tracker_is_marked(conn_prefix_tracker, addr,
+                                   approx_time())) {
+    conn_num_prefix_rejected++;
+    return dos_conn_defense_type;
+  }
+
   /* We are only interested in client connection from the geoip cache. */
   entry = geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT);
   if (entry == NULL) {
@@ -624,6 +934,34 @@ dos_should_refuse_single_hop_client(void)
                                        0 /* default */, 0, 1);
 }
 
+/* Log the busiest networks of each prefix tracker, if any. */
+static void
+prefix_log_heartbeat_top(void)
+{
+  char *cc_top = NULL, *conn_top = NULL;
+  const time_t now = approx_time();
+  const int scrub = get_options()->SafeLogging_ == SAFELOG_SCRUB_ALL;
+
+  if (cc_prefix_tracker) {
+    cc_top = dos_prefix_tracker_format_top(cc_prefix_tracker, 3, now,
+                                           scrub);
+  }
+  if (conn_prefix_tracker) {
+    conn_top = dos_prefix_tracker_format_top(conn_prefix_tracker, 3, now,
+                                             scrub);
+  }
+  if (cc_top) {
+    log_notice(LD_HEARTBEAT, "Busiest networks creating circuits: %s.",
+               cc_top);
+  }
+  if (conn_top) {
+    log_notice(LD_HEARTBEAT, "Busiest networks opening connections: %s.",
+               conn_top);
+  }
+  tor_free(cc_top);
+  tor_free(conn_top);
+}
+
 /* Log a heartbeat message with some statistics. */
 void
 dos_log_heartbeat(void)
@@ -633,6 +971,8 @@ dos_log_heartbeat(void)
   char *single_hop_client_msg = NULL;
   char *circ_stats_msg = NULL;
   char *hs_dos_intro2_msg = NULL;
+  char *prefix_msg = NULL;
+  char *stream_msg = NULL;
 
   /* Stats number coming from relay.c append_cell_to_circuit_queue(). */
   tor_asprintf(&circ_stats_msg,
@@ -652,6 +992,22 @@ dos_log_heartbeat(void)
                  conn_num_addr_rejected);
   }
 
+  if (cc_prefix_tracker || conn_prefix_tracker) {
+    tor_asprintf(&prefix_msg,
+                 " %" PRIu32 " networks marked for circuits,"
+                 " %" PRIu32 " for connections,"
+                 " %" PRIu64 " connections closed by network.",
+                 cc_num_marked_prefixes, conn_num_marked_prefixes,
+                 conn_num_prefix_rejected);
+  }
+
+  if (dos_stream_enabled) {
+    tor_asprintf(&stream_msg,
+                 " %" PRIu64 " streams refused,"
+                 " %" PRIu64 " circuits closed for too many streams.",
+                 stream_num_refused, stream_num_circ_closed);
+  }
+
   if (dos_should_refuse_single_hop_client()) {
     tor_asprintf(&single_hop_client_msg,
                  " %" PRIu64 " single hop clients refused.",
@@ -664,13 +1020,19 @@ dos_log_heartbeat(void)
                hs_dos_get_intro2_rejected_count());
 
   log_notice(LD_HEARTBEAT,
-             "DoS mitigation since startup:%s%s%s%s%s",
+             "DoS mitigation since startup:%s%s%s%s%s%s%s",
              circ_stats_msg,
              (cc_msg != NULL) ? cc_msg : " [cc not enabled]",
              (conn_msg != NULL) ? conn_msg : " [conn not enabled]",
+             (prefix_msg != NULL) ? prefix_msg : "",
+             (stream_msg != NULL) ? stream_msg : "",
              (single_hop_client_msg != NULL) ? single_hop_client_msg : "",
              (hs_dos_intro2_msg != NULL) ? hs_dos_intro2_msg : "");
 
+  prefix_log_heartbeat_top();
+
+  tor_free(stream_msg);
+  tor_free(prefix_msg);
   tor_free(conn_msg);
   tor_free(cc_msg);
   tor_free(single_hop_client_msg);
@@ -702,6 +1064,19 @@ dos_new_client_conn(or_connection_t *or_conn, const char *transport_name)
     goto end;
   }
 
+  /* Count the connection against the prefixes of the address. A marked
+   * prefix gets its connections refused for one decay period at a time, so
+   * that it gets unmarked once it has slowed down. */
+  if (conn_prefix_tracker) {
+    const time_t now = approx_time();
+    if (dos_prefix_tracker_note(conn_prefix_tracker, &TO_CONN(or_conn)->addr,
+                                now, now + DOS_PREFIX_DECAY_PERIOD)) {
+      log_debug(LD_DOS, "Detected connection DoS by a network including "
+                        "address: %s", fmt_addr(&TO_CONN(or_conn)->addr));
+      conn_num_marked_prefixes++;
+    }
+  }
+
   /* We are only interested in client connection from the geoip cache. */
   entry = geoip_lookup_client(&TO_CONN(or_conn)->addr, transport_name,
                               GEOIP_CLIENT_CONNECT);
@@ -801,6 +1176,14 @@ dos_free_all(void)
   /* Free the connection mitigation subsystem. It is safe to do this even if
    * it wasn't initialized. */
   conn_free_all();
+
+  /* Free the per-prefix mitigation subsystem. It is safe to do this even if
+   * it wasn't initialized. */
+  prefix_free_all();
+
+  /* Free the stream creation mitigation subsystem. It is safe to do this
+   * even if it wasn't initialized. */
+  stream_free_all();
 }
 
 /* Initialize the Denial of Service subsystem. */
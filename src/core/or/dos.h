@@ -120,6 +120,56 @@ typedef enum dos_conn_defense_type_t {
 
 dos_conn_defense_type_t dos_conn_addr_get_defense_type(const tor_addr_t *addr);
 
+/*
+ * Per-prefix DoS mitigation interface.
+ */
+
+/* DoSPrefixTrackingEnabled default. Disabled by default. */
+#define DOS_PREFIX_ENABLED_DEFAULT 0
+/* DoSPrefixMaxAddresses default. */
+#define DOS_PREFIX_MAX_ADDRESSES_DEFAULT 32
+
+/*
+ * Stream creation DoS mitigation interface.
+ */
+
+/* DoSStreamCreationEnabled default. Disabled by default. */
+#define DOS_STREAM_ENABLED_DEFAULT 0
+/* DoSStreamCreationDefenseType maps to the dos_stream_defense_type_t enum. */
+#define DOS_STREAM_DEFENSE_TYPE_DEFAULT DOS_STREAM_DEFENSE_REFUSE_STREAM
+/* DoSStreamCreationRate is 100 per seconds. */
+#define DOS_STREAM_RATE_DEFAULT 100
+/* DoSStreamCreationBurst default. */
+#define DOS_STREAM_BURST_DEFAULT 300
+
+/* Type of defense that we can use for the stream creation DoS mitigation. */
+typedef enum dos_stream_defense_type_t {
+  /* No defense used. */
+  DOS_STREAM_DEFENSE_NONE             = 1,
+  /* Refuse the stream: an END cell, or an error RESOLVED cell, is sent
+   * back. */
+  DOS_STREAM_DEFENSE_REFUSE_STREAM    = 2,
+  /* Close the whole circuit. */
+  DOS_STREAM_DEFENSE_CLOSE_CIRCUIT    = 3,
+
+  /* Maximum value that can be used. Useful for the boundaries of the
+   * consensus parameter. */
+  DOS_STREAM_DEFENSE_MAX              = 3,
+} dos_stream_defense_type_t;
+
+/* Statistics of the stream creation DoS mitigation, for the MetricsPort. */
+typedef struct dos_stream_stats_t {
+  /* Streams refused with the DOS_STREAM_DEFENSE_REFUSE_STREAM defense. */
+  uint64_t n_refused_streams;
+  /* Circuits closed with the DOS_STREAM_DEFENSE_CLOSE_CIRCUIT defense. */
+  uint64_t n_closed_circuits;
+} dos_stream_stats_t;
+
+void dos_stream_init_circ_tbf(or_circuit_t *circ);
+dos_stream_defense_type_t dos_stream_new_begin_or_resolve_cell(
+                                                   or_circuit_t *circ);
+void dos_stream_get_stats(dos_stream_stats_t *stats_out);
+
 #ifdef DOS_PRIVATE
 
 STATIC uint32_t get_param_conn_max_concurrent_count(
@@ -136,6 +186,10 @@ MOCK_DECL(STATIC unsigned int, get_param_cc_enabled,
           (const networkstatus_t *ns));
 MOCK_DECL(STATIC unsigned int, get_param_conn_enabled,
           (const networkstatus_t *ns));
+MOCK_DECL(STATIC unsigned int, get_param_prefix_enabled,
+          (const networkstatus_t *ns));
+MOCK_DECL(STATIC unsigned int, get_param_stream_enabled,
+          (const networkstatus_t *ns));
 
 #endif /* defined(DOS_PRIVATE) */
 
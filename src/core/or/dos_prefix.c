@@ -0,0 +1,408 @@
+/* Copyright (c) 2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file dos_prefix.c
+ * \brief Track the busiest address prefixes in a fixed amount of memory.
+ *
+ * The DoS mitigation subsystem keeps its per-address statistics in the
+ * geoip client cache, with one entry per client address.  An attacker who
+ * controls a whole /24, or a /48 of IPv6 space, can spread its circuits and
+ * connections over enough addresses that none of them looks busy, while
+ * making the cache grow with every address it uses.
+ *
+ * A dos_prefix_tracker_t counts events (circuit creations, or new
+ * connections) per address prefix instead, at a few prefix lengths at once.
+ * The counts live in a count-min sketch: a few rows of counters, each
+ * indexed by a different hash of the prefix, where the smallest of a
+ * prefix's counters bounds its count from above.  Next to the sketch, we
+ * keep exact entries for the handful of prefixes with the largest counts,
+ * space-saving style: a prefix whose estimate beats the smallest entry
+ * takes its place.  Those entries are where we remember which prefixes we
+ * have marked as attacking us, and which we report in the heartbeat.
+ *
+ * Every DOS_PREFIX_DECAY_PERIOD seconds, we halve every count, so that the
+ * counts measure recent rates rather than totals.  The memory we use does
+ * not depend on how many addresses we see.
+ **/
+
+#define DOS_PREFIX_PRIVATE
+
+#include "core/or/or.h"
+#include "core/or/dos_prefix.h"
+
+#include "ext/siphash.h"
+
+/** Length of the key we use for a prefix: its family, its length in bits,
+ * and the bytes of the address, with the bits past the prefix cleared. */
+#define DOS_PREFIX_KEY_LEN 18
+
+/** A prefix length that we track, for one address family. */
+typedef struct dos_prefix_granularity_t {
+  sa_family_t family;
+  /** Prefix length in bits.  Must be a multiple of 8. */
+  uint8_t bits;
+  /** How many times the tracker's threshold prefixes of this length may
+   * send before we mark them. */
+  uint8_t factor;
+} dos_prefix_granularity_t;
+
+/** The prefix lengths we track.  A /64 is what one IPv6 customer usually
+ * gets, so we treat it like a small IPv4 network. */
+static const dos_prefix_granularity_t dos_prefix_granularities[] = {
+  { AF_INET, 24, 1 },
+  { AF_INET, 16, 8 },
+  { AF_INET6, 64, 1 },
+  { AF_INET6, 48, 8 },
+};
+#define DOS_PREFIX_N_GRANULARITIES ARRAY_LENGTH(dos_prefix_granularities)
+
+/** One of the busiest prefixes that a tracker has seen. */
+typedef struct dos_prefix_entry_t {
+  uint8_t key[DOS_PREFIX_KEY_LEN];
+  /** The sketch's estimate for this prefix, when we last saw it. */
+  uint32_t count;
+  /** Until when this prefix is marked as attacking us, or 0 if it never
+   * was.  We never evict a marked entry. */
+  time_t marked_until_ts;
+} dos_prefix_entry_t;
+
+/** A fixed-size tracker of the busiest address prefixes. */
+struct dos_prefix_tracker_t {
+  /** The count-min sketch. */
+  uint32_t sketch[DOS_PREFIX_SKETCH_DEPTH][DOS_PREFIX_SKETCH_WIDTH];
+  /** The busiest prefixes, in no particular order. */
+  dos_prefix_entry_t top[DOS_PREFIX_N_TOP];
+  /** Number of elements of <b>top</b> in use. */
+  int n_top;
+  /** For each element of dos_prefix_granularities, the count at which we
+   * mark a prefix. */
+  uint32_t threshold[DOS_PREFIX_N_GRANULARITIES];
+  /** When we next halve the counts, or 0 if we have seen no events. */
+  time_t next_decay_ts;
+  /** The latest marked_until_ts of any entry, so that we can skip the search
+   * when nothing is marked. */
+  time_t last_marked_until_ts;
+};
+
+/** Allocate and return a new, empty prefix tracker that never marks
+ * anything until dos_prefix_tracker_set_threshold() is called. */
+dos_prefix_tracker_t *
+dos_prefix_tracker_new(void)
+{
+  dos_prefix_tracker_t *tracker = tor_malloc_zero(sizeof(*tracker));
+  dos_prefix_tracker_set_threshold(tracker, UINT32_MAX);
+  return tracker;
+}
+
+/** Release all storage held by <b>tracker</b>. */
+void
+dos_prefix_tracker_free_(dos_prefix_tracker_t *tracker)
+{
+  tor_free(tracker);
+}
+
+/** Mark prefixes of the shortest lengths we track once <b>threshold</b>
+ * events come from them within about one DOS_PREFIX_DECAY_PERIOD; longer
+ * prefixes get a proportionally larger threshold. */
+void
+dos_prefix_tracker_set_threshold(dos_prefix_tracker_t *tracker,
+                                 uint64_t threshold)
+{
+  tor_assert(tracker);
+  for (unsigned i = 0; i < DOS_PREFIX_N_GRANULARITIES; ++i) {
+    uint64_t t = threshold * dos_prefix_granularities[i].factor;
+    tracker->threshold[i] = (uint32_t) MIN(t, UINT32_MAX);
+  }
+}
+
+/** Set <b>key</b> to the key for the first <b>bits</b> bits of
+ * <b>addr</b>. */
+static void
+dos_prefix_make_key(uint8_t *key, const tor_addr_t *addr, int bits)
+{
+  memset(key, 0, DOS_PREFIX_KEY_LEN);
+  key[1] = (uint8_t) bits;
+  if (tor_addr_family(addr) == AF_INET) {
+    const uint32_t a = tor_addr_to_ipv4n(addr);
+    key[0] = 4;
+    memcpy(key + 2, &a, bits / 8);
+  } else {
+    key[0] = 6;
+    memcpy(key + 2, tor_addr_to_in6_addr8(addr), bits / 8);
+  }
+}
+
+/** Set <b>idx_out</b> to the column of <b>key</b> in each row of the
+ * sketch. */
+static void
+dos_prefix_key_columns(const uint8_t *key, unsigned *idx_out)
+{
+  /* Derive all the row hashes from one siphash: h1 + i*h2 is as good as
+   * independent hashes for a count-min sketch. */
+  const uint64_t h = siphash24g(key, DOS_PREFIX_KEY_LEN);
+  const uint32_t h1 = (uint32_t) h, h2 = (uint32_t) (h >> 32) | 1;
+  for (unsigned i = 0; i < DOS_PREFIX_SKETCH_DEPTH; ++i) {
+    idx_out[i] = (h1 + i * h2) & (DOS_PREFIX_SKETCH_WIDTH - 1);
+  }
+}
+
+/** Count one event for <b>key</b> in the sketch, and return its new
+ * estimate. */
+static uint32_t
+dos_prefix_sketch_add(dos_prefix_tracker_t *tracker, const uint8_t *key)
+{
+  unsigned idx[DOS_PREFIX_SKETCH_DEPTH];
+  uint32_t min = UINT32_MAX;
+
+  dos_prefix_key_columns(key, idx);
+  for (unsigned i = 0; i < DOS_PREFIX_SKETCH_DEPTH; ++i) {
+    min = MIN(min, tracker->sketch[i][idx[i]]);
+  }
+  if (min == UINT32_MAX)
+    return min;
+  /* Conservative update: only raise the counters that were at the
+   * estimate.  The others already count more than this key's events. */
+  ++min;
+  for (unsigned i = 0; i < DOS_PREFIX_SKETCH_DEPTH; ++i) {
+    if (tracker->sketch[i][idx[i]] < min)
+      tracker->sketch[i][idx[i]] = min;
+  }
+  return min;
+}
+
+/** Halve every count in <b>tracker</b> once for each DOS_PREFIX_DECAY_PERIOD
+ * that has ended by <b>now</b>, and forget the entries that drop to 0. */
+static void
+dos_prefix_tracker_decay(dos_prefix_tracker_t *tracker, time_t now)
+{
+  unsigned shift;
+  int i;
+
+  if (tracker->next_decay_ts == 0 ||
+      now < tracker->next_decay_ts - DOS_PREFIX_DECAY_PERIOD) {
+    /* First event, or our clock jumped backward: start a new period. */
+    tracker->next_decay_ts = now + DOS_PREFIX_DECAY_PERIOD;
+    return;
+  }
+  if (now < tracker->next_decay_ts)
+    return;
+
+  shift = 1 + (unsigned) MIN((now - tracker->next_decay_ts) /
+                             DOS_PREFIX_DECAY_PERIOD, 31);
+  tracker->next_decay_ts = now + DOS_PREFIX_DECAY_PERIOD;
+
+  if (shift >= 32) {
+    memset(tracker->sketch, 0, sizeof(tracker->sketch));
+  } else {
+    for (unsigned r = 0; r < DOS_PREFIX_SKETCH_DEPTH; ++r) {
+      for (unsigned c = 0; c < DOS_PREFIX_SKETCH_WIDTH; ++c) {
+        tracker->sketch[r][c] >>= shift;
+      }
+    }
+  }
+  for (i = 0; i < tracker->n_top; ) {
+    dos_prefix_entry_t *ent = &tracker->top[i];
+    ent->count = shift >= 32 ? 0 : ent->count >> shift;
+    if (ent->count == 0 && ent->marked_until_ts < now) {
+      *ent = tracker->top[--tracker->n_top];
+    } else {
+      ++i;
+    }
+  }
+}
+
+/** Return the entry for <b>key</b>, which has a count of <b>count</b>, in the
+ * busiest prefixes of <b>tracker</b>.  Add it if it isn't there and it is
+ * busier than an unmarked entry that we can replace.  Return NULL if it
+ * isn't one of the busiest prefixes. */
+static dos_prefix_entry_t *
+dos_prefix_tracker_update_top(dos_prefix_tracker_t *tracker,
+                              const uint8_t *key, uint32_t count, time_t now)
+{
+  dos_prefix_entry_t *ent = NULL, *min = NULL;
+
+  for (int i = 0; i < tracker->n_top; ++i) {
+    dos_prefix_entry_t *e = &tracker->top[i];
+    if (fast_memeq(e->key, key, DOS_PREFIX_KEY_LEN)) {
+      e->count = count;
+      return e;
+    }
+    if (e->marked_until_ts < now && (!min || e->count < min->count))
+      min = e;
+  }
+
+  if (tracker->n_top < DOS_PREFIX_N_TOP) {
+    ent = &tracker->top[tracker->n_top++];
+  } else if (min && min->count < count) {
+    ent = min;
+  } else {
+    return NULL;
+  }
+  memcpy(ent->key, key, DOS_PREFIX_KEY_LEN);
+  ent->count = count;
+  ent->marked_until_ts = 0;
+  return ent;
+}
+
+/** Count one event from <b>addr</b> at <b>now</b>, for each prefix of it
+ * that we track.  If that takes one of those prefixes over its threshold,
+ * mark it until at least <b>mark_until</b>.  Return 1 if we marked a prefix
+ * that wasn't already marked, else 0. */
+int
+dos_prefix_tracker_note(dos_prefix_tracker_t *tracker,
+                        const tor_addr_t *addr, time_t now,
+                        time_t mark_until)
+{
+  const sa_family_t family = tor_addr_family(addr);
+  uint8_t key[DOS_PREFIX_KEY_LEN];
+  int newly_marked = 0;
+
+  tor_assert(tracker);
+  tor_assert(addr);
+
+  if (family != AF_INET && family != AF_INET6)
+    return 0;
+
+  dos_prefix_tracker_decay(tracker, now);
+
+  for (unsigned i = 0; i < DOS_PREFIX_N_GRANULARITIES; ++i) {
+    const dos_prefix_granularity_t *g = &dos_prefix_granularities[i];
+    dos_prefix_entry_t *ent;
+    uint32_t count;
+
+    if (g->family != family)
+      continue;
+    dos_prefix_make_key(key, addr, g->bits);
+    count = dos_prefix_sketch_add(tracker, key);
+    ent = dos_prefix_tracker_update_top(tracker, key, count, now);
+    if (ent == NULL || count < tracker->threshold[i])
+      continue;
+
+    if (ent->marked_until_ts < now)
+      newly_marked = 1;
+    ent->marked_until_ts = MAX(ent->marked_until_ts, mark_until);
+    tracker->last_marked_until_ts = MAX(tracker->last_marked_until_ts,
+                                        ent->marked_until_ts);
+  }
+  return newly_marked;
+}
+
+/** Return true iff some prefix of <b>addr</b> is marked in <b>tracker</b> at
+ * <b>now</b>. */
+int
+dos_prefix_tracker_is_marked(const dos_prefix_tracker_t *tracker,
+                             const tor_addr_t *addr, time_t now)
+{
+  const sa_family_t family = tor_addr_family(addr);
+  uint8_t key[DOS_PREFIX_KEY_LEN];
+
+  tor_assert(tracker);
+  tor_assert(addr);
+
+  /* This is on the path of every CREATE cell: usually, nothing is marked. */
+  if (tracker->last_marked_until_ts < now)
+    return 0;
+
+  for (unsigned i = 0; i < DOS_PREFIX_N_GRANULARITIES; ++i) {
+    const dos_prefix_granularity_t *g = &dos_prefix_granularities[i];
+    if (g->family != family)
+      continue;
+    dos_prefix_make_key(key, addr, g->bits);
+    for (int j = 0; j < tracker->n_top; ++j) {
+      const dos_prefix_entry_t *ent = &tracker->top[j];
+      if (ent->marked_until_ts >= now &&
+          fast_memeq(ent->key, key, DOS_PREFIX_KEY_LEN))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/** Helper for sorting entries by decreasing count. */
+static int
+dos_prefix_entry_compare_by_count_(const void **a, const void **b)
+{
+  const dos_prefix_entry_t *ea = *a, *eb = *b;
+  if (ea->count > eb->count)
+    return -1;
+  else if (ea->count < eb->count)
+    return 1;
+  return 0;
+}
+
+/** Return a newly allocated string describing the <b>n</b> busiest prefixes
+ * in <b>tracker</b>, busiest first, as "PREFIX/BITS (~COUNT)", with
+ * "marked" after the ones that are marked at <b>now</b>.  If <b>scrub</b> is
+ * true, leave the addresses out.  Return NULL if there are none. */
+char *
+dos_prefix_tracker_format_top(const dos_prefix_tracker_t *tracker, int n,
+                              time_t now, int scrub)
+{
+  smartlist_t *entries = smartlist_new();
+  smartlist_t *out = smartlist_new();
+  char *result = NULL;
+
+  tor_assert(tracker);
+
+  for (int i = 0; i < tracker->n_top; ++i) {
+    if (tracker->top[i].count > 0)
+      smartlist_add(entries, (void *) &tracker->top[i]);
+  }
+  smartlist_sort(entries, dos_prefix_entry_compare_by_count_);
+
+  SMARTLIST_FOREACH_BEGIN(entries, const dos_prefix_entry_t *, ent) {
+    tor_addr_t addr;
+    char buf[TOR_ADDR_BUF_LEN + 8];
+    if (ent_sl_idx >= n)
+      break;
+    if (ent->key[0] == 4) {
+      uint32_t a;
+      memcpy(&a, ent->key + 2, sizeof(a));
+      tor_addr_from_ipv4n(&addr, a);
+    } else {
+      tor_addr_from_ipv6_bytes(&addr, ent->key + 2);
+    }
+    tor_snprintf(buf, sizeof(buf), "%s/%d",
+                 scrub ? "[scrubbed]" : fmt_addr(&addr), ent->key[1]);
+    smartlist_add_asprintf(out, "%s (~%"PRIu32")%s", buf, ent->count,
+                           ent->marked_until_ts >= now ? " marked" : "");
+  } SMARTLIST_FOREACH_END(ent);
+
+  if (smartlist_len(out))
+    result = smartlist_join_strings(out, ", ", 0, NULL);
+
+  SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+  smartlist_free(out);
+  smartlist_free(entries);
+  return result;
+}
+
+#ifdef TOR_UNIT_TESTS
+
+/** Return the estimate in <b>tracker</b> for the first <b>bits</b> bits of
+ * <b>addr</b>. */
+STATIC uint32_t
+dos_prefix_tracker_estimate(const dos_prefix_tracker_t *tracker,
+                            const tor_addr_t *addr, int bits)
+{
+  uint8_t key[DOS_PREFIX_KEY_LEN];
+  unsigned idx[DOS_PREFIX_SKETCH_DEPTH];
+  uint32_t min = UINT32_MAX;
+
+  dos_prefix_make_key(key, addr, bits);
+  dos_prefix_key_columns(key, idx);
+  for (unsigned i = 0; i < DOS_PREFIX_SKETCH_DEPTH; ++i) {
+    min = MIN(min, tracker->sketch[i][idx[i]]);
+  }
+  return min;
+}
+
+/** Return the number of prefixes for which <b>tracker</b> has an entry. */
+STATIC int
+dos_prefix_tracker_get_n_top(const dos_prefix_tracker_t *tracker)
+{
+  return tracker->n_top;
+}
+
+#endif /* defined(TOR_UNIT_TESTS) */
@@ -0,0 +1,55 @@
+/* Copyright (c) 2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file dos_prefix.h
+ * \brief Header file for dos_prefix.c.
+ **/
+
+#ifndef TOR_DOS_PREFIX_H
+#define TOR_DOS_PREFIX_H
+
+#include "core/or/or.h"
+
+/** How often, in seconds, a tracker halves all of its counts.  An address
+ * that sends events at a steady rate of R per second reaches a count
+ * between R and 2R times this value. */
+#define DOS_PREFIX_DECAY_PERIOD 60
+
+typedef struct dos_prefix_tracker_t dos_prefix_tracker_t;
+
+dos_prefix_tracker_t *dos_prefix_tracker_new(void);
+void dos_prefix_tracker_free_(dos_prefix_tracker_t *tracker);
+#define dos_prefix_tracker_free(t) \
+  FREE_AND_NULL(dos_prefix_tracker_t, dos_prefix_tracker_free_, (t))
+
+void dos_prefix_tracker_set_threshold(dos_prefix_tracker_t *tracker,
+                                      uint64_t threshold);
+int dos_prefix_tracker_note(dos_prefix_tracker_t *tracker,
+                            const tor_addr_t *addr, time_t now,
+                            time_t mark_until);
+int dos_prefix_tracker_is_marked(const dos_prefix_tracker_t *tracker,
+                                 const tor_addr_t *addr, time_t now);
+char *dos_prefix_tracker_format_top(const dos_prefix_tracker_t *tracker,
+                                    int n, time_t now, int scrub);
+
+#ifdef DOS_PREFIX_PRIVATE
+
+/** Number of rows in the count-min sketch of a tracker. */
+#define DOS_PREFIX_SKETCH_DEPTH 4
+/** Number of counters in each row of the count-min sketch of a tracker.
+ * Must be a power of two. */
+#define DOS_PREFIX_SKETCH_WIDTH 4096
+/** Number of prefixes a tracker keeps exact state for. */
+#define DOS_PREFIX_N_TOP 32
+
+#ifdef TOR_UNIT_TESTS
+STATIC uint32_t dos_prefix_tracker_estimate(
+                                      const dos_prefix_tracker_t *tracker,
+                                      const tor_addr_t *addr, int bits);
+STATIC int dos_prefix_tracker_get_n_top(const dos_prefix_tracker_t *tracker);
+#endif /* defined(TOR_UNIT_TESTS) */
+
+#endif /* defined(DOS_PREFIX_PRIVATE) */
+
+#endif /* !defined(TOR_DOS_PREFIX_H) */
@@ -71,6 +71,12 @@ struct edge_connection_t {
   /** True iff we've blocked reading until the circuit has fewer queued
    * cells. */
   unsigned int edge_blocked_on_circ:1;
+  /** True iff we have asked the other end to stop sending on this stream
+   * with an XOFF, and haven't sent the matching XON yet. */
+  unsigned int xoff_sent:1;
+  /** True iff the other end has asked us to stop sending on this stream
+   * with an XOFF, and hasn't sent the matching XON yet. */
+  unsigned int xoff_received:1;
 
   /** Unique ID for directory requests; this used to be in connection_t, but
    * that's going away and being used on channels instead.  We still tag
@@ -210,6 +210,16 @@ struct curve25519_public_key_t;
 #define RELAY_COMMAND_PADDING_NEGOTIATE 41
 #define RELAY_COMMAND_PADDING_NEGOTIATED 42
 
+/* Experimental commands for congestion control, not in tor-spec.txt. The
+ * spec gives 43 and 44 to XOFF and XON cells of a different format, so these
+ * use numbers far from the assigned ones. Relays that don't know them drop
+ * them, and we only send the last two once a CC_NEGOTIATED_EXP cell told us
+ * the other end knows them too. See congestion_control_common.c. */
+#define RELAY_COMMAND_CC_NEGOTIATE_EXP 240
+#define RELAY_COMMAND_CC_NEGOTIATED_EXP 241
+#define RELAY_COMMAND_XOFF_EXP 242
+#define RELAY_COMMAND_XON_EXP 243
+
 /* Reasons why an OR connection is closed. */
 #define END_OR_CONN_REASON_DONE           1
 #define END_OR_CONN_REASON_REFUSED        2 /* connection refused */
@@ -926,6 +936,7 @@ typedef enum {
 typedef struct onion_handshake_state_t onion_handshake_state_t;
 typedef struct relay_crypto_t relay_crypto_t;
 typedef struct crypt_path_t crypt_path_t;
+typedef struct congestion_control_t congestion_control_t;
 typedef struct crypt_path_reference_t crypt_path_reference_t;
 
 #define CPATH_KEY_MATERIAL_LEN (20*2+16*2)
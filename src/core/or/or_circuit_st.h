@@ -28,6 +28,9 @@ struct or_circuit_t {
    * a cpuworker and is waiting for a response. Used to decide whether it is
    * safe to free a circuit or if it is still in use by a cpuworker. */
   struct workqueue_entry_t *workqueue_entry;
+  /** True iff <b>workqueue_entry</b> holds the onionskins of other circuits
+   * too, in which case we can't cancel it. */
+  unsigned int workqueue_entry_is_batch : 1;
 
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
@@ -63,6 +66,11 @@ struct or_circuit_t {
    *  statistics. */
   unsigned int circuit_carries_hs_traffic_stats : 1;
 
+  /** True iff the client negotiated congestion control with us on this
+   * circuit with a CC_NEGOTIATE_EXP cell. Its streams may then ask for
+   * XON/XOFF flow control. */
+  unsigned int ccontrol_negotiated : 1;
+
   /** True iff this circuit was made with a CREATE_FAST cell, or a CREATE[2]
    * cell with a TAP handshake. If this is the case and this is a rend circuit,
    * this is a v2 circuit, otherwise if this is a rend circuit it's a v3
@@ -90,6 +98,11 @@ struct or_circuit_t {
    * used if this is a service introduction circuit at the intro point
    * (purpose = CIRCUIT_PURPOSE_INTRO_POINT). */
   token_bucket_ctr_t introduce2_bucket;
+
+  /** Stream creation bucket: every BEGIN, BEGIN_DIR and RESOLVE cell on this
+   * circuit takes a token from it. Only used if the stream creation DoS
+   * mitigation is enabled. */
+  token_bucket_ctr_t stream_limiter;
 };
 
 #endif /* !defined(OR_CIRCUIT_ST_H) */
@@ -15,6 +15,7 @@
 #include "core/or/or_sys.h"
 #include "core/or/policies.h"
 #include "core/or/protover.h"
+#include "core/or/relay.h"
 #include "core/or/versions.h"
 
 #include "lib/subsys/subsys.h"
@@ -32,6 +33,7 @@ subsys_or_shutdown(void)
   protover_free_all();
   protover_summary_cache_free_all();
   policies_free_all();
+  cell_pools_free_all();
 }
 
 static int
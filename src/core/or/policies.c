@@ -20,6 +20,7 @@
 #include "core/or/or.h"
 #include "feature/client/bridges.h"
 #include "app/config/config.h"
+#include "core/or/compiled_policy.h"
 #include "core/or/policies.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/nodelist/microdesc.h"
@@ -2773,6 +2774,7 @@ parse_short_policy(const char *summary)
   result->is_accept = is_accept;
   result->n_entries = n_entries;
   memcpy(result->entries, entries, sizeof(short_policy_entry_t)*n_entries);
+  result->compiled = short_policy_compile(result);
   return result;
 
  bad_ent:
@@ -2811,6 +2813,8 @@ write_short_policy(const short_policy_t *policy)
 void
 short_policy_free_(short_policy_t *policy)
 {
+  if (policy)
+    compiled_short_policy_free(policy->compiled);
   tor_free(policy);
 }
 
@@ -2835,11 +2839,15 @@ compare_tor_addr_to_short_policy(const tor_addr_t *addr, uint16_t port,
       (tor_addr_is_internal(addr, 0) || tor_addr_is_loopback(addr)))
     return ADDR_POLICY_REJECTED;
 
-  for (i=0; i < policy->n_entries; ++i) {
-    const short_policy_entry_t *e = &policy->entries[i];
-    if (e->min_port <= port && port <= e->max_port) {
-      found_match = 1;
-      break;
+  if (policy->compiled) {
+    found_match = compiled_short_policy_lists_port(policy->compiled, port);
+  } else {
+    for (i=0; i < policy->n_entries; ++i) {
+      const short_policy_entry_t *e = &policy->entries[i];
+      if (e->min_port <= port && port <= e->max_port) {
+        found_match = 1;
+        break;
+      }
     }
   }
 
@@ -3131,4 +3139,5 @@ policies_free_all(void)
     }
   }
   HT_CLEAR(policy_map, &policy_root);
+  compiled_policy_free_all();
 }
@@ -60,6 +60,9 @@ typedef struct short_policy_t {
   unsigned int is_accept : 1;
   /** The actual number of values in 'entries'. */
   unsigned int n_entries : 31;
+  /** The ports that 'entries' lists, compiled for constant-time lookup, or
+   * NULL if we haven't compiled them. */
+  struct compiled_short_policy_t *compiled;
   /** An array of 0 or more short_policy_entry_t values, each describing a
    * range of ports that this policy accepts or rejects (depending on the
    * value of is_accept).
@@ -56,6 +56,8 @@
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
 #include "core/or/circuitpadding.h"
+#include "core/or/congestion_control_common.h"
+#include "core/or/congestion_control_flow.h"
 #include "core/or/extendinfo.h"
 #include "lib/compress/compress.h"
 #include "app/config/config.h"
@@ -97,6 +99,7 @@
 #include "feature/nodelist/routerinfo_st.h"
 #include "core/or/socks_request_st.h"
 #include "core/or/sendme.h"
+#include "lib/malloc/slab.h"
 
 static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
                                             cell_direction_t cell_direction,
@@ -530,6 +533,10 @@ relay_command_to_string(uint8_t command)
     case RELAY_COMMAND_EXTENDED2: return "EXTENDED2";
     case RELAY_COMMAND_PADDING_NEGOTIATE: return "PADDING_NEGOTIATE";
     case RELAY_COMMAND_PADDING_NEGOTIATED: return "PADDING_NEGOTIATED";
+    case RELAY_COMMAND_CC_NEGOTIATE_EXP: return "CC_NEGOTIATE_EXP";
+    case RELAY_COMMAND_CC_NEGOTIATED_EXP: return "CC_NEGOTIATED_EXP";
+    case RELAY_COMMAND_XOFF_EXP: return "XOFF_EXP";
+    case RELAY_COMMAND_XON_EXP: return "XON_EXP";
     default:
       tor_snprintf(buf, sizeof(buf), "Unrecognized relay command %u",
                    (unsigned)command);
@@ -1505,6 +1512,24 @@ connection_edge_process_relay_cell_not_open(
 //  return -1;
 }
 
+/** We may send more data on the stream <b>conn</b> of <b>circ</b>: start
+ * reading from it again, unless the circuit queue is full, and package what
+ * it already holds. */
+static void
+connection_edge_resume_reading(edge_connection_t *conn, circuit_t *circ)
+{
+  if (circuit_queue_streams_are_blocked(circ)) {
+    /* Still waiting for queue to flush; don't touch conn */
+    return;
+  }
+  connection_start_reading(TO_CONN(conn));
+  /* handle whatever might still be on the inbuf */
+  if (connection_edge_package_raw_inbuf(conn, 1, NULL) < 0) {
+    /* (We already sent an end cell if possible) */
+    connection_mark_for_close(TO_CONN(conn));
+  }
+}
+
 /** Process a SENDME cell that arrived on <b>circ</b>. If it is a stream level
  * cell, it is destined for the given <b>conn</b>. If it is a circuit level
  * cell, it is destined for the <b>layer_hint</b>. The <b>domain</b> is the
@@ -1565,18 +1590,39 @@ process_sendme_cell(const relay_header_t *rh, const cell_t *cell,
    * properly updated, we'll read on the edge connection to see if we can
    * get data out towards the end point (Exit or client) since we are now
    * allowed to deliver more cells. */
+  connection_edge_resume_reading(conn, circ);
+  return 0;
+}
 
-  if (circuit_queue_streams_are_blocked(circ)) {
-    /* Still waiting for queue to flush; don't touch conn */
+/** Process an XOFF or XON cell that arrived on <b>circ</b> for the stream
+ * <b>conn</b>. The <b>domain</b> is the logging domain that should be used.
+ *
+ * Return 0 if everything went well or a negative value representing a circuit
+ * end reason on error for which the caller is responsible for closing it. */
+static int
+process_xon_xoff_cell(const relay_header_t *rh, circuit_t *circ,
+                      edge_connection_t *conn, int domain)
+{
+  int ret;
+
+  tor_assert(rh);
+
+  if (!conn) {
+    log_info(domain, "%s cell dropped, unknown stream (streamid %d).",
+             relay_command_to_string(rh->command), rh->stream_id);
     return 0;
   }
-  connection_start_reading(TO_CONN(conn));
-  /* handle whatever might still be on the inbuf */
-  if (connection_edge_package_raw_inbuf(conn, 1, NULL) < 0) {
-    /* (We already sent an end cell if possible) */
-    connection_mark_for_close(TO_CONN(conn));
-    return 0;
+
+  if (rh->command == RELAY_COMMAND_XOFF_EXP) {
+    return flow_control_process_xoff(conn);
   }
+
+  ret = flow_control_process_xon(conn);
+  if (ret <= 0) {
+    return ret;
+  }
+  /* The other end can take more data on this stream again. */
+  connection_edge_resume_reading(conn, circ);
   return 0;
 }
 
@@ -1676,8 +1722,8 @@ handle_relay_cell_command(cell_t *cell, circuit_t *circ,
       }
 
       /* Update our stream-level deliver window that we just received a DATA
-       * cell. Going below 0 means we have a protocol level error so the
-       * stream and circuit are closed. */
+       * cell. Going below 0, or overrunning an XOFF, means we have a
+       * protocol level error so the stream and circuit are closed. */
 
       if (sendme_stream_data_received(conn) < 0) {
         log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
@@ -1909,6 +1955,9 @@ handle_relay_cell_command(cell_t *cell, circuit_t *circ,
       return 0;
     case RELAY_COMMAND_SENDME:
       return process_sendme_cell(rh, cell, circ, conn, layer_hint, domain);
+    case RELAY_COMMAND_XOFF_EXP:
+    case RELAY_COMMAND_XON_EXP:
+      return process_xon_xoff_cell(rh, circ, conn, domain);
     case RELAY_COMMAND_RESOLVE:
       if (layer_hint) {
         log_fn(LOG_PROTOCOL_WARN, LD_APP,
@@ -1924,8 +1973,7 @@ handle_relay_cell_command(cell_t *cell, circuit_t *circ,
                circ->purpose);
         return 0;
       }
-      connection_exit_begin_resolve(cell, TO_OR_CIRCUIT(circ));
-      return 0;
+      return connection_exit_begin_resolve(cell, TO_OR_CIRCUIT(circ));
     case RELAY_COMMAND_RESOLVED:
       if (conn) {
         log_fn(LOG_PROTOCOL_WARN, domain,
@@ -1948,6 +1996,18 @@ handle_relay_cell_command(cell_t *cell, circuit_t *circ,
       log_info(domain,
                "'resolved' received, no conn attached anymore. Ignoring.");
       return 0;
+    case RELAY_COMMAND_CC_NEGOTIATE_EXP:
+      congestion_control_process_negotiate(circ,
+                                           cell->payload+RELAY_HEADER_SIZE,
+                                           rh->length);
+      return 0;
+    case RELAY_COMMAND_CC_NEGOTIATED_EXP:
+      if (congestion_control_process_negotiated(circ, layer_hint,
+                                        cell->payload+RELAY_HEADER_SIZE,
+                                        rh->length) == 0) {
+        circuit_read_valid_data(TO_ORIGIN_CIRCUIT(circ), rh->length);
+      }
+      return 0;
     case RELAY_COMMAND_ESTABLISH_INTRO:
     case RELAY_COMMAND_ESTABLISH_RENDEZVOUS:
     case RELAY_COMMAND_INTRODUCE1:
@@ -2139,6 +2199,156 @@ connection_edge_get_inbuf_bytes_to_package(size_t n_available,
   return package_length;
 }
 
+/** Most RELAY_DATA cells that an exit packages from one stream in a single
+ * batch. Batches never straddle more than one SENDME boundary, since the
+ * relay crypto state only remembers one SENDME digest at a time. */
+#define EXIT_PACKAGE_BATCH_MAX 32
+
+/** Helper for connection_edge_package_raw_inbuf(): package up to
+ * <b>max_cells</b> RELAY_DATA cells from the inbuf of the exit stream
+ * <b>conn</b> onto <b>or_circ</b>, and update the package windows.
+ *
+ * Instead of sending every cell through connection_edge_send_command(), we
+ * fill all the cells first, encrypt them together, and queue them with a
+ * single circuitmux and scheduler update.
+ *
+ * Return the number of cells packaged, or -1 (and set the end reason of
+ * <b>conn</b>) if the circuit should be closed. */
+static int
+connection_exit_package_inbuf_batch(edge_connection_t *conn,
+                                    or_circuit_t *or_circ,
+                                    int package_partial, int max_cells)
+{
+  circuit_t *circ = TO_CIRCUIT(or_circ);
+  cell_t cells[EXIT_PACKAGE_BATCH_MAX];
+  cell_t *cellp[EXIT_PACKAGE_BATCH_MAX];
+  relay_header_t rh;
+  size_t n_bytes = 0;
+  int n_cells = 0, i;
+
+  CTASSERT(EXIT_PACKAGE_BATCH_MAX <= CIRCWINDOW_INCREMENT);
+  tor_assert(max_cells > 0 && max_cells <= EXIT_PACKAGE_BATCH_MAX);
+
+  if (circ->marked_for_close)
+    return 0;
+  if (BUG(!or_circ->p_chan))
+    return 0;
+
+  while (n_cells < max_cells) {
+    size_t length = connection_edge_get_inbuf_bytes_to_package(
+                         connection_get_inbuf_len(TO_CONN(conn)),
+                         package_partial, circ);
+    if (!length)
+      break;
+
+    cell_t *cell = &cells[n_cells];
+    memset(cell, 0, sizeof(cell_t));
+    cell->command = CELL_RELAY;
+    cell->circ_id = or_circ->p_circ_id;
+
+    memset(&rh, 0, sizeof(rh));
+    rh.command = RELAY_COMMAND_DATA;
+    rh.stream_id = conn->stream_id;
+    rh.length = length;
+    relay_header_pack(cell->payload, &rh);
+    connection_buf_get_bytes((char *)cell->payload + RELAY_HEADER_SIZE,
+                             length, TO_CONN(conn));
+    pad_cell_payload(cell->payload, length);
+
+    cellp[n_cells++] = cell;
+    n_bytes += length;
+  }
+
+  if (!n_cells)
+    return 0;
+
+  stats_n_data_bytes_packaged += n_bytes;
+  stats_n_data_cells_packaged += n_cells;
+
+  log_debug(LD_EXIT,TOR_SOCKET_T_FORMAT": Packaging %d bytes in %d cells "
+            "(%d waiting).", conn->base_.s, (int)n_bytes, n_cells,
+            (int)connection_get_inbuf_len(TO_CONN(conn)));
+
+#ifdef MEASUREMENTS_21206
+  /* Keep track of the number of RELAY_DATA cells sent for directory
+   * connections. */
+  connection_t *linked_conn = TO_CONN(conn)->linked_conn;
+
+  if (linked_conn && linked_conn->type == CONN_TYPE_DIR) {
+    TO_DIR_CONN(linked_conn)->data_cells_sent += n_cells;
+  }
+#endif /* defined(MEASUREMENTS_21206) */
+
+  /* This records the SENDME digest in the crypto state if one of the cells
+   * is the last one before a SENDME. */
+  relay_encrypt_cells_inbound(cellp, n_cells, or_circ);
+  stats_n_relay_cells_relayed += n_cells;
+
+  append_cells_to_circuit_queue(circ, or_circ->p_chan, cellp, n_cells,
+                                CELL_DIRECTION_IN, conn->stream_id);
+  if (circ->marked_for_close) {
+    /* The queue was full; don't continue, don't need to mark conn. */
+    return 0;
+  }
+
+  for (i = 0; i < n_cells; ++i) {
+    /* Tell circpad we sent a relay cell. */
+    circpad_deliver_sent_relay_cell_events(circ, RELAY_COMMAND_DATA);
+
+    /* Note the cell digest for SENDME v1, and handle the package windows,
+     * one cell at a time so that both see the window each cell had. */
+    sendme_record_cell_digest_on_circ(circ, NULL);
+    if (sendme_note_circuit_data_packaged(circ, NULL) < 0) {
+      /* Package window has gone under 0. Protocol issue. */
+      log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+             "Circuit package window is below 0. Closing circuit.");
+      conn->end_reason = END_STREAM_REASON_TORPROTOCOL;
+      return -1;
+    }
+    sendme_note_stream_data_packaged(conn);
+  }
+
+  return n_cells;
+}
+
+/** Helper for connection_edge_package_raw_inbuf(): package one batch of
+ * cells from the exit stream <b>conn</b> onto <b>or_circ</b>, whose package
+ * windows must not be empty. Handle <b>max_cells</b> as
+ * connection_edge_package_raw_inbuf() does.
+ *
+ * Return 1 if we should try to package more cells, 0 if we should stop, and
+ * -1 if the circuit should be closed. */
+static int
+connection_exit_package_inbuf(edge_connection_t *conn, or_circuit_t *or_circ,
+                              int package_partial, int *max_cells)
+{
+  circuit_t *circ = TO_CIRCUIT(or_circ);
+  int n_cells = MIN(conn->package_window, circ->package_window);
+  n_cells = MIN(n_cells, EXIT_PACKAGE_BATCH_MAX);
+  if (max_cells)
+    n_cells = MIN(n_cells, *max_cells);
+
+  n_cells = connection_exit_package_inbuf_batch(conn, or_circ,
+                                                package_partial, n_cells);
+  if (n_cells <= 0)
+    return n_cells;
+
+  if (conn->package_window <= 0) {
+    connection_stop_reading(TO_CONN(conn));
+    log_debug(LD_EXIT,"conn->package_window reached 0.");
+    circuit_consider_stop_edge_reading(circ, NULL);
+    return 0; /* don't process the inbuf any more */
+  }
+  log_debug(LD_EXIT,"conn->package_window is now %d",conn->package_window);
+
+  if (max_cells) {
+    *max_cells -= n_cells;
+    if (*max_cells <= 0)
+      return 0;
+  }
+  return 1;
+}
+
 /** If <b>conn</b> has an entire relay payload of bytes on its inbuf (or
  * <b>package_partial</b> is true), and the appropriate package windows aren't
  * empty, grab a cell and send it down the circuit.
@@ -2197,6 +2407,21 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
     return 0;
   }
 
+  if (conn->xoff_received) {
+    log_debug(domain, "stream has received an XOFF. Skipping.");
+    connection_stop_reading(TO_CONN(conn));
+    return 0;
+  }
+
+  if (! CIRCUIT_IS_ORIGIN(circ)) {
+    /* Exits package bulk data in batches. */
+    int r = connection_exit_package_inbuf(conn, TO_OR_CIRCUIT(circ),
+                                          package_partial, max_cells);
+    if (r <= 0)
+      return r;
+    goto repeat_connection_edge_package_raw_inbuf;
+  }
+
   sending_from_optimistic = entry_conn &&
     entry_conn->sending_optimistic_data != NULL;
 
@@ -2377,7 +2602,8 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   /* Activate reading starting from the chosen stream */
   for (conn=chosen_stream; conn; conn = conn->next_stream) {
     /* Start reading for the streams starting from here */
-    if (conn->base_.marked_for_close || conn->package_window <= 0)
+    if (conn->base_.marked_for_close || conn->package_window <= 0 ||
+        conn->xoff_received)
       continue;
     if (!layer_hint || conn->cpath_layer == layer_hint) {
       connection_start_reading(TO_CONN(conn));
@@ -2388,7 +2614,8 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   }
   /* Go back and do the ones we skipped, circular-style */
   for (conn = first_conn; conn != chosen_stream; conn = conn->next_stream) {
-    if (conn->base_.marked_for_close || conn->package_window <= 0)
+    if (conn->base_.marked_for_close || conn->package_window <= 0 ||
+        conn->xoff_received)
       continue;
     if (!layer_hint || conn->cpath_layer == layer_hint) {
       connection_start_reading(TO_CONN(conn));
@@ -2414,7 +2641,8 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
    * package.
    */
   for (conn=first_conn; conn; conn=conn->next_stream) {
-    if (conn->base_.marked_for_close || conn->package_window <= 0)
+    if (conn->base_.marked_for_close || conn->package_window <= 0 ||
+        conn->xoff_received)
       continue;
     if (!layer_hint || conn->cpath_layer == layer_hint) {
       int n = cells_per_conn, r;
@@ -2500,12 +2728,72 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
 /** The total number of cells we have allocated. */
 static size_t total_cells_allocated = 0;
 
+/** How many packed cells we carve out of each slab of the packed cell pool.
+ * 64 cells make slabs of about 34KB. */
+#define PACKED_CELL_POOL_ITEMS_PER_SLAB 64
+/** How many empty slabs the packed cell pool keeps around for bursts before
+ * giving them back to the allocator: about 2MB. */
+#define PACKED_CELL_POOL_MAX_EMPTY_SLABS 64
+/** How many destroy cells we carve out of each slab of the destroy cell
+ * pool. */
+#define DESTROY_CELL_POOL_ITEMS_PER_SLAB 256
+/** How many empty slabs the destroy cell pool keeps around. */
+#define DESTROY_CELL_POOL_MAX_EMPTY_SLABS 4
+/** How many cell queue blocks we carve out of each slab of the block pool. */
+#define CELL_QUEUE_BLOCK_POOL_ITEMS_PER_SLAB 64
+/** How many empty slabs the cell queue block pool keeps around. */
+#define CELL_QUEUE_BLOCK_POOL_MAX_EMPTY_SLABS 64
+
+/** Pool from which we allocate every packed_cell_t. */
+static slab_pool_t *packed_cell_pool = NULL;
+/** Pool from which we allocate every destroy_cell_t. */
+static slab_pool_t *destroy_cell_pool = NULL;
+/** Pool from which we allocate every cell_queue_block_t. */
+static slab_pool_t *cell_queue_block_pool = NULL;
+
+/** Return the pool of packed cells, creating it if needed. */
+static inline slab_pool_t *
+get_packed_cell_pool(void)
+{
+  if (PREDICT_UNLIKELY(!packed_cell_pool)) {
+    packed_cell_pool = slab_pool_new(sizeof(packed_cell_t),
+                                     PACKED_CELL_POOL_ITEMS_PER_SLAB,
+                                     PACKED_CELL_POOL_MAX_EMPTY_SLABS);
+  }
+  return packed_cell_pool;
+}
+
+/** Return the pool of destroy cells, creating it if needed. */
+static inline slab_pool_t *
+get_destroy_cell_pool(void)
+{
+  if (PREDICT_UNLIKELY(!destroy_cell_pool)) {
+    destroy_cell_pool = slab_pool_new(sizeof(destroy_cell_t),
+                                      DESTROY_CELL_POOL_ITEMS_PER_SLAB,
+                                      DESTROY_CELL_POOL_MAX_EMPTY_SLABS);
+  }
+  return destroy_cell_pool;
+}
+
+/** Return the pool of cell queue blocks, creating it if needed. */
+static inline slab_pool_t *
+get_cell_queue_block_pool(void)
+{
+  if (PREDICT_UNLIKELY(!cell_queue_block_pool)) {
+    cell_queue_block_pool =
+      slab_pool_new(sizeof(cell_queue_block_t),
+                    CELL_QUEUE_BLOCK_POOL_ITEMS_PER_SLAB,
+                    CELL_QUEUE_BLOCK_POOL_MAX_EMPTY_SLABS);
+  }
+  return cell_queue_block_pool;
+}
+
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
   --total_cells_allocated;
-  tor_free(cell);
+  slab_pool_release(get_packed_cell_pool(), cell);
 }
 
 /** Allocate and return a new packed_cell_t. */
@@ -2513,7 +2801,7 @@ STATIC packed_cell_t *
 packed_cell_new(void)
 {
   ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  return slab_pool_alloc(get_packed_cell_pool());
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2525,6 +2813,74 @@ packed_cell_free_(packed_cell_t *cell)
   packed_cell_free_unchecked(cell);
 }
 
+/** Allocate and return a new destroy_cell_t. */
+static inline destroy_cell_t *
+destroy_cell_new(void)
+{
+  return slab_pool_alloc(get_destroy_cell_pool());
+}
+
+/** Release storage held by a destroy cell taken out of a queue. */
+void
+destroy_cell_free_(destroy_cell_t *cell)
+{
+  if (!cell)
+    return;
+  slab_pool_release(get_destroy_cell_pool(), cell);
+}
+
+/** Fill <b>packed_out</b> and <b>destroy_out</b> with the usage statistics
+ * of the packed cell pool and of the destroy cell pool. */
+void
+cell_pools_get_stats(slab_pool_stats_t *packed_out,
+                     slab_pool_stats_t *destroy_out)
+{
+  if (packed_out)
+    slab_pool_get_stats(get_packed_cell_pool(), packed_out);
+  if (destroy_out)
+    slab_pool_get_stats(get_destroy_cell_pool(), destroy_out);
+}
+
+/** Give every empty slab of the cell pools back to the allocator. Return the
+ * number of bytes freed. */
+size_t
+cell_pools_reclaim(void)
+{
+  size_t freed = 0;
+  if (packed_cell_pool)
+    freed += slab_pool_reclaim(packed_cell_pool, 0);
+  if (destroy_cell_pool)
+    freed += slab_pool_reclaim(destroy_cell_pool, 0);
+  if (cell_queue_block_pool)
+    freed += slab_pool_reclaim(cell_queue_block_pool, 0);
+  return freed;
+}
+
+/** Release all storage held by the cell pools. Every packed and destroy cell,
+ * and every cell queue, must have been freed already. */
+void
+cell_pools_free_all(void)
+{
+  slab_pool_free(packed_cell_pool);
+  slab_pool_free(destroy_cell_pool);
+  slab_pool_free(cell_queue_block_pool);
+}
+
+/** Log the usage statistics <b>st</b> of the cell pool called <b>name</b> at
+ * log level <b>severity</b>. */
+static void
+dump_one_cell_pool_usage(int severity, const char *name,
+                         const slab_pool_stats_t *st)
+{
+  tor_log(severity, LD_MM,
+          "%s cell pool: %"PRIu64" of %"PRIu64" cells in use "
+          "(%"PRIu64" at most) in %"PRIu64" slabs of which %"PRIu64" empty, "
+          "%"PRIu64" bytes. %"PRIu64" slabs reclaimed in %"PRIu64" events.",
+          name, st->n_used, st->n_slots, st->n_used_max, st->n_slabs,
+          st->n_empty_slabs, st->n_bytes, st->n_slabs_reclaimed,
+          st->n_reclaims);
+}
+
 /** Log current statistics for cell pool allocation at log level
  * <b>severity</b>. */
 void
@@ -2532,6 +2888,8 @@ dump_cell_pool_usage(int severity)
 {
   int n_circs = 0;
   int n_cells = 0;
+  slab_pool_stats_t packed_stats, destroy_stats;
+
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, c) {
     n_cells += c->n_chan_cells.n;
     if (!CIRCUIT_IS_ORIGIN(c))
@@ -2542,6 +2900,10 @@ dump_cell_pool_usage(int severity)
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
           n_cells, n_circs, (int)total_cells_allocated - n_cells);
+
+  cell_pools_get_stats(&packed_stats, &destroy_stats);
+  dump_one_cell_pool_usage(severity, "Packed", &packed_stats);
+  dump_one_cell_pool_usage(severity, "Destroy", &destroy_stats);
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2557,7 +2919,23 @@ packed_cell_copy(const cell_t *cell, int wide_circ_ids)
 void
 cell_queue_append(cell_queue_t *queue, packed_cell_t *cell)
 {
-  TOR_SIMPLEQ_INSERT_TAIL(&queue->head, cell, next);
+  cell_queue_block_t *tail = queue->tail;
+
+  if (!tail || queue->tail_idx == CELL_QUEUE_BLOCK_LEN) {
+    cell_queue_block_t *block = slab_pool_alloc(get_cell_queue_block_pool());
+    if (tail) {
+      tail->next = block;
+    } else {
+      queue->head = block;
+      queue->head_idx = 0;
+    }
+    queue->tail = tail = block;
+    queue->tail_idx = 0;
+  }
+
+  tail->cells[queue->tail_idx] = cell;
+  tail->inserted_timestamps[queue->tail_idx] = cell->inserted_timestamp;
+  ++queue->tail_idx;
   ++queue->n;
 }
 
@@ -2585,35 +2963,66 @@ void
 cell_queue_init(cell_queue_t *queue)
 {
   memset(queue, 0, sizeof(cell_queue_t));
-  TOR_SIMPLEQ_INIT(&queue->head);
 }
 
 /** Remove and free every cell in <b>queue</b>. */
 void
 cell_queue_clear(cell_queue_t *queue)
 {
-  packed_cell_t *cell;
-  while ((cell = TOR_SIMPLEQ_FIRST(&queue->head))) {
-    TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
-    packed_cell_free_unchecked(cell);
-  }
-  TOR_SIMPLEQ_INIT(&queue->head);
-  queue->n = 0;
+  cell_queue_block_t *block, *next;
+  unsigned idx = queue->head_idx;
+
+  for (block = queue->head; block; block = next) {
+    const unsigned end =
+      (block == queue->tail) ? queue->tail_idx : CELL_QUEUE_BLOCK_LEN;
+    next = block->next;
+    for ( ; idx < end; ++idx)
+      packed_cell_free_unchecked(block->cells[idx]);
+    slab_pool_release(get_cell_queue_block_pool(), block);
+    idx = 0;
+  }
+  cell_queue_init(queue);
 }
 
 /** Extract and return the cell at the head of <b>queue</b>; return NULL if
  * <b>queue</b> is empty. */
-STATIC packed_cell_t *
+packed_cell_t *
 cell_queue_pop(cell_queue_t *queue)
 {
-  packed_cell_t *cell = TOR_SIMPLEQ_FIRST(&queue->head);
-  if (!cell)
+  cell_queue_block_t *head = queue->head;
+  packed_cell_t *cell;
+  if (!head)
     return NULL;
-  TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
+
+  cell = head->cells[queue->head_idx++];
   --queue->n;
+
+  if (head == queue->tail && queue->head_idx == queue->tail_idx) {
+    /* That was the last cell: the queue holds no block when empty. */
+    tor_assert_nonfatal(queue->n == 0);
+    slab_pool_release(get_cell_queue_block_pool(), head);
+    cell_queue_init(queue);
+  } else if (queue->head_idx == CELL_QUEUE_BLOCK_LEN) {
+    queue->head = head->next;
+    queue->head_idx = 0;
+    slab_pool_release(get_cell_queue_block_pool(), head);
+  }
   return cell;
 }
 
+/** If <b>queue</b> is not empty, set *<b>timestamp_out</b> to the time (in
+ * timestamp units) when its oldest cell was inserted, and return true.
+ * Otherwise return false. */
+bool
+cell_queue_get_oldest_timestamp(const cell_queue_t *queue,
+                                uint32_t *timestamp_out)
+{
+  if (!queue->head)
+    return false;
+  *timestamp_out = queue->head->inserted_timestamps[queue->head_idx];
+  return true;
+}
+
 /** Initialize <b>queue</b> as an empty cell queue. */
 void
 destroy_cell_queue_init(destroy_cell_queue_t *queue)
@@ -2629,7 +3038,7 @@ destroy_cell_queue_clear(destroy_cell_queue_t *queue)
   destroy_cell_t *cell;
   while ((cell = TOR_SIMPLEQ_FIRST(&queue->head))) {
     TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
-    tor_free(cell);
+    destroy_cell_free(cell);
   }
   TOR_SIMPLEQ_INIT(&queue->head);
   queue->n = 0;
@@ -2654,7 +3063,7 @@ destroy_cell_queue_append(destroy_cell_queue_t *queue,
                           circid_t circid,
                           uint8_t reason)
 {
-  destroy_cell_t *cell = tor_malloc_zero(sizeof(destroy_cell_t));
+  destroy_cell_t *cell = destroy_cell_new();
   cell->circid = circid;
   cell->reason = reason;
   /* Not yet used, but will be required for OOM handling. */
@@ -2676,7 +3085,7 @@ destroy_cell_to_packed_cell(destroy_cell_t *inp, int wide_circ_ids)
   cell.payload[0] = inp->reason;
   cell_pack(packed, &cell, wide_circ_ids);
 
-  tor_free(inp);
+  destroy_cell_free(inp);
   return packed;
 }
 
@@ -2741,6 +3150,9 @@ cell_queues_check_size(void)
         alloc -= dns_cache_handle_oom(now, bytes_to_remove);
       }
       circuits_handle_oom(alloc);
+      /* Now that we've dropped cells, give the slabs they left empty back to
+       * the allocator. */
+      cell_pools_reclaim();
       return 1;
     }
   }
@@ -3086,6 +3498,14 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
 static int32_t max_circuit_cell_queue_size =
   RELAY_CIRC_CELL_QUEUE_SIZE_DEFAULT;
 
+/** Return the maximum number of cells that a circuit queue may hold before
+ * we close the circuit. */
+int32_t
+relay_get_max_circuit_cell_queue_size(void)
+{
+  return max_circuit_cell_queue_size;
+}
+
 /* Called when the consensus has changed. At this stage, the global consensus
  * object has NOT been updated. It is called from
  * notify_before_networkstatus_changes(). */
@@ -3113,11 +3533,29 @@ void
 append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
                              cell_t *cell, cell_direction_t direction,
                              streamid_t fromstream)
+{
+  append_cells_to_circuit_queue(circ, chan, &cell, 1, direction, fromstream);
+}
+
+/** Add the <b>n_cells</b> cells in <b>cells</b> to the queue of <b>circ</b>
+ * writing to <b>chan</b> transmitting in <b>direction</b>, in that order.
+ *
+ * The cells are copied onto the circuit queue so the caller must cleanup the
+ * memory. The circuitmux and the scheduler are told about the new cells only
+ * once, after all of them are queued.
+ *
+ * This function is part of the fast path. */
+void
+append_cells_to_circuit_queue(circuit_t *circ, channel_t *chan,
+                              cell_t **cells, size_t n_cells,
+                              cell_direction_t direction,
+                              streamid_t fromstream)
 {
   or_circuit_t *orcirc = NULL;
   cell_queue_t *queue;
   int streams_blocked;
   int exitward;
+  size_t i;
   if (circ->marked_for_close)
     return;
 
@@ -3131,21 +3569,23 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
     streams_blocked = circ->streams_blocked_on_p_chan;
   }
 
-  if (PREDICT_UNLIKELY(queue->n >= max_circuit_cell_queue_size)) {
-    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
-           "%s circuit has %d cells in its queue, maximum allowed is %d. "
-           "Closing circuit for safety reasons.",
-           (exitward) ? "Outbound" : "Inbound", queue->n,
-           max_circuit_cell_queue_size);
-    circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
-    stats_n_circ_max_cell_reached++;
-    return;
-  }
+  for (i = 0; i < n_cells; ++i) {
+    if (PREDICT_UNLIKELY(queue->n >= max_circuit_cell_queue_size)) {
+      log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+             "%s circuit has %d cells in its queue, maximum allowed is %d. "
+             "Closing circuit for safety reasons.",
+             (exitward) ? "Outbound" : "Inbound", queue->n,
+             max_circuit_cell_queue_size);
+      circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
+      stats_n_circ_max_cell_reached++;
+      return;
+    }
 
-  /* Very important that we copy to the circuit queue because all calls to
-   * this function use the stack for the cell memory. */
-  cell_queue_append_packed_copy(circ, queue, exitward, cell,
-                                chan->wide_circ_ids, 1);
+    /* Very important that we copy to the circuit queue because all calls to
+     * this function use the stack for the cell memory. */
+    cell_queue_append_packed_copy(circ, queue, exitward, cells[i],
+                                  chan->wide_circ_ids, 1);
+  }
 
   /* Check and run the OOM if needed. */
   if (PREDICT_UNLIKELY(cell_queues_check_size())) {
@@ -3165,8 +3605,8 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
   }
 
   update_circuit_on_cmux(circ, direction);
-  if (queue->n == 1) {
-    /* This was the first cell added to the queue.  We just made this
+  if (queue->n == (int)n_cells) {
+    /* These were the first cells added to the queue.  We just made this
      * circuit active. */
     log_debug(LD_GENERAL, "Made a circuit active.");
   }
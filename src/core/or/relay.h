@@ -17,6 +17,7 @@ extern uint64_t stats_n_relay_cells_delivered;
 extern uint64_t stats_n_circ_max_cell_reached;
 
 void relay_consensus_has_changed(const networkstatus_t *ns);
+int32_t relay_get_max_circuit_cell_queue_size(void);
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
 size_t cell_queues_get_total_allocation(void);
@@ -58,10 +59,22 @@ int have_been_under_memory_pressure(void);
 void packed_cell_free_(packed_cell_t *cell);
 #define packed_cell_free(cell) \
   FREE_AND_NULL(packed_cell_t, packed_cell_free_, (cell))
+void destroy_cell_free_(destroy_cell_t *cell);
+#define destroy_cell_free(cell) \
+  FREE_AND_NULL(destroy_cell_t, destroy_cell_free_, (cell))
+
+struct slab_pool_stats_t;
+void cell_pools_get_stats(struct slab_pool_stats_t *packed_out,
+                          struct slab_pool_stats_t *destroy_out);
+size_t cell_pools_reclaim(void);
+void cell_pools_free_all(void);
 
 void cell_queue_init(cell_queue_t *queue);
 void cell_queue_clear(cell_queue_t *queue);
 void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
+packed_cell_t *cell_queue_pop(cell_queue_t *queue);
+bool cell_queue_get_oldest_timestamp(const cell_queue_t *queue,
+                                     uint32_t *timestamp_out);
 void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
                                    int exitward, const cell_t *cell,
                                    int wide_circ_ids, int use_stats);
@@ -69,6 +82,10 @@ void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
 void append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
                                   cell_t *cell, cell_direction_t direction,
                                   streamid_t fromstream);
+void append_cells_to_circuit_queue(circuit_t *circ, channel_t *chan,
+                                   cell_t **cells, size_t n_cells,
+                                   cell_direction_t direction,
+                                   streamid_t fromstream);
 
 void destroy_cell_queue_init(destroy_cell_queue_t *queue);
 void destroy_cell_queue_clear(destroy_cell_queue_t *queue);
@@ -121,7 +138,6 @@ STATIC int connection_edge_process_resolved_cell(edge_connection_t *conn,
                                                  const cell_t *cell,
                                                  const relay_header_t *rh);
 STATIC packed_cell_t *packed_cell_new(void);
-STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
 STATIC destroy_cell_t *destroy_cell_queue_pop(destroy_cell_queue_t *queue);
 STATIC int cell_queues_check_size(void);
 STATIC int connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
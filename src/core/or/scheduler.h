@@ -108,6 +108,17 @@ typedef struct scheduler_t {
 /* Maximum interval that KIST runs (in ms). */
 #define KIST_SCHED_RUN_INTERVAL_MAX 100
 
+/* Counters of the kernel queries made by the KIST scheduler. */
+typedef struct kist_stats_t {
+  /* Number of times the KIST scheduler ran. */
+  uint64_t n_runs;
+  /* Number of system calls made to read socket information. */
+  uint64_t n_syscalls;
+  /* Number of such system calls avoided by reusing an earlier sample of the
+   * socket information (KISTAdaptiveSampling). */
+  uint64_t n_syscalls_saved;
+} kist_stats_t;
+
 /*****************************************************************************
  * Globally visible scheduler functions
  *
@@ -130,6 +141,8 @@ void scheduler_channel_wants_writes(channel_t *chan);
 MOCK_DECL(void, scheduler_channel_doesnt_want_writes, (channel_t *chan));
 MOCK_DECL(void, scheduler_channel_has_waiting_cells, (channel_t *chan));
 
+void kist_get_stats(kist_stats_t *out);
+
 /*****************************************************************************
  * Private scheduler functions
  *
@@ -187,6 +200,13 @@ typedef struct socket_table_ent_t {
   uint32_t unacked;
   uint32_t mss;
   uint32_t notsent;
+  /* With adaptive sampling: when we last read the TCP info from the kernel,
+   * in msec since an arbitrary point in the past. */
+  uint64_t last_sample_msec;
+  /* With adaptive sampling: number of scheduling runs that the last sample
+   * is used for, and number of those runs that are left. */
+  uint8_t sample_interval;
+  uint8_t runs_until_sample;
 } socket_table_ent_t;
 
 typedef HT_HEAD(outbuf_table_s, outbuf_table_ent_t) outbuf_table_t;
@@ -204,6 +224,9 @@ int kist_scheduler_run_interval(void);
 
 #ifdef TOR_UNIT_TESTS
 extern int32_t sched_run_interval;
+extern int kist_adaptive_sampling;
+STATIC int socket_info_is_fresh(const socket_table_ent_t *ent,
+                                uint64_t now_msec);
 #endif /* TOR_UNIT_TESTS */
 
 #endif /* defined(SCHEDULER_KIST_PRIVATE) */
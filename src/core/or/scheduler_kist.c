@@ -100,6 +100,22 @@ static monotime_t scheduler_last_run;
 static double sock_buf_size_factor = 1.0;
 /* How often the scheduler runs. */
 STATIC int sched_run_interval = KIST_SCHED_RUN_INTERVAL_DEFAULT;
+/* If true, don't ask the kernel for the TCP info of a socket on every
+ * scheduling run, but reuse the last sample while it is recent and most of
+ * the write limit computed from it is left. */
+STATIC int kist_adaptive_sampling = 0;
+/* Counters of the kernel queries made by KIST. */
+static kist_stats_t kist_stats;
+
+/* Number of system calls that update_socket_info_impl() makes to read the
+ * TCP info of a socket. */
+#define KIST_SYSCALLS_PER_SAMPLE 2
+/* With adaptive sampling, the largest number of scheduling runs for which we
+ * use the same sample of a socket's TCP info. */
+#define KIST_MAX_SAMPLE_INTERVAL 8
+/* With adaptive sampling, the longest time for which we use the same sample
+ * of a socket's TCP info, in msec. */
+#define KIST_MAX_SAMPLE_AGE_MSEC 100
 
 #ifdef HAVE_KIST_SUPPORT
 /* Indicate if KIST lite mode is on or off. We can disable it at runtime.
@@ -323,10 +339,41 @@ update_socket_info_impl, (socket_table_ent_t *ent))
                 TLS_PER_CELL_OVERHEAD);
 }
 
-/* Given a socket that isn't in the table, add it.
- * Given a socket that is in the table, re-init values that need init-ing
- * every scheduling run
- */
+/* Return true iff update_socket_info_impl() asks the kernel for the TCP info
+ * of the sockets, rather than using the naive KIST Lite limit. */
+static int
+kist_reads_tcp_info(void)
+{
+#ifdef HAVE_KIST_SUPPORT
+  return !kist_lite_mode && !kist_no_kernel_support;
+#else
+  return 0;
+#endif
+}
+
+/* Return true iff the TCP info sampled for <b>ent</b> can be used for one
+ * more scheduling run at <b>now_msec</b>, instead of asking the kernel again.
+ *
+ * The write limit computed from a sample only ever goes down as we write, so
+ * reusing it never lets us put more in the kernel than the sample allowed.
+ * It does make us write less than we could once the kernel has sent some of
+ * it, so we only do it while at least half of the limit is left. Sockets
+ * that use up their limit are sampled on every run, as without adaptive
+ * sampling: the syscalls we make scale with the congested sockets, not with
+ * all of them. */
+STATIC int
+socket_info_is_fresh(const socket_table_ent_t *ent, uint64_t now_msec)
+{
+  if (!kist_adaptive_sampling)
+    return 0;
+  if (ent->runs_until_sample == 0)
+    return 0;
+  if (now_msec - ent->last_sample_msec > KIST_MAX_SAMPLE_AGE_MSEC)
+    return 0;
+  return ent->written * 2 < ent->limit;
+}
+
+/* Given a socket that isn't in the table, add it. */
 static void
 init_socket_info(socket_table_t *table, const channel_t *chan)
 {
@@ -339,7 +386,6 @@ init_socket_info(socket_table_t *table, const channel_t *chan)
     ent->chan = chan;
     HT_INSERT(socket_table_s, table, ent);
   }
-  ent->written = 0;
 }
 
 /* Add chan to the outbuf table if it isn't already in it. If it is, then don't
@@ -404,16 +450,43 @@ socket_can_write(socket_table_t *table, const channel_t *chan)
   return kist_limit_space > 0;
 }
 
-/* Update the channel's socket kernel information. */
+/* Update the channel's socket kernel information, and reset the amount
+ * written on it. With adaptive sampling, we might keep the last sample and
+ * the amount written since then instead. */
 static void
 update_socket_info(socket_table_t *table, const channel_t *chan)
 {
   socket_table_ent_t *ent = NULL;
+  const int reads_tcp_info = kist_reads_tcp_info();
+  const uint64_t now_msec = monotime_coarse_absolute_msec();
   ent = socket_table_search(table, chan);
   if (SCHED_BUG(!ent, chan)) {
     return; // Whelp. Entry didn't exist for some reason so nothing to do.
   }
+
+  if (reads_tcp_info && socket_info_is_fresh(ent, now_msec)) {
+    --ent->runs_until_sample;
+    kist_stats.n_syscalls_saved += KIST_SYSCALLS_PER_SAMPLE;
+    return;
+  }
+
+  /* If the last sample lasted until its interval ran out, with most of its
+   * limit left, the socket isn't congested: keep the next sample for longer.
+   * Otherwise, sample on every run. */
+  if (kist_adaptive_sampling && ent->runs_until_sample == 0 &&
+      ent->written * 2 < ent->limit) {
+    ent->sample_interval = MIN(MAX(ent->sample_interval, 1) * 2,
+                               KIST_MAX_SAMPLE_INTERVAL);
+  } else {
+    ent->sample_interval = 1;
+  }
+  ent->runs_until_sample = ent->sample_interval - 1;
+  ent->last_sample_msec = now_msec;
+  ent->written = 0;
   update_socket_info_impl(ent);
+  if (reads_tcp_info) {
+    kist_stats.n_syscalls += KIST_SYSCALLS_PER_SAMPLE;
+  }
   log_debug(LD_SCHED, "chan=%" PRIu64 " updated socket info, limit: %" PRIu64
                       ", cwnd: %" PRIu32 ", unacked: %" PRIu32
                       ", notsent: %" PRIu32 ", mss: %" PRIu32,
@@ -515,6 +588,7 @@ static void
 kist_scheduler_on_new_options(void)
 {
   sock_buf_size_factor = get_options()->KISTSockBufSizeFactor;
+  kist_adaptive_sampling = get_options()->KISTAdaptiveSampling;
 
   /* Calls kist_scheduler_run_interval which calls get_options(). */
   set_scheduler_run_interval();
@@ -596,6 +670,8 @@ kist_scheduler_run(void)
 
   outbuf_table_t outbuf_table = HT_INITIALIZER();
 
+  ++kist_stats.n_runs;
+
   /* For each pending channel, collect new kernel information */
   SMARTLIST_FOREACH_BEGIN(cp, const channel_t *, pchan) {
       init_socket_info(&socket_table, pchan);
@@ -780,6 +856,14 @@ get_kist_scheduler(void)
   return &kist_scheduler;
 }
 
+/* Copy the counters of the kernel queries made by KIST into <b>out</b>. */
+void
+kist_get_stats(kist_stats_t *out)
+{
+  tor_assert(out);
+  memcpy(out, &kist_stats, sizeof(*out));
+}
+
 /* Check the torrc (and maybe consensus) for the configured KIST scheduler run
  * interval.
  * - If torrc > 0, then return the positive torrc value (should use KIST, and
@@ -18,6 +18,8 @@
 #include "core/or/crypt_path.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
+#include "core/or/congestion_control_common.h"
+#include "core/or/congestion_control_flow.h"
 #include "core/or/or_circuit_st.h"
 #include "core/or/relay.h"
 #include "core/or/sendme.h"
@@ -69,7 +71,8 @@ pop_first_cell_digest(const circuit_t *circ)
    * package_window down to 0 leading to a circuit close. Scream loudly but
    * still pop the element so we don't memory leak. */
   tor_assert_nonfatal(smartlist_len(circ->sendme_last_digests) <=
-                      CIRCWINDOW_START_MAX / CIRCWINDOW_INCREMENT);
+                      MAX(CIRCWINDOW_START_MAX, CC_CWND_MAX_MAX) /
+                      CIRCWINDOW_INCREMENT);
 
   circ_digest = smartlist_get(circ->sendme_last_digests, 0);
   smartlist_del_keeporder(circ->sendme_last_digests, 0);
@@ -364,12 +367,29 @@ circuit_sendme_cell_is_next(int window)
   return true;
 }
 
+/** Return true iff, once <b>idx</b> more DATA cells are packaged on
+ * <b>circ</b> (towards the hop <b>cpath</b> if we are a client), the next
+ * one we package is expected to make the other end send us a SENDME. */
+static bool
+package_window_sendme_is_next(const circuit_t *circ,
+                              const crypt_path_t *cpath, int idx)
+{
+  const congestion_control_t *cc = cpath ? cpath->ccontrol : circ->ccontrol;
+
+  if (cc) {
+    return congestion_control_sendme_is_next(cc, idx);
+  }
+  return circuit_sendme_cell_is_next((cpath ? cpath->package_window :
+                                              circ->package_window) - idx);
+}
+
 /** Called when we've just received a relay data cell, when we've just
  * finished flushing all bytes to stream <b>conn</b>, or when we've flushed
  * *some* bytes to the stream <b>conn</b>.
  *
  * If conn->outbuf is not too full, and our deliver window is low, send back a
- * suitable number of stream-level sendme cells.
+ * suitable number of stream-level sendme cells. Streams that use XON/XOFF
+ * flow control send those instead.
  */
 void
 sendme_connection_edge_consider_sending(edge_connection_t *conn)
@@ -378,6 +398,11 @@ sendme_connection_edge_consider_sending(edge_connection_t *conn)
 
   int log_domain = TO_CONN(conn)->type == CONN_TYPE_AP ? LD_APP : LD_EXIT;
 
+  if (edge_uses_flow_control(conn)) {
+    flow_control_decide_xon_xoff(conn);
+    goto end;
+  }
+
   /* Don't send it if we still have data to deliver. */
   if (connection_outbuf_too_full(TO_CONN(conn))) {
     goto end;
@@ -442,6 +467,27 @@ sendme_circuit_consider_sending(circuit_t *circ, crypt_path_t *layer_hint)
   }
 }
 
+/* Credit the circuit-level package window <b>package_window</b> for a
+ * SENDME cell, through the congestion control state <b>cc</b> if we have
+ * one. Return false iff the SENDME acknowledges data that we never sent. */
+static bool
+package_window_note_sendme(congestion_control_t *cc, int *package_window)
+{
+  if (cc) {
+    if (congestion_control_process_sendme(cc) < 0) {
+      return false;
+    }
+    *package_window = congestion_control_get_package_window(cc);
+    return true;
+  }
+
+  if ((*package_window + CIRCWINDOW_INCREMENT) > CIRCWINDOW_START_MAX) {
+    return false;
+  }
+  *package_window += CIRCWINDOW_INCREMENT;
+  return true;
+}
+
 /* Process a circuit-level SENDME cell that we just received. The layer_hint,
  * if not NULL, is the Exit hop of the connection which means that we are a
  * client. In that case, circ must be an origin circuit. The cell_body_len is
@@ -475,15 +521,14 @@ sendme_process_circuit_level(crypt_path_t *layer_hint,
     if (BUG(layer_hint == NULL)) {
       return -END_CIRC_REASON_TORPROTOCOL;
     }
-    if ((layer_hint->package_window + CIRCWINDOW_INCREMENT) >
-        CIRCWINDOW_START_MAX) {
+    if (!package_window_note_sendme(layer_hint->ccontrol,
+                                    &layer_hint->package_window)) {
       static struct ratelim_t exit_warn_ratelim = RATELIM_INIT(600);
       log_fn_ratelim(&exit_warn_ratelim, LOG_WARN, LD_PROTOCOL,
                      "Unexpected sendme cell from exit relay. "
                      "Closing circ.");
       return -END_CIRC_REASON_TORPROTOCOL;
     }
-    layer_hint->package_window += CIRCWINDOW_INCREMENT;
     log_debug(LD_APP, "circ-level sendme at origin, packagewindow %d.",
               layer_hint->package_window);
 
@@ -493,15 +538,14 @@ sendme_process_circuit_level(crypt_path_t *layer_hint,
   } else {
     /* We aren't the origin of this circuit so we are the Exit and thus we
      * track the package window with the circuit object. */
-    if ((circ->package_window + CIRCWINDOW_INCREMENT) >
-        CIRCWINDOW_START_MAX) {
+    if (!package_window_note_sendme(circ->ccontrol,
+                                    &circ->package_window)) {
       static struct ratelim_t client_warn_ratelim = RATELIM_INIT(600);
       log_fn_ratelim(&client_warn_ratelim, LOG_PROTOCOL_WARN, LD_PROTOCOL,
                      "Unexpected sendme cell from client. "
                      "Closing circ (window %d).", circ->package_window);
       return -END_CIRC_REASON_TORPROTOCOL;
     }
-    circ->package_window += CIRCWINDOW_INCREMENT;
     log_debug(LD_EXIT, "circ-level sendme at non-origin, packagewindow %d.",
               circ->package_window);
   }
@@ -525,6 +569,14 @@ sendme_process_stream_level(edge_connection_t *conn, circuit_t *circ,
   tor_assert(conn);
   tor_assert(circ);
 
+  /* Streams that use XON/XOFF have no stream-level window to credit. */
+  if (edge_uses_flow_control(conn)) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Unexpected stream sendme cell on a stream that uses XON/XOFF. "
+           "Closing circ.");
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+
   /* Don't allow the other endpoint to request more than our maximum (i.e.
    * initial) stream SENDME window worth of data. Well-behaved stock clients
    * will not request more than this max (as per the check in the while loop
@@ -577,14 +629,36 @@ sendme_circuit_data_received(circuit_t *circ, crypt_path_t *layer_hint)
 }
 
 /* Called when a relay DATA cell is received for the given edge connection
- * conn. Update the deliver window and return its new value. */
+ * conn. Update the deliver window and return its new value. Streams that use
+ * XON/XOFF flow control don't have a deliver window: it never changes, unless
+ * the other end ignores our XOFF, in which case we return -1. */
 int
 sendme_stream_data_received(edge_connection_t *conn)
 {
   tor_assert(conn);
+  if (edge_uses_flow_control(conn)) {
+    if (flow_control_xoff_ignored(conn))
+      return -1;
+    return conn->deliver_window;
+  }
   return --conn->deliver_window;
 }
 
+/* Debit the circuit-level package window <b>package_window</b> for a DATA
+ * cell that we just packaged, through the congestion control state
+ * <b>cc</b> if we have one. */
+static void
+package_window_note_cell_packaged(congestion_control_t *cc,
+                                  int *package_window)
+{
+  if (cc) {
+    congestion_control_note_cell_sent(cc);
+    *package_window = congestion_control_get_package_window(cc);
+  } else {
+    --*package_window;
+  }
+}
+
 /* Called when a relay DATA cell is packaged on the given circuit. If
  * layer_hint is NULL, this means we are the Exit end point else we are the
  * Client. Update the package window and return its new value. */
@@ -598,13 +672,14 @@ sendme_note_circuit_data_packaged(circuit_t *circ, crypt_path_t *layer_hint)
   if (CIRCUIT_IS_ORIGIN(circ)) {
     /* Client side. */
     tor_assert(layer_hint);
-    --layer_hint->package_window;
+    package_window_note_cell_packaged(layer_hint->ccontrol,
+                                      &layer_hint->package_window);
     package_window = layer_hint->package_window;
     domain = LD_APP;
   } else {
     /* Exit side. */
     tor_assert(!layer_hint);
-    --circ->package_window;
+    package_window_note_cell_packaged(circ->ccontrol, &circ->package_window);
     package_window = circ->package_window;
     domain = LD_EXIT;
   }
@@ -614,12 +689,17 @@ sendme_note_circuit_data_packaged(circuit_t *circ, crypt_path_t *layer_hint)
 }
 
 /* Called when a relay DATA cell is packaged for the given edge connection
- * conn. Update the package window and return its new value. */
+ * conn. Update the package window and return its new value. Streams that use
+ * XON/XOFF flow control don't have a package window: it never changes. */
 int
 sendme_note_stream_data_packaged(edge_connection_t *conn)
 {
   tor_assert(conn);
 
+  if (edge_uses_flow_control(conn)) {
+    return conn->package_window;
+  }
+
   --conn->package_window;
   log_debug(LD_APP, "Stream package_window now %d.", conn->package_window);
   return conn->package_window;
@@ -631,20 +711,14 @@ sendme_note_stream_data_packaged(edge_connection_t *conn)
 void
 sendme_record_cell_digest_on_circ(circuit_t *circ, crypt_path_t *cpath)
 {
-  int package_window;
   uint8_t *sendme_digest;
 
   tor_assert(circ);
 
-  package_window = circ->package_window;
-  if (cpath) {
-    package_window = cpath->package_window;
-  }
-
   /* Is this the last cell before a SENDME? The idea is that if the
    * package_window reaches a multiple of the increment, after this cell, we
    * should expect a SENDME. */
-  if (!circuit_sendme_cell_is_next(package_window)) {
+  if (!package_window_sendme_is_next(circ, cpath, 0)) {
     return;
   }
 
@@ -688,12 +762,24 @@ sendme_record_received_cell_digest(circuit_t *circ, crypt_path_t *cpath)
  * match the digests. */
 void
 sendme_record_sending_cell_digest(circuit_t *circ, crypt_path_t *cpath)
+{
+  sendme_record_sending_cell_digest_in_batch(circ, cpath, 0);
+}
+
+/* Same as sendme_record_sending_cell_digest() but for the <b>idx</b>-th cell
+ * of a batch of cells that are encrypted together before any of them is
+ * queued. Every cell of the batch must count against the package window
+ * which is only decremented once the cells are queued, so the window as seen
+ * by this cell is <b>idx</b> cells lower than the current one. */
+void
+sendme_record_sending_cell_digest_in_batch(circuit_t *circ,
+                                           crypt_path_t *cpath, int idx)
 {
   tor_assert(circ);
+  tor_assert(idx >= 0);
 
   /* Only record if the next cell is expected to be a SENDME. */
-  if (!circuit_sendme_cell_is_next(cpath ? cpath->package_window :
-                                           circ->package_window)) {
+  if (!package_window_sendme_is_next(circ, cpath, idx)) {
     goto end;
   }
 
@@ -39,6 +39,8 @@ void sendme_record_cell_digest_on_circ(circuit_t *circ, crypt_path_t *cpath);
 /* Record cell digest as the SENDME digest. */
 void sendme_record_received_cell_digest(circuit_t *circ, crypt_path_t *cpath);
 void sendme_record_sending_cell_digest(circuit_t *circ, crypt_path_t *cpath);
+void sendme_record_sending_cell_digest_in_batch(circuit_t *circ,
+                                                crypt_path_t *cpath, int idx);
 
 /* Private section starts. */
 #ifdef SENDME_PRIVATE
@@ -14,6 +14,13 @@
 #include "lib/fs/storagedir.h"
 #include "lib/encoding/confline.h"
 
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #define CCE_MAGIC 0x17162253
 
 #ifdef _WIN32
@@ -457,6 +464,39 @@ consensus_cache_entry_get_body(const consensus_cache_entry_t *ent,
   return 0;
 }
 
+/**
+ * Open the file that holds the body of <b>ent</b> for reading.  On success,
+ * return its file descriptor, and set *<b>offset_out</b> to the offset of
+ * the body within that file.  On failure return -1.
+ *
+ * The body of <b>ent</b> must already be loaded: see
+ * consensus_cache_entry_get_body().  The caller must close the file.
+ */
+int
+consensus_cache_entry_open_body(const consensus_cache_entry_t *ent,
+                                off_t *offset_out)
+{
+  struct stat st;
+  int fd;
+
+  if (BUG(ent->magic != CCE_MAGIC))
+    return -1; // LCOV_EXCL_LINE
+  if (! ent->map || ! ent->in_cache)
+    return -1;
+
+  fd = storage_dir_open_for_reading(ent->in_cache->dir, ent->fname);
+  if (fd < 0)
+    return -1;
+  /* Make sure that this is still the file that we have mapped. */
+  if (fstat(fd, &st) < 0 || (uint64_t)st.st_size != ent->map->size) {
+    close(fd);
+    return -1;
+  }
+
+  *offset_out = (off_t)(ent->body - (const uint8_t *)ent->map->data);
+  return fd;
+}
+
 /**
  * Unmap every mmap'd element of <b>cache</b> that has been unused
  * since <b>cutoff</b>.
@@ -65,6 +65,8 @@ void consensus_cache_entry_mark_for_aggressive_release(
 int consensus_cache_entry_get_body(const consensus_cache_entry_t *ent,
                                    const uint8_t **body_out,
                                    size_t *sz_out);
+int consensus_cache_entry_open_body(const consensus_cache_entry_t *ent,
+                                    off_t *offset_out);
 
 #ifdef TOR_UNIT_TESTS
 int consensus_cache_entry_is_mapped(consensus_cache_entry_t *ent);
@@ -32,6 +32,21 @@ connection_dirserv_flushed_some(dir_connection_t *conn)
 }
 ENABLE_GCC_WARNING("-Wmissing-noreturn")
 
+int
+connection_dirserv_sendfile_pending(const dir_connection_t *conn)
+{
+  (void) conn;
+  return 0;
+}
+
+int
+connection_dirserv_sendfile_some(dir_connection_t *conn, size_t max_bytes)
+{
+  (void) conn;
+  (void) max_bytes;
+  return 0;
+}
+
 void
 dir_conn_clear_spool(dir_connection_t *conn)
 {
@@ -26,6 +26,19 @@
 
 #include "lib/compress/compress.h"
 
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+/** Defined if we can send the bodies of consensus cache entries straight
+ * from their files to the network with sendfile(). */
+#define USE_SENDFILE
+#endif
+
 /**
  * \file dirserv.c
  * \brief Directory server core implementation. Manages directory
@@ -312,6 +325,7 @@ spooled_resource_new(dir_spool_source_t source,
 {
   spooled_resource_t *spooled = tor_malloc_zero(sizeof(spooled_resource_t));
   spooled->spool_source = source;
+  spooled->cce_fd = -1;
   switch (source) {
     case DIR_SPOOL_NETWORKSTATUS:
       spooled->spool_eagerly = 0;
@@ -347,6 +361,7 @@ spooled_resource_new_from_cache_entry(consensus_cache_entry_t *entry)
   spooled_resource_t *spooled = tor_malloc_zero(sizeof(spooled_resource_t));
   spooled->spool_source = DIR_SPOOL_CONSENSUS_CACHE_ENTRY;
   spooled->spool_eagerly = 0;
+  spooled->cce_fd = -1;
   consensus_cache_entry_incref(entry);
   spooled->consensus_cache_entry = entry;
 
@@ -376,6 +391,10 @@ spooled_resource_free_(spooled_resource_t *spooled)
     consensus_cache_entry_decref(spooled->consensus_cache_entry);
   }
 
+  if (spooled->cce_fd >= 0) {
+    close(spooled->cce_fd);
+  }
+
   tor_free(spooled);
 }
 
@@ -444,6 +463,31 @@ spooled_resource_estimate_size(const spooled_resource_t *spooled,
   }
 }
 
+#ifdef USE_SENDFILE
+/** Return true iff we should send the body of <b>spooled</b>, a consensus
+ * cache entry, to <b>conn</b> with sendfile() rather than through the
+ * outbuf of <b>conn</b>.  Open the file that holds the body if we need to.
+ *
+ * We only do this on plain directory connections with a socket of their own,
+ * when we don't compress the data on the fly: the bodies that we send are
+ * already compressed as needed. */
+static int
+spooled_resource_use_sendfile(spooled_resource_t *spooled,
+                              dir_connection_t *conn)
+{
+  if (spooled->cce_fd >= 0)
+    return 1;
+  if (!SOCKET_OK(TO_CONN(conn)->s) || TO_CONN(conn)->linked ||
+      conn->compress_state)
+    return 0;
+
+  spooled->cce_fd =
+    consensus_cache_entry_open_body(spooled->consensus_cache_entry,
+                                    &spooled->cce_fd_offset);
+  return spooled->cce_fd >= 0;
+}
+#endif /* defined(USE_SENDFILE) */
+
 /** Return code for spooled_resource_flush_some */
 typedef enum {
   SRFS_ERR = -1,
@@ -493,6 +537,15 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
     if (BUG(!cached && !cce))
       return SRFS_DONE;
 
+#ifdef USE_SENDFILE
+    if (cce && spooled_resource_use_sendfile(spooled, conn)) {
+      /* connection_dirserv_sendfile_some() does the actual sending. */
+      if (spooled->cached_dir_offset >= (off_t)spooled->cce_len)
+        return SRFS_DONE;
+      return SRFS_MORE;
+    }
+#endif /* defined(USE_SENDFILE) */
+
     int64_t total_len;
     const char *ptr;
     if (cached) {
@@ -781,6 +834,77 @@ connection_dirserv_flushed_some(dir_connection_t *conn)
   return 0;
 }
 
+/** Return the resource at the head of the spool of <b>conn</b> if we are
+ * sending its body with sendfile(), and it has bytes left to send. Return
+ * NULL otherwise. */
+static spooled_resource_t *
+connection_dirserv_get_sendfile_resource(const dir_connection_t *conn)
+{
+  spooled_resource_t *spooled;
+
+  if (!conn->spool || !smartlist_len(conn->spool))
+    return NULL;
+  spooled = smartlist_get(conn->spool, smartlist_len(conn->spool)-1);
+  if (spooled->cce_fd < 0 ||
+      spooled->cached_dir_offset >= (off_t)spooled->cce_len)
+    return NULL;
+  return spooled;
+}
+
+/** Return true iff <b>conn</b> has bytes to send with sendfile(), in
+ * addition to the ones on its outbuf. */
+int
+connection_dirserv_sendfile_pending(const dir_connection_t *conn)
+{
+  return connection_dirserv_get_sendfile_resource(conn) != NULL;
+}
+
+/** Send up to <b>max_bytes</b> from the file of the resource that we are
+ * sending to <b>conn</b> with sendfile(), straight to the socket of
+ * <b>conn</b>.  Call this only once the outbuf of <b>conn</b> is empty.
+ * Return the number of bytes sent, 0 if there was nothing to send or if
+ * sending would block, and -1 on error.
+ */
+int
+connection_dirserv_sendfile_some(dir_connection_t *conn, size_t max_bytes)
+{
+  spooled_resource_t *spooled =
+    connection_dirserv_get_sendfile_resource(conn);
+  if (!spooled || !max_bytes)
+    return 0;
+  tor_assert(connection_get_outbuf_len(TO_CONN(conn)) == 0);
+
+#ifdef USE_SENDFILE
+  size_t remaining = spooled->cce_len - (size_t)spooled->cached_dir_offset;
+  off_t offset = spooled->cce_fd_offset + spooled->cached_dir_offset;
+  ssize_t r;
+
+  if (max_bytes > remaining)
+    max_bytes = remaining;
+  if (max_bytes > INT_MAX)
+    max_bytes = INT_MAX;
+
+  r = sendfile(TO_CONN(conn)->s, spooled->cce_fd, &offset, max_bytes);
+  if (r < 0) {
+    int e = tor_socket_errno(TO_CONN(conn)->s);
+    if (ERRNO_IS_EAGAIN(e))
+      return 0;
+    log_info(LD_DIRSERV, "sendfile() failed: %s", tor_socket_strerror(e));
+    return -1;
+  } else if (r == 0) {
+    /* The file is shorter than it was when we mapped it. */
+    log_warn(LD_BUG, "Reached the end of a consensus cache file early.");
+    return -1;
+  }
+  spooled->cached_dir_offset += r;
+  return (int)r;
+#else /* !defined(USE_SENDFILE) */
+  /* We never open files to send when we can't use sendfile(). */
+  tor_assert_nonfatal_unreached();
+  return -1;
+#endif /* defined(USE_SENDFILE) */
+}
+
 /** Remove every element from <b>conn</b>'s outgoing spool, and delete
  * the spool. */
 void
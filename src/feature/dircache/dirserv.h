@@ -69,9 +69,18 @@ typedef struct spooled_resource_t {
    * The current offset into cached_dir or cce_body. Only used when
    * spool_eagerly is false */
   off_t cached_dir_offset;
+  /**
+   * A file descriptor open on the file that holds cce_body, if we send
+   * cce_body with sendfile(); -1 otherwise. */
+  int cce_fd;
+  /** The offset of cce_body within the file at cce_fd. */
+  off_t cce_fd_offset;
 } spooled_resource_t;
 
 int connection_dirserv_flushed_some(dir_connection_t *conn);
+int connection_dirserv_sendfile_pending(const dir_connection_t *conn);
+int connection_dirserv_sendfile_some(dir_connection_t *conn,
+                                     size_t max_bytes);
 
 enum dir_spool_source_t;
 int dir_split_resource_into_spoolable(const char *resource,
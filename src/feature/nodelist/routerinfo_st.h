@@ -58,6 +58,9 @@ struct routerinfo_t {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit on IPv4?  NULL for 'reject *:*'. */
+  /** For our own routerinfo only: <b>exit_policy</b>, compiled for fast
+   * lookups, or NULL if we didn't compile it. */
+  struct compiled_addr_policy_t *compiled_exit_policy;
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
@@ -45,6 +45,21 @@
  * resolve, by calling connection_exit_connect() if the client sent a
  * RELAY_BEGIN cell, and by calling send_resolved_cell() or
  * send_hostname_cell() if the client sent a RELAY_RESOLVE cell.
+ *
+ * Streams that ask for an address that we are already looking up wait for
+ * that lookup instead of launching their own, and a single lookup asks for
+ * both the A and the AAAA records of an address. When a cached answer has
+ * served a few streams and is about to expire, we look the address up again
+ * in the background (see cached_resolve_wants_refresh()), so that popular
+ * names don't take a miss every time their TTL runs out. Failures are cached
+ * too, but not for as long as answers.
+ *
+ * The cache is kept within ServerDNSCacheMaxSize bytes, if that is set, and
+ * gives memory back when the relay runs low on it (dns_cache_handle_oom()).
+ * Either way, we evict the cached answers that no stream has used for the
+ * longest time first, using the CLOCK approximation of LRU: a hit only sets
+ * a bit in the entry, and the hand of the clock clears those bits as it goes
+ * around looking for an entry to evict.
  **/
 
 #define DNS_PRIVATE
@@ -66,6 +81,7 @@
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/evloop/compat_libevent.h"
 #include "lib/sandbox/sandbox.h"
+#include "lib/time/compat_time.h"
 
 #include "core/or/edge_connection_st.h"
 #include "core/or/or_circuit_st.h"
@@ -83,6 +99,18 @@
  * that the resolver is wedged? */
 #define RESOLVE_MAX_TIMEOUT 300
 
+/** A cached answer that has been given to at least this many streams is
+ * worth looking up again before it expires. */
+#define DNS_PREFETCH_MIN_HITS 3
+/** We look a popular cached answer up again once it is in the last
+ * 1/DNS_PREFETCH_WINDOW_DIVISOR of its time in the cache. */
+#define DNS_PREFETCH_WINDOW_DIVISOR 10
+/** How long do we cache the news that an address doesn't exist? */
+#define DNS_NEGATIVE_TTL 60
+/** How long do we cache a transient failure?  Only long enough to fail the
+ * streams that arrive together, rather than launching a lookup for each. */
+#define DNS_TRANSIENT_ERR_TTL 10
+
 /** Our evdns_base; this structure handles all our name lookups. */
 static struct evdns_base *the_evdns_base = NULL;
 
@@ -128,6 +156,13 @@ static uint64_t n_ipv6_timeouts = 0;
 /** Global: Do we think that IPv6 DNS is broken? */
 static int dns_is_broken_for_ipv6 = 0;
 
+/** Counters for the DNS cache; see dns_get_stats(). */
+static dns_stats_t dns_stats;
+
+/** Number of bytes held by all the cached_resolve_t objects that exist,
+ * wherever they are, and by the hostnames of their PTR answers. */
+static size_t dns_cache_entries_bytes = 0;
+
 /** Function to compare hashed resolves on their addresses; used to
  * implement hash tables. */
 static inline int
@@ -268,6 +303,20 @@ has_dns_init_failed(void)
   return nameserver_config_failed;
 }
 
+/** Return a new PENDING cached_resolve_t for <b>address</b>. */
+static cached_resolve_t *
+cached_resolve_new(const char *address)
+{
+  cached_resolve_t *resolve = tor_malloc_zero(sizeof(cached_resolve_t));
+  resolve->magic = CACHED_RESOLVE_MAGIC;
+  resolve->state = CACHE_STATE_PENDING;
+  resolve->minheap_idx = -1;
+  resolve->clock_idx = -1;
+  strlcpy(resolve->address, address, sizeof(resolve->address));
+  dns_cache_entries_bytes += sizeof(cached_resolve_t);
+  return resolve;
+}
+
 /** Helper: free storage held by an entry in the DNS cache. */
 static void
 free_cached_resolve_(cached_resolve_t *r)
@@ -279,8 +328,12 @@ free_cached_resolve_(cached_resolve_t *r)
     r->pending_connections = victim->next;
     tor_free(victim);
   }
-  if (r->res_status_hostname == RES_STATUS_DONE_OK)
+  free_cached_resolve_(r->refresh);
+  if (r->res_status_hostname == RES_STATUS_DONE_OK) {
+    dns_cache_entries_bytes -= strlen(r->result_ptr.hostname) + 1;
     tor_free(r->result_ptr.hostname);
+  }
+  dns_cache_entries_bytes -= sizeof(cached_resolve_t);
   r->magic = 0xFF00FF00;
   tor_free(r);
 }
@@ -318,6 +371,7 @@ cached_resolve_add_answer(cached_resolve_t *resolve,
 
     if (dns_result == DNS_ERR_NONE && answer_hostname) {
       resolve->result_ptr.hostname = tor_strdup(answer_hostname);
+      dns_cache_entries_bytes += strlen(answer_hostname) + 1;
       resolve->res_status_hostname = RES_STATUS_DONE_OK;
     } else {
       resolve->result_ptr.err_hostname = dns_result;
@@ -364,6 +418,64 @@ cached_resolve_have_all_answers(const cached_resolve_t *resolve)
           resolve->res_status_hostname != RES_STATUS_INFLIGHT);
 }
 
+/** Return true iff at least one of the lookups for <b>resolve</b> gave us an
+ * answer. */
+static int
+cached_resolve_has_answer(const cached_resolve_t *resolve)
+{
+  return (resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
+          resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
+          resolve->res_status_hostname == RES_STATUS_DONE_OK);
+}
+
+/** Return true iff at least one of the lookups for <b>resolve</b> failed
+ * with a transient error. */
+static int
+cached_resolve_has_transient_error(const cached_resolve_t *resolve)
+{
+  return (resolve->res_status_ipv4 == RES_STATUS_DONE_ERR &&
+          evdns_err_is_transient(resolve->result_ipv4.err_ipv4)) ||
+         (resolve->res_status_ipv6 == RES_STATUS_DONE_ERR &&
+          evdns_err_is_transient(resolve->result_ipv6.err_ipv6)) ||
+         (resolve->res_status_hostname == RES_STATUS_DONE_ERR &&
+          evdns_err_is_transient(resolve->result_ptr.err_hostname));
+}
+
+/** Return how many seconds we should keep the completed lookups of
+ * <b>resolve</b> in the cache.
+ *
+ * Answers are kept for the clipped value of their lowest TTL. Failures are
+ * kept for a short fixed time: the TTL that comes with them is usually the
+ * SOA minimum of the zone, which can be hours. */
+STATIC uint32_t
+cached_resolve_get_cache_ttl(const cached_resolve_t *resolve)
+{
+  uint32_t ttl = UINT32_MAX;
+
+  if (!cached_resolve_has_answer(resolve)) {
+    if (cached_resolve_has_transient_error(resolve))
+      return DNS_TRANSIENT_ERR_TTL;
+    return DNS_NEGATIVE_TTL;
+  }
+
+  if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
+       resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_ipv4 < ttl)
+    ttl = resolve->ttl_ipv4;
+
+  if ((resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
+       resolve->res_status_ipv6 == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_ipv6 < ttl)
+    ttl = resolve->ttl_ipv6;
+
+  if ((resolve->res_status_hostname == RES_STATUS_DONE_OK ||
+       resolve->res_status_hostname == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_hostname < ttl)
+    ttl = resolve->ttl_hostname;
+
+  return clip_dns_ttl(ttl);
+}
+
 /** Set an expiry time for a cached_resolve_t, and add it to the expiry
  * priority queue */
 static void
@@ -379,6 +491,109 @@ set_expiry(cached_resolve_t *resolve, time_t expires)
                        resolve);
 }
 
+/** The CACHED resolves, in the order in which the hand of the eviction
+ * clock goes past them. */
+static smartlist_t *cached_resolve_clock = NULL;
+/** Index in cached_resolve_clock of the next resolve that the hand of the
+ * eviction clock will look at. */
+static int cached_resolve_clock_hand = 0;
+
+/** Add the CACHED resolve <b>resolve</b> to the eviction clock. It has to
+ * be used by a stream before it gets a second chance. */
+static void
+cached_resolve_clock_add(cached_resolve_t *resolve)
+{
+  tor_assert(resolve->clock_idx == -1);
+  if (!cached_resolve_clock)
+    cached_resolve_clock = smartlist_new();
+  resolve->clock_idx = smartlist_len(cached_resolve_clock);
+  resolve->clock_referenced = 0;
+  smartlist_add(cached_resolve_clock, resolve);
+}
+
+/** Remove <b>resolve</b> from the eviction clock, if it is there. The last
+ * resolve of the clock takes its place. */
+static void
+cached_resolve_clock_remove(cached_resolve_t *resolve)
+{
+  cached_resolve_t *last;
+  const int idx = resolve->clock_idx;
+
+  if (idx < 0 || !cached_resolve_clock)
+    return;
+  tor_assert(smartlist_get(cached_resolve_clock, idx) == resolve);
+
+  last = smartlist_pop_last(cached_resolve_clock);
+  if (last != resolve) {
+    smartlist_set(cached_resolve_clock, idx, last);
+    last->clock_idx = idx;
+  }
+  resolve->clock_idx = -1;
+  if (cached_resolve_clock_hand >= smartlist_len(cached_resolve_clock))
+    cached_resolve_clock_hand = 0;
+}
+
+/** Remove the CACHED resolve <b>resolve</b> from the cache, and free it. */
+static void
+cached_resolve_evict(cached_resolve_t *resolve)
+{
+  cached_resolve_t *removed;
+
+  tor_assert(resolve->state == CACHE_STATE_CACHED);
+  removed = HT_REMOVE(cache_map, &cache_root, resolve);
+  tor_assert(removed == resolve);
+  smartlist_pqueue_remove(cached_resolve_pqueue,
+                          compare_cached_resolves_by_expiry_,
+                          offsetof(cached_resolve_t, minheap_idx),
+                          resolve);
+  cached_resolve_clock_remove(resolve);
+  free_cached_resolve_(resolve);
+}
+
+/** Move the hand of the eviction clock until it finds a CACHED resolve that
+ * no stream has used since the hand last went past it, and evict that
+ * resolve. Return 0 if the cache had nothing to evict, and 1 otherwise. */
+STATIC int
+cached_resolve_clock_evict_one(void)
+{
+  cached_resolve_t *resolve;
+
+  if (!cached_resolve_clock || smartlist_len(cached_resolve_clock) == 0)
+    return 0;
+
+  /* This ends after at most one full turn of the clock, since we clear the
+   * bits as we go. */
+  while (1) {
+    resolve = smartlist_get(cached_resolve_clock, cached_resolve_clock_hand);
+    if (!resolve->clock_referenced)
+      break;
+    resolve->clock_referenced = 0;
+    if (++cached_resolve_clock_hand >= smartlist_len(cached_resolve_clock))
+      cached_resolve_clock_hand = 0;
+  }
+
+  log_debug(LD_EXIT, "Evicting cached resolve for %s.",
+            escaped_safe_str(resolve->address));
+  cached_resolve_evict(resolve);
+  ++dns_stats.n_evicted;
+  return 1;
+}
+
+/** If ServerDNSCacheMaxSize is set, evict cached resolves until the DNS
+ * cache fits in it. */
+static void
+dns_cache_enforce_budget(void)
+{
+  const uint64_t max_size = get_options()->ServerDNSCacheMaxSize;
+
+  if (!max_size)
+    return;
+  while (dns_cache_total_allocation() > max_size) {
+    if (!cached_resolve_clock_evict_one())
+      break;
+  }
+}
+
 /** Free all storage held in the DNS cache and related structures. */
 void
 dns_free_all(void)
@@ -400,6 +615,9 @@ dns_free_all(void)
   HT_CLEAR(cache_map, &cache_root);
   smartlist_free(cached_resolve_pqueue);
   cached_resolve_pqueue = NULL;
+  smartlist_free(cached_resolve_clock);
+  cached_resolve_clock = NULL;
+  cached_resolve_clock_hand = 0;
   tor_free(resolv_conf_fname);
 }
 
@@ -470,15 +688,13 @@ purge_expired_resolves(time_t now)
                 removed ? removed->address : "NULL", (void*)removed);
       }
       tor_assert(removed == resolve);
+      cached_resolve_clock_remove(resolve);
     } else {
       /* This should be in state DONE. Make sure it's not in the cache. */
       cached_resolve_t *tmp = HT_FIND(cache_map, &cache_root, resolve);
       tor_assert(tmp != resolve);
     }
-    if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
-      tor_free(resolve->result_ptr.hostname);
-    resolve->magic = 0xF0BBF0BB;
-    tor_free(resolve);
+    free_cached_resolve_(resolve);
   }
 
   assert_cache_ok();
@@ -555,6 +771,17 @@ send_resolved_cell,(edge_connection_t *conn, uint8_t answer_type,
   connection_edge_send_command(conn, RELAY_COMMAND_RESOLVED, buf, buflen);
 }
 
+/** Answer the RESOLVE request of <b>conn</b> with an error of type
+ * <b>answer_type</b>, which must be RESOLVED_TYPE_ERROR or
+ * RESOLVED_TYPE_ERROR_TRANSIENT, without looking anything up. */
+void
+dns_send_resolved_error_cell(edge_connection_t *conn, uint8_t answer_type)
+{
+  tor_assert(answer_type == RESOLVED_TYPE_ERROR ||
+             answer_type == RESOLVED_TYPE_ERROR_TRANSIENT);
+  send_resolved_cell(conn, answer_type, NULL);
+}
+
 /** Send a response to the RESOLVE request of a connection for an in-addr.arpa
  * address on connection <b>conn</b> which yielded the result <b>hostname</b>.
  * The answer type will be RESOLVED_HOSTNAME.
@@ -681,6 +908,42 @@ dns_resolve(edge_connection_t *exitconn)
   return r;
 }
 
+/** Return true iff we should look up the address of the CACHED resolve
+ * <b>resolve</b> again now, at <b>now</b>, so that we have a fresh answer
+ * for it before this one expires. We only do that for answers (not
+ * failures) that enough streams have asked for. */
+STATIC int
+cached_resolve_wants_refresh(const cached_resolve_t *resolve, time_t now)
+{
+  tor_assert(resolve->state == CACHE_STATE_CACHED);
+
+  if (resolve->refresh || resolve->n_hits < DNS_PREFETCH_MIN_HITS)
+    return 0;
+  if (!cached_resolve_has_answer(resolve))
+    return 0;
+  return resolve->expire - now <=
+         (time_t) (resolve->cache_ttl / DNS_PREFETCH_WINDOW_DIVISOR);
+}
+
+/** Launch a new lookup for the address of the CACHED resolve
+ * <b>resolve</b>. Until the answers come back, streams keep getting the
+ * answer we already have; see cached_resolve_finish_refresh(). */
+static void
+cached_resolve_launch_refresh(cached_resolve_t *resolve)
+{
+  cached_resolve_t *refresh = cached_resolve_new(resolve->address);
+
+  log_debug(LD_EXIT, "Refreshing cached answer for %s.",
+            escaped_safe_str(resolve->address));
+  resolve->refresh = refresh;
+  if (launch_resolve(refresh) < 0) {
+    resolve->refresh = NULL;
+    free_cached_resolve_(refresh);
+    return;
+  }
+  ++dns_stats.n_prefetches;
+}
+
 /** Helper function for dns_resolve: same functionality, but does not handle:
  *     - marking connections on error and clearing their on_circuit
  *     - linking connections to n_streams/resolving_streams,
@@ -789,6 +1052,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
         pending_connection->next = resolve->pending_connections;
         resolve->pending_connections = pending_connection;
         *made_connection_pending_out = 1;
+        ++dns_stats.n_coalesced;
         log_debug(LD_EXIT,"Connection (fd "TOR_SOCKET_T_FORMAT") waiting "
                   "for pending DNS resolve of %s", exitconn->base_.s,
                   escaped_safe_str(exitconn->base_.address));
@@ -800,6 +1064,16 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
                   escaped_safe_str(resolve->address));
 
         *resolve_out = resolve;
+        resolve->clock_referenced = 1;
+
+        if (cached_resolve_has_answer(resolve)) {
+          ++dns_stats.n_hits;
+          ++resolve->n_hits;
+          if (cached_resolve_wants_refresh(resolve, now))
+            cached_resolve_launch_refresh(resolve);
+        } else {
+          ++dns_stats.n_negative_hits;
+        }
 
         return set_exitconn_info_from_resolve(exitconn, resolve, hostname_out);
       case CACHE_STATE_DONE:
@@ -810,11 +1084,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   }
   tor_assert(!resolve);
   /* not there, need to add it */
-  resolve = tor_malloc_zero(sizeof(cached_resolve_t));
-  resolve->magic = CACHED_RESOLVE_MAGIC;
-  resolve->state = CACHE_STATE_PENDING;
-  resolve->minheap_idx = -1;
-  strlcpy(resolve->address, exitconn->base_.address, sizeof(resolve->address));
+  resolve = cached_resolve_new(exitconn->base_.address);
 
   /* add this connection to the pending list */
   pending_connection = tor_malloc_zero(sizeof(pending_connection_t));
@@ -829,6 +1099,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   log_debug(LD_EXIT,"Launching %s.",
             escaped_safe_str(exitconn->base_.address));
   assert_cache_ok();
+  ++dns_stats.n_misses;
 
   return launch_resolve(resolve);
 }
@@ -1109,6 +1380,55 @@ is_test_address(const char *address)
     smartlist_contains_string_case(options->ServerDNSTestAddresses, address);
 }
 
+/** Note that we have all the answers we asked for <b>resolve</b>. */
+static void
+note_resolve_done(const cached_resolve_t *resolve)
+{
+  const uint64_t now_msec = monotime_coarse_absolute_msec();
+
+  if (!resolve->launched_msec)
+    return;
+  ++dns_stats.n_resolves;
+  if (now_msec > resolve->launched_msec)
+    dns_stats.resolve_msec_total += now_msec - resolve->launched_msec;
+}
+
+/** The background lookup for the CACHED resolve <b>resolve</b> is complete:
+ * unless it failed for a transient reason, put its outcome in the cache
+ * instead of <b>resolve</b>. */
+static void
+cached_resolve_finish_refresh(cached_resolve_t *resolve)
+{
+  cached_resolve_t *refresh = resolve->refresh;
+  unsigned int referenced;
+
+  resolve->refresh = NULL;
+  if (!cached_resolve_has_answer(refresh) &&
+      cached_resolve_has_transient_error(refresh)) {
+    /* Keep what we have until it expires. */
+    log_info(LD_EXIT, "Couldn't refresh cached answer for %s.",
+             escaped_safe_str(resolve->address));
+    free_cached_resolve_(refresh);
+    return;
+  }
+
+  /* The refresh keeps the second chance that the old entry had earned. */
+  referenced = resolve->clock_referenced;
+  cached_resolve_evict(resolve);
+
+  refresh->state = CACHE_STATE_CACHED;
+  refresh->cache_ttl = cached_resolve_get_cache_ttl(refresh);
+  assert_resolve_ok(refresh);
+  HT_INSERT(cache_map, &cache_root, refresh);
+  set_expiry(refresh, time(NULL) + refresh->cache_ttl);
+  cached_resolve_clock_add(refresh);
+  refresh->clock_referenced = referenced;
+  ++dns_stats.n_refreshed;
+
+  assert_cache_ok();
+  dns_cache_enforce_budget();
+}
+
 /** Called on the OR side when the eventdns library tells us the outcome of a
  * single DNS resolve: remember the answer, and tell all pending connections
  * about the result of the lookup if the lookup is now done.  (<b>address</b>
@@ -1141,6 +1461,17 @@ dns_found_answer(const char *address, uint8_t query_type,
   }
   assert_resolve_ok(resolve);
 
+  if (resolve->state == CACHE_STATE_CACHED && resolve->refresh) {
+    cached_resolve_t *refresh = resolve->refresh;
+    cached_resolve_add_answer(refresh, query_type, dns_answer,
+                              addr, hostname, ttl);
+    if (cached_resolve_have_all_answers(refresh)) {
+      note_resolve_done(refresh);
+      cached_resolve_finish_refresh(resolve);
+    }
+    return;
+  }
+
   if (resolve->state != CACHE_STATE_PENDING) {
     /* XXXX Maybe update addr? or check addr for consistency? Or let
      * VALID replace FAILED? */
@@ -1157,6 +1488,7 @@ dns_found_answer(const char *address, uint8_t query_type,
                             addr, hostname, ttl);
 
   if (cached_resolve_have_all_answers(resolve)) {
+    note_resolve_done(resolve);
     inform_pending_connections(resolve);
 
     make_pending_resolve_cached(resolve);
@@ -1249,64 +1581,30 @@ inform_pending_connections(cached_resolve_t *resolve)
   }
 }
 
-/** Remove a pending cached_resolve_t from the hashtable, and add a
- * corresponding cached cached_resolve_t.
- *
- * This function is only necessary because of the perversity of our
- * cache timeout code; see inline comment for ideas on eliminating it.
+/** Turn the PENDING cached_resolve_t <b>resolve</b>, which has all its
+ * answers, into a CACHED one, which expires when its answers do.
  **/
 static void
 make_pending_resolve_cached(cached_resolve_t *resolve)
 {
-  cached_resolve_t *removed;
-
-  resolve->state = CACHE_STATE_DONE;
-  removed = HT_REMOVE(cache_map, &cache_root, resolve);
-  if (removed != resolve) {
-    log_err(LD_BUG, "The pending resolve we found wasn't removable from"
-            " the cache. Tried to purge %s (%p); instead got %s (%p).",
-            resolve->address, (void*)resolve,
-            removed ? removed->address : "NULL", (void*)removed);
-  }
-  assert_resolve_ok(resolve);
-  assert_cache_ok();
-  /* The resolve will eventually just hit the time-out in the expiry queue and
-  * expire. See fd0bafb0dedc7e2 for a brief explanation of how this got that
-  * way.  XXXXX we could do better!*/
-
-  {
-    cached_resolve_t *new_resolve = tor_memdup(resolve,
-                                               sizeof(cached_resolve_t));
-    uint32_t ttl = UINT32_MAX;
-    new_resolve->expire = 0; /* So that set_expiry won't croak. */
-    if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
-      new_resolve->result_ptr.hostname =
-        tor_strdup(resolve->result_ptr.hostname);
-
-    new_resolve->state = CACHE_STATE_CACHED;
-
-    assert_resolve_ok(new_resolve);
-    HT_INSERT(cache_map, &cache_root, new_resolve);
-
-    if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
-         resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_ipv4 < ttl)
-      ttl = resolve->ttl_ipv4;
-
-    if ((resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
-         resolve->res_status_ipv6 == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_ipv6 < ttl)
-      ttl = resolve->ttl_ipv6;
-
-    if ((resolve->res_status_hostname == RES_STATUS_DONE_OK ||
-         resolve->res_status_hostname == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_hostname < ttl)
-      ttl = resolve->ttl_hostname;
-
-    set_expiry(new_resolve, time(NULL) + clip_dns_ttl(ttl));
+  tor_assert(resolve->state == CACHE_STATE_PENDING);
+  tor_assert(!resolve->pending_connections);
+
+  if (resolve->minheap_idx >= 0) {
+    smartlist_pqueue_remove(cached_resolve_pqueue,
+                            compare_cached_resolves_by_expiry_,
+                            offsetof(cached_resolve_t, minheap_idx),
+                            resolve);
   }
+  resolve->expire = 0; /* So that set_expiry won't croak. */
+  resolve->state = CACHE_STATE_CACHED;
+  resolve->cache_ttl = cached_resolve_get_cache_ttl(resolve);
+  set_expiry(resolve, time(NULL) + resolve->cache_ttl);
+  cached_resolve_clock_add(resolve);
 
+  assert_resolve_ok(resolve);
   assert_cache_ok();
+  dns_cache_enforce_budget();
 }
 
 /** Eventdns helper: return true iff the eventdns result <b>err</b> is
@@ -1726,6 +2024,7 @@ launch_resolve,(cached_resolve_t *resolve))
 
   r = tor_addr_parse_PTR_name(
                             &a, resolve->address, AF_UNSPEC, 0);
+  resolve->launched_msec = monotime_coarse_absolute_msec();
 
   tor_assert(the_evdns_base);
   if (r == 0) {
@@ -2096,6 +2395,11 @@ assert_resolve_ok(cached_resolve_t *resolve)
   if (resolve->state != CACHE_STATE_PENDING) {
     tor_assert(!resolve->pending_connections);
   }
+  if (resolve->refresh) {
+    tor_assert(resolve->state == CACHE_STATE_CACHED);
+    tor_assert(resolve->refresh->state == CACHE_STATE_PENDING);
+    tor_assert(!resolve->refresh->refresh);
+  }
   if (resolve->state == CACHE_STATE_PENDING ||
       resolve->state == CACHE_STATE_DONE) {
 #if 0
@@ -2120,8 +2424,12 @@ dns_cache_entry_count(void)
 size_t
 dns_cache_total_allocation(void)
 {
-  return sizeof(struct cached_resolve_t) * dns_cache_entry_count() +
-         HT_MEM_USAGE(&cache_root);
+  size_t total = dns_cache_entries_bytes + HT_MEM_USAGE(&cache_root);
+  if (cached_resolve_pqueue)
+    total += cached_resolve_pqueue->capacity * sizeof(void *);
+  if (cached_resolve_clock)
+    total += cached_resolve_clock->capacity * sizeof(void *);
+  return total;
 }
 
 /** Log memory information about our internal DNS cache at level 'severity'. */
@@ -2142,35 +2450,36 @@ dump_dns_mem_usage(int severity)
 
 /* Do a round of OOM cleanup on all DNS entries. Return the amount of removed
  * bytes. It is possible that the returned value is lower than min_remove_bytes
- * if the caches get emptied out so the caller should be aware of this. */
+ * if the caches get emptied out so the caller should be aware of this.
+ *
+ * Expired entries go first, and then the cached answers that streams have
+ * used the least recently, so that the answers for popular names stay. */
 size_t
 dns_cache_handle_oom(time_t now, size_t min_remove_bytes)
 {
-  time_t time_inc = 0;
-  size_t total_bytes_removed = 0;
-  size_t current_size = dns_cache_total_allocation();
+  const size_t initial_size = dns_cache_total_allocation();
+  size_t total_bytes_removed;
 
-  do {
-    /* If no DNS entries left, break loop. */
-    if (!dns_cache_entry_count())
-      break;
-
-    /* Get cutoff interval and remove entries. */
-    time_t cutoff = now + time_inc;
-    purge_expired_resolves(cutoff);
-
-    /* Update amount of bytes removed and array size. */
-    size_t bytes_removed = current_size - dns_cache_total_allocation();
-    current_size -= bytes_removed;
-    total_bytes_removed += bytes_removed;
+  purge_expired_resolves(now);
+  total_bytes_removed = initial_size - dns_cache_total_allocation();
 
-    /* Increase time_inc by a reasonable fraction. */
-    time_inc += (MAX_DNS_TTL / 4);
-  } while (total_bytes_removed < min_remove_bytes);
+  while (total_bytes_removed < min_remove_bytes) {
+    if (!cached_resolve_clock_evict_one())
+      break;
+    total_bytes_removed = initial_size - dns_cache_total_allocation();
+  }
 
   return total_bytes_removed;
 }
 
+/** Fill <b>stats_out</b> with the counters of the DNS cache. */
+void
+dns_get_stats(dns_stats_t *stats_out)
+{
+  tor_assert(stats_out);
+  memcpy(stats_out, &dns_stats, sizeof(*stats_out));
+}
+
 #ifdef DEBUG_DNS_CACHE
 /** Exit with an assertion if the DNS cache is corrupt. */
 static void
@@ -2187,6 +2496,12 @@ assert_cache_ok_(void)
     assert_resolve_ok(*resolve);
     tor_assert((*resolve)->state != CACHE_STATE_DONE);
   }
+  if (cached_resolve_clock) {
+    SMARTLIST_FOREACH(cached_resolve_clock, cached_resolve_t *, res, {
+      tor_assert(res->state == CACHE_STATE_CACHED);
+      tor_assert(res->clock_idx == res_sl_idx);
+    });
+  }
   if (!cached_resolve_pqueue)
     return;
 
@@ -2218,4 +2533,5 @@ void
 dns_insert_cache_entry(cached_resolve_t *new_entry)
 {
   HT_INSERT(cache_map, &cache_root, new_entry);
+  dns_cache_entries_bytes += sizeof(cached_resolve_t);
 }
@@ -12,6 +12,28 @@
 #ifndef TOR_DNS_H
 #define TOR_DNS_H
 
+/** Counters for the exit DNS cache. */
+typedef struct dns_stats_t {
+  /** Streams that were given a cached answer. */
+  uint64_t n_hits;
+  /** Streams that were given a cached failure. */
+  uint64_t n_negative_hits;
+  /** Streams for which we had to launch a lookup. */
+  uint64_t n_misses;
+  /** Streams that waited for a lookup launched for another stream. */
+  uint64_t n_coalesced;
+  /** Lookups launched to refresh a popular cached answer. */
+  uint64_t n_prefetches;
+  /** Refresh lookups whose outcome replaced the cached answer. */
+  uint64_t n_refreshed;
+  /** Cached answers thrown away before they expired, to save memory. */
+  uint64_t n_evicted;
+  /** Lookups for which we got all the answers, and the total time it took,
+   * in msec. */
+  uint64_t n_resolves;
+  uint64_t resolve_msec_total;
+} dns_stats_t;
+
 #ifdef HAVE_MODULE_RELAY
 
 int dns_init(void);
@@ -20,6 +42,8 @@ int dns_reset(void);
 void connection_dns_remove(edge_connection_t *conn);
 void assert_connection_edge_not_dns_pending(edge_connection_t *conn);
 int dns_resolve(edge_connection_t *exitconn);
+void dns_send_resolved_error_cell(edge_connection_t *conn,
+                                  uint8_t answer_type);
 int dns_seems_to_be_broken(void);
 int dns_seems_to_be_broken_for_ipv6(void);
 void dns_reset_correctness_checks(void);
@@ -31,6 +55,7 @@ size_t dns_cache_handle_oom(time_t now, size_t min_remove_bytes);
  * need stubs. */
 void dns_free_all(void);
 void dns_launch_correctness_checks(void);
+void dns_get_stats(dns_stats_t *stats_out);
 
 #else /* !defined(HAVE_MODULE_RELAY) */
 
@@ -59,6 +84,9 @@ dns_reset(void)
 {
   return 0;
 }
+#define dns_send_resolved_error_cell(conn, answer_type) \
+  ((void)(conn), (void)(answer_type))
+
 static inline int
 dns_resolve(edge_connection_t *exitconn)
 {
@@ -99,6 +127,11 @@ set_exitconn_info_from_resolve,(edge_connection_t *exitconn,
 MOCK_DECL(STATIC int,
 launch_resolve,(cached_resolve_t *resolve));
 
+STATIC uint32_t cached_resolve_get_cache_ttl(const cached_resolve_t *resolve);
+STATIC int cached_resolve_wants_refresh(const cached_resolve_t *resolve,
+                                        time_t now);
+STATIC int cached_resolve_clock_evict_one(void);
+
 #endif /* defined(DNS_PRIVATE) */
 
 #endif /* !defined(TOR_DNS_H) */
@@ -30,13 +30,13 @@ typedef struct pending_connection_t {
 
 /* Possible states for a cached resolve_t */
 /** We are waiting for the resolver system to tell us an answer here.
- * When we get one, or when we time out, the state of this cached_resolve_t
- * will become "DONE" and we'll possibly add a CACHED
- * entry. This cached_resolve_t will be in the hash table so that we will
- * know not to launch more requests for this addr, but rather to add more
- * connections to the pending list for the addr. */
+ * When we get one, the state of this cached_resolve_t will become "CACHED";
+ * if we give up on it, it will become "DONE". This cached_resolve_t will be
+ * in the hash table so that we will know not to launch more requests for
+ * this addr, but rather to add more connections to the pending list for the
+ * addr. */
 #define CACHE_STATE_PENDING 0
-/** This used to be a pending cached_resolve_t, and we got an answer for it.
+/** This used to be a pending cached_resolve_t, and we gave up on it.
  * Now we're waiting for this cached_resolve_t to expire.  This should
  * have no pending connections, and should not appear in the hash table. */
 #define CACHE_STATE_DONE 1
@@ -98,6 +98,23 @@ typedef struct cached_resolve_t {
   pending_connection_t *pending_connections;
   /** Position of this element in the heap*/
   int minheap_idx;
+  /** For a CACHED resolve: position of this element in the eviction clock,
+   * or -1. */
+  int clock_idx;
+  /** For a CACHED resolve: true iff a stream has used this answer since the
+   * hand of the eviction clock last went past it. */
+  unsigned int clock_referenced : 1;
+  /** How long we decided to keep this answer in the cache, in seconds. */
+  uint32_t cache_ttl;
+  /** How many streams have been given this cached answer. */
+  uint32_t n_hits;
+  /** When we launched the lookups for this resolve, in msec of the coarse
+   * monotonic clock, or 0 if we didn't. */
+  uint64_t launched_msec;
+  /** For a CACHED resolve only: a PENDING resolve, which is not in the hash
+   * table, that looks <b>address</b> up again before this answer expires.
+   * NULL if there is no such lookup in flight. */
+  struct cached_resolve_t *refresh;
 } cached_resolve_t;
 
 #endif /* !defined(TOR_DNS_STRUCTS_H) */
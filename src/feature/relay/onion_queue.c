@@ -21,6 +21,16 @@
  *      them to worker threads.
  *   <li>Expiring onionskins on the relay side if they have waited for
  *     too long.
+ *   <li>Optionally, when the "OnionQueueCoDel" consensus parameter is set,
+ *     managing the queues with CoDel: once onionskins have kept waiting
+ *     for more than a target delay over a whole interval, we drop
+ *     onionskins at an increasing rate until the delay goes back down.
+ *     Those are requests that their clients would likely have given up on
+ *     anyway, and dropping them lets fresher ones through. In that mode,
+ *     we also shed from the sources (channels from relays, addresses of
+ *     clients) that have the most onionskins queued, rather than from
+ *     whoever happens to be at the head of the queue or to arrive when it
+ *     is full.
  * </ul>
  **/
 
@@ -31,19 +41,31 @@
 #include "app/config/config.h"
 #include "core/mainloop/cpuworker.h"
 #include "core/or/circuitlist.h"
+#include "core/or/channel.h"
 #include "core/or/onion.h"
 #include "feature/nodelist/networkstatus.h"
+#include "lib/container/order.h"
+#include "lib/time/compat_time.h"
 
 #include "core/or/or_circuit_st.h"
 
+#include <math.h>
+
+typedef struct onion_queue_source_t onion_queue_source_t;
+
 /** Type for a linked list of circuits that are waiting for a free CPU worker
  * to process a waiting onion handshake. */
 typedef struct onion_queue_t {
   TOR_TAILQ_ENTRY(onion_queue_t) next;
+  /** Link in the list of the entries of the same type from <b>source</b>. */
+  TOR_TAILQ_ENTRY(onion_queue_t) next_from_source;
   or_circuit_t *circ;
   uint16_t handshake_type;
   create_cell_t *onionskin;
-  time_t when_added;
+  /** When we queued this entry, in coarse monotonic milliseconds. */
+  uint64_t when_added_msec;
+  /** Where this onionskin comes from. */
+  onion_queue_source_t *source;
 } onion_queue_t;
 
 /** 5 seconds on the onion queue til we just send back a destroy */
@@ -52,6 +74,61 @@ typedef struct onion_queue_t {
 TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t);
 typedef struct onion_queue_head_t onion_queue_head_t;
 
+/** The onionskins that one source has in the queues. A source is the
+ * channel that a relay sent us its onionskins on, or the address of a
+ * client: a client can open as many channels as it likes. */
+struct onion_queue_source_t {
+  /** Key of this source in ol_sources; see onion_queue_source_key(). */
+  char key[DIGEST_LEN];
+  /** Entries from this source, oldest first, indexed by handshake type. */
+  onion_queue_head_t entries[MAX_ONION_HANDSHAKE_TYPE+1];
+  /** Number of entries of each type in <b>entries</b>. */
+  int n_entries[MAX_ONION_HANDSHAKE_TYPE+1];
+  /** Total number of entries from this source. */
+  int n_total;
+};
+
+/** Map from source key to onion_queue_source_t, for every source that has
+ * at least one onionskin queued. */
+static digestmap_t *ol_sources = NULL;
+
+/** Indexed by handshake type: a source with the most queued onionskins of
+ * that type, or NULL if we don't know which one it is. We only update this
+ * when sources gain entries, so it can lag behind after removals; that is
+ * good enough to pick who to shed from. */
+static onion_queue_source_t *ol_heaviest[MAX_ONION_HANDSHAKE_TYPE+1];
+
+/** CoDel state of one handshake type queue. See RFC 8289. */
+typedef struct onion_queue_codel_t {
+  /** When the queue delay will have stayed above target for a whole
+   * interval, or 0 if it is below target. */
+  uint64_t first_above_time_msec;
+  /** When we drop our next onionskin, in the dropping state. */
+  uint64_t drop_next_msec;
+  /** Number of onionskins we dropped since we entered the dropping state,
+   * and that number when we last left it. */
+  uint32_t count;
+  uint32_t last_count;
+  /** True iff we are in the dropping state. */
+  unsigned int dropping : 1;
+} onion_queue_codel_t;
+
+static onion_queue_codel_t ol_codel[MAX_ONION_HANDSHAKE_TYPE+1];
+
+/** Number of recent queue delays that we keep to compute percentiles. */
+#define ONION_QUEUE_DELAY_SAMPLES 1024
+
+/** Ring of the queue delays, in msec, of the last onionskins that left the
+ * queue for a cpuworker. */
+static uint32_t ol_delay_samples[ONION_QUEUE_DELAY_SAMPLES];
+/** Total number of samples ever written to ol_delay_samples. */
+static uint64_t ol_n_delay_samples = 0;
+
+/** Number of onionskins we dropped, per reason. */
+static uint64_t ol_n_expired = 0;
+static uint64_t ol_n_codel_dropped = 0;
+static uint64_t ol_n_fairness_shed = 0;
+
 /** Array of queues of circuits waiting for CPU workers. An element is NULL
  * if that queue is empty.*/
 static onion_queue_head_t ol_list[MAX_ONION_HANDSHAKE_TYPE+1] =
@@ -66,6 +143,167 @@ static int ol_entries[MAX_ONION_HANDSHAKE_TYPE+1];
 static int num_ntors_per_tap(void);
 static void onion_queue_entry_remove(onion_queue_t *victim);
 
+/** Return true iff we manage the onion queues with CoDel and per-source
+ * fairness. */
+static int
+onion_queue_codel_enabled(void)
+{
+  return networkstatus_get_param(NULL, "OnionQueueCoDel",
+                                 0, 0, 1);
+}
+
+/** Return the CoDel target queue delay, in msec. */
+static uint32_t
+onion_queue_codel_target_msec(void)
+{
+#define DEFAULT_ONION_QUEUE_CODEL_TARGET_MSEC 50
+  return networkstatus_get_param(NULL, "OnionQueueCoDelTarget",
+                                 DEFAULT_ONION_QUEUE_CODEL_TARGET_MSEC,
+                                 1, 10000);
+}
+
+/** Return the CoDel interval, in msec. */
+static uint32_t
+onion_queue_codel_interval_msec(void)
+{
+#define DEFAULT_ONION_QUEUE_CODEL_INTERVAL_MSEC 500
+  return networkstatus_get_param(NULL, "OnionQueueCoDelInterval",
+                                 DEFAULT_ONION_QUEUE_CODEL_INTERVAL_MSEC,
+                                 1, 100000);
+}
+
+/** Set <b>key_out</b> to the key of the source of the onionskins of
+ * <b>circ</b>. */
+static void
+onion_queue_source_key(const or_circuit_t *circ, char *key_out)
+{
+  channel_t *chan = circ->p_chan;
+  tor_addr_t addr;
+
+  memset(key_out, 0, DIGEST_LEN);
+  if (!chan)
+    return;
+  if (channel_is_client(chan) && channel_get_addr_if_possible(chan, &addr)) {
+    /* Clients are whoever they connect from. */
+    key_out[0] = 1;
+    if (tor_addr_family(&addr) == AF_INET6)
+      tor_addr_copy_ipv6_bytes((uint8_t *)key_out + 1, &addr);
+    else
+      set_uint32(key_out + 1, tor_addr_to_ipv4n(&addr));
+  } else {
+    /* A relay forwards onionskins from many clients: only count the ones
+     * it sends on this channel against it. */
+    key_out[0] = 2;
+    set_uint64(key_out + 1, chan->global_identifier);
+  }
+}
+
+/** Link <b>entry</b>, of the circuit <b>circ</b>, to its source. */
+static void
+onion_queue_source_add(onion_queue_t *entry, const or_circuit_t *circ)
+{
+  onion_queue_source_t *source;
+  onion_queue_source_t *heaviest;
+  char key[DIGEST_LEN];
+  uint16_t type = entry->handshake_type;
+  int i;
+
+  if (!ol_sources)
+    ol_sources = digestmap_new();
+
+  onion_queue_source_key(circ, key);
+  source = digestmap_get(ol_sources, key);
+  if (!source) {
+    source = tor_malloc_zero(sizeof(*source));
+    memcpy(source->key, key, DIGEST_LEN);
+    for (i = 0; i <= MAX_ONION_HANDSHAKE_TYPE; ++i)
+      TOR_TAILQ_INIT(&source->entries[i]);
+    digestmap_set(ol_sources, key, source);
+  }
+
+  TOR_TAILQ_INSERT_TAIL(&source->entries[type], entry, next_from_source);
+  ++source->n_entries[type];
+  ++source->n_total;
+  entry->source = source;
+
+  heaviest = ol_heaviest[type];
+  if (!heaviest || source->n_entries[type] > heaviest->n_entries[type])
+    ol_heaviest[type] = source;
+}
+
+/** Unlink <b>entry</b> from its source, and forget the source if that was
+ * its last entry. */
+static void
+onion_queue_source_remove(onion_queue_t *entry)
+{
+  onion_queue_source_t *source = entry->source;
+  uint16_t type = entry->handshake_type;
+  int i;
+
+  if (!source)
+    return;
+
+  TOR_TAILQ_REMOVE(&source->entries[type], entry, next_from_source);
+  --source->n_entries[type];
+  --source->n_total;
+  entry->source = NULL;
+
+  if (source->n_total == 0) {
+    digestmap_remove(ol_sources, source->key);
+    for (i = 0; i <= MAX_ONION_HANDSHAKE_TYPE; ++i) {
+      if (ol_heaviest[i] == source)
+        ol_heaviest[i] = NULL;
+    }
+    tor_free(source);
+  }
+}
+
+/** Return a source with the most queued onionskins of type <b>type</b>, or
+ * NULL if there are none. */
+static onion_queue_source_t *
+onion_queue_get_heaviest_source(uint16_t type)
+{
+  if (!ol_heaviest[type] && ol_sources) {
+    /* We forgot about it: look for it again. */
+    DIGESTMAP_FOREACH(ol_sources, key, onion_queue_source_t *, source) {
+      if (source->n_entries[type] > 0 &&
+          (!ol_heaviest[type] ||
+           source->n_entries[type] > ol_heaviest[type]->n_entries[type]))
+        ol_heaviest[type] = source;
+    } DIGESTMAP_FOREACH_END;
+  }
+  return ol_heaviest[type];
+}
+
+/** Remove <b>victim</b> from the queues, and close its circuit because we
+ * are overloaded. <b>why</b> says what made us drop it, for the logs. */
+static void
+onion_queue_shed(onion_queue_t *victim, const char *why)
+{
+  or_circuit_t *circ = victim->circ;
+
+  onion_queue_entry_remove(victim);
+  log_info(LD_CIRC,
+           "Circuit create request %s; canceling due to overload.", why);
+  if (circ && ! TO_CIRCUIT(circ)->marked_for_close) {
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+  }
+}
+
+/** Return the entry of type <b>type</b> that we should drop first: the
+ * oldest one from the source with the most queued onionskins of that
+ * type, unless no source has more than one, in which case the oldest one of
+ * all. */
+static onion_queue_t *
+onion_queue_pick_victim(uint16_t type)
+{
+  onion_queue_source_t *heaviest = onion_queue_get_heaviest_source(type);
+
+  if (heaviest && heaviest->n_entries[type] > 1)
+    return TOR_TAILQ_FIRST(&heaviest->entries[type]);
+  return TOR_TAILQ_FIRST(&ol_list[type]);
+}
+
 /* XXXX Check lengths vs MAX_ONIONSKIN_{CHALLENGE,REPLY}_LEN.
  *
  * (By which I think I meant, "make sure that no
@@ -135,6 +373,38 @@ have_room_for_onionskin(uint16_t type)
   return 1;
 }
 
+/** The queue of type <b>type</b> is full, and <b>circ</b> wants to add an
+ * onionskin to it. If we manage the queues with CoDel and another source has
+ * clearly more onionskins in that queue than the source of <b>circ</b>,
+ * drop the oldest one from that other source and return true: <b>circ</b>
+ * can take its place. Otherwise, return false. */
+static int
+onion_queue_make_room_fairly(const or_circuit_t *circ, uint16_t type)
+{
+  onion_queue_source_t *heaviest, *ours;
+  char key[DIGEST_LEN];
+  int n_ours = 0;
+
+  if (!onion_queue_codel_enabled())
+    return 0;
+
+  heaviest = onion_queue_get_heaviest_source(type);
+  if (!heaviest)
+    return 0;
+
+  onion_queue_source_key(circ, key);
+  ours = ol_sources ? digestmap_get(ol_sources, key) : NULL;
+  if (ours)
+    n_ours = ours->n_entries[type];
+  if (ours == heaviest || heaviest->n_entries[type] <= n_ours + 1)
+    return 0;
+
+  ++ol_n_fairness_shed;
+  onion_queue_shed(TOR_TAILQ_FIRST(&heaviest->entries[type]),
+                   "came from a source with too many of them");
+  return 1;
+}
+
 /** Add <b>circ</b> to the end of ol_list and return 0, except
  * if ol_list is too long, in which case do nothing and return -1.
  */
@@ -142,7 +412,7 @@ int
 onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 {
   onion_queue_t *tmp;
-  time_t now = time(NULL);
+  uint64_t now = monotime_coarse_absolute_msec();
 
   if (onionskin->handshake_type > MAX_ONION_HANDSHAKE_TYPE) {
     /* LCOV_EXCL_START
@@ -157,9 +427,10 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   tmp->circ = circ;
   tmp->handshake_type = onionskin->handshake_type;
   tmp->onionskin = onionskin;
-  tmp->when_added = now;
+  tmp->when_added_msec = now;
 
-  if (!have_room_for_onionskin(onionskin->handshake_type)) {
+  if (!have_room_for_onionskin(onionskin->handshake_type) &&
+      !onion_queue_make_room_fairly(circ, onionskin->handshake_type)) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
     static ratelim_t last_warned =
       RATELIM_INIT(WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL);
@@ -185,21 +456,16 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 
   circ->onionqueue_entry = tmp;
   TOR_TAILQ_INSERT_TAIL(&ol_list[onionskin->handshake_type], tmp, next);
+  onion_queue_source_add(tmp, circ);
 
   /* cull elderly requests. */
   while (1) {
     onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[onionskin->handshake_type]);
-    if (now - head->when_added < (time_t)ONIONQUEUE_WAIT_CUTOFF)
+    if (now - head->when_added_msec < ONIONQUEUE_WAIT_CUTOFF * 1000)
       break;
 
-    circ = head->circ;
-    circ->onionqueue_entry = NULL;
-    onion_queue_entry_remove(head);
-    log_info(LD_CIRC,
-             "Circuit create request is too old; canceling due to overload.");
-    if (! TO_CIRCUIT(circ)->marked_for_close) {
-      circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
-    }
+    ++ol_n_expired;
+    onion_queue_shed(head, "is too old");
   }
   return 0;
 }
@@ -262,6 +528,83 @@ decide_next_handshake_type(void)
   return ONION_HANDSHAKE_TYPE_TAP;
 }
 
+/** Return the time after <b>t</b> when CoDel should drop its next
+ * onionskin, after having dropped <b>count</b> of them. */
+static uint64_t
+onion_queue_codel_control_law(uint64_t t, uint32_t count)
+{
+  return t + (uint64_t) (onion_queue_codel_interval_msec() / sqrt(count));
+}
+
+/** Return true iff CoDel considers the queue of type <b>type</b> congested,
+ * now that its head entry has waited <b>sojourn_msec</b>. */
+static int
+onion_queue_codel_is_congested(onion_queue_codel_t *codel, uint16_t type,
+                               uint64_t sojourn_msec, uint64_t now)
+{
+  /* A delay under target, or a single waiting onionskin, is fine. */
+  if (sojourn_msec < onion_queue_codel_target_msec() ||
+      ol_entries[type] <= 1) {
+    codel->first_above_time_msec = 0;
+    return 0;
+  }
+  if (codel->first_above_time_msec == 0) {
+    codel->first_above_time_msec = now + onion_queue_codel_interval_msec();
+    return 0;
+  }
+  return now >= codel->first_above_time_msec;
+}
+
+/** Apply CoDel to the queue of type <b>type</b> before we take its head
+ * entry, which has waited <b>sojourn_msec</b>. Return true iff we dropped
+ * an onionskin, in which case the caller should look at the queues
+ * again. */
+static int
+onion_queue_codel_drop(uint16_t type, uint64_t sojourn_msec, uint64_t now)
+{
+  onion_queue_codel_t *codel = &ol_codel[type];
+  int congested = onion_queue_codel_is_congested(codel, type,
+                                                 sojourn_msec, now);
+
+  if (codel->dropping) {
+    if (!congested) {
+      codel->dropping = 0;
+      return 0;
+    }
+    if (now < codel->drop_next_msec)
+      return 0;
+    ++codel->count;
+    codel->drop_next_msec =
+      onion_queue_codel_control_law(codel->drop_next_msec, codel->count);
+  } else {
+    if (!congested)
+      return 0;
+    codel->dropping = 1;
+    /* If we were dropping recently, start again near the rate we had then
+     * rather than from scratch. */
+    if (codel->count > 2 && now - codel->drop_next_msec <
+        16 * (uint64_t) onion_queue_codel_interval_msec())
+      codel->count -= 2;
+    else
+      codel->count = 1;
+    codel->last_count = codel->count;
+    codel->drop_next_msec = onion_queue_codel_control_law(now, codel->count);
+  }
+
+  ++ol_n_codel_dropped;
+  onion_queue_shed(onion_queue_pick_victim(type), "waited for too long");
+  return 1;
+}
+
+/** Remember that an onionskin waited <b>delay_msec</b> in the queue before
+ * we gave it to a cpuworker. */
+static void
+onion_queue_note_delay(uint64_t delay_msec)
+{
+  ol_delay_samples[ol_n_delay_samples++ % ONION_QUEUE_DELAY_SAMPLES] =
+    (uint32_t) MIN(delay_msec, UINT32_MAX);
+}
+
 /** Remove the highest priority item from ol_list[] and return it, or
  * return NULL if the lists are empty.
  */
@@ -269,11 +612,22 @@ or_circuit_t *
 onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
-  uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+  uint16_t handshake_to_choose;
+  onion_queue_t *head;
+  uint64_t now = monotime_coarse_absolute_msec();
+  const int use_codel = onion_queue_codel_enabled();
 
-  if (!head)
-    return NULL; /* no onions pending, we're done */
+  do {
+    handshake_to_choose = decide_next_handshake_type();
+    head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+
+    if (!head)
+      return NULL; /* no onions pending, we're done */
+  } while (use_codel &&
+           onion_queue_codel_drop(handshake_to_choose,
+                                  now - head->when_added_msec, now));
+
+  onion_queue_note_delay(now - head->when_added_msec);
 
   tor_assert(head->circ);
   tor_assert(head->handshake_type <= MAX_ONION_HANDSHAKE_TYPE);
@@ -337,6 +691,7 @@ onion_queue_entry_remove(onion_queue_t *victim)
   }
 
   TOR_TAILQ_REMOVE(&ol_list[victim->handshake_type], victim, next);
+  onion_queue_source_remove(victim);
 
   if (victim->circ)
     victim->circ->onionqueue_entry = NULL;
@@ -362,4 +717,31 @@ clear_pending_onions(void)
     tor_assert(TOR_TAILQ_EMPTY(&ol_list[i]));
   }
   memset(ol_entries, 0, sizeof(ol_entries));
+  memset(ol_codel, 0, sizeof(ol_codel));
+  tor_assert(!ol_sources || digestmap_isempty(ol_sources));
+  digestmap_free(ol_sources, NULL);
+  ol_sources = NULL;
+}
+
+/** Fill <b>out</b> with statistics about the onion queues. */
+void
+onion_queue_get_stats(onion_queue_stats_t *out)
+{
+  uint32_t *samples;
+  int n;
+
+  tor_assert(out);
+  memset(out, 0, sizeof(*out));
+  out->n_expired = ol_n_expired;
+  out->n_codel_dropped = ol_n_codel_dropped;
+  out->n_fairness_shed = ol_n_fairness_shed;
+
+  n = (int) MIN(ol_n_delay_samples, ONION_QUEUE_DELAY_SAMPLES);
+  if (n == 0)
+    return;
+  samples = tor_memdup(ol_delay_samples, n * sizeof(uint32_t));
+  out->delay_msec_p50 = find_nth_uint32(samples, n, (n - 1) * 50 / 100);
+  out->delay_msec_p90 = find_nth_uint32(samples, n, (n - 1) * 90 / 100);
+  out->delay_msec_p99 = find_nth_uint32(samples, n, (n - 1) * 99 / 100);
+  tor_free(samples);
 }
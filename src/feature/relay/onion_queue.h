@@ -20,4 +20,23 @@ int onion_num_pending(uint16_t handshake_type);
 void onion_pending_remove(or_circuit_t *circ);
 void clear_pending_onions(void);
 
+/** Statistics about the onion queues, for the MetricsPort. */
+typedef struct onion_queue_stats_t {
+  /** Percentiles of the time that the last onionskins we handed to the
+   * cpuworkers spent in the queue, in msec. */
+  uint32_t delay_msec_p50;
+  uint32_t delay_msec_p90;
+  uint32_t delay_msec_p99;
+  /** Number of onionskins we dropped because they were older than
+   * ONIONQUEUE_WAIT_CUTOFF. */
+  uint64_t n_expired;
+  /** Number of onionskins that CoDel dropped. */
+  uint64_t n_codel_dropped;
+  /** Number of onionskins we dropped to make room for onionskins from a
+   * source with fewer queued ones. */
+  uint64_t n_fairness_shed;
+} onion_queue_stats_t;
+
+void onion_queue_get_stats(onion_queue_stats_t *out);
+
 #endif /* !defined(TOR_ONION_QUEUE_H) */
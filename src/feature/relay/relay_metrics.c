@@ -0,0 +1,537 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file relay_metrics.c
+ * @brief Relay metrics exposed through the MetricsPort
+ *
+ * Unlike the onion service metrics, which are updated as events happen, most
+ * relay metrics are snapshots of state owned by other subsystems. The store
+ * is therefore emptied and filled again, through the fill_fn of each entry
+ * of base_metrics, every time the MetricsPort is queried.
+ **/
+
+#include "orconfig.h"
+
+#include "core/or/or.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/dos.h"
+#include "core/or/relay.h"
+#include "core/or/scheduler.h"
+#include "feature/relay/dns.h"
+#include "feature/relay/onion_queue.h"
+
+#include "lib/malloc/malloc.h"
+#include "lib/net/buffers_net.h"
+#include "lib/malloc/slab.h"
+#include "lib/container/smartlist.h"
+#include "lib/metrics/metrics_store.h"
+
+#include "feature/relay/relay_metrics.h"
+
+/** Declarations of each fill function for metrics defined in base_metrics. */
+static void fill_cell_pool_used(void);
+static void fill_cell_pool_used_max(void);
+static void fill_cell_pool_bytes(void);
+static void fill_cell_pool_reclaims(void);
+static void fill_kist_runs(void);
+static void fill_kist_syscalls(void);
+static void fill_buf_read_calls(void);
+static void fill_buf_read_bytes(void);
+static void fill_cpuworker_jobs(void);
+static void fill_cpuworker_onionskins(void);
+static void fill_onionskin_usec(void);
+static void fill_onion_queue_delay_msec(void);
+static void fill_onion_queue_drops(void);
+static void fill_dns_cache_lookups(void);
+static void fill_dns_prefetches(void);
+static void fill_dns_resolve_msec(void);
+static void fill_dos_stream_rejects(void);
+
+/** The base metrics that is a static array of metrics added to the metrics
+ * store.
+ *
+ * The key member MUST be also the index of the entry in the array. */
+static const relay_metrics_entry_t base_metrics[] =
+{
+  {
+    .key = RELAY_METRICS_CELL_POOL_USED,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_cell_pool_used),
+    .help = "Number of cells currently allocated from the cell pools",
+    .fill_fn = fill_cell_pool_used,
+  },
+  {
+    .key = RELAY_METRICS_CELL_POOL_USED_MAX,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_cell_pool_used_max),
+    .help = "Highest number of cells ever allocated from the cell pools",
+    .fill_fn = fill_cell_pool_used_max,
+  },
+  {
+    .key = RELAY_METRICS_CELL_POOL_BYTES,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_cell_pool_bytes),
+    .help = "Number of bytes held by the cell pools",
+    .fill_fn = fill_cell_pool_bytes,
+  },
+  {
+    .key = RELAY_METRICS_CELL_POOL_RECLAIMS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_cell_pool_reclaim_total),
+    .help = "Total number of times the cell pools gave memory back",
+    .fill_fn = fill_cell_pool_reclaims,
+  },
+  {
+    .key = RELAY_METRICS_KIST_RUNS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_kist_run_total),
+    .help = "Total number of KIST scheduler runs",
+    .fill_fn = fill_kist_runs,
+  },
+  {
+    .key = RELAY_METRICS_KIST_SYSCALLS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_kist_socket_syscall_total),
+    .help = "Total number of socket info syscalls made and saved by KIST",
+    .fill_fn = fill_kist_syscalls,
+  },
+  {
+    .key = RELAY_METRICS_BUF_READ_CALLS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_buf_read_call_total),
+    .help = "Total number of syscalls made to read into buffers",
+    .fill_fn = fill_buf_read_calls,
+  },
+  {
+    .key = RELAY_METRICS_BUF_READ_BYTES,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_buf_read_bytes_total),
+    .help = "Total number of bytes read into buffers by those syscalls",
+    .fill_fn = fill_buf_read_bytes,
+  },
+  {
+    .key = RELAY_METRICS_CPUWORKER_JOBS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_cpuworker_job_total),
+    .help = "Total number of onionskin jobs answered by the cpuworkers",
+    .fill_fn = fill_cpuworker_jobs,
+  },
+  {
+    .key = RELAY_METRICS_CPUWORKER_ONIONSKINS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_cpuworker_onionskin_total),
+    .help = "Total number of onionskins in the jobs answered by the "
+            "cpuworkers",
+    .fill_fn = fill_cpuworker_onionskins,
+  },
+  {
+    .key = RELAY_METRICS_ONIONSKIN_USEC,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_onionskin_latency_usec),
+    .help = "Average time to process one onionskin, in microseconds",
+    .fill_fn = fill_onionskin_usec,
+  },
+  {
+    .key = RELAY_METRICS_ONION_QUEUE_DELAY_MSEC,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_onion_queue_delay_msec),
+    .help = "Time the last onionskins waited in the onion queue, "
+            "in milliseconds",
+    .fill_fn = fill_onion_queue_delay_msec,
+  },
+  {
+    .key = RELAY_METRICS_ONION_QUEUE_DROPS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_onion_queue_drop_total),
+    .help = "Total number of onionskins dropped from the onion queue",
+    .fill_fn = fill_onion_queue_drops,
+  },
+  {
+    .key = RELAY_METRICS_DNS_CACHE_LOOKUPS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_dns_cache_lookup_total),
+    .help = "Total number of streams that looked up an address in the "
+            "DNS cache",
+    .fill_fn = fill_dns_cache_lookups,
+  },
+  {
+    .key = RELAY_METRICS_DNS_PREFETCHES,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_dns_prefetch_total),
+    .help = "Total number of lookups launched to refresh a cached "
+            "DNS answer",
+    .fill_fn = fill_dns_prefetches,
+  },
+  {
+    .key = RELAY_METRICS_DNS_RESOLVE_MSEC,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_dns_resolve_latency_msec),
+    .help = "Average time to get the answers of a DNS lookup, "
+            "in milliseconds",
+    .fill_fn = fill_dns_resolve_msec,
+  },
+  {
+    .key = RELAY_METRICS_DOS_STREAM_REJECTS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_dos_stream_reject_total),
+    .help = "Total number of times a circuit went over its stream "
+            "creation rate",
+    .fill_fn = fill_dos_stream_rejects,
+  },
+};
+static const size_t num_base_metrics = ARRAY_LENGTH(base_metrics);
+
+/** The only and single store of all the relay metrics. */
+static metrics_store_t *the_store;
+
+/** The list of stores returned by relay_metrics_get_stores(): it only ever
+ * contains the_store. */
+static smartlist_t *the_stores_list;
+
+/** Helper: Add to the store one entry of the metric at <b>key</b> per cell
+ * pool, with the values <b>packed_val</b> and <b>destroy_val</b>. */
+static void
+add_cell_pool_entries(relay_metrics_key_t key, uint64_t packed_val,
+                      uint64_t destroy_val)
+{
+  const relay_metrics_entry_t *rentry = &base_metrics[key];
+  metrics_store_entry_t *sentry;
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("pool", "packed"));
+  metrics_store_entry_update(sentry, (int64_t) packed_val);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("pool", "destroy"));
+  metrics_store_entry_update(sentry, (int64_t) destroy_val);
+}
+
+/** Fill function for the RELAY_METRICS_CELL_POOL_USED metric. */
+static void
+fill_cell_pool_used(void)
+{
+  slab_pool_stats_t packed, destroy;
+  cell_pools_get_stats(&packed, &destroy);
+  add_cell_pool_entries(RELAY_METRICS_CELL_POOL_USED,
+                        packed.n_used, destroy.n_used);
+}
+
+/** Fill function for the RELAY_METRICS_CELL_POOL_USED_MAX metric. */
+static void
+fill_cell_pool_used_max(void)
+{
+  slab_pool_stats_t packed, destroy;
+  cell_pools_get_stats(&packed, &destroy);
+  add_cell_pool_entries(RELAY_METRICS_CELL_POOL_USED_MAX,
+                        packed.n_used_max, destroy.n_used_max);
+}
+
+/** Fill function for the RELAY_METRICS_CELL_POOL_BYTES metric. */
+static void
+fill_cell_pool_bytes(void)
+{
+  slab_pool_stats_t packed, destroy;
+  cell_pools_get_stats(&packed, &destroy);
+  add_cell_pool_entries(RELAY_METRICS_CELL_POOL_BYTES,
+                        packed.n_bytes, destroy.n_bytes);
+}
+
+/** Fill function for the RELAY_METRICS_CELL_POOL_RECLAIMS metric. */
+static void
+fill_cell_pool_reclaims(void)
+{
+  slab_pool_stats_t packed, destroy;
+  cell_pools_get_stats(&packed, &destroy);
+  add_cell_pool_entries(RELAY_METRICS_CELL_POOL_RECLAIMS,
+                        packed.n_reclaims, destroy.n_reclaims);
+}
+
+/** Fill function for the RELAY_METRICS_KIST_RUNS metric. */
+static void
+fill_kist_runs(void)
+{
+  const relay_metrics_entry_t *rentry = &base_metrics[RELAY_METRICS_KIST_RUNS];
+  metrics_store_entry_t *sentry;
+  kist_stats_t stats;
+
+  kist_get_stats(&stats);
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_update(sentry, (int64_t) stats.n_runs);
+}
+
+/** Fill function for the RELAY_METRICS_KIST_SYSCALLS metric. */
+static void
+fill_kist_syscalls(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_KIST_SYSCALLS];
+  metrics_store_entry_t *sentry;
+  kist_stats_t stats;
+
+  kist_get_stats(&stats);
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("state", "made"));
+  metrics_store_entry_update(sentry, (int64_t) stats.n_syscalls);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("state", "saved"));
+  metrics_store_entry_update(sentry, (int64_t) stats.n_syscalls_saved);
+}
+
+/** Fill function for the RELAY_METRICS_BUF_READ_CALLS metric. */
+static void
+fill_buf_read_calls(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_BUF_READ_CALLS];
+  metrics_store_entry_t *sentry;
+  buf_net_stats_t stats;
+
+  buf_net_get_stats(&stats);
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_update(sentry, (int64_t) stats.n_read_calls);
+}
+
+/** Fill function for the RELAY_METRICS_BUF_READ_BYTES metric. */
+static void
+fill_buf_read_bytes(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_BUF_READ_BYTES];
+  metrics_store_entry_t *sentry;
+  buf_net_stats_t stats;
+
+  buf_net_get_stats(&stats);
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_update(sentry, (int64_t) stats.n_bytes_read);
+}
+
+/** Fill function for the RELAY_METRICS_CPUWORKER_JOBS metric. */
+static void
+fill_cpuworker_jobs(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_CPUWORKER_JOBS];
+  metrics_store_entry_t *sentry;
+  cpuworker_onion_stats_t stats;
+
+  cpuworker_get_onion_stats(&stats);
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_update(sentry, (int64_t) stats.n_jobs);
+}
+
+/** Fill function for the RELAY_METRICS_CPUWORKER_ONIONSKINS metric. */
+static void
+fill_cpuworker_onionskins(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_CPUWORKER_ONIONSKINS];
+  metrics_store_entry_t *sentry;
+  cpuworker_onion_stats_t stats;
+
+  cpuworker_get_onion_stats(&stats);
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_update(sentry, (int64_t) stats.n_onionskins);
+}
+
+/** Helper: Add to the store the entries of the
+ * RELAY_METRICS_ONIONSKIN_USEC metric for the handshake type <b>type</b>,
+ * named <b>type_name</b>. */
+static void
+add_onionskin_usec_entries(const cpuworker_onion_stats_t *stats,
+                           uint16_t type, const char *type_name)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_ONIONSKIN_USEC];
+  metrics_store_entry_t *sentry;
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("type", type_name));
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("phase", "worker"));
+  metrics_store_entry_update(sentry, stats->usec_worker[type]);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("type", type_name));
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("phase", "roundtrip"));
+  metrics_store_entry_update(sentry, stats->usec_roundtrip[type]);
+}
+
+/** Fill function for the RELAY_METRICS_ONIONSKIN_USEC metric. */
+static void
+fill_onionskin_usec(void)
+{
+  cpuworker_onion_stats_t stats;
+
+  cpuworker_get_onion_stats(&stats);
+  add_onionskin_usec_entries(&stats, ONION_HANDSHAKE_TYPE_TAP, "tap");
+  add_onionskin_usec_entries(&stats, ONION_HANDSHAKE_TYPE_NTOR, "ntor");
+}
+
+/** Helper: Add to the store one entry of the metric at <b>key</b>, with the
+ * label <b>label_name</b> set to <b>label_value</b> and the value
+ * <b>value</b>. */
+static void
+add_labeled_entry(relay_metrics_key_t key, const char *label_name,
+                  const char *label_value, int64_t value)
+{
+  const relay_metrics_entry_t *rentry = &base_metrics[key];
+  metrics_store_entry_t *sentry;
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label(label_name, label_value));
+  metrics_store_entry_update(sentry, value);
+}
+
+/** Fill function for the RELAY_METRICS_ONION_QUEUE_DELAY_MSEC metric. */
+static void
+fill_onion_queue_delay_msec(void)
+{
+  onion_queue_stats_t stats;
+
+  onion_queue_get_stats(&stats);
+  add_labeled_entry(RELAY_METRICS_ONION_QUEUE_DELAY_MSEC, "quantile", "0.5",
+                    stats.delay_msec_p50);
+  add_labeled_entry(RELAY_METRICS_ONION_QUEUE_DELAY_MSEC, "quantile", "0.9",
+                    stats.delay_msec_p90);
+  add_labeled_entry(RELAY_METRICS_ONION_QUEUE_DELAY_MSEC, "quantile", "0.99",
+                    stats.delay_msec_p99);
+}
+
+/** Fill function for the RELAY_METRICS_ONION_QUEUE_DROPS metric. */
+static void
+fill_onion_queue_drops(void)
+{
+  onion_queue_stats_t stats;
+
+  onion_queue_get_stats(&stats);
+  add_labeled_entry(RELAY_METRICS_ONION_QUEUE_DROPS, "reason", "expired",
+                    (int64_t) stats.n_expired);
+  add_labeled_entry(RELAY_METRICS_ONION_QUEUE_DROPS, "reason", "codel",
+                    (int64_t) stats.n_codel_dropped);
+  add_labeled_entry(RELAY_METRICS_ONION_QUEUE_DROPS, "reason", "fairness",
+                    (int64_t) stats.n_fairness_shed);
+}
+
+/** Fill function for the RELAY_METRICS_DNS_CACHE_LOOKUPS metric. */
+static void
+fill_dns_cache_lookups(void)
+{
+  dns_stats_t stats;
+
+  dns_get_stats(&stats);
+  add_labeled_entry(RELAY_METRICS_DNS_CACHE_LOOKUPS, "result", "hit",
+                    (int64_t) stats.n_hits);
+  add_labeled_entry(RELAY_METRICS_DNS_CACHE_LOOKUPS, "result", "negative_hit",
+                    (int64_t) stats.n_negative_hits);
+  add_labeled_entry(RELAY_METRICS_DNS_CACHE_LOOKUPS, "result", "coalesced",
+                    (int64_t) stats.n_coalesced);
+  add_labeled_entry(RELAY_METRICS_DNS_CACHE_LOOKUPS, "result", "miss",
+                    (int64_t) stats.n_misses);
+}
+
+/** Fill function for the RELAY_METRICS_DNS_PREFETCHES metric. */
+static void
+fill_dns_prefetches(void)
+{
+  dns_stats_t stats;
+
+  dns_get_stats(&stats);
+  add_labeled_entry(RELAY_METRICS_DNS_PREFETCHES, "state", "launched",
+                    (int64_t) stats.n_prefetches);
+  add_labeled_entry(RELAY_METRICS_DNS_PREFETCHES, "state", "refreshed",
+                    (int64_t) stats.n_refreshed);
+}
+
+/** Fill function for the RELAY_METRICS_DNS_RESOLVE_MSEC metric. */
+static void
+fill_dns_resolve_msec(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_DNS_RESOLVE_MSEC];
+  metrics_store_entry_t *sentry;
+  dns_stats_t stats;
+  uint64_t avg = 0;
+
+  dns_get_stats(&stats);
+  if (stats.n_resolves)
+    avg = stats.resolve_msec_total / stats.n_resolves;
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help);
+  metrics_store_entry_update(sentry, (int64_t) avg);
+}
+
+/** Fill function for the RELAY_METRICS_DOS_STREAM_REJECTS metric. */
+static void
+fill_dos_stream_rejects(void)
+{
+  dos_stream_stats_t stats;
+
+  dos_stream_get_stats(&stats);
+  add_labeled_entry(RELAY_METRICS_DOS_STREAM_REJECTS, "defense",
+                    "refuse_stream", (int64_t) stats.n_refused_streams);
+  add_labeled_entry(RELAY_METRICS_DOS_STREAM_REJECTS, "defense",
+                    "close_circuit", (int64_t) stats.n_closed_circuits);
+}
+
+/** Return a list of all the relay metrics stores. This is the
+ * function attached to the .get_metrics() member of the subsys_t. */
+const smartlist_t *
+relay_metrics_get_stores(void)
+{
+  if (BUG(!the_store)) {
+    return NULL;
+  }
+
+  /* Reset the store and fill it again with the current values. */
+  metrics_store_reset(the_store);
+  for (size_t i = 0; i < num_base_metrics; ++i) {
+    if (BUG(base_metrics[i].key != i)) {
+      continue;
+    }
+    base_metrics[i].fill_fn();
+  }
+
+  return the_stores_list;
+}
+
+/** Initialize the relay metrics. */
+void
+relay_metrics_init(void)
+{
+  if (BUG(the_store)) {
+    return;
+  }
+  the_store = metrics_store_new();
+  the_stores_list = smartlist_new();
+  smartlist_add(the_stores_list, the_store);
+}
+
+/** Free the relay metrics store. */
+void
+relay_metrics_free(void)
+{
+  smartlist_free(the_stores_list);
+  metrics_store_free(the_store);
+}
@@ -0,0 +1,76 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file relay_metrics.h
+ * @brief Header for feature/relay/relay_metrics.c
+ **/
+
+#ifndef TOR_FEATURE_RELAY_RELAY_METRICS_H
+#define TOR_FEATURE_RELAY_RELAY_METRICS_H
+
+#include "lib/container/smartlist.h"
+#include "lib/metrics/metrics_common.h"
+
+/** Metrics key for each reported metrics. This key is also used as an index in
+ * the base_metrics array. */
+typedef enum {
+  /** Number of cells in use in each cell pool. */
+  RELAY_METRICS_CELL_POOL_USED = 0,
+  /** Highest number of cells ever in use in each cell pool. */
+  RELAY_METRICS_CELL_POOL_USED_MAX = 1,
+  /** Number of bytes held by each cell pool. */
+  RELAY_METRICS_CELL_POOL_BYTES = 2,
+  /** Number of times each cell pool gave memory back to the allocator. */
+  RELAY_METRICS_CELL_POOL_RECLAIMS = 3,
+  /** Number of KIST scheduler runs. */
+  RELAY_METRICS_KIST_RUNS = 4,
+  /** Number of socket info syscalls made and saved by KIST. */
+  RELAY_METRICS_KIST_SYSCALLS = 5,
+  /** Number of syscalls made to read from sockets into buffers. */
+  RELAY_METRICS_BUF_READ_CALLS = 6,
+  /** Number of bytes read from sockets into buffers. */
+  RELAY_METRICS_BUF_READ_BYTES = 7,
+  /** Number of jobs answered by the cpuworkers. */
+  RELAY_METRICS_CPUWORKER_JOBS = 8,
+  /** Number of onionskins in the jobs answered by the cpuworkers. */
+  RELAY_METRICS_CPUWORKER_ONIONSKINS = 9,
+  /** Average time to process an onionskin, per handshake type. */
+  RELAY_METRICS_ONIONSKIN_USEC = 10,
+  /** Percentiles of the time onionskins spent in the onion queue. */
+  RELAY_METRICS_ONION_QUEUE_DELAY_MSEC = 11,
+  /** Number of onionskins dropped from the onion queue, per reason. */
+  RELAY_METRICS_ONION_QUEUE_DROPS = 12,
+  /** Number of exit DNS cache lookups, per result. */
+  RELAY_METRICS_DNS_CACHE_LOOKUPS = 13,
+  /** Number of lookups launched to refresh a cached DNS answer. */
+  RELAY_METRICS_DNS_PREFETCHES = 14,
+  /** Average time to get the answers of an exit DNS lookup. */
+  RELAY_METRICS_DNS_RESOLVE_MSEC = 15,
+  /** Number of streams and circuits the stream creation DoS mitigation
+   * acted against, per defense. */
+  RELAY_METRICS_DOS_STREAM_REJECTS = 16,
+} relay_metrics_key_t;
+
+/** The metadata of a relay metric. */
+typedef struct relay_metrics_entry_t {
+  /* Metric key used as a static array index. */
+  relay_metrics_key_t key;
+  /* Metric type. */
+  metrics_type_t type;
+  /* Metrics output name. */
+  const char *name;
+  /* Metrics output help comment. */
+  const char *help;
+  /* Update value function. */
+  void (*fill_fn)(void);
+} relay_metrics_entry_t;
+
+/* Init. */
+void relay_metrics_init(void);
+void relay_metrics_free(void);
+
+/* Accessors. */
+const smartlist_t *relay_metrics_get_stores(void);
+
+#endif /* !defined(TOR_FEATURE_RELAY_RELAY_METRICS_H) */
@@ -15,6 +15,7 @@
 #include "feature/relay/dns.h"
 #include "feature/relay/ext_orport.h"
 #include "feature/relay/onion_queue.h"
+#include "feature/relay/relay_metrics.h"
 #include "feature/relay/relay_periodic.h"
 #include "feature/relay/relay_sys.h"
 #include "feature/relay/routerkeys.h"
@@ -26,6 +27,7 @@ static int
 subsys_relay_initialize(void)
 {
   relay_register_periodic_events();
+  relay_metrics_init();
   return 0;
 }
 
@@ -37,6 +39,7 @@ subsys_relay_shutdown(void)
   clear_pending_onions();
   routerkeys_free_all();
   router_free_all();
+  relay_metrics_free();
 }
 
 const struct subsys_fns_t sys_relay = {
@@ -46,4 +49,6 @@ const struct subsys_fns_t sys_relay = {
   .level = RELAY_SUBSYS_LEVEL,
   .initialize = subsys_relay_initialize,
   .shutdown = subsys_relay_shutdown,
+
+  .get_metrics = relay_metrics_get_stores,
 };
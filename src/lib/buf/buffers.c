@@ -376,6 +376,17 @@ buf_get_default_chunk_size(const buf_t *buf)
   return buf->default_chunk_size;
 }
 
+/** Make <b>buf</b> allocate chunks of at least <b>sz</b> bytes, header
+ * included, whenever it needs a new chunk. Chunks that are already
+ * allocated are left alone. */
+void
+buf_set_default_chunk_size(buf_t *buf, size_t sz)
+{
+  tor_assert(sz >= MIN_CHUNK_ALLOC);
+  tor_assert(sz <= MAX_CHUNK_ALLOC);
+  buf->default_chunk_size = sz;
+}
+
 /** Remove all data from <b>buf</b>. */
 void
 buf_clear(buf_t *buf)
@@ -498,6 +509,29 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
   return chunk;
 }
 
+/** Free every chunk of <b>buf</b> after <b>chunk</b>, and make <b>chunk</b>
+ * the new tail of <b>buf</b>.  If <b>chunk</b> is NULL, free every chunk of
+ * <b>buf</b>.  The chunks that we free must not hold any data. */
+void
+buf_free_chunks_after(buf_t *buf, chunk_t *chunk)
+{
+  chunk_t *victim, *next;
+
+  victim = chunk ? chunk->next : buf->head;
+  for (; victim; victim = next) {
+    next = victim->next;
+    tor_assert(victim->datalen == 0);
+    buf_chunk_free_unchecked(victim);
+  }
+  if (chunk) {
+    chunk->next = NULL;
+    buf->tail = chunk;
+  } else {
+    buf->head = buf->tail = NULL;
+  }
+  check();
+}
+
 /** Return the age of the oldest chunk in the buffer <b>buf</b>, in
  * timestamp units.  Requires the current monotonic timestamp as its
  * input <b>now</b>.
@@ -24,6 +24,7 @@ typedef struct buf_t buf_t;
 buf_t *buf_new(void);
 buf_t *buf_new_with_capacity(size_t size);
 size_t buf_get_default_chunk_size(const buf_t *buf);
+void buf_set_default_chunk_size(buf_t *buf, size_t sz);
 void buf_free_(buf_t *buf);
 #define buf_free(b) FREE_AND_NULL(buf_t, buf_free_, (b))
 void buf_clear(buf_t *buf);
@@ -100,6 +101,7 @@ struct buf_t {
 };
 
 chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
+void buf_free_chunks_after(buf_t *buf, chunk_t *chunk);
 /** If a read onto the end of a chunk would be smaller than this number, then
  * just start a new chunk. */
 #define MIN_READ_LEN 8
@@ -13,9 +13,19 @@
  * is a workqueue_entry_t, containing data to process and a function to
  * process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
- * by using an alert_sockets_t object, as implemented in net/alertsock.c.
+ * Every worker thread has its own queues of pending work, protected by its
+ * own lock, so that the workers don't all contend for a single lock.  The
+ * main thread hands new work to an idle worker when there is one, and
+ * informs it with that worker's condition variable; otherwise, it spreads
+ * the work over the busy workers.  A worker that runs out of work takes
+ * ("steals") pending work from the queues of the other workers before it
+ * goes idle.
+ *
+ * The workers inform the main process of completed work by pushing it on a
+ * reply queue, without taking any lock when the compiler supports C11
+ * atomics, and by using an alert_sockets_t object, as implemented in
+ * net/alertsock.c.  Only the first reply of each batch that the main
+ * thread has not yet picked up writes to the alert socket.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
@@ -48,20 +58,24 @@ TOR_TAILQ_HEAD(work_tailq_t, workqueue_entry_t);
 typedef struct work_tailq_t work_tailq_t;
 
 struct threadpool_t {
-  /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+  /** An array of pointers to workerthread_t: one for each worker thread.
+   * It does not change once the threads are running, so that the threads
+   * can look at each other without holding the lock. */
   struct workerthread_t **threads;
 
-  /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
-  tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** Stack of the threads that have run out of work and are waiting for
+   * more, most recently idle last. */
+  struct workerthread_t **idle_threads;
+  /** Number of elements in idle_threads. */
+  int n_idle_threads;
+  /** Index in threads of the thread that gets the next piece of work if
+   * no thread is idle. */
+  int next_thread;
 
   /** The current 'update generation' of the threadpool.  Any thread that is
-   * at an earlier generation needs to run the update function. */
-  unsigned generation;
+   * at an earlier generation needs to run the update function.  It only
+   * changes with the lock held, but threads read it without the lock. */
+  atomic_counter_t generation;
 
   /** Function that should be run for updates on each thread. */
   workqueue_reply_t (*update_fn)(void *, void *);
@@ -75,7 +89,8 @@ struct threadpool_t {
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect all the above fields, but not the work queues of
+   * the threads. */
   tor_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
@@ -93,13 +108,18 @@ struct threadpool_t {
 #define WORKQUEUE_PRIORITY_BITS 2
 
 struct workqueue_entry_t {
-  /** The next workqueue_entry_t that's pending on the same thread or
-   * reply queue. */
+  /** The next workqueue_entry_t that's pending on the same thread. */
   TOR_TAILQ_ENTRY(workqueue_entry_t) next_work;
+  /** The workqueue_entry_t that was put on the same reply queue just
+   * before this one. */
+  struct workqueue_entry_t *next_reply;
   /** The threadpool to which this workqueue_entry_t was assigned. This field
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_t *on_pool;
+  /** The thread on whose queue this entry was put. Another thread may end
+   * up running it. */
+  struct workerthread_t *on_thread;
   /** True iff this entry is waiting for a worker to start processing it. */
   uint8_t pending;
   /** Priority of this entry. */
@@ -113,10 +133,18 @@ struct workqueue_entry_t {
 };
 
 struct replyqueue_t {
+#ifdef HAVE_WORKING_STDATOMIC
+  /** Singly-linked list of answers that the reply queue needs to handle,
+   * most recent first, linked by their next_reply field.  The worker
+   * threads push on it with compare-and-swap, and the main thread takes
+   * the whole list at once. */
+  _Atomic(workqueue_entry_t *) answers;
+#else
   /** Mutex to protect the answers field */
   tor_mutex_t lock;
-  /** Doubly-linked list of answers that the reply queue needs to handle. */
-  TOR_TAILQ_HEAD(, workqueue_entry_t) answers;
+  /** As above, but protected by <b>lock</b>. */
+  workqueue_entry_t *answers;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
 
   /** Mechanism to wake up the main thread when it is receiving answers. */
   alert_sockets_t alert;
@@ -134,9 +162,28 @@ typedef struct workerthread_t {
   /** Reply queue to which we pass our results. */
   replyqueue_t *reply_queue;
   /** The current update generation of this thread */
-  unsigned generation;
+  size_t generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
+
+  /** Mutex to protect <b>work</b>. */
+  tor_mutex_t lock;
+  /** Condition variable that we wait on when we have no work, and which
+   * gets signaled when someone gives us work or an update. */
+  tor_cond_t condition;
+  /** Queues of pending work given to this thread. The queue with priority
+   * <b>p</b> is work[p]. */
+  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** Number of entries in <b>work</b>.  Other threads read it without the
+   * lock, to skip empty queues when they look for work to steal. */
+  atomic_counter_t n_pending;
+  /** True iff this thread is waiting on <b>condition</b>.  Protected by
+   * <b>lock</b>. */
+  unsigned int is_waiting : 1;
+  /** True iff this thread is on the idle_threads stack of its pool.
+   * Protected by the lock of the pool, so it must not share a bit-field
+   * with <b>is_waiting</b>. */
+  unsigned int is_idle;
 } workerthread_t;
 
 static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
@@ -192,14 +239,16 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   workqueue_priority_t prio = ent->priority;
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work[prio], ent, next_work);
+    atomic_counter_sub(&thread->n_pending, 1);
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -207,32 +256,40 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
-
-   must hold lock */
+/** Return true iff any of the queues in <b>work</b> holds an entry. */
 static int
-worker_thread_has_work(workerthread_t *thread)
+work_queues_have_work(work_tailq_t *work)
 {
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
+    if (!TOR_TAILQ_EMPTY(&work[i]))
         return 1;
   }
-  return thread->generation != thread->in_pool->generation;
+  return 0;
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
+/** Return true iff <b>thread</b> needs to run the update function of its
+ * pool before it does any more work. */
+static int
+worker_thread_needs_update(workerthread_t *thread)
+{
+  return thread->generation !=
+    atomic_counter_get(&thread->in_pool->generation);
+}
+
+/** Extract the next workqueue_entry_t from the queues of <b>victim</b> for
+ * <b>thread</b> to run, removing it from the relevant queues and marking it
+ * as non-pending. <b>victim</b> may be <b>thread</b> itself.
  *
- * The caller must hold the lock. */
+ * The caller must hold the lock of <b>victim</b>. */
 static workqueue_entry_t *
-worker_thread_extract_next_work(workerthread_t *thread)
+worker_thread_extract_next_work(workerthread_t *thread,
+                                workerthread_t *victim)
 {
-  threadpool_t *pool = thread->in_pool;
   work_tailq_t *queue = NULL, *this_queue;
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
+    this_queue = &victim->work[i];
     if (!TOR_TAILQ_EMPTY(this_queue)) {
       queue = this_queue;
       if (! crypto_fast_rng_one_in_n(get_thread_fast_rng(),
@@ -251,10 +308,142 @@ worker_thread_extract_next_work(workerthread_t *thread)
 
   workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
   TOR_TAILQ_REMOVE(queue, work, next_work);
+  atomic_counter_sub(&victim->n_pending, 1);
   work->pending = 0;
   return work;
 }
 
+/** Take the next piece of work for <b>thread</b> from the queues of
+ * <b>victim</b>, or return NULL if there is none. */
+static workqueue_entry_t *
+worker_thread_take_work(workerthread_t *thread, workerthread_t *victim)
+{
+  workqueue_entry_t *work = NULL;
+
+  if (victim != thread && atomic_counter_get(&victim->n_pending) == 0)
+    return NULL;
+
+  tor_mutex_acquire(&victim->lock);
+  /* Work that was queued after an update must not run before the update:
+   * check for one with the lock held, since whoever queued that work took
+   * it after moving to the new generation. */
+  if (! worker_thread_needs_update(thread))
+    work = worker_thread_extract_next_work(thread, victim);
+  tor_mutex_release(&victim->lock);
+
+  return work;
+}
+
+/** Return the next piece of work for <b>thread</b>: from its own queues if
+ * they are not empty, or else from those of the other threads.  Return NULL
+ * if there is no work, or if the thread needs to run an update first. */
+static workqueue_entry_t *
+worker_thread_get_work(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_entry_t *work;
+  int i, start;
+
+  work = worker_thread_take_work(thread, thread);
+  if (work || pool->n_threads == 1)
+    return work;
+
+  /* Start at a random thread, so that idle threads don't all go after the
+   * same one. */
+  start = (int) crypto_fast_rng_get_uint(get_thread_fast_rng(),
+                                         pool->n_threads);
+  for (i = 0; i < pool->n_threads; ++i) {
+    workerthread_t *victim = pool->threads[(start + i) % pool->n_threads];
+    if (victim == thread)
+      continue;
+    work = worker_thread_take_work(thread, victim);
+    if (work || worker_thread_needs_update(thread))
+      break;
+  }
+  return work;
+}
+
+/** Put <b>thread</b> on the idle stack of its pool, so that it gets the next
+ * piece of work.  Return true iff it wasn't there yet. */
+static int
+worker_thread_set_idle(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  int was_idle;
+
+  tor_mutex_acquire(&pool->lock);
+  was_idle = thread->is_idle;
+  if (! was_idle) {
+    pool->idle_threads[pool->n_idle_threads++] = thread;
+    thread->is_idle = 1;
+  }
+  tor_mutex_release(&pool->lock);
+
+  return ! was_idle;
+}
+
+/** Take <b>thread</b> off the idle stack of its pool, if it is still
+ * there: it found work on its own, so new work should go to a thread that
+ * has none. */
+static void
+worker_thread_clear_idle(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  int i;
+
+  tor_mutex_acquire(&pool->lock);
+  if (thread->is_idle) {
+    for (i = 0; i < pool->n_idle_threads; ++i) {
+      if (pool->idle_threads[i] == thread)
+        break;
+    }
+    tor_assert(i < pool->n_idle_threads);
+    /* Keep the other threads in the order they went idle. */
+    memmove(&pool->idle_threads[i], &pool->idle_threads[i+1],
+            (pool->n_idle_threads - i - 1) * sizeof(workerthread_t *));
+    --pool->n_idle_threads;
+    thread->is_idle = 0;
+  }
+  tor_mutex_release(&pool->lock);
+}
+
+/** Wait until <b>thread</b> gets some work or an update. */
+static void
+worker_thread_wait(workerthread_t *thread)
+{
+  tor_mutex_acquire(&thread->lock);
+  while (! work_queues_have_work(thread->work) &&
+         ! worker_thread_needs_update(thread)) {
+    thread->is_waiting = 1;
+    int r = tor_cond_wait(&thread->condition, &thread->lock, NULL);
+    thread->is_waiting = 0;
+    if (r < 0) {
+      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+      break;
+    }
+  }
+  tor_mutex_release(&thread->lock);
+}
+
+/** Run the current update function of the pool of <b>thread</b>, and
+ * return its result. */
+static workqueue_reply_t
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  void *arg;
+  workqueue_reply_t (*update_fn)(void*,void*);
+
+  tor_mutex_acquire(&pool->lock);
+  arg = pool->update_args[thread->index];
+  pool->update_args[thread->index] = NULL;
+  update_fn = pool->update_fn;
+  thread->generation = atomic_counter_get(&pool->generation);
+  tor_mutex_release(&pool->lock);
+
+  return update_fn(thread->state, arg);
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -262,58 +451,48 @@ static void
 worker_thread_main(void *thread_)
 {
   workerthread_t *thread = thread_;
-  threadpool_t *pool = thread->in_pool;
   workqueue_entry_t *work;
   workqueue_reply_t result;
+  /* True iff we have put ourselves on the idle stack since we last ran
+   * some work. */
+  int went_idle = 0;
 
-  tor_mutex_acquire(&pool->lock);
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
-
-        tor_mutex_acquire(&pool->lock);
-        continue;
+    if (worker_thread_needs_update(thread)) {
+      if (worker_thread_run_update(thread) != WQ_RPL_REPLY) {
+        return;
       }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
-      tor_mutex_release(&pool->lock);
-
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
-      result = work->fn(thread->state, work->arg);
+      continue;
+    }
 
-      /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
+    work = worker_thread_get_work(thread);
+    if (work == NULL) {
+      /* Once we are on the idle stack, new work comes to us: look once more
+       * for work that was queued elsewhere before that, and then wait. */
+      if (worker_thread_set_idle(thread))
+        went_idle = 1;
+      else
+        worker_thread_wait(thread);
+      continue;
+    }
 
-      /* We may need to exit the thread. */
-      if (result != WQ_RPL_REPLY) {
-        return;
-      }
-      tor_mutex_acquire(&pool->lock);
+    /* If we found this work ourselves after going idle, nobody took us
+     * off the idle stack: do it now, or new work would wait behind it
+     * while other threads sleep. */
+    if (went_idle) {
+      worker_thread_clear_idle(thread);
+      went_idle = 0;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
 
-    /* TODO: support an idle-function */
+    /* We run the work function without holding any lock. */
+    result = work->fn(thread->state, work->arg);
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    /* Queue the reply for the main thread. */
+    queue_reply(thread->reply_queue, work);
+
+    /* We may need to exit the thread. */
+    if (result != WQ_RPL_REPLY) {
+      return;
     }
   }
 }
@@ -323,38 +502,51 @@ worker_thread_main(void *thread_)
 static void
 queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
 {
-  int was_empty;
+  workqueue_entry_t *head;
+
+#ifdef HAVE_WORKING_STDATOMIC
+  head = atomic_load_explicit(&queue->answers, memory_order_relaxed);
+  do {
+    work->next_reply = head;
+  } while (! atomic_compare_exchange_weak_explicit(&queue->answers,
+                                                   &head, work,
+                                                   memory_order_release,
+                                                   memory_order_relaxed));
+#else
   tor_mutex_acquire(&queue->lock);
-  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
+  head = queue->answers;
+  work->next_reply = head;
+  queue->answers = work;
   tor_mutex_release(&queue->lock);
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
 
-  if (was_empty) {
+  /* The main thread takes all the answers at once: only wake it up for the
+   * first one. */
+  if (head == NULL) {
     if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
       /* XXXX complain! */
     }
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate a new worker thread to use state object <b>state</b>, and send
+ * responses to <b>replyqueue</b>.  The caller must start it. */
 static workerthread_t *
 workerthread_new(int32_t lower_priority_chance,
                  void *state, threadpool_t *pool, replyqueue_t *replyqueue)
 {
   workerthread_t *thr = tor_malloc_zero(sizeof(workerthread_t));
+  unsigned i;
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
-
-  if (spawn_func(worker_thread_main, thr) < 0) {
-    //LCOV_EXCL_START
-    tor_assert_nonfatal_unreached();
-    log_err(LD_GENERAL, "Can't launch worker thread.");
-    tor_free(thr);
-    return NULL;
-    //LCOV_EXCL_STOP
+  thr->generation = atomic_counter_get(&pool->generation);
+  tor_mutex_init_for_cond(&thr->lock);
+  tor_cond_init(&thr->condition);
+  atomic_counter_init(&thr->n_pending);
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    TOR_TAILQ_INIT(&thr->work[i]);
   }
 
   return thr;
@@ -389,22 +581,40 @@ threadpool_queue_work_priority(threadpool_t *pool,
                                void (*reply_fn)(void *),
                                void *arg)
 {
+  workerthread_t *thread;
+
   tor_assert(((int)prio) >= WORKQUEUE_PRIORITY_FIRST &&
              ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
+  if (BUG(pool->n_threads == 0))
+    return NULL; // LCOV_EXCL_LINE
 
   workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
   ent->on_pool = pool;
   ent->pending = 1;
   ent->priority = prio;
 
+  /* Give the work to the thread that went idle last, if any: it is the
+   * most likely to still have its state in cache.  Otherwise, spread it
+   * over the busy threads; the first one to run out of work will take
+   * it. */
   tor_mutex_acquire(&pool->lock);
-
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
-
-  tor_cond_signal_one(&pool->condition);
-
+  if (pool->n_idle_threads) {
+    thread = pool->idle_threads[--pool->n_idle_threads];
+    thread->is_idle = 0;
+  } else {
+    thread = pool->threads[pool->next_thread];
+    pool->next_thread = (pool->next_thread + 1) % pool->n_threads;
+  }
   tor_mutex_release(&pool->lock);
 
+  ent->on_thread = thread;
+  tor_mutex_acquire(&thread->lock);
+  TOR_TAILQ_INSERT_TAIL(&thread->work[prio], ent, next_work);
+  atomic_counter_add(&thread->n_pending, 1);
+  if (thread->is_waiting)
+    tor_cond_signal_one(&thread->condition);
+  tor_mutex_release(&thread->lock);
+
   return ent;
 }
 
@@ -461,12 +671,17 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_args = new_args;
   pool->free_update_arg_fn = free_fn;
   pool->update_fn = fn;
-  ++pool->generation;
-
-  tor_cond_signal_all(&pool->condition);
+  atomic_counter_add(&pool->generation, 1);
 
   tor_mutex_release(&pool->lock);
 
+  for (i = 0; i < n_threads; ++i) {
+    workerthread_t *thread = pool->threads[i];
+    tor_mutex_acquire(&thread->lock);
+    tor_cond_signal_one(&thread->condition);
+    tor_mutex_release(&thread->lock);
+  }
+
   if (old_args) {
     for (i = 0; i < n_threads; ++i) {
       if (old_args[i] && old_args_free_fn)
@@ -489,43 +704,46 @@ threadpool_queue_update(threadpool_t *pool,
 #define CHANCE_PERMISSIVE 37
 #define CHANCE_STRICT INT32_MAX
 
-/** Launch threads until we have <b>n</b>. */
+/** Launch <b>n</b> threads. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
+  int i;
+
   if (BUG(n < 0))
     return -1; // LCOV_EXCL_LINE
+  if (BUG(pool->n_threads != 0))
+    return -1; // LCOV_EXCL_LINE
   if (n > MAX_THREADS)
     n = MAX_THREADS;
 
-  tor_mutex_acquire(&pool->lock);
-
-  if (pool->n_threads < n)
-    pool->threads = tor_reallocarray(pool->threads,
-                                     sizeof(workerthread_t*), n);
-
-  while (pool->n_threads < n) {
+  /* The threads look at each other's queues: set all of them up before we
+   * start any. */
+  pool->threads = tor_calloc(n, sizeof(workerthread_t*));
+  pool->idle_threads = tor_calloc(n, sizeof(workerthread_t*));
+  for (i = 0; i < n; ++i) {
     /* For half of our threads, we'll choose lower priorities permissively;
      * for the other half, we'll stick more strictly to higher priorities.
      * This keeps slow low-priority tasks from taking over completely. */
-    int32_t chance = (pool->n_threads & 1) ? CHANCE_STRICT : CHANCE_PERMISSIVE;
+    int32_t chance = (i & 1) ? CHANCE_STRICT : CHANCE_PERMISSIVE;
 
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
     workerthread_t *thr = workerthread_new(chance,
                                            state, pool, pool->reply_queue);
+    thr->index = i;
+    pool->threads[i] = thr;
+  }
+  pool->n_threads = n;
 
-    if (!thr) {
+  for (i = 0; i < n; ++i) {
+    if (spawn_func(worker_thread_main, pool->threads[i]) < 0) {
       //LCOV_EXCL_START
       tor_assert_nonfatal_unreached();
-      pool->free_thread_state_fn(state);
-      tor_mutex_release(&pool->lock);
+      log_err(LD_GENERAL, "Can't launch worker thread.");
       return -1;
       //LCOV_EXCL_STOP
     }
-    thr->index = pool->n_threads;
-    pool->threads[pool->n_threads++] = thr;
   }
-  tor_mutex_release(&pool->lock);
 
   return 0;
 }
@@ -547,11 +765,7 @@ threadpool_new(int n_threads,
   threadpool_t *pool;
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
-  tor_cond_init(&pool->condition);
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
-  }
+  atomic_counter_init(&pool->generation);
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
@@ -561,9 +775,7 @@ threadpool_new(int n_threads,
   if (threadpool_start_threads(pool, n_threads) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
-    tor_cond_uninit(&pool->condition);
-    tor_mutex_uninit(&pool->lock);
-    tor_free(pool);
+    /* We can't free the pool: some of its threads may be running. */
     return NULL;
     //LCOV_EXCL_STOP
   }
@@ -595,8 +807,12 @@ replyqueue_new(uint32_t alertsocks_flags)
     //LCOV_EXCL_STOP
   }
 
+#ifdef HAVE_WORKING_STDATOMIC
+  atomic_init(&rq->answers, NULL);
+#else
   tor_mutex_init(&rq->lock);
-  TOR_TAILQ_INIT(&rq->answers);
+  rq->answers = NULL;
+#endif
 
   return rq;
 }
@@ -656,19 +872,31 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
+  workqueue_entry_t *answers, *work, *next, *in_order = NULL;
+#ifdef HAVE_WORKING_STDATOMIC
+  answers = atomic_exchange_explicit(&queue->answers, NULL,
+                                     memory_order_acquire);
+#else
   tor_mutex_acquire(&queue->lock);
-  while (!TOR_TAILQ_EMPTY(&queue->answers)) {
-    /* lock must be held at this point.*/
-    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
-    TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
-    tor_mutex_release(&queue->lock);
+  answers = queue->answers;
+  queue->answers = NULL;
+  tor_mutex_release(&queue->lock);
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+
+  /* The answers are most recent first: handle them in the order in which
+   * they arrived.  Any answer that arrives from now on will alert us
+   * again. */
+  for (work = answers; work; work = next) {
+    next = work->next_reply;
+    work->next_reply = in_order;
+    in_order = work;
+  }
+
+  for (work = in_order; work; work = next) {
+    next = work->next_reply;
     work->on_pool = NULL;
 
     work->reply_fn(work->arg);
     workqueue_entry_free(work);
-
-    tor_mutex_acquire(&queue->lock);
   }
-
-  tor_mutex_release(&queue->lock);
 }
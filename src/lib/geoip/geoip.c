@@ -15,13 +15,20 @@
  *
  * The geoip lookup tables are implemented as sorted lists of disjoint address
  * ranges, each mapping to a singleton geoip_country_t.  These country objects
- * are also indexed by their names in a hashtable.
+ * are also indexed by their names in a hashtable.  Once a table is loaded, we
+ * build a geoip_index_t over it, so that a lookup only has to search the few
+ * ranges that start in the same /16 as the address.
  *
  * The tables are populated from disk at startup by the geoip_load_file()
  * function.  For more information on the file format they read, see that
  * function.  See the scripts and the README file in src/config for more
  * information about how those files are generated.
  *
+ * Instead of a text file, geoip_load_file() also accepts a binary file made
+ * from one by src/config/geoip-compile.py.  We don't parse those at all: we
+ * map them into memory, and search the mapping directly.  See
+ * geoip_load_binary_file() for their format.
+ *
  * Tor uses GeoIP information in order to implement user requests (such as
  * ExcludeNodes {cc}), and to keep track of how much usage relays are getting
  * for each country.
@@ -36,6 +43,7 @@
 #include "lib/ctime/di_ops.h"
 #include "lib/encoding/binascii.h"
 #include "lib/fs/files.h"
+#include "lib/fs/mmap.h"
 #include "lib/log/escape.h"
 #include "lib/malloc/malloc.h"
 #include "lib/net/address.h" //????
@@ -64,6 +72,41 @@ typedef struct geoip_ipv6_entry_t {
   intptr_t country; /**< An index into geoip_countries */
 } geoip_ipv6_entry_t;
 
+/** A GeoIP table for one address family, kept in a binary file that we have
+ * mapped into memory.  See geoip_load_binary_file() for the format. */
+typedef struct geoip_binary_db_t {
+  /** The mapped file. */
+  tor_mmap_t *map;
+  /** The first of the file's address ranges. */
+  const uint8_t *entries;
+  /** How many address ranges the file has. */
+  uint32_t n_entries;
+  /** How many bytes each address takes: 4 or 16. */
+  size_t addr_len;
+  /** For each country in the file, its index into geoip_countries. */
+  country_t *country_map;
+  /** How many countries the file has. */
+  uint16_t n_countries;
+} geoip_binary_db_t;
+
+/** Number of first-level buckets in a geoip_index_t: one for each value of
+ * the top 16 bits of an address. */
+#define GEOIP_INDEX_N_BUCKETS (1u << 16)
+
+/** A lookup index over a sorted list of geoip_ipv4_entry_t or
+ * geoip_ipv6_entry_t.  Relays look up the country of every client that
+ * connects to them, and a binary search over the whole list, through a
+ * pointer per step, costs far more cache misses than it needs to. */
+typedef struct geoip_index_t {
+  /** For each value <b>p</b> of the top 16 bits of an address, the
+   * position in the list of the first entry whose ip_low starts with
+   * <b>p</b> or more.  The last element is the length of the list. */
+  uint32_t bucket[GEOIP_INDEX_N_BUCKETS + 1];
+  /** The top 32 bits of each entry's ip_low, in list order: all of it for
+   * IPv4. */
+  uint32_t *low32;
+} geoip_index_t;
+
 /** A list of geoip_country_t */
 static smartlist_t *geoip_countries = NULL;
 /** A map from lowercased country codes to their position in geoip_countries.
@@ -76,6 +119,18 @@ static smartlist_t *geoip_ipv4_entries = NULL;
 /** List of all known geoip_ipv6_entry_t, sorted by their respective
  * ip_low values. */
 static smartlist_t *geoip_ipv6_entries = NULL;
+/** Index over geoip_ipv4_entries, or NULL if we haven't built one since we
+ * last changed it. */
+static geoip_index_t *geoip_ipv4_index = NULL;
+/** Index over geoip_ipv6_entries, or NULL if we haven't built one since we
+ * last changed it. */
+static geoip_index_t *geoip_ipv6_index = NULL;
+/** The binary IPv4 GeoIP table, if we loaded one instead of a list of
+ * geoip_ipv4_entry_t. */
+static geoip_binary_db_t *geoip_ipv4_bindb = NULL;
+/** The binary IPv6 GeoIP table, if we loaded one instead of a list of
+ * geoip_ipv6_entry_t. */
+static geoip_binary_db_t *geoip_ipv6_bindb = NULL;
 
 /** SHA1 digest of the IPv4 GeoIP file to include in extra-info
  * descriptors. */
@@ -84,6 +139,18 @@ static char geoip_digest[DIGEST_LEN];
  * descriptors. */
 static char geoip6_digest[DIGEST_LEN];
 
+/** Release all storage held by <b>idx</b>. */
+static void
+geoip_index_free_(geoip_index_t *idx)
+{
+  if (!idx)
+    return;
+  tor_free(idx->low32);
+  tor_free(idx);
+}
+#define geoip_index_free(idx) \
+  FREE_AND_NULL(geoip_index_t, geoip_index_free_, (idx))
+
 /** Return a list of geoip_country_t for all known countries. */
 const smartlist_t *
 geoip_get_countries(void)
@@ -111,20 +178,14 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
-                const char *country)
+/** Return the index in geoip_countries of the 2-letter country code
+ * <b>country</b>, adding it if it isn't there yet. */
+static intptr_t
+geoip_get_or_add_country(const char *country)
 {
   intptr_t idx;
   void *idxplus1_;
 
-  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
-    return;
-  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
-    return;
-
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
   if (!idxplus1_) {
@@ -141,6 +202,23 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, (int)idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  return idx;
+}
+
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
+                const char *country)
+{
+  intptr_t idx;
+
+  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
+    return;
+  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  idx = geoip_get_or_add_country(country);
 
   if (tor_addr_family(low) == AF_INET) {
     geoip_ipv4_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv4_entry_t));
@@ -148,12 +226,14 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     ent->ip_high = tor_addr_to_ipv4h(high);
     ent->country = idx;
     smartlist_add(geoip_ipv4_entries, ent);
+    geoip_index_free(geoip_ipv4_index);
   } else if (tor_addr_family(low) == AF_INET6) {
     geoip_ipv6_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv6_entry_t));
     ent->ip_low = *tor_addr_to_in6_assert(low);
     ent->ip_high = *tor_addr_to_in6_assert(high);
     ent->country = idx;
     smartlist_add(geoip_ipv6_entries, ent);
+    geoip_index_free(geoip_ipv6_index);
   }
 }
 
@@ -302,6 +382,260 @@ init_geoip_countries(void)
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
 }
 
+/** Release all storage held by <b>db</b>, and unmap its file. */
+static void
+geoip_binary_db_free_(geoip_binary_db_t *db)
+{
+  if (!db)
+    return;
+  tor_munmap_file(db->map);
+  tor_free(db->country_map);
+  tor_free(db);
+}
+#define geoip_binary_db_free(db) \
+  FREE_AND_NULL(geoip_binary_db_t, geoip_binary_db_free_, (db))
+
+/** Forget the GeoIP table we have for <b>family</b>, in whichever form we
+ * loaded it, along with its index. */
+static void
+geoip_clear_table(sa_family_t family)
+{
+  if (family == AF_INET) {
+    if (geoip_ipv4_entries) {
+      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
+                        tor_free(e));
+      smartlist_free(geoip_ipv4_entries);
+    }
+    geoip_binary_db_free(geoip_ipv4_bindb);
+    geoip_index_free(geoip_ipv4_index);
+  } else {
+    if (geoip_ipv6_entries) {
+      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
+                        tor_free(e));
+      smartlist_free(geoip_ipv6_entries);
+    }
+    geoip_binary_db_free(geoip_ipv6_bindb);
+    geoip_index_free(geoip_ipv6_index);
+  }
+}
+
+/** Return the big-endian 16-bit value at <b>p</b>. */
+static inline uint16_t
+geoip_get_be16(const uint8_t *p)
+{
+  return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+/** Return the big-endian 32-bit value at <b>p</b>. */
+static inline uint32_t
+geoip_get_be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+    ((uint32_t)p[2] << 8) | p[3];
+}
+
+/** Magic string at the start of a binary GeoIP file. */
+#define GEOIP_BINARY_MAGIC "TORGEOIP"
+#define GEOIP_BINARY_MAGIC_LEN 8
+/** The only version of the binary GeoIP format we know. */
+#define GEOIP_BINARY_VERSION 1
+/** Length of the header of a binary GeoIP file. */
+#define GEOIP_BINARY_HEADER_LEN 40
+
+/** Try to load the binary GeoIP table for <b>family</b> from
+ * <b>filename</b>.  Return 0 if we loaded it, -1 if it is a binary GeoIP
+ * file that we can't use, or 1 if it isn't a binary GeoIP file at all.
+ *
+ * A binary GeoIP file has a 40-byte header, a table of countries, and a
+ * table of address ranges.  All integers are big-endian.  The header is:
+ *   8 bytes: "TORGEOIP"
+ *   1 byte: the format version, 1.
+ *   1 byte: the address family of the file: 4 or 6.
+ *   2 bytes: N_COUNTRIES.
+ *   4 bytes: N_RANGES.
+ *   20 bytes: the SHA1 digest of the text GeoIP file this was made from.
+ *   4 bytes: zero.
+ * Then there are N_COUNTRIES 2-letter country codes, with no separators.
+ * Then there are N_RANGES address ranges, sorted and disjoint, each of
+ * which is the lowest address in the range, the highest address in the
+ * range (both as 4 bytes for IPv4, or 16 bytes for IPv6), and the 2-byte
+ * index of its country in the table of countries.
+ *
+ * We only check the header here: a file with badly ordered ranges gives
+ * wrong answers, but we never read outside the file.
+ */
+static int
+geoip_load_binary_file(sa_family_t family, const char *filename,
+                       int severity)
+{
+  tor_mmap_t *map;
+  const uint8_t *data;
+  geoip_binary_db_t *db = NULL;
+  size_t addr_len = (family == AF_INET) ? 4 : 16;
+  uint16_t n_countries;
+  uint32_t n_entries;
+  uint64_t expected_len;
+  int i;
+
+  map = tor_mmap_file(filename);
+  if (!map)
+    return 1;
+  data = (const uint8_t *) map->data;
+  if (map->size < GEOIP_BINARY_MAGIC_LEN ||
+      fast_memneq(data, GEOIP_BINARY_MAGIC, GEOIP_BINARY_MAGIC_LEN)) {
+    tor_munmap_file(map);
+    return 1;
+  }
+
+  if (map->size < GEOIP_BINARY_HEADER_LEN) {
+    log_fn(severity, LD_GENERAL, "Binary GEOIP file %s is truncated.",
+           filename);
+    goto err;
+  }
+  if (data[8] != GEOIP_BINARY_VERSION) {
+    log_fn(severity, LD_GENERAL, "Binary GEOIP file %s has unknown "
+           "version %d.", filename, data[8]);
+    goto err;
+  }
+  if (data[9] != (family == AF_INET ? 4 : 6)) {
+    log_fn(severity, LD_GENERAL, "Binary GEOIP file %s is not an %s file.",
+           filename, (family == AF_INET) ? "IPv4" : "IPv6");
+    goto err;
+  }
+  n_countries = geoip_get_be16(data + 10);
+  n_entries = geoip_get_be32(data + 12);
+  expected_len = GEOIP_BINARY_HEADER_LEN + 2 * (uint64_t)n_countries +
+    (2 * addr_len + 2) * (uint64_t)n_entries;
+  if (map->size != expected_len) {
+    log_fn(severity, LD_GENERAL, "Binary GEOIP file %s should be %"PRIu64
+           " bytes long, but it is %"PRIu64".", filename, expected_len,
+           (uint64_t)map->size);
+    goto err;
+  }
+
+  if (!geoip_countries)
+    init_geoip_countries();
+  db = tor_malloc_zero(sizeof(geoip_binary_db_t));
+  db->country_map = tor_calloc(n_countries + 1, sizeof(country_t));
+  for (i = 0; i < n_countries; ++i) {
+    const char *cc = (const char *) data + GEOIP_BINARY_HEADER_LEN + 2 * i;
+    char country[3] = { cc[0], cc[1], 0 };
+    if (!TOR_ISALNUM(country[0]) || !TOR_ISALNUM(country[1])) {
+      log_fn(severity, LD_GENERAL, "Binary GEOIP file %s has a bad country "
+             "code %s.", filename, escaped(country));
+      goto err;
+    }
+    db->country_map[i] = (country_t) geoip_get_or_add_country(country);
+  }
+  db->map = map;
+  db->entries = data + GEOIP_BINARY_HEADER_LEN + 2 * n_countries;
+  db->n_entries = n_entries;
+  db->addr_len = addr_len;
+  db->n_countries = n_countries;
+
+  /* The file replaces whatever table we had. */
+  geoip_clear_table(family);
+  if (family == AF_INET) {
+    geoip_ipv4_bindb = db;
+    memcpy(geoip_digest, data + 16, DIGEST_LEN);
+  } else {
+    geoip_ipv6_bindb = db;
+    memcpy(geoip6_digest, data + 16, DIGEST_LEN);
+  }
+
+  log_notice(LD_GENERAL, "Mapped binary GEOIP %s file %s, with %u address "
+             "ranges.", (family == AF_INET) ? "IPv4" : "IPv6", filename,
+             (unsigned) n_entries);
+  return 0;
+
+ err:
+  if (db) {
+    tor_free(db->country_map);
+    tor_free(db);
+  }
+  tor_munmap_file(map);
+  return -1;
+}
+
+/** Return the country index for the big-endian address <b>key</b> in the
+ * binary GeoIP table <b>db</b>, or 0 if no range has it. */
+static int
+geoip_binary_db_lookup(const geoip_binary_db_t *db, const uint8_t *key)
+{
+  const size_t entry_len = 2 * db->addr_len + 2;
+  const uint8_t *entry;
+  uint32_t lo = 0, hi = db->n_entries;
+  uint16_t country;
+
+  /* Find the first range that starts after the address: if the address is
+   * anywhere, it's in the range before that one. */
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (fast_memcmp(db->entries + mid * entry_len, key, db->addr_len) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return 0;
+
+  entry = db->entries + (lo - 1) * entry_len;
+  if (fast_memcmp(key, entry + db->addr_len, db->addr_len) > 0)
+    return 0;
+  country = geoip_get_be16(entry + 2 * db->addr_len);
+  if (country >= db->n_countries)
+    return 0;
+  return db->country_map[country];
+}
+
+/** Build and return a geoip_index_t over <b>entries</b>, a sorted list of
+ * GeoIP entries for <b>family</b>. */
+static geoip_index_t *
+geoip_index_new(const smartlist_t *entries, sa_family_t family)
+{
+  geoip_index_t *idx = tor_malloc_zero(sizeof(geoip_index_t));
+  const uint32_t n = smartlist_len(entries);
+  uint32_t p, pos = 0;
+
+  idx->low32 = tor_calloc(n + 1, sizeof(uint32_t));
+  SMARTLIST_FOREACH_BEGIN(entries, const void *, e) {
+    if (family == AF_INET) {
+      idx->low32[e_sl_idx] = ((const geoip_ipv4_entry_t *)e)->ip_low;
+    } else {
+      const geoip_ipv6_entry_t *ent = e;
+      idx->low32[e_sl_idx] = geoip_get_be32(ent->ip_low.s6_addr);
+    }
+  } SMARTLIST_FOREACH_END(e);
+
+  for (p = 0; p <= GEOIP_INDEX_N_BUCKETS; ++p) {
+    while (pos < n && (idx->low32[pos] >> 16) < p)
+      ++pos;
+    idx->bucket[p] = pos;
+  }
+  return idx;
+}
+
+/** Return the position of the last entry in the list that <b>idx</b>
+ * indexes whose ip_low starts with 32 bits no greater than <b>key32</b>, or
+ * -1 if there is none. */
+static int
+geoip_index_find(const geoip_index_t *idx, uint32_t key32)
+{
+  /* Every entry before this bucket starts below key32, so we only need to
+   * look at the ones in it. */
+  uint32_t lo = idx->bucket[key32 >> 16];
+  uint32_t hi = idx->bucket[(key32 >> 16) + 1];
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (idx->low32[mid] <= key32)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (int)lo - 1;
+}
+
 /** Clear appropriate GeoIP database, based on <b>family</b>, and
  * reload it from the file <b>filename</b>. Return 0 on success, -1 on
  * failure.
@@ -319,15 +653,23 @@ init_geoip_countries(void)
  *
  * It also recognizes, and skips over, blank lines and lines that start
  * with '#' (comments).
+ *
+ * If <b>filename</b> is a binary GeoIP file instead, we map it into memory
+ * and use it as it is: see geoip_load_binary_file().
  */
 int
 geoip_load_file(sa_family_t family, const char *filename, int severity)
 {
   FILE *f;
   crypto_digest_t *geoip_digest_env = NULL;
+  int r;
 
   tor_assert(family == AF_INET || family == AF_INET6);
 
+  r = geoip_load_binary_file(family, filename, severity);
+  if (r <= 0)
+    return r;
+
   if (!(f = tor_fopen_cloexec(filename, "r"))) {
     log_fn(severity, LD_GENERAL, "Failed to open GEOIP file %s.",
            filename);
@@ -336,19 +678,10 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
   if (!geoip_countries)
     init_geoip_countries();
 
+  geoip_clear_table(family);
   if (family == AF_INET) {
-    if (geoip_ipv4_entries) {
-      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv4_entries);
-    }
     geoip_ipv4_entries = smartlist_new();
   } else { /* AF_INET6 */
-    if (geoip_ipv6_entries) {
-      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv6_entries);
-    }
     geoip_ipv6_entries = smartlist_new();
   }
   geoip_digest_env = crypto_digest_new();
@@ -370,10 +703,12 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
    * our extra-info descriptors. */
   if (family == AF_INET) {
     smartlist_sort(geoip_ipv4_entries, geoip_ipv4_compare_entries_);
+    geoip_ipv4_index = geoip_index_new(geoip_ipv4_entries, AF_INET);
     crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
   } else {
     /* AF_INET6 */
     smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
+    geoip_ipv6_index = geoip_index_new(geoip_ipv6_entries, AF_INET6);
     crypto_digest_get_digest(geoip_digest_env, geoip6_digest, DIGEST_LEN);
   }
   crypto_digest_free(geoip_digest_env);
@@ -389,6 +724,31 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
  */
 int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
+{
+  const geoip_ipv4_entry_t *ent;
+  int pos;
+
+  if (geoip_ipv4_bindb) {
+    const uint8_t key[4] = {
+      (uint8_t)(ipaddr >> 24), (uint8_t)(ipaddr >> 16),
+      (uint8_t)(ipaddr >> 8), (uint8_t)ipaddr
+    };
+    return geoip_binary_db_lookup(geoip_ipv4_bindb, key);
+  }
+  if (!geoip_ipv4_index)
+    return geoip_get_country_by_ipv4_bsearch(ipaddr);
+
+  pos = geoip_index_find(geoip_ipv4_index, ipaddr);
+  if (pos < 0)
+    return 0;
+  ent = smartlist_get(geoip_ipv4_entries, pos);
+  return ipaddr <= ent->ip_high ? (int)ent->country : 0;
+}
+
+/** As geoip_get_country_by_ipv4(), but search the whole list of entries,
+ * without using an index. */
+STATIC int
+geoip_get_country_by_ipv4_bsearch(uint32_t ipaddr)
 {
   geoip_ipv4_entry_t *ent;
   if (!geoip_ipv4_entries)
@@ -405,6 +765,39 @@ geoip_get_country_by_ipv4(uint32_t ipaddr)
  */
 int
 geoip_get_country_by_ipv6(const struct in6_addr *addr)
+{
+  const geoip_ipv6_entry_t *ent;
+  uint32_t key32;
+  int pos;
+
+  if (geoip_ipv6_bindb)
+    return geoip_binary_db_lookup(geoip_ipv6_bindb, addr->s6_addr);
+  if (!geoip_ipv6_index)
+    return geoip_get_country_by_ipv6_bsearch(addr);
+
+  key32 = geoip_get_be32(addr->s6_addr);
+  pos = geoip_index_find(geoip_ipv6_index, key32);
+  /* Entries that share our top 32 bits can still start after us. */
+  while (pos >= 0 && geoip_ipv6_index->low32[pos] == key32) {
+    ent = smartlist_get(geoip_ipv6_entries, pos);
+    if (fast_memcmp(ent->ip_low.s6_addr, addr->s6_addr,
+                    sizeof(struct in6_addr)) <= 0)
+      break;
+    --pos;
+  }
+  if (pos < 0)
+    return 0;
+  ent = smartlist_get(geoip_ipv6_entries, pos);
+  if (fast_memcmp(addr->s6_addr, ent->ip_high.s6_addr,
+                  sizeof(struct in6_addr)) > 0)
+    return 0;
+  return (int)ent->country;
+}
+
+/** As geoip_get_country_by_ipv6(), but search the whole list of entries,
+ * without using an index. */
+STATIC int
+geoip_get_country_by_ipv6_bsearch(const struct in6_addr *addr)
 {
   geoip_ipv6_entry_t *ent;
 
@@ -461,9 +854,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_entries != NULL || geoip_ipv4_bindb != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_entries != NULL || geoip_ipv6_bindb != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -489,16 +882,8 @@ clear_geoip_db(void)
   }
 
   strmap_free(country_idxplus1_by_lc_code, NULL);
-  if (geoip_ipv4_entries) {
-    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv4_entries);
-  }
-  if (geoip_ipv6_entries) {
-    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv6_entries);
-  }
+  geoip_clear_table(AF_INET);
+  geoip_clear_table(AF_INET6);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
   geoip_ipv4_entries = NULL;
@@ -21,6 +21,8 @@
 #ifdef GEOIP_PRIVATE
 STATIC int geoip_parse_entry(const char *line, sa_family_t family);
 STATIC void clear_geoip_db(void);
+STATIC int geoip_get_country_by_ipv4_bsearch(uint32_t ipaddr);
+STATIC int geoip_get_country_by_ipv6_bsearch(const struct in6_addr *addr);
 #endif /* defined(GEOIP_PRIVATE) */
 
 struct in6_addr;
@@ -0,0 +1,328 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file slab.c
+ * \brief A size-specialized allocator for objects that we allocate and free
+ *   at a high rate, such as cells.
+ *
+ * Objects are carved out of "slabs", each one a single allocation holding a
+ * fixed number of object slots. Every slab keeps a free list of its slots;
+ * the pool keeps its slabs on three lists depending on whether they are
+ * full, partially used, or empty. We always allocate from a partially used
+ * slab when there is one so that the objects in use stay packed in as few
+ * slabs as possible, which lets whole slabs become empty and be given back to
+ * the allocator.
+ *
+ * To keep some memory around for bursts, a pool holds on to up to
+ * <b>max_empty_slabs</b> empty slabs; past that, a slab is freed as soon as
+ * it becomes empty. slab_pool_reclaim() frees empty slabs on demand, for
+ * instance when we are low on memory.
+ *
+ * A slab_pool_t is not thread-safe: each pool must only be used by one
+ * thread at a time.
+ **/
+
+#include "orconfig.h"
+
+#include <string.h>
+
+#include "lib/malloc/slab.h"
+#include "lib/err/torerr.h"
+
+typedef struct slab_t slab_t;
+
+/** Header placed in front of each object slot, so that we can find the slab
+ * that an object belongs to when it is released. The union makes sure that
+ * the object right after it is suitably aligned. */
+typedef union slab_slot_hdr_t {
+  slab_t *slab;
+  void *align_ptr;
+  uint64_t align_u64;
+  double align_dbl;
+} slab_slot_hdr_t;
+
+/** A free object slot: its storage is used to link it in the free list of
+ * its slab. */
+typedef struct slab_free_slot_t {
+  struct slab_free_slot_t *next;
+} slab_free_slot_t;
+
+/** One slab: a header followed by <b>items_per_slab</b> slots. */
+struct slab_t {
+  /** The pool that this slab belongs to. */
+  slab_pool_t *pool;
+  /** Links in the slab list (full, partial or empty) of our pool. */
+  slab_t *next;
+  slab_t *prev;
+  /** First free object in this slab, or NULL if the slab is full. */
+  slab_free_slot_t *free_list;
+  /** Number of slots that were never handed out; they are all at the end of
+   * the slab and aren't on the free list yet. */
+  size_t n_untouched;
+  /** Number of objects of this slab currently in use. */
+  size_t n_used;
+  /** Storage for the object slots. */
+  slab_slot_hdr_t slots[FLEXIBLE_ARRAY_MEMBER];
+};
+
+struct slab_pool_t {
+  /** Size of an object as requested by the user. */
+  size_t item_size;
+  /** Size of a slot: a header plus the object rounded up for alignment. */
+  size_t slot_size;
+  /** Number of slots per slab. */
+  size_t items_per_slab;
+  /** Number of bytes allocated for each slab. */
+  size_t slab_alloc_size;
+  /** How many empty slabs we keep before we start freeing them. */
+  size_t max_empty_slabs;
+
+  /** Slabs with no free slot. */
+  slab_t *full;
+  /** Slabs with some free slots and some used ones. */
+  slab_t *partial;
+  /** Slabs with no slot in use. */
+  slab_t *empty;
+
+  /** Number of slabs on the empty list. */
+  size_t n_empty_slabs;
+
+  /** Usage statistics. */
+  slab_pool_stats_t stats;
+};
+
+/** Remove <b>slab</b> from the list whose head is at <b>head</b>. */
+static void
+slab_list_remove(slab_t **head, slab_t *slab)
+{
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    *head = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->next = slab->prev = NULL;
+}
+
+/** Insert <b>slab</b> at the front of the list whose head is at
+ * <b>head</b>. */
+static void
+slab_list_push(slab_t **head, slab_t *slab)
+{
+  slab->prev = NULL;
+  slab->next = *head;
+  if (*head)
+    (*head)->prev = slab;
+  *head = slab;
+}
+
+/** Return a pointer to the <b>idx</b>th slot of <b>slab</b>. */
+static inline slab_slot_hdr_t *
+slab_get_slot(const slab_pool_t *pool, slab_t *slab, size_t idx)
+{
+  return (slab_slot_hdr_t *)(((char *) slab->slots) + idx * pool->slot_size);
+}
+
+/** Free every slab on the list at <b>head</b>. */
+static void
+slab_list_free_all(slab_t **head)
+{
+  slab_t *slab, *next;
+  for (slab = *head; slab; slab = next) {
+    next = slab->next;
+    tor_free_(slab);
+  }
+  *head = NULL;
+}
+
+/** Return a new pool of objects of <b>item_size</b> bytes each, allocated
+ * from slabs of <b>items_per_slab</b> objects. The pool keeps at most
+ * <b>max_empty_slabs</b> slabs that have no object in use. */
+slab_pool_t *
+slab_pool_new(size_t item_size, size_t items_per_slab, size_t max_empty_slabs)
+{
+  slab_pool_t *pool;
+  const size_t align = sizeof(slab_slot_hdr_t);
+
+  raw_assert(item_size > 0);
+  raw_assert(items_per_slab > 0);
+
+  if (item_size < sizeof(slab_free_slot_t))
+    item_size = sizeof(slab_free_slot_t);
+
+  pool = tor_malloc_zero(sizeof(slab_pool_t));
+  pool->item_size = item_size;
+  pool->slot_size = sizeof(slab_slot_hdr_t) +
+    ((item_size + align - 1) / align) * align;
+  pool->items_per_slab = items_per_slab;
+  pool->slab_alloc_size = offsetof(slab_t, slots) +
+    pool->slot_size * items_per_slab;
+  pool->max_empty_slabs = max_empty_slabs;
+  return pool;
+}
+
+/** Free <b>pool</b> and all the slabs it holds. Every object allocated from
+ * <b>pool</b> becomes invalid. */
+void
+slab_pool_free_(slab_pool_t *pool)
+{
+  if (!pool)
+    return;
+  slab_list_free_all(&pool->full);
+  slab_list_free_all(&pool->partial);
+  slab_list_free_all(&pool->empty);
+  tor_free_(pool);
+}
+
+/** Allocate a new slab for <b>pool</b> and put it on its partial list. */
+static slab_t *
+slab_new(slab_pool_t *pool)
+{
+  slab_t *slab = tor_malloc_(pool->slab_alloc_size);
+  slab->pool = pool;
+  slab->next = slab->prev = NULL;
+  slab->free_list = NULL;
+  slab->n_untouched = pool->items_per_slab;
+  slab->n_used = 0;
+
+  ++pool->stats.n_slabs;
+  pool->stats.n_slots += pool->items_per_slab;
+  pool->stats.n_bytes += pool->slab_alloc_size;
+  return slab;
+}
+
+/** Give <b>slab</b>, which must be empty and on no list, back to the
+ * allocator. */
+static void
+slab_free(slab_pool_t *pool, slab_t *slab)
+{
+  raw_assert(slab->n_used == 0);
+  --pool->stats.n_slabs;
+  pool->stats.n_slots -= pool->items_per_slab;
+  pool->stats.n_bytes -= pool->slab_alloc_size;
+  ++pool->stats.n_slabs_reclaimed;
+  tor_free_(slab);
+}
+
+/** Return a new zeroed object from <b>pool</b>. Never returns NULL. */
+void *
+slab_pool_alloc(slab_pool_t *pool)
+{
+  slab_t *slab;
+  slab_slot_hdr_t *hdr;
+  void *item;
+
+  raw_assert(pool);
+
+  if (pool->partial) {
+    slab = pool->partial;
+  } else if (pool->empty) {
+    slab = pool->empty;
+    slab_list_remove(&pool->empty, slab);
+    --pool->n_empty_slabs;
+    slab_list_push(&pool->partial, slab);
+  } else {
+    slab = slab_new(pool);
+    slab_list_push(&pool->partial, slab);
+  }
+
+  if (slab->free_list) {
+    item = slab->free_list;
+    slab->free_list = slab->free_list->next;
+    hdr = ((slab_slot_hdr_t *) item) - 1;
+  } else {
+    raw_assert(slab->n_untouched > 0);
+    hdr = slab_get_slot(pool, slab,
+                        pool->items_per_slab - slab->n_untouched);
+    --slab->n_untouched;
+    hdr->slab = slab;
+    item = hdr + 1;
+  }
+  raw_assert(hdr->slab == slab);
+
+  if (++slab->n_used == pool->items_per_slab) {
+    slab_list_remove(&pool->partial, slab);
+    slab_list_push(&pool->full, slab);
+  }
+
+  if (++pool->stats.n_used > pool->stats.n_used_max)
+    pool->stats.n_used_max = pool->stats.n_used;
+
+  memset(item, 0, pool->item_size);
+  return item;
+}
+
+/** Return <b>item</b>, which must have been allocated from <b>pool</b>, to
+ * <b>pool</b>. Does nothing if <b>item</b> is NULL. */
+void
+slab_pool_release(slab_pool_t *pool, void *item)
+{
+  slab_slot_hdr_t *hdr;
+  slab_t *slab;
+  slab_free_slot_t *slot;
+
+  raw_assert(pool);
+  if (!item)
+    return;
+
+  hdr = ((slab_slot_hdr_t *) item) - 1;
+  slab = hdr->slab;
+  raw_assert(slab->pool == pool);
+  raw_assert(slab->n_used > 0);
+
+  slot = item;
+  slot->next = slab->free_list;
+  slab->free_list = slot;
+
+  if (slab->n_used-- == pool->items_per_slab) {
+    slab_list_remove(&pool->full, slab);
+    slab_list_push(&pool->partial, slab);
+  }
+  --pool->stats.n_used;
+
+  if (slab->n_used == 0) {
+    slab_list_remove(&pool->partial, slab);
+    if (pool->n_empty_slabs < pool->max_empty_slabs) {
+      slab_list_push(&pool->empty, slab);
+      ++pool->n_empty_slabs;
+    } else {
+      ++pool->stats.n_reclaims;
+      slab_free(pool, slab);
+    }
+  }
+}
+
+/** Give empty slabs of <b>pool</b> back to the allocator until we have at
+ * most <b>n_keep</b> of them left. Return the number of bytes freed. */
+size_t
+slab_pool_reclaim(slab_pool_t *pool, size_t n_keep)
+{
+  size_t freed = 0;
+
+  raw_assert(pool);
+
+  if (pool->n_empty_slabs <= n_keep)
+    return 0;
+
+  while (pool->n_empty_slabs > n_keep) {
+    slab_t *slab = pool->empty;
+    slab_list_remove(&pool->empty, slab);
+    --pool->n_empty_slabs;
+    slab_free(pool, slab);
+    freed += pool->slab_alloc_size;
+  }
+  ++pool->stats.n_reclaims;
+  return freed;
+}
+
+/** Fill <b>out</b> with the usage statistics of <b>pool</b>. */
+void
+slab_pool_get_stats(const slab_pool_t *pool, slab_pool_stats_t *out)
+{
+  raw_assert(pool);
+  raw_assert(out);
+
+  memcpy(out, &pool->stats, sizeof(*out));
+  out->n_empty_slabs = pool->n_empty_slabs;
+}
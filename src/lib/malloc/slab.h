@@ -0,0 +1,53 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file slab.h
+ * \brief Headers for slab.c
+ **/
+
+#ifndef TOR_SLAB_H
+#define TOR_SLAB_H
+
+#include "lib/cc/torint.h"
+#include "lib/malloc/malloc.h"
+#include <stddef.h>
+
+/** A pool of fixed-size objects, carved out of larger "slabs". */
+typedef struct slab_pool_t slab_pool_t;
+
+/** Usage statistics of a slab_pool_t, as returned by
+ * slab_pool_get_stats(). */
+typedef struct slab_pool_stats_t {
+  /** Number of objects handed out and not yet released. */
+  uint64_t n_used;
+  /** Highest value that n_used ever reached. */
+  uint64_t n_used_max;
+  /** Number of object slots, used or not, in all the slabs we hold. */
+  uint64_t n_slots;
+  /** Number of slabs we hold. */
+  uint64_t n_slabs;
+  /** Number of slabs we hold that have no object in use. */
+  uint64_t n_empty_slabs;
+  /** Number of bytes we got from the allocator for our slabs. */
+  uint64_t n_bytes;
+  /** Number of times we gave one or more empty slabs back to the
+   * allocator. */
+  uint64_t n_reclaims;
+  /** Total number of slabs we ever gave back to the allocator. */
+  uint64_t n_slabs_reclaimed;
+} slab_pool_stats_t;
+
+slab_pool_t *slab_pool_new(size_t item_size, size_t items_per_slab,
+                           size_t max_empty_slabs);
+void slab_pool_free_(slab_pool_t *pool);
+#define slab_pool_free(pool) \
+  FREE_AND_NULL(slab_pool_t, slab_pool_free_, (pool))
+
+void *slab_pool_alloc(slab_pool_t *pool);
+void slab_pool_release(slab_pool_t *pool, void *item);
+size_t slab_pool_reclaim(slab_pool_t *pool, size_t n_keep);
+
+void slab_pool_get_stats(const slab_pool_t *pool, slab_pool_stats_t *out);
+
+#endif /* !defined(TOR_SLAB_H) */
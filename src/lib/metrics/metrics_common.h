@@ -41,5 +41,6 @@ typedef struct metrics_gauge_t {
 } metrics_gauge_t;
 
 const char *metrics_type_to_str(const metrics_type_t type);
+const char *metrics_format_label(const char *key, const char *value);
 
 #endif /* !defined(TOR_LIB_METRICS_METRICS_COMMON_H) */
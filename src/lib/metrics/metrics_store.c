@@ -86,6 +86,16 @@ metrics_store_free_(metrics_store_t *store)
   tor_free(store);
 }
 
+/** Remove every entry from the given store so it can be filled again. */
+void
+metrics_store_reset(metrics_store_t *store)
+{
+  tor_assert(store);
+
+  strmap_free(store->entries, metrics_store_free_void);
+  store->entries = strmap_new();
+}
+
 /** Find all metrics entry in the given store identified by name. If not found,
  * NULL is returned. */
 smartlist_t *
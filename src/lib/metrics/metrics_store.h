@@ -25,6 +25,7 @@ void metrics_store_free_(metrics_store_t *store);
 metrics_store_t *metrics_store_new(void);
 
 /* Modifiers. */
+void metrics_store_reset(metrics_store_t *store);
 metrics_store_entry_t *metrics_store_add(metrics_store_t *store,
                                          metrics_type_t type,
                                          const char *name, const char *help);
@@ -21,10 +21,43 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H) && !defined(_WIN32)
+/** Defined if we can flush several chunks of a buffer with one writev()
+ * call. */
+#define USE_WRITEV
+#endif
+#if defined(HAVE_READV) && defined(HAVE_SYS_UIO_H) && !defined(_WIN32)
+/** Defined if we can fill several chunks of a buffer with one readv()
+ * call. */
+#define USE_READV
+#endif
+
+/** Largest number of fresh chunks that we add to a buffer for a single
+ * readv() call, on top of the space left in its tail chunk. */
+#define BUF_READV_MAX_NEW_CHUNKS 2
+
+/** Largest number of chunks that we try to flush with a single writev()
+ * call. */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define BUF_MAX_IOVECS IOV_MAX
+#else
+#define BUF_MAX_IOVECS 64
+#endif
+
+/** Counters for the syscalls that we make to fill and flush buffers. */
+static buf_net_stats_t buf_net_stats;
 
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
@@ -52,6 +85,7 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
     read_result = tor_socket_recv(fd, CHUNK_WRITE_PTR(chunk), at_most, 0);
   else
     read_result = read(fd, CHUNK_WRITE_PTR(chunk), at_most);
+  ++buf_net_stats.n_read_calls;
 
   if (read_result < 0) {
     int e = is_socket ? tor_socket_errno(fd) : errno;
@@ -72,6 +106,7 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
     *reached_eof = 1;
     return 0;
   } else { /* actually got bytes. */
+    buf_net_stats.n_bytes_read += read_result;
     buf->datalen += read_result;
     chunk->datalen += read_result;
     log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
@@ -81,6 +116,90 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
   }
 }
 
+#ifdef USE_READV
+/** Helper for buf_read_from_fd(): read up to <b>at_most</b> bytes from
+ * <b>fd</b> onto the end of <b>buf</b> with a single readv() call, into the
+ * space left in the tail chunk of <b>buf</b> and into up to
+ * BUF_READV_MAX_NEW_CHUNKS fresh chunks.  Fresh chunks that we don't fill are
+ * freed again.  Set *<b>tried_out</b> to the number of bytes we tried to
+ * read.  Otherwise, behave as read_to_chunk().
+ */
+static int
+read_to_chunks_readv(buf_t *buf, tor_socket_t fd, size_t at_most,
+                     int *reached_eof, int *error, bool is_socket,
+                     size_t *tried_out)
+{
+  struct iovec iov[BUF_READV_MAX_NEW_CHUNKS + 1];
+  chunk_t *chunks[BUF_READV_MAX_NEW_CHUNKS + 1];
+  chunk_t *old_tail = buf->tail, *last_used;
+  int n_iov = 0, i;
+  size_t tried = 0, left;
+  ssize_t read_result;
+
+  if (old_tail && CHUNK_REMAINING_CAPACITY(old_tail) >= MIN_READ_LEN) {
+    size_t len = CHUNK_REMAINING_CAPACITY(old_tail);
+    if (len > at_most)
+      len = at_most;
+    chunks[n_iov] = old_tail;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(old_tail);
+    iov[n_iov].iov_len = len;
+    ++n_iov;
+    tried += len;
+  }
+  while (tried < at_most && n_iov < (int)ARRAY_LENGTH(iov)) {
+    chunk_t *chunk = buf_add_chunk_with_capacity(buf, at_most - tried, 1);
+    size_t len = chunk->memlen;
+    if (len > at_most - tried)
+      len = at_most - tried;
+    chunks[n_iov] = chunk;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(chunk);
+    iov[n_iov].iov_len = len;
+    ++n_iov;
+    tried += len;
+  }
+  *tried_out = tried;
+
+  read_result = readv(fd, iov, n_iov);
+  ++buf_net_stats.n_read_calls;
+
+  /* Give the bytes that we read to the chunks that they landed in, and find
+   * the last chunk that holds any data. */
+  last_used = old_tail;
+  left = read_result > 0 ? (size_t)read_result : 0;
+  for (i = 0; i < n_iov && left; ++i) {
+    size_t len = iov[i].iov_len;
+    if (len > left)
+      len = left;
+    chunks[i]->datalen += len;
+    left -= len;
+    last_used = chunks[i];
+  }
+  buf_free_chunks_after(buf, last_used);
+
+  if (read_result < 0) {
+    int e = is_socket ? tor_socket_errno(fd) : errno;
+
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      if (error)
+        *error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  } else { /* actually got bytes. */
+    buf_net_stats.n_bytes_read += read_result;
+    buf->datalen += read_result;
+    log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+              (int)buf->datalen);
+    tor_assert(read_result <= BUF_MAX_LEN);
+    return (int)read_result;
+  }
+}
+#endif /* defined(USE_READV) */
+
 /** Read from file descriptor <b>fd</b>, writing onto end of <b>buf</b>.  Read
  * at most <b>at_most</b> bytes, growing the buffer as necessary.  If recv()
  * returns 0 (because of EOF), set *<b>reached_eof</b> to 1 and return 0.
@@ -110,20 +229,29 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
 
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
-    chunk_t *chunk;
-    if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
-      chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
-      if (readlen > chunk->memlen)
-        readlen = chunk->memlen;
-    } else {
-      size_t cap = CHUNK_REMAINING_CAPACITY(buf->tail);
-      chunk = buf->tail;
-      if (cap < readlen)
-        readlen = cap;
-    }
+#ifdef USE_READV
+    if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < readlen) {
+      /* The tail chunk can't take it all: read into fresh chunks too. */
+      r = read_to_chunks_readv(buf, fd, readlen, reached_eof, socket_error,
+                               is_socket, &readlen);
+    } else
+#endif /* defined(USE_READV) */
+    {
+      chunk_t *chunk;
+      if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
+        chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+        if (readlen > chunk->memlen)
+          readlen = chunk->memlen;
+      } else {
+        size_t cap = CHUNK_REMAINING_CAPACITY(buf->tail);
+        chunk = buf->tail;
+        if (cap < readlen)
+          readlen = cap;
+      }
 
-    r = read_to_chunk(buf, chunk, fd, readlen,
-                      reached_eof, socket_error, is_socket);
+      r = read_to_chunk(buf, chunk, fd, readlen,
+                        reached_eof, socket_error, is_socket);
+    }
     check();
     if (r < 0)
       return r; /* Error */
@@ -153,6 +281,7 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
     write_result = tor_socket_send(fd, chunk->data, sz, 0);
   else
     write_result = write(fd, chunk->data, sz);
+  ++buf_net_stats.n_write_calls;
 
   if (write_result < 0) {
     int e = is_socket ? tor_socket_errno(fd) : errno;
@@ -167,11 +296,65 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
     log_debug(LD_NET,"write() would block, returning.");
     return 0;
   } else {
+    buf_net_stats.n_bytes_written += write_result;
+    buf_drain(buf, write_result);
+    tor_assert(write_result <= BUF_MAX_LEN);
+    return (int)write_result;
+  }
+}
+
+#ifdef USE_WRITEV
+/** Helper for buf_flush_to_fd(): try to write up to <b>sz</b> bytes from the
+ * first chunks of <b>buf</b> onto file descriptor <b>fd</b>, with a single
+ * writev() call.  Set *<b>tried_out</b> to the number of bytes we tried to
+ * write.  Return the number of bytes written on success, 0 on blocking, -1 on
+ * failure.
+ */
+static int
+flush_chunks_writev(tor_socket_t fd, buf_t *buf, size_t sz,
+                    bool is_socket, size_t *tried_out)
+{
+  struct iovec iov[BUF_MAX_IOVECS];
+  int n_iov = 0;
+  size_t tried = 0;
+  const chunk_t *chunk;
+  ssize_t write_result;
+
+  for (chunk = buf->head; chunk && tried < sz && n_iov < BUF_MAX_IOVECS;
+       chunk = chunk->next) {
+    size_t len = chunk->datalen;
+    if (!len)
+      continue;
+    if (len > sz - tried)
+      len = sz - tried;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = len;
+    ++n_iov;
+    tried += len;
+  }
+  *tried_out = tried;
+  if (!n_iov)
+    return 0;
+
+  write_result = writev(fd, iov, n_iov);
+  ++buf_net_stats.n_write_calls;
+
+  if (write_result < 0) {
+    int e = is_socket ? tor_socket_errno(fd) : errno;
+
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"writev() would block, returning.");
+    return 0;
+  } else {
+    buf_net_stats.n_bytes_written += write_result;
     buf_drain(buf, write_result);
     tor_assert(write_result <= BUF_MAX_LEN);
     return (int)write_result;
   }
 }
+#endif /* defined(USE_WRITEV) */
 
 /** Write data from <b>buf</b> to the file descriptor <b>fd</b>.  Write at most
  * <b>sz</b> bytes, and remove the written bytes
@@ -196,12 +379,20 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
-    if (buf->head->datalen >= sz)
-      flushlen0 = sz;
-    else
-      flushlen0 = buf->head->datalen;
+#ifdef USE_WRITEV
+    if (buf->head->datalen < sz) {
+      /* The data spans several chunks: gather them into one syscall. */
+      r = flush_chunks_writev(fd, buf, sz, is_socket, &flushlen0);
+    } else
+#endif /* defined(USE_WRITEV) */
+    {
+      if (buf->head->datalen >= sz)
+        flushlen0 = sz;
+      else
+        flushlen0 = buf->head->datalen;
 
-    r = flush_chunk(fd, buf, buf->head, flushlen0, is_socket);
+      r = flush_chunk(fd, buf, buf->head, flushlen0, is_socket);
+    }
     check();
     if (r < 0)
       return r;
@@ -263,3 +454,12 @@ buf_read_from_pipe(buf_t *buf, int fd, size_t at_most,
 {
   return buf_read_from_fd(buf, fd, at_most, reached_eof, socket_error, false);
 }
+
+/** Copy the counters for the syscalls that we made to fill and flush buffers
+ * into *<b>out</b>. */
+void
+buf_net_get_stats(buf_net_stats_t *out)
+{
+  tor_assert(out);
+  memcpy(out, &buf_net_stats, sizeof(*out));
+}
@@ -14,6 +14,7 @@
 #define TOR_BUFFERS_NET_H
 
 #include <stddef.h>
+#include "lib/cc/torint.h"
 #include "lib/net/socket.h"
 
 struct buf_t;
@@ -29,4 +30,19 @@ int buf_read_from_pipe(struct buf_t *buf, int fd, size_t at_most,
 
 int buf_flush_to_pipe(struct buf_t *buf, int fd, size_t sz);
 
+/** Counters for the syscalls made by the functions above, as returned by
+ * buf_net_get_stats(). */
+typedef struct buf_net_stats_t {
+  /** Number of send(), write() or writev() calls made to flush buffers. */
+  uint64_t n_write_calls;
+  /** Number of bytes that those calls wrote. */
+  uint64_t n_bytes_written;
+  /** Number of recv(), read() or readv() calls made to fill buffers. */
+  uint64_t n_read_calls;
+  /** Number of bytes that those calls read. */
+  uint64_t n_bytes_read;
+} buf_net_stats_t;
+
+void buf_net_get_stats(buf_net_stats_t *out);
+
 #endif /* !defined(TOR_BUFFERS_NET_H) */
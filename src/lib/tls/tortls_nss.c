@@ -693,6 +693,16 @@ tor_tls_get_n_raw_bytes(tor_tls_t *tls,
   tls->last_write_count = w;
 }
 
+void
+tor_tls_get_kernel_offload(tor_tls_t *tls, bool *send_out, bool *recv_out)
+{
+  tor_assert(tls);
+  tor_assert(send_out);
+  tor_assert(recv_out);
+  /* NSS has no kernel TLS support. */
+  *send_out = *recv_out = false;
+}
+
 int
 tor_tls_get_buffer_sizes(tor_tls_t *tls,
                          size_t *rbuf_capacity, size_t *rbuf_bytes,
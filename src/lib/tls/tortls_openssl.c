@@ -617,6 +617,14 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
                         SSL_OP_ALLOW_UNSAFE_LEGACY_RENEGOTIATION);
   }
 
+#ifdef SSL_OP_ENABLE_KTLS
+  /* Once the keys are set up, OpenSSL hands the record layer over to the
+   * kernel if the kernel and the negotiated cipher allow it, and silently
+   * keeps doing it in userspace otherwise. */
+  if (flags & TOR_TLS_CTX_USE_KTLS)
+    SSL_CTX_set_options(result->ctx, SSL_OP_ENABLE_KTLS);
+#endif /* defined(SSL_OP_ENABLE_KTLS) */
+
   /* Don't actually allow compression; it uses RAM and time, it makes TLS
    * vulnerable to CRIME-style attacks, and most of the data we transmit over
    * TLS is encrypted (and therefore uncompressible) anyway. */
@@ -1403,9 +1411,33 @@ tor_tls_finish_handshake(tor_tls_t *tls)
     }
   }
   tls_log_errors(NULL, LOG_WARN, LD_NET, "finishing the handshake");
+  {
+    bool ktls_send, ktls_recv;
+    tor_tls_get_kernel_offload(tls, &ktls_send, &ktls_recv);
+    if (ktls_send || ktls_recv)
+      log_info(LD_NET, "Kernel TLS offload enabled on %s for%s%s.",
+               ADDR(tls), ktls_send ? " sending" : "",
+               ktls_recv ? " receiving" : "");
+  }
   return r;
 }
 
+/** Set *<b>send_out</b> and *<b>recv_out</b> to true iff the kernel
+ * encrypts, respectively decrypts, the TLS records of <b>tls</b>. */
+void
+tor_tls_get_kernel_offload(tor_tls_t *tls, bool *send_out, bool *recv_out)
+{
+  tor_assert(tls);
+  tor_assert(send_out);
+  tor_assert(recv_out);
+#ifdef BIO_get_ktls_send
+  *send_out = BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) != 0;
+  *recv_out = BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)) != 0;
+#else
+  *send_out = *recv_out = false;
+#endif /* defined(BIO_get_ktls_send) */
+}
+
 /** Return true iff this TLS connection is authenticated.
  */
 int
@@ -10,6 +10,9 @@
 
 #include "orconfig.h"
 
+#define BUFFERS_PRIVATE
+#define CHANNEL_OBJECT_PRIVATE
+
 #include "core/or/or.h"
 #include "core/crypto/onion_tap.h"
 #include "core/crypto/relay_crypto.h"
@@ -25,6 +28,10 @@
 #endif /* defined(ENABLE_OPENSSL) */
 
 #include "core/or/circuitlist.h"
+#include "core/or/channel.h"
+#include "core/or/scheduler.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
 #include "app/config/config.h"
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
@@ -37,12 +44,29 @@
 
 #include "core/or/cell_st.h"
 #include "core/or/or_circuit_st.h"
+#include "core/or/cell_queue_st.h"
+#include "core/or/edge_connection_st.h"
+#include "core/or/relay.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "lib/buf/buffers.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/socket.h"
+#include "lib/tls/tortls.h"
+#include "lib/malloc/slab.h"
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
 
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/nodelist/microdesc.h"
+#include "core/or/compiled_policy.h"
+#include "core/or/policies.h"
+#include "lib/geoip/geoip.h"
+
+#include "feature/nodelist/microdesc_st.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -254,6 +278,115 @@ bench_onion_ntor_impl(void)
   dimap_free(keymap, NULL);
 }
 
+/** A job for bench_onion_ntor_batches(): a worker thread answers
+ * <b>n</b> copies of the same ntor onionskin back to back. */
+typedef struct ntor_batch_job_t {
+  const di_digest256_map_t *keymap;
+  const uint8_t *nodeid;
+  const uint8_t *onionskin;
+  int n;
+} ntor_batch_job_t;
+
+/** Number of ntor_batch_job_t that the worker hasn't answered yet. */
+static int ntor_batch_jobs_pending = 0;
+
+static void *
+ntor_batch_state_new(void *arg)
+{
+  (void)arg;
+  return tor_malloc_zero(1);
+}
+
+static void
+ntor_batch_state_free(void *state)
+{
+  tor_free(state);
+}
+
+static workqueue_reply_t
+ntor_batch_threadfn(void *state, void *work)
+{
+  const ntor_batch_job_t *job = work;
+  uint8_t reply[NTOR_REPLY_LEN];
+  uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
+  int i;
+
+  (void)state;
+  for (i = 0; i < job->n; ++i) {
+    onion_skin_ntor_server_handshake(job->onionskin, job->keymap, NULL,
+                                     job->nodeid, reply,
+                                     key_out, sizeof(key_out));
+  }
+  return WQ_RPL_REPLY;
+}
+
+static void
+ntor_batch_replyfn(void *work)
+{
+  tor_free(work);
+  if (--ntor_batch_jobs_pending == 0)
+    tor_libevent_exit_loop_after_callback(tor_libevent_get_base());
+}
+
+/** Measure the throughput of server-side ntor handshakes answered by a
+ * worker thread, as the cpuworkers do, for several numbers of onionskins
+ * per job. */
+static void
+bench_onion_ntor_batches(void)
+{
+  const int iters = 1<<10;
+  const int batch_sizes[] = { 1, 2, 4, 8, 16 };
+  curve25519_keypair_t keypair;
+  uint8_t os[NTOR_ONIONSKIN_LEN];
+  ntor_handshake_state_t *state = NULL;
+  uint8_t nodeid[DIGEST_LEN];
+  di_digest256_map_t *keymap = NULL;
+  tor_libevent_cfg_t cfg;
+  replyqueue_t *replyqueue;
+  threadpool_t *pool;
+  uint64_t start, end;
+  unsigned b;
+  int i;
+
+  curve25519_secret_key_generate(&keypair.seckey, 0);
+  curve25519_public_key_generate(&keypair.pubkey, &keypair.seckey);
+  dimap_add_entry(&keymap, keypair.pubkey.public_key, &keypair);
+  crypto_rand((char *)nodeid, sizeof(nodeid));
+  onion_skin_ntor_create(nodeid, &keypair.pubkey, &state, os);
+
+  if (!tor_libevent_is_initialized()) {
+    memset(&cfg, 0, sizeof(cfg));
+    tor_libevent_initialize(&cfg);
+  }
+  replyqueue = replyqueue_new(0);
+  pool = threadpool_new(1, replyqueue, ntor_batch_state_new,
+                        ntor_batch_state_free, NULL);
+  tor_assert(pool);
+  threadpool_register_reply_event(pool, NULL);
+
+  for (b = 0; b < ARRAY_LENGTH(batch_sizes); ++b) {
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < iters; i += batch_sizes[b]) {
+      ntor_batch_job_t *job = tor_malloc_zero(sizeof(*job));
+      job->keymap = keymap;
+      job->nodeid = nodeid;
+      job->onionskin = os;
+      job->n = batch_sizes[b];
+      ++ntor_batch_jobs_pending;
+      threadpool_queue_work(pool, ntor_batch_threadfn, ntor_batch_replyfn,
+                            job);
+    }
+    tor_libevent_run_event_loop(tor_libevent_get_base(), 0);
+    end = perftime();
+    printf("Server-side, through a worker, %d per job: %f usec\n",
+           batch_sizes[b], NANOCOUNT(start, end, iters)/1e3);
+  }
+
+  ntor_handshake_state_free(state);
+  dimap_free(keymap, NULL);
+}
+
 static void
 bench_onion_ntor(void)
 {
@@ -265,6 +398,7 @@ bench_onion_ntor(void)
     curve25519_set_impl_params(ed);
     bench_onion_ntor_impl();
   }
+  bench_onion_ntor_batches();
 }
 
 static void
@@ -423,6 +557,56 @@ bench_cell_aes(void)
 
   crypto_cipher_free(c);
   tor_free(b);
+
+  /* Now crypt batches of cells through the three layers of a circuit, once
+   * cell by cell and once hop by hop. */
+  const int max_batch = 64;
+  const int n_hops = 3;
+  crypto_cipher_t *hops[3];
+  cell_t *cells = tor_malloc_zero(sizeof(cell_t) * max_batch);
+  cell_t **cellp = tor_malloc_zero(sizeof(cell_t *) * max_batch);
+  int batch, j, h;
+
+  for (h = 0; h < n_hops; ++h) {
+    crypto_rand(key, sizeof(key));
+    hops[h] = crypto_cipher_new(key);
+  }
+  for (i = 0; i < max_batch; ++i)
+    cellp[i] = &cells[i];
+
+  for (batch = 1; batch <= max_batch; batch *= 2) {
+    const int n_batches = iters / batch;
+    uint64_t single_ns, batch_ns;
+
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < n_batches; ++i) {
+      for (j = 0; j < batch; ++j) {
+        for (h = 0; h < n_hops; ++h)
+          relay_crypt_one_payload(hops[h], cells[j].payload);
+      }
+    }
+    end = perftime();
+    single_ns = end - start;
+
+    start = perftime();
+    for (i = 0; i < n_batches; ++i) {
+      for (h = 0; h < n_hops; ++h)
+        relay_crypt_payloads(hops[h], cellp, batch);
+    }
+    end = perftime();
+    batch_ns = end - start;
+
+    printf("%d cells per batch, %d hops: %.0f cells/sec one by one, "
+           "%.0f cells/sec batched\n", batch, n_hops,
+           (n_batches * batch) / (single_ns / 1e9),
+           (n_batches * batch) / (batch_ns / 1e9));
+  }
+
+  for (h = 0; h < n_hops; ++h)
+    crypto_cipher_free(hops[h]);
+  tor_free(cells);
+  tor_free(cellp);
 }
 
 /** Run digestmap_t performance benchmarks. */
@@ -616,6 +800,310 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** A cell queued the way cell_queue_t used to queue them, linked through
+ * the cells themselves, to compare against the current cell_queue_t. */
+typedef struct list_cell_t {
+  TOR_SIMPLEQ_ENTRY(list_cell_t) next;
+  char body[CELL_MAX_NETWORK_SIZE];
+  uint32_t inserted_timestamp;
+} list_cell_t;
+TOR_SIMPLEQ_HEAD(list_cell_queue_t, list_cell_t);
+
+/** Size of the buffer that evict_caches() walks through. */
+#define EVICT_BUF_LEN (32<<20)
+
+/** Push everything else out of the CPU caches by touching every cache line of
+ * <b>buf</b>, which must be EVICT_BUF_LEN bytes long. */
+static void
+evict_caches(char *buf)
+{
+  int i;
+  for (i = 0; i < EVICT_BUF_LEN; i += 64)
+    buf[i]++;
+}
+
+static void
+bench_cell_queue(void)
+{
+  const int n_cells = 1<<16;
+  const int iters = 16;
+  int n_queues, i, it;
+  uint64_t start, end, t_append, t_age, t_pop;
+  uint32_t ts;
+  uint64_t sum = 0;
+  cell_t cell;
+  cell_queue_t staging;
+  packed_cell_t **cells = tor_calloc(n_cells, sizeof(packed_cell_t *));
+  list_cell_t **lcells = tor_calloc(n_cells, sizeof(list_cell_t *));
+  char *junk = tor_malloc_zero(EVICT_BUF_LEN);
+  /* Allocate the list cells the same way as packed cells, so that only the
+   * queues differ. */
+  slab_pool_t *list_pool = slab_pool_new(sizeof(list_cell_t), 64, 64);
+
+  memset(&cell, 0, sizeof(cell));
+  cell_queue_init(&staging);
+  for (i = 0; i < n_cells; ++i) {
+    cell_queue_append_packed_copy(NULL, &staging, 0, &cell, 1, 0);
+    cells[i] = cell_queue_pop(&staging);
+    cells[i]->inserted_timestamp = i;
+    lcells[i] = slab_pool_alloc(list_pool);
+    lcells[i]->inserted_timestamp = i;
+  }
+
+  reset_perftime();
+
+  /* Spread the same cells over more and more circuits, and start each step
+   * with cold caches, as a relay would when it gets back to a circuit. */
+  for (n_queues = 1; n_queues <= 4096; n_queues *= 16) {
+    struct list_cell_queue_t *lq =
+      tor_calloc(n_queues, sizeof(struct list_cell_queue_t));
+    cell_queue_t *cq = tor_calloc(n_queues, sizeof(cell_queue_t));
+    for (i = 0; i < n_queues; ++i) {
+      TOR_SIMPLEQ_INIT(&lq[i]);
+      cell_queue_init(&cq[i]);
+    }
+
+    t_append = t_age = t_pop = 0;
+    for (it = 0; it < iters; ++it) {
+      start = perftime();
+      for (i = 0; i < n_cells; ++i)
+        TOR_SIMPLEQ_INSERT_TAIL(&lq[i % n_queues], lcells[i], next);
+      end = perftime();
+      t_append += end - start;
+      evict_caches(junk);
+      start = perftime();
+      for (i = 0; i < n_queues; ++i)
+        sum += TOR_SIMPLEQ_FIRST(&lq[i])->inserted_timestamp;
+      end = perftime();
+      t_age += end - start;
+      evict_caches(junk);
+      start = perftime();
+      for (i = 0; i < n_cells; ++i) {
+        list_cell_t *c = TOR_SIMPLEQ_FIRST(&lq[i % n_queues]);
+        TOR_SIMPLEQ_REMOVE_HEAD(&lq[i % n_queues], next);
+        sum += c->body[0];
+      }
+      end = perftime();
+      t_pop += end - start;
+    }
+    printf("%d queues, linked list: %.2f ns per append, "
+           "%.2f ns per oldest-cell lookup, %.2f ns per pop\n", n_queues,
+           NANOCOUNT(0, t_append, n_cells * iters),
+           NANOCOUNT(0, t_age, n_queues * iters),
+           NANOCOUNT(0, t_pop, n_cells * iters));
+
+    t_append = t_age = t_pop = 0;
+    for (it = 0; it < iters; ++it) {
+      start = perftime();
+      for (i = 0; i < n_cells; ++i)
+        cell_queue_append(&cq[i % n_queues], cells[i]);
+      end = perftime();
+      t_append += end - start;
+      evict_caches(junk);
+      start = perftime();
+      for (i = 0; i < n_queues; ++i) {
+        cell_queue_get_oldest_timestamp(&cq[i], &ts);
+        sum += ts;
+      }
+      end = perftime();
+      t_age += end - start;
+      evict_caches(junk);
+      start = perftime();
+      for (i = 0; i < n_cells; ++i) {
+        packed_cell_t *c = cell_queue_pop(&cq[i % n_queues]);
+        sum += c->body[0];
+      }
+      end = perftime();
+      t_pop += end - start;
+    }
+    printf("%d queues, cell_queue_t: %.2f ns per append, "
+           "%.2f ns per oldest-cell lookup, %.2f ns per pop\n", n_queues,
+           NANOCOUNT(0, t_append, n_cells * iters),
+           NANOCOUNT(0, t_age, n_queues * iters),
+           NANOCOUNT(0, t_pop, n_cells * iters));
+
+    tor_free(lq);
+    tor_free(cq);
+  }
+
+  /* Time clearing full queues, cells and all. */
+  {
+    struct list_cell_queue_t lq;
+    list_cell_t *c;
+    TOR_SIMPLEQ_INIT(&lq);
+    for (i = 0; i < n_cells; ++i)
+      TOR_SIMPLEQ_INSERT_TAIL(&lq, lcells[i], next);
+    evict_caches(junk);
+    start = perftime();
+    while ((c = TOR_SIMPLEQ_FIRST(&lq))) {
+      TOR_SIMPLEQ_REMOVE_HEAD(&lq, next);
+      slab_pool_release(list_pool, c);
+    }
+    end = perftime();
+    printf("Clearing %d cells, linked list: %.2f ns per cell\n", n_cells,
+           NANOCOUNT(start, end, n_cells));
+
+    for (i = 0; i < n_cells; ++i)
+      cell_queue_append(&staging, cells[i]);
+    evict_caches(junk);
+    start = perftime();
+    cell_queue_clear(&staging);
+    end = perftime();
+    printf("Clearing %d cells, cell_queue_t: %.2f ns per cell\n", n_cells,
+           NANOCOUNT(start, end, n_cells));
+  }
+
+  /* Keep the compiler from optimizing the loops away. */
+  if (sum == 0)
+    puts("");
+
+  slab_pool_free(list_pool);
+  tor_free(junk);
+  tor_free(cells);
+  tor_free(lcells);
+}
+
+static void
+bench_cmux_ewma(void)
+{
+  const int n_circs_max = 10000;
+  const int n_cells = 1<<20;
+  circuitmux_policy_t *policies[2] = { &ewma_policy, &ewma_bucket_policy };
+  const char *names[2] = { "heap", "buckets" };
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuit_t *circs = tor_calloc(n_circs_max, sizeof(circuit_t));
+  circuitmux_policy_circ_data_t **circ_data =
+    tor_calloc(n_circs_max, sizeof(circuitmux_policy_circ_data_t *));
+  uint64_t start, end;
+  int n_circs, p, i;
+
+  cmux_ewma_set_options(NULL, NULL);
+  reset_perftime();
+
+  for (n_circs = 10; n_circs <= n_circs_max; n_circs *= 10) {
+    for (p = 0; p < 2; ++p) {
+      circuitmux_policy_t *pol = policies[p];
+      circuitmux_policy_data_t *pol_data = pol->alloc_cmux_data(cmux);
+      for (i = 0; i < n_circs; ++i) {
+        circ_data[i] = pol->alloc_circ_data(cmux, pol_data, &circs[i],
+                                            CELL_DIRECTION_OUT, 1);
+        pol->notify_circ_active(cmux, pol_data, &circs[i], circ_data[i]);
+      }
+
+      /* Send one cell at a time from whichever circuit the policy picks,
+       * as channel_flush_from_first_active_circuit() does. */
+      start = perftime();
+      for (i = 0; i < n_cells; ++i) {
+        circuit_t *circ = pol->pick_active_circuit(cmux, pol_data);
+        pol->notify_xmit_cells(cmux, pol_data, circ,
+                               circ_data[circ - circs], 1);
+      }
+      end = perftime();
+      printf("%d circuits, %s: %.2f ns per pick and update\n",
+             n_circs, names[p], NANOCOUNT(start, end, n_cells));
+
+      /* Circuits come and go as their queues empty and fill up. */
+      start = perftime();
+      for (i = 0; i < n_cells; ++i) {
+        int idx = (int)(((uint64_t)i * 7919) % n_circs);
+        pol->notify_circ_inactive(cmux, pol_data, &circs[idx],
+                                  circ_data[idx]);
+        pol->notify_circ_active(cmux, pol_data, &circs[idx],
+                                circ_data[idx]);
+      }
+      end = perftime();
+      printf("%d circuits, %s: %.2f ns per deactivate and activate\n",
+             n_circs, names[p], NANOCOUNT(start, end, n_cells));
+
+      for (i = 0; i < n_circs; ++i) {
+        pol->notify_circ_inactive(cmux, pol_data, &circs[i], circ_data[i]);
+        pol->free_circ_data(cmux, pol_data, &circs[i], circ_data[i]);
+      }
+      pol->free_cmux_data(cmux, pol_data);
+    }
+  }
+
+  circuitmux_free(cmux);
+  tor_free(circ_data);
+  tor_free(circs);
+}
+
+/** Measure how fast an exit packages the data of a bulk download, read from
+ * one stream, into RELAY_DATA cells on the circuit of the stream. */
+static void
+bench_exit_package(void)
+{
+  /* Stay under the queue size at which we would block the stream. */
+  const int cells_per_round = 128;
+  const int rounds = 4096;
+  const size_t datalen = cells_per_round * RELAY_PAYLOAD_SIZE;
+  char *data = tor_malloc(datalen);
+  char key[CPATH_KEY_MATERIAL_LEN];
+  tor_libevent_cfg_t cfg;
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  or_circuit_t *or_circ;
+  edge_connection_t *conn;
+  uint64_t start, end, total = 0;
+  uint64_t n_cells = stats_n_data_cells_packaged;
+  int i;
+
+  /* Our options never went through validation, which is what picks the
+   * scheduler types and the memory limit for our queues. */
+  get_options_mutable()->MaxMemInQueues = UINT64_MAX;
+  if (!get_options()->SchedulerTypes_) {
+    int *sched_type = tor_malloc_zero(sizeof(int));
+    *sched_type = SCHEDULER_VANILLA;
+    get_options_mutable()->SchedulerTypes_ = smartlist_new();
+    smartlist_add(get_options_mutable()->SchedulerTypes_, sched_type);
+  }
+  if (!tor_libevent_is_initialized()) {
+    memset(&cfg, 0, sizeof(cfg));
+    tor_libevent_initialize(&cfg);
+  }
+  tor_init_connection_lists();
+  scheduler_init();
+
+  channel_init(chan);
+  chan->cmux = circuitmux_alloc();
+  cmux_ewma_set_options(NULL, NULL);
+  circuitmux_set_policy(chan->cmux, &ewma_policy);
+  or_circ = or_circuit_new(1, chan);
+  TO_CIRCUIT(or_circ)->purpose = CIRCUIT_PURPOSE_OR;
+  crypto_rand(key, sizeof(key));
+  relay_crypto_init(&or_circ->crypto, key, sizeof(key), 0, 0);
+
+  conn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  conn->stream_id = 1;
+  conn->on_circuit = TO_CIRCUIT(or_circ);
+  crypto_rand(data, datalen);
+
+  reset_perftime();
+  for (i = 0; i < rounds; ++i) {
+    buf_add(TO_CONN(conn)->inbuf, data, datalen);
+    TO_CIRCUIT(or_circ)->package_window = CIRCWINDOW_START;
+    conn->package_window = STREAMWINDOW_START;
+    start = perftime();
+    connection_edge_package_raw_inbuf(conn, 1, NULL);
+    end = perftime();
+    total += end - start;
+    cell_queue_clear(&or_circ->p_chan_cells);
+    circuitmux_set_num_cells(chan->cmux, TO_CIRCUIT(or_circ), 0);
+  }
+  n_cells = stats_n_data_cells_packaged - n_cells;
+
+  printf("Exit packaging: %.2f ns per cell (%.2f MB/s of stream data)\n",
+         NANOCOUNT(0, total, n_cells),
+         (rounds * (double)datalen) / NANOCOUNT(0, total, 1000));
+
+  conn->on_circuit = NULL;
+  connection_free_(TO_CONN(conn));
+  circuitmux_detach_circuit(chan->cmux, TO_CIRCUIT(or_circ));
+  circuit_free_all();
+  circuitmux_free(chan->cmux);
+  tor_free(chan);
+  tor_free(data);
+}
+
 static void
 bench_dh(void)
 {
@@ -738,6 +1226,462 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+/** If set, a cached-microdescs file to take the exit policies for
+ * bench_exit_ports() from. */
+static const char *bench_microdescs_fname = NULL;
+
+/** Add a made-up set of microdescriptor exit policies to <b>out</b>,
+ * modelled on the ones in a recent consensus: mostly the default and
+ * reduced exit policies, and a long tail of smaller port lists. */
+static void
+bench_exit_ports_synthetic_policies(smartlist_t *out)
+{
+  const char *common[] = {
+    "reject 25,119,135-139,445,563,1214,4661-4666,6346-6429,6699,6881-6999",
+    "accept 20-23,43,53,79-81,88,110,143,194,220,389,443,464,531,543-544,"
+      "554,563,636,706,749,873,902-904,981,989-995,1194,1220,1293,1500,"
+      "1533,1677,1723,1755,1863,2082-2083,2086-2087,2095-2096,2102-2104,"
+      "3128,3389,3690,4321,4643,5050,5190,5222-5223,5228,5900,6660-6669,"
+      "6679,6697,8000,8008,8074,8080,8087-8088,8332-8333,8443,8888,9418,"
+      "9999-10000,11371,12350,19294,19638,23456,33033,64738",
+    "accept 80,443",
+    "accept 53,80,443,5222-5223,25565",
+  };
+  const int N_EXITS = 1500;
+  int i;
+
+  for (i = 0; i < N_EXITS; ++i) {
+    short_policy_t *policy;
+    if (i % 10 < 8) {
+      policy = parse_short_policy(common[i % ARRAY_LENGTH(common)]);
+    } else {
+      char buf[128];
+      tor_snprintf(buf, sizeof(buf), "accept 22,80,443,%d-%d,%d",
+                   1024 + i, 2048 + i, 8000 + (i % 97));
+      policy = parse_short_policy(buf);
+    }
+    smartlist_add(out, policy);
+  }
+}
+
+/** Time how long it takes to decide whether each exit of the network
+ * allows a set of common ports, using the compiled port bitmaps and using
+ * a linear scan of the port ranges.  Use the exit policies of a real
+ * network if we were given a cached-microdescs file with --microdescs. */
+static void
+bench_exit_ports(void)
+{
+  const uint16_t ports[] = { 22, 25, 53, 80, 443, 6667, 8080, 9999, 50000 };
+  const int N = 200;
+  smartlist_t *policies = smartlist_new();
+  smartlist_t *mds = NULL;
+  char *mds_text = NULL;
+  compiled_short_policy_t **saved = NULL;
+  uint64_t start, end;
+  int i, n_accepted = 0, n_accepted_linear = 0;
+
+  if (bench_microdescs_fname) {
+    mds_text = read_file_to_str(bench_microdescs_fname, RFTS_IGNORE_MISSING,
+                                NULL);
+    if (!mds_text) {
+      printf("Couldn't read %s.\n", bench_microdescs_fname);
+      goto done;
+    }
+    mds = microdescs_parse_from_string(mds_text, NULL, 1,
+                                       SAVED_NOWHERE, NULL);
+    SMARTLIST_FOREACH(mds, microdesc_t *, md, {
+      if (md->exit_policy)
+        smartlist_add(policies, md->exit_policy);
+    });
+    printf("%d microdescriptors, %d with exit policies.\n",
+           smartlist_len(mds), smartlist_len(policies));
+  } else {
+    bench_exit_ports_synthetic_policies(policies);
+    printf("%d synthetic exit policies.\n", smartlist_len(policies));
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < N; ++i) {
+    for (unsigned p = 0; p < ARRAY_LENGTH(ports); ++p) {
+      SMARTLIST_FOREACH(policies, const short_policy_t *, policy, {
+        if (compare_tor_addr_to_short_policy(NULL, ports[p], policy) ==
+            ADDR_POLICY_PROBABLY_ACCEPTED)
+          ++n_accepted;
+      });
+    }
+  }
+  end = perftime();
+  printf("Compiled port lookup: %.2f nsec per exit per port\n",
+         NANOCOUNT(start, end,
+                   N * ARRAY_LENGTH(ports) * smartlist_len(policies)));
+
+  /* Take the compiled bitmaps away to time the linear scan. */
+  saved = tor_calloc(smartlist_len(policies) + 1, sizeof(*saved));
+  SMARTLIST_FOREACH(policies, short_policy_t *, policy, {
+    saved[policy_sl_idx] = policy->compiled;
+    policy->compiled = NULL;
+  });
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < N; ++i) {
+    for (unsigned p = 0; p < ARRAY_LENGTH(ports); ++p) {
+      SMARTLIST_FOREACH(policies, const short_policy_t *, policy, {
+        if (compare_tor_addr_to_short_policy(NULL, ports[p], policy) ==
+            ADDR_POLICY_PROBABLY_ACCEPTED)
+          ++n_accepted_linear;
+      });
+    }
+  }
+  end = perftime();
+  printf("Linear port lookup: %.2f nsec per exit per port\n",
+         NANOCOUNT(start, end,
+                   N * ARRAY_LENGTH(ports) * smartlist_len(policies)));
+  SMARTLIST_FOREACH(policies, short_policy_t *, policy,
+                    policy->compiled = saved[policy_sl_idx]);
+  tor_assert(n_accepted == n_accepted_linear);
+
+ done:
+  if (mds) {
+    SMARTLIST_FOREACH(mds, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(mds);
+  } else {
+    SMARTLIST_FOREACH(policies, short_policy_t *, policy,
+                      short_policy_free(policy));
+  }
+  smartlist_free(policies);
+  tor_free(saved);
+  tor_free(mds_text);
+}
+
+/** If set, a GeoIPFile for bench_geoip() to load instead of a synthetic
+ * one. */
+static const char *bench_geoip_fname = NULL;
+/** If set, a GeoIPv6File for bench_geoip() to load instead of a synthetic
+ * one. */
+static const char *bench_geoip6_fname = NULL;
+
+/** Write a made-up GeoIP file for <b>family</b> to <b>fname</b>, with about
+ * as many ranges as a real one.  Return 0 on success, -1 on failure. */
+static int
+bench_geoip_write_synthetic(sa_family_t family, const char *fname)
+{
+  smartlist_t *lines = smartlist_new();
+  char *contents;
+  int i, r;
+
+  if (family == AF_INET) {
+    /* Ranges of random width, with random gaps, across the whole space. */
+    uint64_t cur = 0;
+    for (i = 0; i < 200000; ++i) {
+      uint64_t width = 1 + crypto_rand_uint64(30000);
+      if (cur + width > UINT32_MAX)
+        break;
+      smartlist_add_asprintf(lines, "%u,%u,%c%c\n", (unsigned)cur,
+                             (unsigned)(cur + width - 1),
+                             'a' + crypto_rand_int(26),
+                             'a' + crypto_rand_int(26));
+      cur += width + crypto_rand_uint64(10000);
+    }
+  } else {
+    /* Like the real table, crowd the ranges into 2001::/16 and 2a00::/16,
+     * each covering a random number of /64s. */
+    for (int half = 0; half < 2; ++half) {
+      uint64_t cur = half ? UINT64_C(0x2a00000000000000)
+                          : UINT64_C(0x2001000000000000);
+      for (i = 0; i < 30000; ++i) {
+        uint8_t a[16];
+        char low[TOR_ADDR_BUF_LEN], high[TOR_ADDR_BUF_LEN];
+        uint64_t n64 = 1 + crypto_rand_uint64(UINT64_C(1) << 28);
+        memset(a, 0, sizeof(a));
+        set_uint32(a, htonl((uint32_t)(cur >> 32)));
+        set_uint32(a + 4, htonl((uint32_t)cur));
+        tor_inet_ntop(AF_INET6, a, low, sizeof(low));
+        cur += n64 - 1;
+        memset(a + 8, 0xff, 8);
+        set_uint32(a, htonl((uint32_t)(cur >> 32)));
+        set_uint32(a + 4, htonl((uint32_t)cur));
+        tor_inet_ntop(AF_INET6, a, high, sizeof(high));
+        smartlist_add_asprintf(lines, "%s,%s,%c%c\n", low, high,
+                               'a' + crypto_rand_int(26),
+                               'a' + crypto_rand_int(26));
+        cur += 1 + crypto_rand_uint64(UINT64_C(1) << 28);
+      }
+    }
+  }
+  contents = smartlist_join_strings(lines, "", 0, NULL);
+  r = write_str_to_file(fname, contents, 0);
+  tor_free(contents);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return r;
+}
+
+/** Load a GeoIP table for <b>family</b>: the one in <b>fname</b> if it is
+ * set, else a synthetic one.  Return 0 on success, -1 on failure. */
+static int
+bench_geoip_load(sa_family_t family, const char *fname)
+{
+  char tmpname[256];
+  const char *tmpdir = getenv("TMPDIR");
+  int r;
+
+  if (fname)
+    return geoip_load_file(family, fname, LOG_WARN);
+
+  tor_snprintf(tmpname, sizeof(tmpname), "%s/tor-bench-geoip%s-%d",
+               tmpdir ? tmpdir : "/tmp", family == AF_INET ? "" : "6",
+               (int)getpid());
+  if (bench_geoip_write_synthetic(family, tmpname) < 0)
+    return -1;
+  r = geoip_load_file(family, tmpname, LOG_WARN);
+  unlink(tmpname);
+  return r;
+}
+
+/** Time how many GeoIP country lookups we can do per second, for IPv4 and
+ * for IPv6 addresses.  Use the tables in the files given with --geoip and
+ * --geoip6 if there are any. */
+static void
+bench_geoip(void)
+{
+  const int N_ADDRS = 4096, N = 500;
+  uint32_t *addrs = tor_calloc(N_ADDRS, sizeof(uint32_t));
+  struct in6_addr *addrs6 = tor_calloc(N_ADDRS, sizeof(struct in6_addr));
+  uint64_t start, end;
+  int i, j, n_found = 0;
+
+  if (bench_geoip_load(AF_INET, bench_geoip_fname) < 0 ||
+      bench_geoip_load(AF_INET6, bench_geoip6_fname) < 0) {
+    printf("Couldn't load GeoIP tables.\n");
+    goto done;
+  }
+
+  /* IPv6 addresses anywhere in the space are mostly unassigned, so look up
+   * ones in the /16s where the assignments are. */
+  crypto_rand((char *)addrs, N_ADDRS * sizeof(uint32_t));
+  crypto_rand((char *)addrs6, N_ADDRS * sizeof(struct in6_addr));
+  for (i = 0; i < N_ADDRS; ++i) {
+    addrs6[i].s6_addr[0] = (i & 1) ? 0x2a : 0x20;
+    addrs6[i].s6_addr[1] = (i & 1) ? 0x00 : 0x01;
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < N; ++i) {
+    for (j = 0; j < N_ADDRS; ++j) {
+      if (geoip_get_country_by_ipv4(addrs[j]) > 0)
+        ++n_found;
+    }
+  }
+  end = perftime();
+  printf("IPv4 lookup: %.2f nsec (%.2f M lookups/sec)\n",
+         NANOCOUNT(start, end, N * N_ADDRS),
+         1e3 / NANOCOUNT(start, end, N * N_ADDRS));
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < N; ++i) {
+    for (j = 0; j < N_ADDRS; ++j) {
+      if (geoip_get_country_by_ipv6(&addrs6[j]) > 0)
+        ++n_found;
+    }
+  }
+  end = perftime();
+  printf("IPv6 lookup: %.2f nsec (%.2f M lookups/sec)\n",
+         NANOCOUNT(start, end, N * N_ADDRS),
+         1e3 / NANOCOUNT(start, end, N * N_ADDRS));
+  printf("(%d lookups found a country)\n", n_found);
+
+ done:
+  geoip_free_all();
+  tor_free(addrs);
+  tor_free(addrs6);
+}
+
+/** Run a loopback benchmark of buf_flush_to_socket(), with a buffer full of
+ * cells: report how many write syscalls we make per MB, and how much CPU
+ * (for both ends of the socket) we spend per Gbit, when we flush one chunk
+ * per syscall and when we flush as many chunks as we can at once. */
+static void
+bench_buf_flush(void)
+{
+  const size_t total = 64 << 20;
+  const size_t max_queued = 256 << 10;
+  char cell[CELL_MAX_NETWORK_SIZE];
+  char *sink = tor_malloc(65536);
+  tor_socket_t fds[2];
+  int per_chunk;
+
+  crypto_rand(cell, sizeof(cell));
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    puts("Couldn't create a socketpair; skipping.");
+    tor_free(sink);
+    return;
+  }
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+
+  for (per_chunk = 1; per_chunk >= 0; --per_chunk) {
+    buf_t *buf = buf_new();
+    buf_net_stats_t before, after;
+    uint64_t start, end;
+    size_t sent = 0;
+
+    reset_perftime();
+    buf_net_get_stats(&before);
+    start = perftime();
+    while (sent < total) {
+      while (buf_datalen(buf) < max_queued)
+        buf_add(buf, cell, sizeof(cell));
+      while (buf_datalen(buf)) {
+        size_t sz = buf_datalen(buf);
+        int r;
+        if (per_chunk && buf->head->datalen < sz)
+          sz = buf->head->datalen;
+        r = buf_flush_to_socket(buf, fds[0], sz);
+        tor_assert(r >= 0);
+        sent += r;
+        if ((size_t)r < sz) {
+          /* The socket is full: play the other end. */
+          while (tor_socket_recv(fds[1], sink, 65536, 0) > 0)
+            ;
+        }
+      }
+    }
+    while (tor_socket_recv(fds[1], sink, 65536, 0) > 0)
+      ;
+    end = perftime();
+    buf_net_get_stats(&after);
+
+    printf("%s: %.2f write calls per MB, %.2f msec CPU per Gbit\n",
+           per_chunk ? "One chunk per call" : "Gathered chunks   ",
+           (after.n_write_calls - before.n_write_calls) /
+             ((double)sent / (1<<20)),
+           NANOCOUNT(start, end, sent) * 125);
+    buf_free(buf);
+  }
+
+  tor_close_socket(fds[0]);
+  tor_close_socket(fds[1]);
+  tor_free(sink);
+}
+
+/** Helper for bench_tls_relay(): set <b>fds</b> to a connected pair of TCP
+ * sockets on the loopback interface.  Return 0 on success, -1 on failure. */
+static int
+open_loopback_tcp_pair(tor_socket_t fds[2])
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  tor_socket_t listener;
+
+  fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  listener = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(listener))
+    return -1;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listener, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr *)&sin, &len) < 0)
+    goto err;
+  fds[0] = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(fds[0]) ||
+      connect(fds[0], (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    goto err;
+  len = sizeof(sin);
+  fds[1] = tor_accept_socket(listener, (struct sockaddr *)&sin, &len);
+  if (!SOCKET_OK(fds[1]))
+    goto err;
+  tor_close_socket(listener);
+  return 0;
+ err:
+  tor_close_socket(listener);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  return -1;
+}
+
+/** Run a loopback benchmark of TLS link traffic: report the CPU time (for
+ * both ends) that we spend per relayed Gbit, with and without kernel TLS
+ * offload. */
+static void
+bench_tls_relay(void)
+{
+  const size_t total = 256 << 20;
+  crypto_pk_t *pk1 = crypto_pk_new(), *pk2 = crypto_pk_new();
+  char *block = tor_malloc(16384), *sink = tor_malloc(16384);
+  int use_ktls;
+
+  crypto_pk_generate_key(pk1);
+  crypto_pk_generate_key(pk2);
+  crypto_rand(block, 16384);
+
+  for (use_ktls = 0; use_ktls <= 1; ++use_ktls) {
+    tor_tls_t *client = NULL, *server = NULL;
+    tor_socket_t fds[2];
+    bool client_done = false, server_done = false;
+    bool ktls_send = false, ktls_recv = false;
+    size_t sent = 0, received = 0;
+    uint64_t start, end;
+    int r;
+
+    if (tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER |
+                             (use_ktls ? TOR_TLS_CTX_USE_KTLS : 0),
+                             pk1, pk2, 86400) < 0 ||
+        open_loopback_tcp_pair(fds) < 0) {
+      puts("Couldn't set up TLS over loopback; skipping.");
+      break;
+    }
+    set_socket_nonblocking(fds[0]);
+    set_socket_nonblocking(fds[1]);
+    client = tor_tls_new(fds[0], 0);
+    server = tor_tls_new(fds[1], 1);
+    while (!(client_done && server_done)) {
+      if (!client_done) {
+        r = tor_tls_handshake(client);
+        tor_assert(r == TOR_TLS_DONE || !TOR_TLS_IS_ERROR(r));
+        client_done = (r == TOR_TLS_DONE);
+      }
+      if (!server_done) {
+        r = tor_tls_handshake(server);
+        tor_assert(r == TOR_TLS_DONE || !TOR_TLS_IS_ERROR(r));
+        server_done = (r == TOR_TLS_DONE);
+      }
+    }
+    tor_tls_get_kernel_offload(client, &ktls_send, &ktls_recv);
+
+    reset_perftime();
+    start = perftime();
+    while (received < total) {
+      while (sent < total) {
+        r = tor_tls_write(client, block, 16384);
+        if (r <= 0)
+          break;
+        sent += r;
+      }
+      while ((r = tor_tls_read(server, sink, 16384)) > 0)
+        received += r;
+      tor_assert(r == TOR_TLS_WANTREAD || r == TOR_TLS_WANTWRITE);
+    }
+    end = perftime();
+
+    printf("%s (kTLS send %d, recv %d): %.2f msec CPU per Gbit\n",
+           use_ktls ? "KernelTLS 1" : "KernelTLS 0",
+           ktls_send, ktls_recv, NANOCOUNT(start, end, received) * 125);
+    tor_tls_free(client);
+    tor_tls_free(server);
+  }
+
+  crypto_pk_free(pk1);
+  crypto_pk_free(pk2);
+  tor_free(block);
+  tor_free(sink);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -760,6 +1704,11 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cell_queue),
+  ENT(cmux_ewma),
+  ENT(exit_package),
+  ENT(buf_flush),
+  ENT(tls_relay),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -768,6 +1717,8 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(exit_ports),
+  ENT(geoip),
   {NULL,NULL,0}
 };
 
@@ -823,6 +1774,12 @@ main(int argc, const char **argv)
   for (i = 1; i < argc; ++i) {
     if (!strcmp(argv[i], "--list")) {
       list = 1;
+    } else if (!strcmp(argv[i], "--microdescs") && i + 1 < argc) {
+      bench_microdescs_fname = argv[++i];
+    } else if (!strcmp(argv[i], "--geoip") && i + 1 < argc) {
+      bench_geoip_fname = argv[++i];
+    } else if (!strcmp(argv[i], "--geoip6") && i + 1 < argc) {
+      bench_geoip6_fname = argv[++i];
     } else {
       benchmark_t *benchmark = find_benchmark(argv[i]);
       ++n_enabled;
@@ -17,6 +17,7 @@
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitpadding.h"
+#include "core/or/congestion_control_common.h"
 #include "core/or/crypt_path.h"
 #include "core/or/relay.h"
 #include "core/or/relay_crypto_st.h"
@@ -79,6 +80,11 @@ free_fake_orcirc(or_circuit_t *orcirc)
   relay_crypto_clear(&orcirc->crypto);
 
   circpad_circuit_free_all_machineinfos(circ);
+  congestion_control_free(circ->ccontrol);
+  if (circ->sendme_last_digests) {
+    SMARTLIST_FOREACH(circ->sendme_last_digests, uint8_t *, d, tor_free(d));
+    smartlist_free(circ->sendme_last_digests);
+  }
 
   if (orcirc->p_chan && orcirc->p_chan->cmux) {
     circuitmux_detach_circuit(orcirc->p_chan->cmux, circ);
@@ -33,12 +33,14 @@
 #define ROUTER_PRIVATE
 #define CIRCUITSTATS_PRIVATE
 #define CIRCUITLIST_PRIVATE
+#define CPUWORKER_PRIVATE
 #define MAINLOOP_PRIVATE
 #define STATEFILE_PRIVATE
 
 #include "core/or/or.h"
 #include "lib/err/backtrace.h"
 #include "lib/buf/buffers.h"
+#include "core/or/channel.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitstats.h"
 #include "lib/compress/compress.h"
@@ -49,13 +51,16 @@
 #include "feature/rend/rendcache.h"
 #include "feature/rend/rendparse.h"
 #include "test/test.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/memarea/memarea.h"
 #include "core/or/onion.h"
 #include "core/crypto/onion_ntor.h"
 #include "core/crypto/onion_fast.h"
 #include "core/crypto/onion_tap.h"
 #include "core/or/policies.h"
+#include "feature/nodelist/networkstatus.h"
 #include "app/config/statefile.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 
@@ -65,6 +70,7 @@
 #include "feature/rend/rend_intro_point_st.h"
 #include "feature/rend/rend_service_descriptor_st.h"
 #include "feature/relay/onion_queue.h"
+#include "feature/relay/router.h"
 
 /** Run unit tests for the onion handshake code. */
 static void
@@ -355,6 +361,307 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+static int onion_queue_codel_enabled = 0;
+
+static int32_t
+mock_onion_queue_get_param(const networkstatus_t *ns, const char *param_name,
+                           int32_t default_val, int32_t min_val,
+                           int32_t max_val)
+{
+  (void)ns;
+  (void)min_val;
+  (void)max_val;
+  if (!strcmp(param_name, "OnionQueueCoDel"))
+    return onion_queue_codel_enabled;
+  return default_val;
+}
+
+static int n_onion_queue_marked = 0;
+
+static void
+mock_onion_queue_mark_for_close_(circuit_t *circ, int reason, int line,
+                                 const char *file)
+{
+  (void)reason;
+  (void)line;
+  (void)file;
+  circ->marked_for_close = 1;
+  ++n_onion_queue_marked;
+}
+
+/** Helper: queue an ntor onionskin for <b>circ</b>. */
+static int
+onion_queue_add_ntor(or_circuit_t *circ)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  create_cell_t *create = tor_malloc_zero(sizeof(create_cell_t));
+
+  create_cell_init(create, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  if (onion_pending_add(circ, create) < 0) {
+    tor_free(create);
+    return -1;
+  }
+  return 0;
+}
+
+/** Run unit tests for the CoDel management of the onion queues. */
+static void
+test_onion_queue_codel(void *arg)
+{
+#define N_CODEL_CIRCS 10
+  or_circuit_t *circs[N_CODEL_CIRCS];
+  create_cell_t *onionskin = NULL;
+  onion_queue_stats_t stats;
+  int i;
+  (void)arg;
+
+  MOCK(networkstatus_get_param, mock_onion_queue_get_param);
+  MOCK(circuit_mark_for_close_, mock_onion_queue_mark_for_close_);
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(INT64_C(1000) * 1000 * 1000);
+  onion_queue_codel_enabled = 1;
+
+  for (i = 0; i < N_CODEL_CIRCS; ++i) {
+    circs[i] = or_circuit_new(0, NULL);
+    tt_int_op(onion_queue_add_ntor(circs[i]), OP_EQ, 0);
+  }
+
+  /* Above target, but not for a whole interval yet: nothing dropped. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(1100) * 1000 * 1000);
+  tt_ptr_op(onion_next_task(&onionskin), OP_EQ, circs[0]);
+  tor_free(onionskin);
+  tt_int_op(n_onion_queue_marked, OP_EQ, 0);
+
+  /* Above target for an interval: drop one, and serve the next one. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(1700) * 1000 * 1000);
+  tt_ptr_op(onion_next_task(&onionskin), OP_EQ, circs[2]);
+  tor_free(onionskin);
+  tt_int_op(n_onion_queue_marked, OP_EQ, 1);
+  tt_assert(TO_CIRCUIT(circs[1])->marked_for_close);
+  tt_ptr_op(circs[1]->onionqueue_entry, OP_EQ, NULL);
+
+  /* Before the next drop time, nothing is dropped... */
+  tt_ptr_op(onion_next_task(&onionskin), OP_EQ, circs[3]);
+  tor_free(onionskin);
+  tt_int_op(n_onion_queue_marked, OP_EQ, 1);
+
+  /* ... and after it, we drop one more. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(2200) * 1000 * 1000);
+  tt_ptr_op(onion_next_task(&onionskin), OP_EQ, circs[5]);
+  tor_free(onionskin);
+  tt_int_op(n_onion_queue_marked, OP_EQ, 2);
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ, 4);
+
+  /* Without CoDel, old onionskins only expire after the cutoff. */
+  onion_queue_codel_enabled = 0;
+  monotime_coarse_set_mock_time_nsec(INT64_C(3000) * 1000 * 1000);
+  tt_ptr_op(onion_next_task(&onionskin), OP_EQ, circs[6]);
+  tor_free(onionskin);
+  tt_int_op(n_onion_queue_marked, OP_EQ, 2);
+
+  /* CoDel catches up with the drops it missed, but never drops the last
+   * onionskin of a queue. */
+  onion_queue_codel_enabled = 1;
+  tt_ptr_op(onion_next_task(&onionskin), OP_EQ, circs[9]);
+  tor_free(onionskin);
+  tt_int_op(n_onion_queue_marked, OP_EQ, 4);
+  tt_assert(TO_CIRCUIT(circs[8])->marked_for_close);
+  tt_assert(! TO_CIRCUIT(circs[9])->marked_for_close);
+  tt_ptr_op(onion_next_task(&onionskin), OP_EQ, NULL);
+
+  onion_queue_get_stats(&stats);
+  tt_u64_op(stats.n_codel_dropped, OP_EQ, 4);
+  tt_u64_op(stats.n_expired, OP_EQ, 0);
+  tt_int_op(stats.delay_msec_p50, OP_EQ, 700);
+  tt_int_op(stats.delay_msec_p99, OP_EQ, 2000);
+
+ done:
+  clear_pending_onions();
+  for (i = 0; i < N_CODEL_CIRCS; ++i)
+    circuit_free_(TO_CIRCUIT(circs[i]));
+  tor_free(onionskin);
+  monotime_disable_test_mocking();
+  UNMOCK(networkstatus_get_param);
+  UNMOCK(circuit_mark_for_close_);
+#undef N_CODEL_CIRCS
+}
+
+/** Run unit tests for the per-source fairness of the onion queues. */
+static void
+test_onion_queue_fairness(void *arg)
+{
+#define N_FAIR_CIRCS 80
+  or_circuit_t *circs[N_FAIR_CIRCS];
+  channel_t chan_a, chan_b;
+  create_cell_t *onionskin = NULL;
+  onion_queue_stats_t stats;
+  int i;
+  (void)arg;
+
+  memset(circs, 0, sizeof(circs));
+  MOCK(networkstatus_get_param, mock_onion_queue_get_param);
+  MOCK(circuit_mark_for_close_, mock_onion_queue_mark_for_close_);
+  /* Make the queues full as soon as they have 50 entries. */
+  get_options_mutable()->MaxOnionQueueDelay = 0;
+  onion_queue_codel_enabled = 1;
+
+  memset(&chan_a, 0, sizeof(chan_a));
+  memset(&chan_b, 0, sizeof(chan_b));
+  chan_a.global_identifier = 1;
+  chan_b.global_identifier = 2;
+  for (i = 0; i < N_FAIR_CIRCS; ++i) {
+    circs[i] = or_circuit_new(0, NULL);
+    circs[i]->p_chan = (i < 50) ? &chan_a : &chan_b;
+  }
+
+  /* One relay fills the queue. */
+  for (i = 0; i < 50; ++i)
+    tt_int_op(onion_queue_add_ntor(circs[i]), OP_EQ, 0);
+
+  /* Another one still gets its onionskins in, at the expense of the
+   * oldest ones of the first one... */
+  tt_int_op(onion_queue_add_ntor(circs[50]), OP_EQ, 0);
+  tt_int_op(onion_queue_add_ntor(circs[51]), OP_EQ, 0);
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ, 50);
+  tt_int_op(n_onion_queue_marked, OP_EQ, 2);
+  tt_assert(TO_CIRCUIT(circs[0])->marked_for_close);
+  tt_assert(TO_CIRCUIT(circs[1])->marked_for_close);
+
+  /* ... until both have as many queued. */
+  for (i = 52; i < 75; ++i)
+    tt_int_op(onion_queue_add_ntor(circs[i]), OP_EQ, 0);
+  tt_int_op(onion_queue_add_ntor(circs[75]), OP_EQ, -1);
+  onion_queue_get_stats(&stats);
+  tt_u64_op(stats.n_fairness_shed, OP_EQ, 25);
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ, 50);
+
+  /* Without CoDel, a full queue refuses everyone. */
+  onion_queue_codel_enabled = 0;
+  onion_pending_remove(circs[50]);
+  tt_int_op(onion_queue_add_ntor(circs[75]), OP_EQ, 0);
+  tt_int_op(onion_queue_add_ntor(circs[76]), OP_EQ, -1);
+  tt_int_op(n_onion_queue_marked, OP_EQ, 25);
+
+  /* The entries come out in the order they went in. */
+  tt_ptr_op(onion_next_task(&onionskin), OP_EQ, circs[25]);
+  tor_free(onionskin);
+
+ done:
+  clear_pending_onions();
+  for (i = 0; i < N_FAIR_CIRCS; ++i) {
+    if (circs[i]) {
+      circs[i]->p_chan = NULL;
+      circuit_free_(TO_CIRCUIT(circs[i]));
+    }
+  }
+  tor_free(onionskin);
+  UNMOCK(networkstatus_get_param);
+  UNMOCK(circuit_mark_for_close_);
+#undef N_FAIR_CIRCS
+}
+
+/** Run unit tests for the size of the onionskin batches that we give to the
+ * cpuworkers. */
+static void
+test_onion_batch_size(void *arg)
+{
+  (void)arg;
+
+  /* Nothing waits, or no room: no job. */
+  tt_int_op(cpuworker_next_batch_size(10, 0, 0), OP_EQ, 0);
+  tt_int_op(cpuworker_next_batch_size(0, 10, 100), OP_EQ, 0);
+
+  /* A short queue goes out as it is. */
+  tt_int_op(cpuworker_next_batch_size(100, 3, 50), OP_EQ, 3);
+  tt_int_op(cpuworker_next_batch_size(2, 2, 50), OP_EQ, 2);
+
+  /* A long queue goes out in full batches. */
+  tt_int_op(cpuworker_next_batch_size(100, 20, 50), OP_EQ, 8);
+  tt_int_op(cpuworker_next_batch_size(8, 20, 50), OP_EQ, 8);
+
+  /* When there is room for less than a batch, wait for more replies... */
+  tt_int_op(cpuworker_next_batch_size(1, 20, 50), OP_EQ, 0);
+  tt_int_op(cpuworker_next_batch_size(7, 20, 50), OP_EQ, 0);
+  /* ... unless the workers have nothing to do. */
+  tt_int_op(cpuworker_next_batch_size(7, 20, 0), OP_EQ, 7);
+
+ done:
+  ;
+}
+
+/** Jobs that mock_cpuworker_queue_work() was given. */
+static smartlist_t *onion_batch_jobs = NULL;
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void)priority;
+  (void)fn;
+  (void)reply_fn;
+  smartlist_add(onion_batch_jobs, arg);
+  /* Any non-NULL pointer will do: nobody looks inside it. */
+  return (workqueue_entry_t *)arg;
+}
+
+/** Check that a new onionskin waits behind the ones that are already queued,
+ * even when the workers have room for it. */
+static void
+test_onion_batch_fifo(void *arg)
+{
+  or_circuit_t *circ_old = NULL, *circ_new = NULL;
+  create_cell_t *create = NULL;
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  channel_t chan;
+  (void)arg;
+
+  onion_batch_jobs = smartlist_new();
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  /* The workers copy our onion keys, which need the key lock. */
+  tt_int_op(init_keys_client(), OP_EQ, 0);
+  cpu_init();
+
+  memset(&chan, 0, sizeof(chan));
+  circ_old = or_circuit_new(0, NULL);
+  circ_new = or_circuit_new(0, NULL);
+  circ_old->p_chan = circ_new->p_chan = &chan;
+
+  /* An onionskin waits for a batch to fill up. */
+  tt_int_op(onion_queue_add_ntor(circ_old), OP_EQ, 0);
+
+  /* A new one doesn't overtake it: both go out in one job, oldest first. */
+  create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(create, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  tt_int_op(assign_onionskin_to_cpuworker(circ_new, create), OP_EQ, 0);
+  create = NULL;
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ, 0);
+  tt_int_op(smartlist_len(onion_batch_jobs), OP_EQ, 1);
+  tt_ptr_op(circ_old->workqueue_entry, OP_NE, NULL);
+  tt_ptr_op(circ_new->workqueue_entry, OP_EQ, circ_old->workqueue_entry);
+  tt_assert(circ_new->workqueue_entry_is_batch);
+
+ done:
+  clear_pending_onions();
+  tor_free(create);
+  if (circ_old) {
+    circ_old->workqueue_entry = NULL;
+    circ_old->p_chan = NULL;
+    circuit_free_(TO_CIRCUIT(circ_old));
+  }
+  if (circ_new) {
+    circ_new->workqueue_entry = NULL;
+    circ_new->p_chan = NULL;
+    circuit_free_(TO_CIRCUIT(circ_new));
+  }
+  SMARTLIST_FOREACH(onion_batch_jobs, void *, job, tor_free(job));
+  smartlist_free(onion_batch_jobs);
+  UNMOCK(cpuworker_queue_work);
+}
+
 static void
 test_circuit_timeout(void *arg)
 {
@@ -656,6 +963,10 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  FORK(onion_queue_codel),
+  FORK(onion_queue_fairness),
+  ENT(onion_batch_size),
+  FORK(onion_batch_fifo),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
@@ -687,6 +998,7 @@ struct testgroup_t testgroups[] = {
   { "circuitstats/", circuitstats_tests },
   { "circuituse/", circuituse_tests },
   { "compat/libevent/", compat_libevent_tests },
+  { "congestion_control/", congestion_control_tests },
   { "config/", config_tests },
   { "config/mgr/", confmgr_tests },
   { "config/parse/", confparse_tests },
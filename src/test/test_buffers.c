@@ -7,6 +7,7 @@
 #define PROTO_HTTP_PRIVATE
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
+#include "lib/net/buffers_net.h"
 #include "lib/tls/buffers_tls.h"
 #include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
@@ -789,6 +790,42 @@ test_buffers_chunk_size(void *arg)
   ;
 }
 
+static void
+test_buffers_set_chunk_size(void *arg)
+{
+  (void)arg;
+  buf_t *buf = buf_new();
+  char cell[CELL_MAX_NETWORK_SIZE];
+  int i, n_chunks = 0;
+  const chunk_t *ch;
+
+  memset(cell, 0x5a, sizeof(cell));
+
+  /* This is what an OR connection's outbuf looks like: every chunk should
+   * hold about 16KB, so that the TLS layer gets full-sized writes. */
+  tt_uint_op(buf_get_default_chunk_size(buf), OP_EQ, 4096);
+  buf_set_default_chunk_size(buf, 16384);
+  tt_uint_op(buf_get_default_chunk_size(buf), OP_EQ, 16384);
+
+  for (i = 0; i < 64; ++i)
+    buf_add(buf, cell, sizeof(cell));
+  buf_assert_ok(buf);
+  tt_uint_op(buf_datalen(buf), OP_EQ, 64 * sizeof(cell));
+
+  for (ch = buf->head; ch; ch = ch->next) {
+    ++n_chunks;
+    tt_uint_op(ch->memlen, OP_GT, 16000);
+    /* Every chunk but the last one is full. */
+    if (ch->next)
+      tt_uint_op(ch->datalen, OP_EQ, ch->memlen);
+  }
+  /* 64 cells are a little over 32KB. */
+  tt_int_op(n_chunks, OP_EQ, 3);
+
+ done:
+  buf_free(buf);
+}
+
 static void
 test_buffers_find_contentlen(void *arg)
 {
@@ -858,6 +895,135 @@ test_buffer_peek_startswith(void *arg)
   buf_free(buf);
 }
 
+#ifndef _WIN32
+static void
+test_buffers_flush_to_socket(void *arg)
+{
+  (void)arg;
+  buf_t *buf = buf_new_with_capacity(4096);
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  char *data = tor_malloc(8*4096), *got = tor_malloc(8*4096);
+  buf_net_stats_t before, after;
+  int n_chunks = 0, r;
+  ssize_t n_read = 0;
+
+  crypto_rand(data, 8*4096);
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+
+  /* Add the data in cell-sized pieces, as the relay code would. */
+  for (r = 0; r < 8*4096; r += 512)
+    buf_add(buf, data + r, 512);
+  for (chunk_t *c = buf->head; c; c = c->next)
+    ++n_chunks;
+  tt_int_op(n_chunks, OP_GT, 1);
+
+  /* Flush part of the data, stopping in the middle of a chunk. */
+  buf_net_get_stats(&before);
+  r = buf_flush_to_socket(buf, fds[0], 3*4096 + 100);
+  tt_int_op(r, OP_EQ, 3*4096 + 100);
+  tt_int_op(buf_datalen(buf), OP_EQ, 5*4096 - 100);
+
+  /* Then flush the rest. */
+  r = buf_flush_to_socket(buf, fds[0], buf_datalen(buf));
+  tt_int_op(r, OP_EQ, 5*4096 - 100);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+  buf_net_get_stats(&after);
+
+  tt_u64_op(after.n_bytes_written - before.n_bytes_written, OP_EQ, 8*4096);
+#ifdef HAVE_WRITEV
+  /* Each flush spans several chunks, but needs only one syscall. */
+  tt_u64_op(after.n_write_calls - before.n_write_calls, OP_EQ, 2);
+#else
+  tt_u64_op(after.n_write_calls - before.n_write_calls, OP_GE, n_chunks);
+#endif
+
+  /* The data must come out unchanged and in order. */
+  while (n_read < 8*4096) {
+    ssize_t n = tor_socket_recv(fds[1], got + n_read, 8*4096 - n_read, 0);
+    tt_int_op(n, OP_GT, 0);
+    n_read += n;
+  }
+  tt_mem_op(got, OP_EQ, data, 8*4096);
+
+ done:
+  buf_free(buf);
+  tor_free(data);
+  tor_free(got);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+}
+
+static void
+test_buffers_read_from_socket(void *arg)
+{
+  (void)arg;
+  buf_t *buf = buf_new_with_capacity(4096);
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  char *data = tor_malloc(32768), *got = tor_malloc(32768);
+  buf_net_stats_t before, after;
+  int r, eof = 0, err = 0;
+  size_t tail_room;
+
+  crypto_rand(data, 32768);
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);
+
+  /* Leave some room in the tail chunk, then make more data than it can hold
+   * ready on the socket. */
+  buf_add(buf, data, 1000);
+  tail_room = CHUNK_REMAINING_CAPACITY(buf->tail);
+  tt_int_op(tail_room, OP_GT, 0);
+  tt_int_op(tor_socket_send(fds[0], data + 1000, 20000, 0), OP_EQ, 20000);
+
+  buf_net_get_stats(&before);
+  r = buf_read_from_socket(buf, fds[1], 32768 - 1000, &eof, &err);
+  tt_int_op(r, OP_EQ, 20000);
+  tt_int_op(eof, OP_EQ, 0);
+  buf_net_get_stats(&after);
+  buf_assert_ok(buf);
+  tt_u64_op(after.n_bytes_read - before.n_bytes_read, OP_EQ, 20000);
+#ifdef HAVE_READV
+  /* The data spans the tail chunk and a fresh one, but needs only one
+   * syscall. */
+  tt_u64_op(after.n_read_calls - before.n_read_calls, OP_EQ, 1);
+#endif
+  /* We must not have kept any fresh chunk that got no data. */
+  tt_u64_op(buf->tail->datalen, OP_GT, 0);
+  tt_ptr_op(buf->tail->next, OP_EQ, NULL);
+
+  /* Nothing more to read: we must not grow the buffer. */
+  r = buf_read_from_socket(buf, fds[1], 4096, &eof, &err);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 0);
+  tt_u64_op(buf->tail->datalen, OP_GT, 0);
+  buf_assert_ok(buf);
+
+  /* EOF. */
+  tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  r = buf_read_from_socket(buf, fds[1], 4096, &eof, &err);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 1);
+  buf_assert_ok(buf);
+
+  tt_int_op(buf_datalen(buf), OP_EQ, 21000);
+  buf_get_bytes(buf, got, 21000);
+  tt_mem_op(got, OP_EQ, data, 21000);
+
+ done:
+  buf_free(buf);
+  tor_free(data);
+  tor_free(got);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+}
+#endif /* !defined(_WIN32) */
+
 struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
@@ -870,7 +1036,12 @@ struct testcase_t buffer_tests[] = {
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
+  { "set_chunk_size", test_buffers_set_chunk_size, 0, NULL, NULL },
   { "find_contentlen", test_buffers_find_contentlen, 0, NULL, NULL },
+#ifndef _WIN32
+  { "flush_to_socket", test_buffers_flush_to_socket, TT_FORK, NULL, NULL },
+  { "read_from_socket", test_buffers_read_from_socket, TT_FORK, NULL, NULL },
+#endif
 
   { "compress/zlib", test_buffers_compress, TT_FORK,
     &passthrough_setup, (char*)"deflate" },
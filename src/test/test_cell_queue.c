@@ -12,6 +12,9 @@
 #include "core/or/cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
 #include "core/or/origin_circuit_st.h"
+#include "core/or/destroy_cell_queue_st.h"
+
+#include "lib/malloc/slab.h"
 
 static void
 test_cq_manip(void *arg)
@@ -139,9 +142,125 @@ test_circuit_n_cells(void *arg)
   circuit_free_(TO_CIRCUIT(origin_c));
 }
 
+static void
+test_cell_pools(void *arg)
+{
+  cell_queue_t cq;
+  destroy_cell_queue_t dq;
+  slab_pool_stats_t packed, destroy;
+  uint64_t packed_used, destroy_used;
+  int i;
+  (void) arg;
+
+  cell_queue_init(&cq);
+  destroy_cell_queue_init(&dq);
+
+  cell_pools_get_stats(&packed, &destroy);
+  packed_used = packed.n_used;
+  destroy_used = destroy.n_used;
+
+  for (i = 0; i < 200; ++i) {
+    cell_queue_append(&cq, packed_cell_new());
+    destroy_cell_queue_append(&dq, i, 1);
+  }
+  cell_pools_get_stats(&packed, &destroy);
+  tt_u64_op(packed.n_used, OP_EQ, packed_used + 200);
+  tt_u64_op(packed.n_used_max, OP_GE, packed_used + 200);
+  tt_u64_op(packed.n_bytes, OP_GE, 200 * sizeof(packed_cell_t));
+  tt_u64_op(destroy.n_used, OP_EQ, destroy_used + 200);
+
+  /* Queued cells come back to the pools when the queues are cleared, and
+   * the pools give the empty slabs back on demand. */
+  cell_queue_clear(&cq);
+  destroy_cell_queue_clear(&dq);
+  cell_pools_get_stats(&packed, &destroy);
+  tt_u64_op(packed.n_used, OP_EQ, packed_used);
+  tt_u64_op(destroy.n_used, OP_EQ, destroy_used);
+  tt_u64_op(packed.n_empty_slabs, OP_GT, 0);
+
+  tt_u64_op(cell_pools_reclaim(), OP_GT, 0);
+  cell_pools_get_stats(&packed, &destroy);
+  tt_u64_op(packed.n_empty_slabs, OP_EQ, 0);
+  tt_u64_op(destroy.n_empty_slabs, OP_EQ, 0);
+
+ done:
+  cell_queue_clear(&cq);
+  destroy_cell_queue_clear(&dq);
+}
+
+static void
+test_cq_blocks(void *arg)
+{
+  cell_queue_t cq;
+  packed_cell_t *cells[CELL_QUEUE_BLOCK_LEN * 3 + 5];
+  packed_cell_t *pc;
+  const int n = (int) ARRAY_LENGTH(cells);
+  uint32_t ts;
+  int i, next_pop = 0;
+  (void) arg;
+
+  cell_queue_init(&cq);
+  tt_assert(! cell_queue_get_oldest_timestamp(&cq, &ts));
+
+  for (i = 0; i < n; ++i) {
+    cells[i] = packed_cell_new();
+    cells[i]->inserted_timestamp = 1000 + i;
+  }
+
+  /* Fill a few blocks, and check that cells come out in order, with the
+   * right timestamps, while we keep appending behind them. */
+  for (i = 0; i < n; ++i) {
+    cell_queue_append(&cq, cells[i]);
+    tt_int_op(cq.n, OP_EQ, i + 1 - next_pop);
+    if (i % 3 == 2) {
+      tt_assert(cell_queue_get_oldest_timestamp(&cq, &ts));
+      tt_uint_op(ts, OP_EQ, 1000 + next_pop);
+      pc = cell_queue_pop(&cq);
+      tt_ptr_op(pc, OP_EQ, cells[next_pop]);
+      ++next_pop;
+    }
+  }
+  tt_ptr_op(cq.head, OP_NE, cq.tail);
+
+  while (next_pop < n) {
+    tt_assert(cell_queue_get_oldest_timestamp(&cq, &ts));
+    tt_uint_op(ts, OP_EQ, 1000 + next_pop);
+    tt_ptr_op(cell_queue_pop(&cq), OP_EQ, cells[next_pop]);
+    ++next_pop;
+  }
+  tt_int_op(cq.n, OP_EQ, 0);
+  tt_ptr_op(cq.head, OP_EQ, NULL);
+  tt_ptr_op(cq.tail, OP_EQ, NULL);
+  tt_ptr_op(cell_queue_pop(&cq), OP_EQ, NULL);
+  tt_assert(! cell_queue_get_oldest_timestamp(&cq, &ts));
+
+  /* Exactly one full block, then clear it along with a partial one. */
+  for (i = 0; i < CELL_QUEUE_BLOCK_LEN; ++i)
+    cell_queue_append(&cq, cells[i]);
+  tt_ptr_op(cq.head, OP_EQ, cq.tail);
+  tt_int_op(cq.tail_idx, OP_EQ, CELL_QUEUE_BLOCK_LEN);
+  cell_queue_append(&cq, cells[i]);
+  tt_ptr_op(cq.head, OP_NE, cq.tail);
+  tt_int_op(cq.tail_idx, OP_EQ, 1);
+  pc = cell_queue_pop(&cq);
+  tt_ptr_op(pc, OP_EQ, cells[0]);
+  packed_cell_free(pc);
+  cell_queue_clear(&cq);
+  tt_int_op(cq.n, OP_EQ, 0);
+  tt_ptr_op(cq.head, OP_EQ, NULL);
+  for (i = CELL_QUEUE_BLOCK_LEN + 1; i < n; ++i)
+    packed_cell_free(cells[i]);
+  return;
+
+ done:
+  cell_queue_clear(&cq);
+}
+
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
+  { "blocks", test_cq_blocks, TT_FORK, NULL, NULL },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
+  { "pools", test_cell_pools, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -182,6 +182,77 @@ test_clist_maps(void *arg)
   UNMOCK(circuitmux_detach_circuit);
 }
 
+static void
+test_clist_maps_many(void *arg)
+{
+  channel_t *ch1 = new_fake_channel();
+  channel_t *ch2 = new_fake_channel();
+  or_circuit_t *or_c1 = NULL;
+  circid_t id;
+  const circid_t first = 1000, last = 6000;
+
+  (void) arg;
+
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_mock);
+  MOCK(circuitmux_detach_circuit, circuitmux_detach_mock);
+  ch1->cmux = tor_malloc(1);
+  ch2->cmux = tor_malloc(1);
+
+  or_c1 = or_circuit_new(7, ch1);
+  circuit_set_n_circid_chan(TO_CIRCUIT(or_c1), 7, ch2);
+
+  /* Make the map grow well past its initial size, and make sure that the
+   * circuit and the placeholders all move along. */
+  for (id = first; id < last; ++id) {
+    channel_mark_circid_unusable(ch1, id);
+    channel_mark_circid_unusable(ch2, id);
+  }
+  tt_ptr_op(circuit_get_by_circid_channel(7, ch1), OP_EQ, TO_CIRCUIT(or_c1));
+  tt_ptr_op(circuit_get_by_circid_channel(7, ch2), OP_EQ, TO_CIRCUIT(or_c1));
+  for (id = first; id < last; ++id) {
+    tt_int_op(circuit_id_in_use_on_channel(id, ch1), OP_EQ, 2);
+    tt_int_op(circuit_id_in_use_on_channel(id, ch2), OP_EQ, 2);
+  }
+  tt_int_op(circuit_id_in_use_on_channel(last, ch1), OP_EQ, 0);
+  tt_int_op(circuit_id_when_marked_unusable_on_channel(first, ch1), OP_NE, 0);
+  tt_int_op(circuit_id_when_marked_unusable_on_channel(7, ch1), OP_EQ, 0);
+
+  /* Removing entries moves others around: check that they can all still be
+   * found. */
+  for (id = first; id < last; id += 2)
+    channel_mark_circid_usable(ch1, id);
+  for (id = first; id < last; ++id) {
+    tt_int_op(circuit_id_in_use_on_channel(id, ch1), OP_EQ,
+              (id - first) % 2 ? 2 : 0);
+    tt_int_op(circuit_id_in_use_on_channel(id, ch2), OP_EQ, 2);
+  }
+  tt_ptr_op(circuit_get_by_circid_channel(7, ch1), OP_EQ, TO_CIRCUIT(or_c1));
+
+  /* Now empty most of the map, so that it shrinks. */
+  for (id = first; id < last; ++id) {
+    channel_mark_circid_usable(ch1, id);
+    channel_mark_circid_usable(ch2, id);
+  }
+  for (id = first; id < last; ++id) {
+    tt_int_op(circuit_id_in_use_on_channel(id, ch1), OP_EQ, 0);
+    tt_int_op(circuit_id_in_use_on_channel(id, ch2), OP_EQ, 0);
+  }
+  tt_ptr_op(circuit_get_by_circid_channel(7, ch1), OP_EQ, TO_CIRCUIT(or_c1));
+  tt_ptr_op(circuit_get_by_circid_channel(7, ch2), OP_EQ, TO_CIRCUIT(or_c1));
+
+ done:
+  if (or_c1)
+    circuit_free_(TO_CIRCUIT(or_c1));
+  if (ch1)
+    tor_free(ch1->cmux);
+  if (ch2)
+    tor_free(ch2->cmux);
+  tor_free(ch1);
+  tor_free(ch2);
+  UNMOCK(circuitmux_attach_circuit);
+  UNMOCK(circuitmux_detach_circuit);
+}
+
 static void
 test_rend_token_maps(void *arg)
 {
@@ -466,6 +537,7 @@ test_hs_circuitmap_isolation(void *arg)
 
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
+  { "maps_many", test_clist_maps_many, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
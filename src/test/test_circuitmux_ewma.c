@@ -4,9 +4,12 @@
 #define CIRCUITMUX_PRIVATE
 #define CIRCUITMUX_EWMA_PRIVATE
 
+#include <math.h>
+
 #include "core/or/or.h"
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
+#include "app/config/or_options_st.h"
 
 #include "test/fakechans.h"
 #include "test/fakecircs.h"
@@ -185,6 +188,277 @@ test_cmux_ewma_policy_data(void *arg)
   ewma_policy.free_cmux_data(&cmux, pol_data);
 }
 
+static void
+test_cmux_ewma_bucket_idx(void *arg)
+{
+  int i, prev;
+
+  (void) arg;
+
+  tt_int_op(cell_ewma_get_bucket_idx(0.0), OP_EQ, 0);
+  tt_int_op(cell_ewma_get_bucket_idx(ldexp(1.0, EWMA_BUCKET_MIN_LOG2 - 1)),
+            OP_EQ, 0);
+  tt_int_op(cell_ewma_get_bucket_idx(ldexp(1.0, EWMA_BUCKET_MIN_LOG2)),
+            OP_EQ, 1);
+  tt_int_op(cell_ewma_get_bucket_idx(1.0), OP_EQ,
+            1 - EWMA_BUCKET_MIN_LOG2 * EWMA_BUCKETS_PER_OCTAVE);
+  tt_int_op(cell_ewma_get_bucket_idx(1.2), OP_EQ,
+            2 - EWMA_BUCKET_MIN_LOG2 * EWMA_BUCKETS_PER_OCTAVE);
+  tt_int_op(cell_ewma_get_bucket_idx(1.99), OP_EQ,
+            4 - EWMA_BUCKET_MIN_LOG2 * EWMA_BUCKETS_PER_OCTAVE);
+  tt_int_op(cell_ewma_get_bucket_idx(2.0), OP_EQ,
+            5 - EWMA_BUCKET_MIN_LOG2 * EWMA_BUCKETS_PER_OCTAVE);
+  tt_int_op(cell_ewma_get_bucket_idx(1e300), OP_EQ, EWMA_N_BUCKETS - 1);
+
+  /* Buckets never go down as the count goes up, and a bucket never spans
+   * more than a quarter of an octave. */
+  prev = 0;
+  for (i = 0; i < 64 * 16; ++i) {
+    double count = ldexp(1.0, EWMA_BUCKET_MIN_LOG2 + i / 16) *
+      (1.0 + (i % 16) / 16.0);
+    int idx = cell_ewma_get_bucket_idx(count);
+    tt_int_op(idx, OP_GE, prev);
+    tt_int_op(idx, OP_LE, prev + 1);
+    prev = idx;
+  }
+
+ done:
+  ;
+}
+
+static void
+test_cmux_ewma_get_policy(void *arg)
+{
+  or_options_t options;
+
+  (void) arg;
+
+  memset(&options, 0, sizeof(options));
+  options.CircuitPriorityHalflife = -1.0;
+
+  tt_ptr_op(cmux_ewma_get_policy(), OP_EQ, &ewma_policy);
+  options.CircuitPriorityBuckets = 1;
+  cmux_ewma_set_options(&options, NULL);
+  tt_ptr_op(cmux_ewma_get_policy(), OP_EQ, &ewma_bucket_policy);
+  options.CircuitPriorityBuckets = 0;
+  cmux_ewma_set_options(&options, NULL);
+  tt_ptr_op(cmux_ewma_get_policy(), OP_EQ, &ewma_policy);
+
+ done:
+  ;
+}
+
+/** Return the EWMA cell count of the circuit with <b>circ_data</b>. */
+static double
+get_cell_count(circuitmux_policy_circ_data_t *circ_data)
+{
+  ewma_policy_circ_data_t *ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data);
+  return ewma_data ? ewma_data->cell_ewma.cell_count : -1.0;
+}
+
+static void
+test_cmux_ewma_bucket_policy(void *arg)
+{
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuit_t circ[3]; /* garbage */
+  circuitmux_policy_circ_data_t *circ_data[3] = { NULL, NULL, NULL };
+  ewma_policy_data_t *ewma_pol_data;
+  ewma_policy_circ_data_t *ewma_data;
+  const double counts[3] = { 50.0, 10.0, 10.5 };
+  int i;
+
+  (void) arg;
+
+  pol_data = ewma_bucket_policy.alloc_cmux_data(&cmux);
+  tt_assert(pol_data);
+  ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
+  tt_ptr_op(ewma_pol_data->active_circuit_pqueue, OP_EQ, NULL);
+  tt_assert(ewma_pol_data->buckets);
+  tt_ptr_op(ewma_bucket_policy.pick_active_circuit(&cmux, pol_data),
+            OP_EQ, NULL);
+
+  for (i = 0; i < 3; ++i) {
+    circ_data[i] = ewma_bucket_policy.alloc_circ_data(&cmux, pol_data,
+                                                      &circ[i],
+                                                      CELL_DIRECTION_OUT, 1);
+    ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data[i]);
+    tt_assert(ewma_data);
+    ewma_data->cell_ewma.cell_count = counts[i];
+    ewma_data->cell_ewma.last_adjusted_tick =
+      ewma_pol_data->active_circuit_pqueue_last_recalibrated;
+    ewma_bucket_policy.notify_circ_active(&cmux, pol_data, &circ[i],
+                                          circ_data[i]);
+  }
+  tt_int_op(ewma_pol_data->n_bucketed, OP_EQ, 3);
+
+  /* 10 and 10.5 share a bucket: the first one in gets picked. */
+  tt_ptr_op(ewma_bucket_policy.pick_active_circuit(&cmux, pol_data),
+            OP_EQ, &circ[1]);
+
+  /* Sending a cell moves it behind the other one. */
+  ewma_bucket_policy.notify_xmit_cells(&cmux, pol_data, &circ[1],
+                                       circ_data[1], 1);
+  tt_ptr_op(ewma_bucket_policy.pick_active_circuit(&cmux, pol_data),
+            OP_EQ, &circ[2]);
+  tt_double_op(get_cell_count(circ_data[1]), OP_GE, 11.0);
+
+  /* Once the quiet circuits are inactive, the busy one is picked. */
+  ewma_bucket_policy.notify_circ_inactive(&cmux, pol_data, &circ[1],
+                                          circ_data[1]);
+  ewma_bucket_policy.notify_circ_inactive(&cmux, pol_data, &circ[2],
+                                          circ_data[2]);
+  tt_int_op(ewma_pol_data->n_bucketed, OP_EQ, 1);
+  tt_ptr_op(ewma_bucket_policy.pick_active_circuit(&cmux, pol_data),
+            OP_EQ, &circ[0]);
+  ewma_bucket_policy.notify_circ_inactive(&cmux, pol_data, &circ[0],
+                                          circ_data[0]);
+  tt_int_op(ewma_pol_data->n_bucketed, OP_EQ, 0);
+  tt_ptr_op(ewma_bucket_policy.pick_active_circuit(&cmux, pol_data),
+            OP_EQ, NULL);
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    ewma_bucket_policy.free_circ_data(&cmux, pol_data, &circ[i],
+                                      circ_data[i]);
+  }
+  ewma_bucket_policy.free_cmux_data(&cmux, pol_data);
+}
+
+static void
+test_cmux_ewma_bucket_xmit_cell(void *arg)
+{
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuit_t circ; /* garbage */
+  circuitmux_policy_circ_data_t *circ_data = NULL;
+  ewma_policy_data_t *ewma_pol_data;
+  ewma_policy_circ_data_t *ewma_data;
+  unsigned now;
+  double old_cell_count;
+
+  (void) arg;
+
+  pol_data = ewma_bucket_policy.alloc_cmux_data(&cmux);
+  tt_assert(pol_data);
+  circ_data = ewma_bucket_policy.alloc_circ_data(&cmux, pol_data, &circ,
+                                                 CELL_DIRECTION_OUT, 42);
+  tt_assert(circ_data);
+  ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
+  ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data);
+  now = ewma_pol_data->active_circuit_pqueue_last_recalibrated;
+
+  ewma_bucket_policy.notify_circ_active(&cmux, pol_data, &circ, circ_data);
+
+  /* One tick after the last re-scaling, we don't re-scale: the new cell
+   * just weighs more. */
+  ewma_pol_data->active_circuit_pqueue_last_recalibrated = now - 1;
+  ewma_data->cell_ewma.last_adjusted_tick = now - 1;
+  ewma_bucket_policy.notify_xmit_cells(&cmux, pol_data, &circ, circ_data, 1);
+  tt_uint_op(ewma_pol_data->active_circuit_pqueue_last_recalibrated,
+             OP_EQ, now - 1);
+  tt_double_op(ewma_data->cell_ewma.cell_count, OP_GT, 1.0);
+
+  /* Long after it, we re-scale everything to the current tick. */
+  ewma_pol_data->active_circuit_pqueue_last_recalibrated = now - 100000;
+  ewma_data->cell_ewma.last_adjusted_tick = now - 100000;
+  old_cell_count = ewma_data->cell_ewma.cell_count;
+  ewma_bucket_policy.notify_xmit_cells(&cmux, pol_data, &circ, circ_data, 1);
+  tt_uint_op(ewma_pol_data->active_circuit_pqueue_last_recalibrated,
+             OP_GE, now);
+  tt_uint_op(ewma_data->cell_ewma.last_adjusted_tick, OP_EQ,
+             ewma_pol_data->active_circuit_pqueue_last_recalibrated);
+  tt_double_op(ewma_data->cell_ewma.cell_count, OP_LT, old_cell_count);
+  tt_ptr_op(ewma_bucket_policy.pick_active_circuit(&cmux, pol_data),
+            OP_EQ, &circ);
+
+ done:
+  ewma_bucket_policy.free_circ_data(&cmux, pol_data, &circ, circ_data);
+  ewma_bucket_policy.free_cmux_data(&cmux, pol_data);
+}
+
+/** Run the heap and bucket variants of the EWMA policy side by side, and
+ * check that the bucket one always picks a circuit whose count is within a
+ * bucket of the lowest one, like the heap one does exactly. */
+static void
+test_cmux_ewma_bucket_vs_heap(void *arg)
+{
+  const int n_circs = 200;
+  circuitmux_policy_t *policies[2] = { &ewma_policy, &ewma_bucket_policy };
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *pol_data[2] = { NULL, NULL };
+  circuit_t *circs = NULL; /* garbage */
+  circuitmux_policy_circ_data_t **circ_data[2] = { NULL, NULL };
+  const double tolerance = pow(2.0, 1.0 / EWMA_BUCKETS_PER_OCTAVE) + 1e-9;
+  int p, i, round;
+
+  (void) arg;
+
+  circs = tor_calloc(n_circs, sizeof(circuit_t));
+  for (p = 0; p < 2; ++p) {
+    ewma_policy_data_t *ewma_pol_data;
+    pol_data[p] = policies[p]->alloc_cmux_data(&cmux);
+    ewma_pol_data = TO_EWMA_POL_DATA(pol_data[p]);
+    circ_data[p] = tor_calloc(n_circs, sizeof(*circ_data[p]));
+    for (i = 0; i < n_circs; ++i) {
+      ewma_policy_circ_data_t *ewma_data;
+      circ_data[p][i] = policies[p]->alloc_circ_data(&cmux, pol_data[p],
+                                                     &circs[i],
+                                                     CELL_DIRECTION_OUT, 1);
+      ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data[p][i]);
+      tt_assert(ewma_data);
+      /* Spread the counts over several octaves. */
+      ewma_data->cell_ewma.cell_count = (i * 7919) % 1000 + 0.5;
+      ewma_data->cell_ewma.last_adjusted_tick =
+        ewma_pol_data->active_circuit_pqueue_last_recalibrated;
+      policies[p]->notify_circ_active(&cmux, pol_data[p], &circs[i],
+                                      circ_data[p][i]);
+    }
+  }
+
+  for (round = 0; round < 20000; ++round) {
+    for (p = 0; p < 2; ++p) {
+      circuit_t *picked = policies[p]->pick_active_circuit(&cmux,
+                                                           pol_data[p]);
+      double min_count = INFINITY, picked_count;
+      tt_assert(picked);
+      i = (int)(picked - circs);
+      tt_int_op(i, OP_GE, 0);
+      tt_int_op(i, OP_LT, n_circs);
+      for (int j = 0; j < n_circs; ++j) {
+        min_count = MIN(min_count, get_cell_count(circ_data[p][j]));
+      }
+      picked_count = get_cell_count(circ_data[p][i]);
+      tt_double_op(picked_count, OP_LE,
+                   p == 0 ? min_count : min_count * tolerance);
+      policies[p]->notify_xmit_cells(&cmux, pol_data[p], picked,
+                                     circ_data[p][i], 1);
+    }
+  }
+
+  /* In the long run, both variants share the channel the same way: the
+   * circuits end up with about the same counts. */
+  for (i = 0; i < n_circs; ++i) {
+    double heap_count = get_cell_count(circ_data[0][i]);
+    double bucket_count = get_cell_count(circ_data[1][i]);
+    tt_double_op(bucket_count, OP_LE, heap_count * tolerance + 1.0);
+    tt_double_op(heap_count, OP_LE, bucket_count * tolerance + 1.0);
+  }
+
+ done:
+  for (p = 0; p < 2; ++p) {
+    if (circ_data[p]) {
+      for (i = 0; i < n_circs; ++i) {
+        policies[p]->free_circ_data(&cmux, pol_data[p], &circs[i],
+                                    circ_data[p][i]);
+      }
+    }
+    tor_free(circ_data[p]);
+    policies[p]->free_cmux_data(&cmux, pol_data[p]);
+  }
+  tor_free(circs);
+}
+
 static void *
 cmux_ewma_setup_test(const struct testcase_t *tc)
 {
@@ -223,6 +497,11 @@ struct testcase_t circuitmux_ewma_tests[] = {
   TEST_CMUX_EWMA(policy_circ_data),
   TEST_CMUX_EWMA(notify_circ),
   TEST_CMUX_EWMA(xmit_cell),
+  TEST_CMUX_EWMA(get_policy),
+  TEST_CMUX_EWMA(bucket_idx),
+  TEST_CMUX_EWMA(bucket_policy),
+  TEST_CMUX_EWMA(bucket_xmit_cell),
+  TEST_CMUX_EWMA(bucket_vs_heap),
 
   END_OF_TESTCASES
 };
@@ -0,0 +1,888 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file test_congestion_control.c
+ * \brief Unit tests and simulations for circuit congestion control and
+ *   stream flow control.
+ **/
+
+#define CIRCUITLIST_PRIVATE
+#define CONGESTION_CONTROL_PRIVATE
+#define CONGESTION_CONTROL_FLOW_PRIVATE
+#define CONNECTION_PRIVATE
+#define RELAY_PRIVATE
+
+#include "core/or/or.h"
+
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "core/or/channel.h"
+#include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/congestion_control_common.h"
+#include "core/or/congestion_control_flow.h"
+#include "core/or/congestion_control_vegas.h"
+#include "core/or/connection_edge.h"
+#include "core/or/crypt_path.h"
+#include "core/or/relay.h"
+#include "core/or/sendme.h"
+#include "feature/nodelist/networkstatus.h"
+#include "lib/time/compat_time.h"
+
+#include "core/or/cell_st.h"
+#include "core/or/circuit_st.h"
+#include "core/or/crypt_path_st.h"
+#include "core/or/edge_connection_st.h"
+#include "core/or/entry_connection_st.h"
+#include "core/or/or_circuit_st.h"
+#include "core/or/origin_circuit_st.h"
+#include "feature/nodelist/networkstatus_st.h"
+
+#include "test/fakecircs.h"
+#include "test/test.h"
+
+static channel_t dummy_channel;
+
+static void
+circuitmux_attach_circuit_mock(circuitmux_t *cmux, circuit_t *circ,
+                               cell_direction_t direction)
+{
+  (void) cmux;
+  (void) circ;
+  (void) direction;
+}
+
+static int n_negotiate_sent, n_negotiated_sent;
+static int n_xoff_sent, n_xon_sent, n_end_sent;
+
+static int
+mock_relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
+                                  uint8_t relay_command, const char *payload,
+                                  size_t payload_len,
+                                  crypt_path_t *cpath_layer,
+                                  const char *filename, int lineno)
+{
+  (void) stream_id;
+  (void) circ;
+  (void) payload;
+  (void) payload_len;
+  (void) cpath_layer;
+  (void) filename;
+  (void) lineno;
+
+  if (relay_command == RELAY_COMMAND_CC_NEGOTIATE_EXP)
+    ++n_negotiate_sent;
+  else if (relay_command == RELAY_COMMAND_CC_NEGOTIATED_EXP)
+    ++n_negotiated_sent;
+  else if (relay_command == RELAY_COMMAND_XOFF_EXP)
+    ++n_xoff_sent;
+  else if (relay_command == RELAY_COMMAND_XON_EXP)
+    ++n_xon_sent;
+  else if (relay_command == RELAY_COMMAND_END)
+    ++n_end_sent;
+  return 0;
+}
+
+/** Return a new fake OR circuit on a dummy channel, as we see it once we are
+ * its exit and its client asked for congestion control. Free it with
+ * free_test_orcirc(). */
+static or_circuit_t *
+new_test_orcirc(void)
+{
+  const uint8_t body[1] = { CC_NEGOTIATE_VERSION };
+  or_circuit_t *orcirc;
+
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_circuit_mock);
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  dummy_channel.cmux = circuitmux_alloc();
+  orcirc = new_fake_orcirc(&dummy_channel, &dummy_channel);
+  congestion_control_process_negotiate(TO_CIRCUIT(orcirc), body,
+                                       sizeof(body));
+  return orcirc;
+}
+
+/** Free a circuit made by new_test_orcirc(). */
+static void
+free_test_orcirc(or_circuit_t *orcirc)
+{
+  free_fake_orcirc(orcirc);
+  circuitmux_free(dummy_channel.cmux);
+  dummy_channel.cmux = NULL;
+  UNMOCK(circuitmux_attach_circuit);
+  UNMOCK(relay_send_command_from_edge_);
+}
+
+/** Make the congestion control code use the algorithm <b>alg</b> from now
+ * on, with default values for all the other parameters. */
+static void
+set_cc_alg(int alg)
+{
+  networkstatus_t ns;
+  char param[32];
+
+  memset(&ns, 0, sizeof(ns));
+  ns.net_params = smartlist_new();
+  tor_snprintf(param, sizeof(param), "cc_alg=%d", alg);
+  smartlist_add(ns.net_params, param);
+  congestion_control_new_consensus_params(&ns);
+  smartlist_free(ns.net_params);
+}
+
+static void
+test_cc_window(void *arg)
+{
+  congestion_control_t *cc = NULL;
+  int i;
+
+  (void) arg;
+
+  set_cc_alg(CC_ALG_SENDME);
+  tt_assert(!congestion_control_enabled());
+  tt_ptr_op(congestion_control_new(), OP_EQ, NULL);
+
+  set_cc_alg(CC_ALG_VEGAS);
+  tt_assert(congestion_control_enabled());
+  cc = congestion_control_new();
+  tt_assert(cc);
+  tt_int_op(congestion_control_get_package_window(cc), OP_EQ,
+            CC_CWND_INIT_DEFAULT);
+
+  /* A SENDME that acknowledges nothing is a protocol violation. */
+  tt_int_op(congestion_control_process_sendme(cc), OP_EQ, -1);
+
+  monotime_enable_test_mocking();
+  monotime_set_mock_time_nsec(1000000000);
+
+  /* Only every CIRCWINDOW_INCREMENT-th cell gets a SENDME. */
+  for (i = 0; i < 250; i++) {
+    tt_int_op(congestion_control_sendme_is_next(cc, 0), OP_EQ,
+              (i + 1) % CIRCWINDOW_INCREMENT == 0);
+    congestion_control_note_cell_sent(cc);
+  }
+  tt_int_op(cc->inflight, OP_EQ, 250);
+  tt_int_op(smartlist_len(cc->sendme_pending_timestamps), OP_EQ, 2);
+  tt_int_op(congestion_control_get_package_window(cc), OP_EQ,
+            CC_CWND_INIT_DEFAULT - 250);
+  tt_assert(congestion_control_sendme_is_next(cc, 49));
+  tt_assert(!congestion_control_sendme_is_next(cc, 48));
+
+  /* The first SENDME gives us the RTT. */
+  monotime_set_mock_time_nsec(1000000000 + 50000000);
+  tt_int_op(congestion_control_process_sendme(cc), OP_EQ, 0);
+  tt_int_op(cc->inflight, OP_EQ, 150);
+  tt_u64_op(cc->ewma_rtt_usec, OP_EQ, 50000);
+  tt_u64_op(cc->min_rtt_usec, OP_EQ, 50000);
+  /* The window wasn't full: no growth. */
+  tt_int_op(cc->cwnd, OP_EQ, CC_CWND_INIT_DEFAULT);
+  tt_int_op(congestion_control_get_package_window(cc), OP_EQ,
+            CC_CWND_INIT_DEFAULT - 150);
+
+  /* A slower sample moves the average, not the minimum. */
+  monotime_set_mock_time_nsec(1000000000 + 150000000);
+  tt_int_op(congestion_control_process_sendme(cc), OP_EQ, 0);
+  tt_u64_op(cc->min_rtt_usec, OP_EQ, 50000);
+  tt_u64_op(cc->ewma_rtt_usec, OP_EQ,
+            (2 * 150000 + (CC_EWMA_N_DEFAULT - 1) * 50000) /
+            (CC_EWMA_N_DEFAULT + 1));
+  tt_int_op(smartlist_len(cc->sendme_pending_timestamps), OP_EQ, 0);
+
+ done:
+  monotime_disable_test_mocking();
+  congestion_control_free(cc);
+  set_cc_alg(CC_ALG_SENDME);
+}
+
+static void
+test_cc_vegas(void *arg)
+{
+  congestion_control_t *cc = NULL;
+
+  (void) arg;
+
+  set_cc_alg(CC_ALG_VEGAS);
+  cc = congestion_control_new();
+  tt_assert(cc);
+
+  /* Slow start grows a full window while there is no queue... */
+  cc->cwnd_full = 1;
+  cc->min_rtt_usec = cc->ewma_rtt_usec = 100000;
+  congestion_control_vegas_process_sendme(cc);
+  tt_int_op(cc->cwnd, OP_EQ, CC_CWND_INIT_DEFAULT + CIRCWINDOW_INCREMENT);
+  tt_assert(cc->in_slow_start);
+
+  /* ... and leaves it for a BDP plus gamma window once the RTT shows a
+   * queue. With an RTT twice the minimum, half of the window is queued. */
+  cc->cwnd = 2000;
+  cc->ewma_rtt_usec = 200000;
+  congestion_control_vegas_process_sendme(cc);
+  tt_assert(!cc->in_slow_start);
+  tt_int_op(cc->cwnd, OP_EQ, 1000 + CC_VEGAS_GAMMA_DEFAULT);
+  tt_int_op(cc->next_cwnd_event, OP_EQ, cc->cwnd / CIRCWINDOW_INCREMENT);
+
+  /* In congestion avoidance, the window only changes once per window. */
+  cc->cwnd = 1000;
+  cc->next_cwnd_event = 2;
+  cc->cwnd_full = 1;
+  cc->ewma_rtt_usec = 100000;
+  congestion_control_vegas_process_sendme(cc);
+  tt_int_op(cc->cwnd, OP_EQ, 1000);
+  congestion_control_vegas_process_sendme(cc);
+  tt_int_op(cc->cwnd, OP_EQ, 1000 + CC_CWND_INC_DEFAULT);
+  tt_int_op(cc->next_cwnd_event, OP_EQ, 10);
+
+  /* Between alpha and beta: keep the window. */
+  cc->cwnd = 1000;
+  cc->next_cwnd_event = 1;
+  cc->cwnd_full = 1;
+  cc->ewma_rtt_usec = 100000 * 1000 / (1000 - 150);
+  congestion_control_vegas_process_sendme(cc);
+  tt_int_op(cc->cwnd, OP_EQ, 1000);
+
+  /* Above beta: shrink by one increment. */
+  cc->next_cwnd_event = 1;
+  cc->ewma_rtt_usec = 100000 * 1000 / (1000 - 300);
+  congestion_control_vegas_process_sendme(cc);
+  tt_int_op(cc->cwnd, OP_EQ, 1000 - CC_CWND_INC_DEFAULT);
+
+  /* Far above delta: back to the BDP plus delta, minus an increment. */
+  cc->cwnd = 4000;
+  cc->next_cwnd_event = 1;
+  cc->ewma_rtt_usec = 400000;
+  congestion_control_vegas_process_sendme(cc);
+  tt_int_op(cc->cwnd, OP_EQ,
+            1000 + CC_VEGAS_DELTA_DEFAULT - CC_CWND_INC_DEFAULT);
+
+  /* Never below the minimum. */
+  cc->cwnd = CC_CWND_MIN_DEFAULT + 20;
+  cc->next_cwnd_event = 1;
+  cc->ewma_rtt_usec = 10000000;
+  congestion_control_vegas_process_sendme(cc);
+  tt_int_op(cc->cwnd, OP_EQ, CC_CWND_MIN_DEFAULT);
+
+ done:
+  congestion_control_free(cc);
+  set_cc_alg(CC_ALG_SENDME);
+}
+
+/*
+ * Simulation of one circuit.
+ *
+ * An exit packages DATA cells on a fake circuit as fast as its package
+ * window allows. They go through a single bottleneck relay, served at a
+ * fixed rate in FIFO order, then take half of the base round-trip time to
+ * reach the client. The client sends a SENDME every CIRCWINDOW_INCREMENT
+ * cells, which takes the other half of the round trip to come back. All of
+ * it runs on the mocked monotonic clock, in steps of SIM_STEP_USEC.
+ */
+
+/** Simulation clock resolution, in microseconds. */
+#define SIM_STEP_USEC 100
+/** How long we simulate, and how long we wait before we start measuring. */
+#define SIM_DURATION_USEC (60 * 1000 * 1000)
+#define SIM_WARMUP_USEC (20 * 1000 * 1000)
+/** Size of the FIFOs holding the cells and SENDMEs in flight. */
+#define SIM_FIFO_LEN (1 << 15)
+
+/** A FIFO of timestamps in microseconds. */
+typedef struct sim_fifo_t {
+  uint64_t *t;
+  unsigned head, tail;
+} sim_fifo_t;
+
+static void
+sim_fifo_push(sim_fifo_t *fifo, uint64_t t)
+{
+  tor_assert(fifo->tail - fifo->head < SIM_FIFO_LEN);
+  fifo->t[fifo->tail++ % SIM_FIFO_LEN] = t;
+}
+
+static bool
+sim_fifo_is_empty(const sim_fifo_t *fifo)
+{
+  return fifo->head == fifo->tail;
+}
+
+static uint64_t
+sim_fifo_peek(const sim_fifo_t *fifo)
+{
+  return fifo->t[fifo->head % SIM_FIFO_LEN];
+}
+
+static uint64_t
+sim_fifo_pop(sim_fifo_t *fifo)
+{
+  return fifo->t[fifo->head++ % SIM_FIFO_LEN];
+}
+
+/** What we measured on a simulated circuit, after the warmup. */
+typedef struct sim_result_t {
+  /** Cells delivered to the client per second. */
+  double goodput;
+  /** Average time that a cell waited at the bottleneck, in msec. */
+  double queue_delay_msec;
+} sim_result_t;
+
+/** Simulate an exit sending bulk data to a client through a path whose
+ * bottleneck serves <b>rate</b> cells per second, with a base round-trip
+ * time of <b>rtt_msec</b>. Use the congestion control algorithm
+ * <b>alg</b>. Fill <b>out</b> with the results. */
+static void
+simulate_path(int alg, uint32_t rate, uint32_t rtt_msec, sim_result_t *out)
+{
+  const uint64_t one_way_usec = rtt_msec * 1000 / 2;
+  const uint8_t sendme_payload[1] = { 0 };
+  or_circuit_t *orcirc = NULL;
+  circuit_t *circ;
+  sim_fifo_t bottleneck, to_client, sendmes;
+  uint64_t now, n_delivered = 0, n_served = 0, total_delay = 0;
+  uint64_t n_received = 0;
+  double credit = 0;
+
+  memset(out, 0, sizeof(*out));
+  memset(&bottleneck, 0, sizeof(bottleneck));
+  memset(&to_client, 0, sizeof(to_client));
+  memset(&sendmes, 0, sizeof(sendmes));
+  bottleneck.t = tor_calloc(SIM_FIFO_LEN, sizeof(uint64_t));
+  to_client.t = tor_calloc(SIM_FIFO_LEN, sizeof(uint64_t));
+  sendmes.t = tor_calloc(SIM_FIFO_LEN, sizeof(uint64_t));
+
+  set_cc_alg(alg);
+  orcirc = new_test_orcirc();
+  tt_assert(orcirc);
+  circ = TO_CIRCUIT(orcirc);
+  tt_assert(!circ->ccontrol == (alg == CC_ALG_SENDME));
+
+  for (now = SIM_STEP_USEC; now <= SIM_DURATION_USEC; now += SIM_STEP_USEC) {
+    monotime_set_mock_time_nsec((int64_t) now * 1000);
+
+    /* SENDMEs reaching the exit. */
+    while (!sim_fifo_is_empty(&sendmes) && sim_fifo_peek(&sendmes) <= now) {
+      sim_fifo_pop(&sendmes);
+      if (sendme_process_circuit_level(NULL, circ, sendme_payload, 0) < 0)
+        TT_DIE(("SENDME rejected at %"PRIu64" usec", now));
+    }
+
+    /* The exit has an endless supply of data. */
+    while (circ->package_window > 0) {
+      sendme_record_cell_digest_on_circ(circ, NULL);
+      if (sendme_note_circuit_data_packaged(circ, NULL) < 0)
+        TT_DIE(("Packaged a cell outside of the window"));
+      sim_fifo_push(&bottleneck, now);
+    }
+
+    /* The bottleneck forwards what its rate allows. */
+    credit += (double) rate * SIM_STEP_USEC / 1000000;
+    while (credit >= 1 && !sim_fifo_is_empty(&bottleneck)) {
+      uint64_t queued_at = sim_fifo_pop(&bottleneck);
+      if (now > SIM_WARMUP_USEC) {
+        total_delay += now - queued_at;
+        ++n_served;
+      }
+      sim_fifo_push(&to_client, now + one_way_usec);
+      credit -= 1;
+    }
+    if (sim_fifo_is_empty(&bottleneck))
+      credit = MIN(credit, 1);
+
+    /* Cells reaching the client. */
+    while (!sim_fifo_is_empty(&to_client) &&
+           sim_fifo_peek(&to_client) <= now) {
+      sim_fifo_pop(&to_client);
+      if (now > SIM_WARMUP_USEC)
+        ++n_delivered;
+      if (++n_received % CIRCWINDOW_INCREMENT == 0)
+        sim_fifo_push(&sendmes, now + one_way_usec);
+    }
+  }
+
+  out->goodput = (double) n_delivered * 1000000 /
+                 (SIM_DURATION_USEC - SIM_WARMUP_USEC);
+  out->queue_delay_msec = n_served ? (double) total_delay / n_served / 1000 :
+                                     0;
+
+ done:
+  free_test_orcirc(orcirc);
+  tor_free(bottleneck.t);
+  tor_free(to_client.t);
+  tor_free(sendmes.t);
+}
+
+/** Run the simulation on a path with both fixed windows and Vegas, and
+ * return the results in <b>fixed_out</b> and <b>vegas_out</b>. */
+static void
+simulate_both(const char *name, uint32_t rate, uint32_t rtt_msec,
+              sim_result_t *fixed_out, sim_result_t *vegas_out)
+{
+  monotime_enable_test_mocking();
+  simulate_path(CC_ALG_SENDME, rate, rtt_msec, fixed_out);
+  simulate_path(CC_ALG_VEGAS, rate, rtt_msec, vegas_out);
+  monotime_disable_test_mocking();
+  set_cc_alg(CC_ALG_SENDME);
+
+  TT_BLATHER(("%s path (%u cells/s, %u msec): "
+              "fixed windows: %.0f cells/s, %.1f msec queued; "
+              "vegas: %.0f cells/s, %.1f msec queued",
+              name, rate, rtt_msec,
+              fixed_out->goodput, fixed_out->queue_delay_msec,
+              vegas_out->goodput, vegas_out->queue_delay_msec));
+}
+
+static void
+test_cc_sim_long_path(void *arg)
+{
+  sim_result_t fixed, vegas;
+
+  (void) arg;
+
+  /* The bandwidth-delay product is 3000 cells: a fixed window of 1000 cells
+   * can't use more than a third of the path. */
+  simulate_both("long", 5000, 600, &fixed, &vegas);
+
+  tt_double_op(fixed.goodput, OP_LT, 5000 * 0.4);
+  tt_double_op(vegas.goodput, OP_GT, 5000 * 0.85);
+  tt_double_op(vegas.goodput, OP_GT, 2 * fixed.goodput);
+
+ done:
+  ;
+}
+
+static void
+test_cc_sim_short_path(void *arg)
+{
+  sim_result_t fixed, vegas;
+
+  (void) arg;
+
+  /* The bandwidth-delay product is 200 cells: a fixed window of 1000 cells
+   * keeps about 800 of them queued at the bottleneck. */
+  simulate_both("short", 5000, 40, &fixed, &vegas);
+
+  tt_double_op(fixed.goodput, OP_GT, 5000 * 0.95);
+  tt_double_op(vegas.goodput, OP_GT, 5000 * 0.95);
+  tt_double_op(fixed.queue_delay_msec, OP_GT, 140);
+  tt_double_op(vegas.queue_delay_msec, OP_LT, fixed.queue_delay_msec / 2);
+
+ done:
+  ;
+}
+
+/* Stream flow control. */
+
+static int n_stop_reading;
+
+static void
+mock_connection_stop_reading(connection_t *conn)
+{
+  (void) conn;
+  ++n_stop_reading;
+}
+
+static void
+mock_connection_mark_for_close(connection_t *conn, int line, const char *file)
+{
+  (void) line;
+  (void) file;
+  conn->marked_for_close = 1;
+}
+
+static void
+test_cc_xon_xoff(void *arg)
+{
+  or_circuit_t *orcirc = NULL;
+  edge_connection_t *exitconn = NULL;
+  char *data = NULL;
+  const size_t limit = STREAMWINDOW_START * RELAY_PAYLOAD_SIZE;
+  int deliver_window, package_window;
+
+  (void) arg;
+
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  MOCK(connection_stop_reading, mock_connection_stop_reading);
+
+  orcirc = new_test_orcirc();
+  exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  exitconn->base_.state = EXIT_CONN_STATE_OPEN;
+  exitconn->on_circuit = TO_CIRCUIT(orcirc);
+  exitconn->package_window = STREAMWINDOW_START;
+  exitconn->deliver_window = STREAMWINDOW_START;
+  deliver_window = exitconn->deliver_window;
+  package_window = exitconn->package_window;
+  orcirc->n_streams = exitconn;
+
+  /* Without the flag, XON and XOFF are protocol violations. */
+  tt_int_op(flow_control_process_xoff(exitconn), OP_EQ,
+            -END_CIRC_REASON_TORPROTOCOL);
+  tt_int_op(flow_control_process_xon(exitconn), OP_EQ,
+            -END_CIRC_REASON_TORPROTOCOL);
+
+  exitconn->begincell_flags = BEGIN_FLAG_FLOW_CTRL;
+  tt_assert(edge_uses_flow_control(exitconn));
+
+  /* Stream windows no longer move, and stream SENDMEs are unexpected. */
+  tt_int_op(sendme_stream_data_received(exitconn), OP_EQ, deliver_window);
+  tt_int_op(sendme_note_stream_data_packaged(exitconn), OP_EQ,
+            package_window);
+  tt_int_op(sendme_process_stream_level(exitconn, TO_CIRCUIT(orcirc), 0),
+            OP_EQ, -END_CIRC_REASON_TORPROTOCOL);
+
+  /* Fill the outbuf up to the limit: nothing happens. */
+  data = tor_malloc_zero(limit + 1);
+  connection_buf_add(data, limit, TO_CONN(exitconn));
+  sendme_connection_edge_consider_sending(exitconn);
+  tt_int_op(n_xoff_sent, OP_EQ, 0);
+
+  /* One byte more and we send an XOFF, only once. */
+  connection_buf_add(data, 1, TO_CONN(exitconn));
+  sendme_connection_edge_consider_sending(exitconn);
+  sendme_connection_edge_consider_sending(exitconn);
+  tt_int_op(n_xoff_sent, OP_EQ, 1);
+  tt_assert(exitconn->xoff_sent);
+
+  /* Once half of it is flushed, we send an XON. */
+  buf_drain(TO_CONN(exitconn)->outbuf, limit / 2);
+  sendme_connection_edge_consider_sending(exitconn);
+  tt_int_op(n_xon_sent, OP_EQ, 0);
+  buf_drain(TO_CONN(exitconn)->outbuf, 1);
+  sendme_connection_edge_consider_sending(exitconn);
+  tt_int_op(n_xon_sent, OP_EQ, 1);
+  tt_assert(!exitconn->xoff_sent);
+
+  /* The sending side stops on XOFF and resumes on XON. */
+  tt_int_op(flow_control_process_xoff(exitconn), OP_EQ, 0);
+  tt_assert(exitconn->xoff_received);
+  tt_int_op(n_stop_reading, OP_EQ, 1);
+  tt_int_op(flow_control_process_xoff(exitconn), OP_EQ, 0);
+  tt_int_op(flow_control_process_xon(exitconn), OP_EQ, 1);
+  tt_assert(!exitconn->xoff_received);
+  tt_int_op(flow_control_process_xon(exitconn), OP_EQ, 0);
+
+ done:
+  UNMOCK(relay_send_command_from_edge_);
+  UNMOCK(connection_stop_reading);
+  tor_free(data);
+  if (orcirc)
+    orcirc->n_streams = NULL;
+  free_test_orcirc(orcirc);
+  connection_free_minimal(TO_CONN(exitconn));
+  n_xoff_sent = n_xon_sent = n_stop_reading = 0;
+}
+
+/** Send the stream <b>exitconn</b> on <b>orcirc</b> a DATA cell of
+ * <b>len</b> bytes, and return what processing it returned. */
+static int
+send_test_data_cell(or_circuit_t *orcirc, edge_connection_t *exitconn,
+                    uint16_t len)
+{
+  cell_t cell;
+  relay_header_t rh;
+
+  memset(&cell, 0, sizeof(cell));
+  memset(&rh, 0, sizeof(rh));
+  rh.command = RELAY_COMMAND_DATA;
+  rh.stream_id = exitconn->stream_id;
+  rh.length = len;
+  relay_header_pack(cell.payload, &rh);
+  return handle_relay_cell_command(&cell, TO_CIRCUIT(orcirc), exitconn,
+                                   NULL, &rh, 0);
+}
+
+static void
+test_cc_xoff_ignored(void *arg)
+{
+  or_circuit_t *orcirc = NULL;
+  edge_connection_t *exitconn = NULL;
+  char *data = NULL;
+  const size_t max_len =
+    CC_XOFF_OVERRUN_FACTOR * CC_XOFF_DEFAULT * RELAY_PAYLOAD_SIZE +
+    CC_CWND_MAX_MAX * RELAY_PAYLOAD_SIZE;
+
+  (void) arg;
+
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  MOCK(connection_mark_for_close_internal_, mock_connection_mark_for_close);
+
+  orcirc = new_test_orcirc();
+  exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  exitconn->base_.state = EXIT_CONN_STATE_OPEN;
+  exitconn->on_circuit = TO_CIRCUIT(orcirc);
+  exitconn->base_.purpose = EXIT_PURPOSE_CONNECT;
+  exitconn->stream_id = 42;
+  exitconn->begincell_flags = BEGIN_FLAG_FLOW_CTRL;
+  orcirc->n_streams = exitconn;
+
+  /* Before we send an XOFF, the outbuf may hold anything. */
+  data = tor_malloc_zero(max_len);
+  connection_buf_add(data, max_len, TO_CONN(exitconn));
+  tt_assert(!flow_control_xoff_ignored(exitconn));
+  tt_int_op(send_test_data_cell(orcirc, exitconn, 1), OP_EQ, 0);
+  tt_int_op(n_xoff_sent, OP_EQ, 1);
+  tt_assert(exitconn->xoff_sent);
+
+  /* Data that was in flight when the XOFF left is still fine... */
+  buf_drain(TO_CONN(exitconn)->outbuf, 1);
+  tt_int_op(send_test_data_cell(orcirc, exitconn, 1), OP_EQ, 0);
+  tt_int_op(n_end_sent, OP_EQ, 0);
+  tt_assert(!TO_CONN(exitconn)->marked_for_close);
+
+  /* ...but a peer that keeps going gets its stream and circuit closed. */
+  tt_assert(flow_control_xoff_ignored(exitconn));
+  tt_int_op(send_test_data_cell(orcirc, exitconn, 1), OP_EQ,
+            -END_CIRC_REASON_TORPROTOCOL);
+  tt_int_op(n_end_sent, OP_EQ, 1);
+  tt_assert(TO_CONN(exitconn)->marked_for_close);
+
+ done:
+  UNMOCK(relay_send_command_from_edge_);
+  UNMOCK(connection_mark_for_close_internal_);
+  tor_free(data);
+  if (orcirc)
+    orcirc->n_streams = NULL;
+  free_test_orcirc(orcirc);
+  connection_free_minimal(TO_CONN(exitconn));
+  n_xoff_sent = n_xon_sent = n_end_sent = 0;
+}
+
+static void
+test_cc_negotiate(void *arg)
+{
+  or_circuit_t *orcirc = NULL;
+  circuit_t *circ;
+  const uint8_t body[1] = { CC_NEGOTIATE_VERSION };
+  const uint8_t bad_body[1] = { CC_NEGOTIATE_VERSION + 1 };
+
+  (void) arg;
+
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_circuit_mock);
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  dummy_channel.cmux = circuitmux_alloc();
+  orcirc = new_fake_orcirc(&dummy_channel, &dummy_channel);
+  circ = TO_CIRCUIT(orcirc);
+
+  /* Circuits that we only relay never get congestion control. */
+  set_cc_alg(CC_ALG_VEGAS);
+  tt_ptr_op(circ->ccontrol, OP_EQ, NULL);
+  tt_int_op(circ->package_window, OP_EQ, CIRCWINDOW_START_MAX);
+
+  /* We don't answer while our consensus turns it off, for versions we don't
+   * know, or once some of our cells are in flight. */
+  set_cc_alg(CC_ALG_SENDME);
+  tt_int_op(congestion_control_process_negotiate(circ, body, sizeof(body)),
+            OP_EQ, -1);
+  set_cc_alg(CC_ALG_VEGAS);
+  tt_int_op(congestion_control_process_negotiate(circ, bad_body,
+                                                 sizeof(bad_body)),
+            OP_EQ, -1);
+  tt_int_op(congestion_control_process_negotiate(circ, body, 0), OP_EQ, -1);
+  --circ->package_window;
+  tt_int_op(congestion_control_process_negotiate(circ, body, sizeof(body)),
+            OP_EQ, -1);
+  ++circ->package_window;
+  tt_int_op(n_negotiated_sent, OP_EQ, 0);
+  tt_ptr_op(circ->ccontrol, OP_EQ, NULL);
+  tt_assert(!orcirc->ccontrol_negotiated);
+
+  /* Otherwise we answer, and package with congestion control from now on. */
+  tt_int_op(congestion_control_process_negotiate(circ, body, sizeof(body)),
+            OP_EQ, 0);
+  tt_int_op(n_negotiated_sent, OP_EQ, 1);
+  tt_assert(orcirc->ccontrol_negotiated);
+  tt_ptr_op(circ->ccontrol, OP_NE, NULL);
+  tt_int_op(circ->package_window, OP_EQ, CC_CWND_INIT_DEFAULT);
+
+  /* Only once per circuit. */
+  tt_int_op(congestion_control_process_negotiate(circ, body, sizeof(body)),
+            OP_EQ, -1);
+  tt_int_op(n_negotiated_sent, OP_EQ, 1);
+
+ done:
+  free_test_orcirc(orcirc);
+  set_cc_alg(CC_ALG_SENDME);
+  n_negotiated_sent = 0;
+}
+
+/** Add a hop to the origin circuit <b>ocirc</b>, as it is once the hop is
+ * open, and return it. */
+static crypt_path_t *
+add_test_hop(origin_circuit_t *ocirc)
+{
+  crypt_path_t *hop = tor_malloc_zero(sizeof(crypt_path_t));
+
+  hop->magic = CRYPT_PATH_MAGIC;
+  hop->state = CPATH_STATE_OPEN;
+  hop->package_window = circuit_initial_package_window();
+  hop->deliver_window = CIRCWINDOW_START;
+  cpath_extend_linked_list(&ocirc->cpath, hop);
+  return hop;
+}
+
+static void
+test_cc_negotiated(void *arg)
+{
+  origin_circuit_t *ocirc = NULL;
+  crypt_path_t *exit_hop;
+  entry_connection_t *entryconn = NULL;
+  edge_connection_t *apconn;
+  const uint8_t body[1] = { CC_NEGOTIATE_VERSION };
+
+  (void) arg;
+
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  ocirc = origin_circuit_new();
+  TO_CIRCUIT(ocirc)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  add_test_hop(ocirc);
+  exit_hop = add_test_hop(ocirc);
+  entryconn = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  apconn = ENTRY_TO_EDGE_CONN(entryconn);
+  apconn->on_circuit = TO_CIRCUIT(ocirc);
+  apconn->cpath_layer = exit_hop;
+
+  /* Without congestion control, we don't ask. */
+  set_cc_alg(CC_ALG_SENDME);
+  congestion_control_negotiate_origin_circuit(ocirc);
+  tt_int_op(n_negotiate_sent, OP_EQ, 0);
+
+  /* An answer we didn't ask for gets dropped. */
+  set_cc_alg(CC_ALG_VEGAS);
+  tt_int_op(congestion_control_process_negotiated(TO_CIRCUIT(ocirc),
+                                                  exit_hop, body,
+                                                  sizeof(body)),
+            OP_EQ, -1);
+  tt_ptr_op(exit_hop->ccontrol, OP_EQ, NULL);
+
+  /* We ask the last hop, once. */
+  congestion_control_negotiate_origin_circuit(ocirc);
+  congestion_control_negotiate_origin_circuit(ocirc);
+  tt_int_op(n_negotiate_sent, OP_EQ, 1);
+  tt_assert(exit_hop->cc_negotiate_sent);
+  tt_assert(!ocirc->cpath->cc_negotiate_sent);
+  tt_assert(!flow_control_client_should_negotiate(apconn));
+
+  /* Its answer turns on congestion control and XON/XOFF towards it. */
+  tt_int_op(congestion_control_process_negotiated(TO_CIRCUIT(ocirc),
+                                                  exit_hop, body,
+                                                  sizeof(body)),
+            OP_EQ, 0);
+  tt_assert(exit_hop->cc_negotiated);
+  tt_ptr_op(exit_hop->ccontrol, OP_NE, NULL);
+  tt_int_op(exit_hop->package_window, OP_EQ, CC_CWND_INIT_DEFAULT);
+  tt_assert(flow_control_client_should_negotiate(apconn));
+
+  /* A second answer is a protocol violation. */
+  tt_int_op(congestion_control_process_negotiated(TO_CIRCUIT(ocirc),
+                                                  exit_hop, body,
+                                                  sizeof(body)),
+            OP_EQ, -1);
+
+ done:
+  UNMOCK(relay_send_command_from_edge_);
+  connection_free_minimal(ENTRY_TO_CONN(entryconn));
+  circuit_free_(TO_CIRCUIT(ocirc));
+  set_cc_alg(CC_ALG_SENDME);
+  n_negotiate_sent = 0;
+}
+
+static void
+test_cc_negotiated_after_data(void *arg)
+{
+  origin_circuit_t *ocirc = NULL;
+  crypt_path_t *exit_hop;
+  const uint8_t body[1] = { CC_NEGOTIATE_VERSION };
+
+  (void) arg;
+
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  set_cc_alg(CC_ALG_VEGAS);
+  ocirc = origin_circuit_new();
+  TO_CIRCUIT(ocirc)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  exit_hop = add_test_hop(ocirc);
+  congestion_control_negotiate_origin_circuit(ocirc);
+
+  /* Optimistic data left before the answer came back: we keep the fixed
+   * window, since we can't time the SENDMEs for these cells. */
+  --exit_hop->package_window;
+  tt_int_op(congestion_control_process_negotiated(TO_CIRCUIT(ocirc),
+                                                  exit_hop, body,
+                                                  sizeof(body)),
+            OP_EQ, 0);
+  tt_assert(exit_hop->cc_negotiated);
+  tt_ptr_op(exit_hop->ccontrol, OP_EQ, NULL);
+
+ done:
+  UNMOCK(relay_send_command_from_edge_);
+  circuit_free_(TO_CIRCUIT(ocirc));
+  set_cc_alg(CC_ALG_SENDME);
+  n_negotiate_sent = 0;
+}
+
+static void
+test_cc_queue_limit(void *arg)
+{
+  networkstatus_t ns;
+  congestion_control_t *cc = NULL;
+
+  (void) arg;
+
+  /* Relays close circuits with more than 1000 queued cells: no window may
+   * grow past 500 cells, whatever the consensus asks for. */
+  memset(&ns, 0, sizeof(ns));
+  ns.net_params = smartlist_new();
+  smartlist_add(ns.net_params, (char *) "cc_alg=2");
+  smartlist_add(ns.net_params, (char *) "cc_cwnd_init=2000");
+  smartlist_add(ns.net_params, (char *) "cc_cwnd_min=800");
+  smartlist_add(ns.net_params, (char *) "circ_max_cell_queue_size=1000");
+  relay_consensus_has_changed(&ns);
+  congestion_control_new_consensus_params(&ns);
+
+  cc = congestion_control_new();
+  tt_ptr_op(cc, OP_NE, NULL);
+  tt_uint_op(cc->cwnd_max, OP_EQ, 500);
+  tt_uint_op(cc->cwnd_min, OP_EQ, 500);
+  tt_uint_op(cc->cwnd, OP_EQ, 500);
+
+ done:
+  congestion_control_free(cc);
+  smartlist_free(ns.net_params);
+}
+
+static void
+test_cc_exit_begin_flags(void *arg)
+{
+  or_circuit_t *orcirc = NULL;
+  const uint32_t flags = BEGIN_FLAG_FLOW_CTRL | BEGIN_FLAG_IPV6_OK;
+
+  (void) arg;
+
+  /* Clients that didn't negotiate congestion control with us don't get
+   * XON/XOFF, even when they ask for it. */
+  set_cc_alg(CC_ALG_SENDME);
+  orcirc = new_test_orcirc();
+  tt_uint_op(flow_control_exit_begin_flags(TO_CIRCUIT(orcirc), flags),
+             OP_EQ, BEGIN_FLAG_IPV6_OK);
+  free_test_orcirc(orcirc);
+
+  set_cc_alg(CC_ALG_VEGAS);
+  orcirc = new_test_orcirc();
+  tt_uint_op(flow_control_exit_begin_flags(TO_CIRCUIT(orcirc), flags),
+             OP_EQ, flags);
+
+ done:
+  free_test_orcirc(orcirc);
+  set_cc_alg(CC_ALG_SENDME);
+}
+
+struct testcase_t congestion_control_tests[] = {
+  { "window", test_cc_window, TT_FORK, NULL, NULL },
+  { "vegas", test_cc_vegas, TT_FORK, NULL, NULL },
+  { "sim_long_path", test_cc_sim_long_path, TT_FORK, NULL, NULL },
+  { "sim_short_path", test_cc_sim_short_path, TT_FORK, NULL, NULL },
+  { "xon_xoff", test_cc_xon_xoff, TT_FORK, NULL, NULL },
+  { "xoff_ignored", test_cc_xoff_ignored, TT_FORK, NULL, NULL },
+  { "negotiate", test_cc_negotiate, TT_FORK, NULL, NULL },
+  { "negotiated", test_cc_negotiated, TT_FORK, NULL, NULL },
+  { "negotiated_after_data", test_cc_negotiated_after_data, TT_FORK,
+    NULL, NULL },
+  { "queue_limit", test_cc_queue_limit, TT_FORK, NULL, NULL },
+  { "exit_begin_flags", test_cc_exit_begin_flags, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
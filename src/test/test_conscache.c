@@ -1,15 +1,25 @@
 /* Copyright (c) 2017-2020, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define CONNECTION_PRIVATE
+
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "core/mainloop/connection.h"
 #include "feature/dircache/conscache.h"
+#include "feature/dircache/dirserv.h"
+#include "feature/dircommon/directory.h"
 #include "lib/encoding/confline.h"
 #include "test/test.h"
 
+#include "feature/dircommon/dir_connection_st.h"
+
 #ifdef HAVE_UTIME_H
 #include <utime.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 static void
 test_conscache_open_failure(void *arg)
@@ -328,6 +338,138 @@ test_conscache_filter(void *arg)
   smartlist_free(lst);
 }
 
+static void
+test_conscache_open_body(void *arg)
+{
+  (void)arg;
+  consensus_cache_entry_t *ent = NULL;
+  int fd = -1;
+  char buf[16];
+
+  char *ddir_fname = tor_strdup(get_fname_rnd("datadir_cache"));
+  tor_free(get_options_mutable()->CacheDirectory);
+  get_options_mutable()->CacheDirectory = tor_strdup(ddir_fname);
+  check_private_dir(ddir_fname, CPD_CREATE, NULL);
+  consensus_cache_t *cache = consensus_cache_open("cons", 128);
+  tt_assert(cache);
+
+  config_line_t *labels = NULL;
+  config_line_append(&labels, "Hello", "world");
+  ent = consensus_cache_add(cache, labels,
+                            (const uint8_t *)"A\0B\0C", 5);
+  config_free_lines(labels);
+  tt_assert(ent);
+
+  /* We can't open the body of an entry that isn't mapped. */
+  off_t offset = -1;
+  tt_int_op(consensus_cache_entry_open_body(ent, &offset), OP_EQ, -1);
+
+  const uint8_t *bp = NULL;
+  size_t sz = 0;
+  tt_int_op(consensus_cache_entry_get_body(ent, &bp, &sz), OP_EQ, 0);
+
+  /* Once it's mapped, the file holds the body at the offset we get. */
+  fd = consensus_cache_entry_open_body(ent, &offset);
+  tt_int_op(fd, OP_GE, 0);
+  tt_i64_op(offset, OP_GT, 0);
+  tt_i64_op(lseek(fd, offset, SEEK_SET), OP_EQ, offset);
+  tt_int_op(read(fd, buf, sizeof(buf)), OP_EQ, 5);
+  tt_mem_op(buf, OP_EQ, "A\0B\0C", 5);
+
+ done:
+  if (fd >= 0)
+    close(fd);
+  consensus_cache_entry_decref(ent);
+  tor_free(ddir_fname);
+  consensus_cache_free(cache);
+}
+
+static void
+test_conscache_spool_sendfile(void *arg)
+{
+  (void)arg;
+  consensus_cache_entry_t *ent = NULL;
+  dir_connection_t *conn = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  uint8_t *body = NULL, *received = NULL;
+  const size_t bodylen = 100000;
+  char *ddir_fname = NULL;
+  consensus_cache_t *cache = NULL;
+
+#if !defined(HAVE_SENDFILE) || !defined(HAVE_SYS_SENDFILE_H)
+  tt_skip();
+#endif
+
+  ddir_fname = tor_strdup(get_fname_rnd("datadir_cache"));
+  tor_free(get_options_mutable()->CacheDirectory);
+  get_options_mutable()->CacheDirectory = tor_strdup(ddir_fname);
+  check_private_dir(ddir_fname, CPD_CREATE, NULL);
+  cache = consensus_cache_open("cons", 128);
+  tt_assert(cache);
+
+  body = tor_malloc(bodylen);
+  for (size_t i = 0; i < bodylen; ++i)
+    body[i] = (uint8_t)(i * 7);
+  config_line_t *labels = NULL;
+  config_line_append(&labels, "Hello", "world");
+  ent = consensus_cache_add(cache, labels, body, bodylen);
+  config_free_lines(labels);
+  tt_assert(ent);
+
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  conn = dir_connection_new(AF_INET);
+  TO_CONN(conn)->s = fds[0];
+  fds[0] = TOR_INVALID_SOCKET;
+  TO_CONN(conn)->state = DIR_CONN_STATE_SERVER_WRITING;
+  conn->spool = smartlist_new();
+  smartlist_add(conn->spool, spooled_resource_new_from_cache_entry(ent));
+
+  /* The body doesn't go through the outbuf. */
+  tt_int_op(connection_dirserv_flushed_some(conn), OP_EQ, 0);
+  tt_int_op(connection_get_outbuf_len(TO_CONN(conn)), OP_EQ, 0);
+  tt_assert(connection_dirserv_sendfile_pending(conn));
+  tt_assert(connection_wants_to_flush(TO_CONN(conn)));
+
+  /* Send it in a few pieces, draining the other end as we go. */
+  received = tor_malloc_zero(bodylen);
+  size_t n_received = 0;
+  while (connection_dirserv_sendfile_pending(conn)) {
+    int r = connection_dirserv_sendfile_some(conn, 30000);
+    tt_int_op(r, OP_GT, 0);
+    tt_int_op(r, OP_LE, 30000);
+    while (r > 0) {
+      ssize_t n = recv(fds[1], (char *)received + n_received,
+                       bodylen - n_received, 0);
+      tt_int_op(n, OP_GT, 0);
+      n_received += n;
+      r -= (int)n;
+    }
+    tt_int_op(connection_dirserv_flushed_some(conn), OP_EQ, 0);
+  }
+  tt_u64_op(n_received, OP_EQ, bodylen);
+  tt_mem_op(received, OP_EQ, body, bodylen);
+
+  /* We're done with the spool. */
+  tt_ptr_op(conn->spool, OP_EQ, NULL);
+  tt_int_op(connection_dirserv_sendfile_some(conn, 1000), OP_EQ, 0);
+  tt_assert(! connection_wants_to_flush(TO_CONN(conn)));
+
+ done:
+  if (conn) {
+    dir_conn_clear_spool(conn);
+    connection_free_minimal(TO_CONN(conn));
+  }
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  consensus_cache_entry_decref(ent);
+  tor_free(body);
+  tor_free(received);
+  tor_free(ddir_fname);
+  consensus_cache_free(cache);
+}
+
 #define ENT(name)                                               \
   { #name, test_conscache_ ## name, TT_FORK, NULL, NULL }
 
@@ -336,5 +478,7 @@ struct testcase_t conscache_tests[] = {
   ENT(simple_usage),
   ENT(cleanup),
   ENT(filter),
+  ENT(open_body),
+  ENT(spool_sendfile),
   END_OF_TESTCASES
 };
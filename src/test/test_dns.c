@@ -10,15 +10,18 @@
 #include "feature/relay/dns.h"
 #include "core/mainloop/connection.h"
 #include "core/or/connection_edge.h"
+#include "feature/hibernate/hibernate.h"
 #include "feature/relay/router.h"
 
 #include "core/or/edge_connection_st.h"
 #include "core/or/or_circuit_st.h"
 #include "app/config/or_options_st.h"
 #include "app/config/config.h"
+#include "lib/evloop/compat_libevent.h"
 
 #include <event2/event.h>
 #include <event2/dns.h>
+#include <event2/dns_struct.h>
 
 #ifdef HAVE_EVDNS_BASE_GET_NAMESERVER_ADDR
 
@@ -773,6 +776,372 @@ test_dns_impl_cache_miss(void *arg)
   return;
 }
 
+static void
+test_dns_cache_ttl(void *arg)
+{
+  cached_resolve_t *resolve = tor_malloc_zero(sizeof(cached_resolve_t));
+  uint32_t negative_ttl;
+  time_t now = time(NULL);
+
+  (void)arg;
+
+  resolve->magic = CACHED_RESOLVE_MAGIC;
+  resolve->state = CACHE_STATE_CACHED;
+  resolve->minheap_idx = -1;
+
+  /* Answers are cached for the clipped value of their lowest TTL. */
+  resolve->res_status_ipv4 = RES_STATUS_DONE_OK;
+  resolve->ttl_ipv4 = 30;
+  resolve->res_status_ipv6 = RES_STATUS_DONE_ERR;
+  resolve->result_ipv6.err_ipv6 = DNS_ERR_NOTEXIST;
+  resolve->ttl_ipv6 = 7200;
+  tt_int_op(cached_resolve_get_cache_ttl(resolve), OP_EQ, MIN_DNS_TTL);
+  resolve->ttl_ipv4 = 7200;
+  tt_int_op(cached_resolve_get_cache_ttl(resolve), OP_EQ, MAX_DNS_TTL);
+
+  /* Failures are cached for less than any answer, whatever their TTL, and
+   * transient ones for even less. */
+  resolve->res_status_ipv4 = RES_STATUS_DONE_ERR;
+  resolve->result_ipv4.err_ipv4 = DNS_ERR_NOTEXIST;
+  negative_ttl = cached_resolve_get_cache_ttl(resolve);
+  tt_uint_op(negative_ttl, OP_GT, 0);
+  tt_uint_op(negative_ttl, OP_LT, MIN_DNS_TTL);
+  resolve->result_ipv6.err_ipv6 = DNS_ERR_TIMEOUT;
+  tt_uint_op(cached_resolve_get_cache_ttl(resolve), OP_GT, 0);
+  tt_uint_op(cached_resolve_get_cache_ttl(resolve), OP_LT, negative_ttl);
+
+  /* Popular answers get refreshed near the end of their life only. */
+  resolve->res_status_ipv4 = RES_STATUS_DONE_OK;
+  resolve->cache_ttl = MAX_DNS_TTL;
+  resolve->expire = now + MAX_DNS_TTL / 2;
+  resolve->n_hits = 100;
+  tt_assert(!cached_resolve_wants_refresh(resolve, now));
+  resolve->expire = now + 10;
+  tt_assert(cached_resolve_wants_refresh(resolve, now));
+  resolve->n_hits = 0;
+  tt_assert(!cached_resolve_wants_refresh(resolve, now));
+
+  /* Failures don't get refreshed. */
+  resolve->n_hits = 100;
+  resolve->res_status_ipv4 = RES_STATUS_DONE_ERR;
+  tt_assert(!cached_resolve_wants_refresh(resolve, now));
+
+ done:
+  tor_free(resolve);
+}
+
+/* A nameserver for the stub_nameserver test: it answers every A query with
+ * stub_answer_ipv4, except for the ones about nx.example.com. */
+static int stub_n_queries = 0;
+static uint32_t stub_answer_ipv4 = 0;
+
+static void
+stub_nameserver_cb(struct evdns_server_request *req, void *arg)
+{
+  int i, err = DNS_ERR_NONE;
+
+  (void)arg;
+
+  for (i = 0; i < req->nquestions; ++i) {
+    const struct evdns_server_question *q = req->questions[i];
+    ++stub_n_queries;
+    if (!strcasecmp(q->name, "nx.example.com")) {
+      err = DNS_ERR_NOTEXIST;
+    } else if (q->type == EVDNS_TYPE_A) {
+      uint32_t a = htonl(stub_answer_ipv4);
+      evdns_server_request_add_a_reply(req, q->name, 1, &a, 3600);
+    }
+  }
+  evdns_server_request_respond(req, err);
+}
+
+static or_options_t stub_options;
+
+static const or_options_t *
+stub_get_options(void)
+{
+  return &stub_options;
+}
+
+static int
+stub_we_are_hibernating(void)
+{
+  return 0;
+}
+
+/* Run the event loop until we have all the answers for <b>n</b> lookups. */
+static void
+stub_wait_for_resolves(uint64_t n)
+{
+  dns_stats_t stats;
+  int i;
+
+  for (i = 0; i < 100; ++i) {
+    dns_get_stats(&stats);
+    if (stats.n_resolves >= n)
+      return;
+    event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE);
+  }
+}
+
+/* Ask the DNS cache about <b>address</b> for <b>exitconn</b>, and return the
+ * result of dns_resolve_impl(). If the stream has to wait for a lookup, mark
+ * it for close, so that we don't have to build the circuit the answer would
+ * go to. */
+static int
+stub_resolve(edge_connection_t *exitconn, const char *address,
+             or_circuit_t *on_circ)
+{
+  int made_pending = 0, r;
+  cached_resolve_t *resolve_out = NULL;
+
+  TO_CONN(exitconn)->address = tor_strdup(address);
+  r = dns_resolve_impl(exitconn, 1, on_circ, NULL, &made_pending,
+                       &resolve_out);
+  if (made_pending)
+    TO_CONN(exitconn)->marked_for_close = 1;
+  return r;
+}
+
+/* Start the stub nameserver on a local UDP port, and configure the DNS
+ * cache to use it. Return the server port, or NULL on failure. */
+static struct evdns_server_port *
+stub_nameserver_start(void)
+{
+  tor_socket_t sock;
+  struct evdns_server_port *port = NULL;
+  struct sockaddr_in sin;
+  socklen_t slen = sizeof(sin);
+  char *conf = NULL;
+
+  sock = tor_open_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (!SOCKET_OK(sock))
+    return NULL;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  if (bind(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+      getsockname(sock, (struct sockaddr *)&sin, &slen) < 0 ||
+      set_socket_nonblocking(sock) < 0) {
+    tor_close_socket(sock);
+    return NULL;
+  }
+  /* From now on, the server port owns the socket. */
+  port = tor_evdns_add_server_port(sock, 0, stub_nameserver_cb, NULL);
+  if (!port) {
+    tor_close_socket(sock);
+    return NULL;
+  }
+
+  tor_asprintf(&conf, "nameserver 127.0.0.1:%d\n", ntohs(sin.sin_port));
+  write_str_to_file(get_fname("stub_resolv.conf"), conf, 0);
+  tor_free(conf);
+  stub_options.ServerDNSResolvConfFile =
+    (char *)get_fname("stub_resolv.conf");
+
+  MOCK(get_options, stub_get_options);
+  MOCK(we_are_hibernating, stub_we_are_hibernating);
+  MOCK(router_my_exit_policy_is_reject_star,
+       dns_impl_cache_miss_router_my_exit_policy_is_reject_star);
+  if (dns_init() < 0) {
+    evdns_close_server_port(port);
+    return NULL;
+  }
+  return port;
+}
+
+/* Free the DNS cache, and stop the stub nameserver <b>port</b>. */
+static void
+stub_nameserver_stop(struct evdns_server_port *port)
+{
+  UNMOCK(get_options);
+  UNMOCK(we_are_hibernating);
+  UNMOCK(router_my_exit_policy_is_reject_star);
+  dns_free_all();
+  if (port)
+    evdns_close_server_port(port);
+}
+
+static void
+test_dns_cache_stub_nameserver(void *arg)
+{
+  struct evdns_server_port *port = NULL;
+  edge_connection_t *conns[8];
+  or_circuit_t *on_circ = tor_malloc_zero(sizeof(or_circuit_t));
+  cached_resolve_t query, *entry;
+  dns_stats_t stats;
+  tor_addr_t addr;
+  int i;
+
+  (void)arg;
+
+  for (i = 0; i < (int) ARRAY_LENGTH(conns); ++i)
+    conns[i] = create_valid_exitconn();
+
+  port = stub_nameserver_start();
+  tt_assert(port);
+
+  /* A miss launches a lookup, and the answer gets cached. */
+  stub_answer_ipv4 = 0xc0000201;
+  tt_int_op(stub_resolve(conns[0], "hot.example.com", on_circ), OP_EQ, 0);
+  stub_wait_for_resolves(1);
+  strlcpy(query.address, "hot.example.com", sizeof(query.address));
+  entry = dns_get_cache_entry(&query);
+  tt_assert(entry);
+  tt_int_op(entry->state, OP_EQ, CACHE_STATE_CACHED);
+  tt_int_op(entry->res_status_ipv4, OP_EQ, RES_STATUS_DONE_OK);
+  tt_uint_op(entry->result_ipv4.addr_ipv4, OP_EQ, 0xc0000201);
+  tt_int_op(entry->cache_ttl, OP_EQ, MAX_DNS_TTL);
+  tt_int_op(stub_n_queries, OP_EQ, 1);
+
+  /* Then we answer from the cache. */
+  for (i = 1; i <= 3; ++i)
+    tt_int_op(stub_resolve(conns[i], "hot.example.com", on_circ), OP_EQ, 1);
+  tor_addr_from_ipv4h(&addr, 0xc0000201);
+  tt_assert(tor_addr_eq(&TO_CONN(conns[1])->addr, &addr));
+  tt_assert(!entry->refresh);
+  tt_int_op(stub_n_queries, OP_EQ, 1);
+
+  /* Once the popular answer gets close to its expiry, the next hit
+   * refreshes it in the background. Pretend that we have cached it for long
+   * enough. */
+  entry->cache_ttl = 100 * MAX_DNS_TTL;
+  stub_answer_ipv4 = 0xc0000202;
+  tt_int_op(stub_resolve(conns[4], "hot.example.com", on_circ), OP_EQ, 1);
+  tt_assert(tor_addr_eq(&TO_CONN(conns[4])->addr, &addr));
+  tt_assert(entry->refresh);
+  stub_wait_for_resolves(2);
+  tt_int_op(stub_n_queries, OP_EQ, 2);
+  entry = dns_get_cache_entry(&query);
+  tt_assert(entry);
+  tt_int_op(entry->state, OP_EQ, CACHE_STATE_CACHED);
+  tt_uint_op(entry->result_ipv4.addr_ipv4, OP_EQ, 0xc0000202);
+  tt_int_op(entry->n_hits, OP_EQ, 0);
+
+  /* Streams that ask for an address we're already looking up wait for that
+   * lookup. */
+  tt_int_op(stub_resolve(conns[5], "cold.example.com", on_circ), OP_EQ, 0);
+  tt_int_op(stub_resolve(conns[6], "cold.example.com", on_circ), OP_EQ, 0);
+  stub_wait_for_resolves(3);
+  tt_int_op(stub_n_queries, OP_EQ, 3);
+
+  /* Failures get cached, for a short time. */
+  tt_int_op(stub_resolve(conns[7], "nx.example.com", on_circ), OP_EQ, 0);
+  stub_wait_for_resolves(4);
+  tt_int_op(stub_n_queries, OP_EQ, 4);
+  strlcpy(query.address, "nx.example.com", sizeof(query.address));
+  entry = dns_get_cache_entry(&query);
+  tt_assert(entry);
+  tt_int_op(entry->state, OP_EQ, CACHE_STATE_CACHED);
+  tt_int_op(entry->res_status_ipv4, OP_EQ, RES_STATUS_DONE_ERR);
+  tt_int_op(entry->cache_ttl, OP_LT, MIN_DNS_TTL);
+  tor_free(TO_CONN(conns[7])->address);
+  tt_int_op(stub_resolve(conns[7], "nx.example.com", on_circ), OP_EQ, -1);
+  tt_int_op(stub_n_queries, OP_EQ, 4);
+
+  dns_get_stats(&stats);
+  tt_u64_op(stats.n_misses, OP_EQ, 3);
+  tt_u64_op(stats.n_hits, OP_EQ, 4);
+  tt_u64_op(stats.n_negative_hits, OP_EQ, 1);
+  tt_u64_op(stats.n_coalesced, OP_EQ, 1);
+  tt_u64_op(stats.n_prefetches, OP_EQ, 1);
+  tt_u64_op(stats.n_refreshed, OP_EQ, 1);
+  tt_u64_op(stats.n_resolves, OP_EQ, 4);
+
+ done:
+  stub_nameserver_stop(port);
+  for (i = 0; i < (int) ARRAY_LENGTH(conns); ++i) {
+    tor_free(TO_CONN(conns[i])->address);
+    tor_free(conns[i]);
+  }
+  tor_free(on_circ);
+}
+
+/* Return true iff the DNS cache has an entry for <b>address</b>. */
+static int
+stub_is_cached(const char *address)
+{
+  cached_resolve_t query;
+  strlcpy(query.address, address, sizeof(query.address));
+  return dns_get_cache_entry(&query) != NULL;
+}
+
+static void
+test_dns_cache_eviction(void *arg)
+{
+  struct evdns_server_port *port = NULL;
+  static const char *names[] = {
+    "a.example.com", "b.example.com", "c.example.com", "d.example.com",
+  };
+  edge_connection_t *conns[8];
+  or_circuit_t *on_circ = tor_malloc_zero(sizeof(or_circuit_t));
+  size_t empty_size, size_of_two;
+  dns_stats_t stats;
+  int i;
+
+  (void)arg;
+
+  for (i = 0; i < (int) ARRAY_LENGTH(conns); ++i)
+    conns[i] = create_valid_exitconn();
+
+  port = stub_nameserver_start();
+  tt_assert(port);
+  stub_answer_ipv4 = 0xc0000201;
+  empty_size = dns_cache_total_allocation();
+
+  /* Every answer is accounted for. */
+  tt_int_op(stub_resolve(conns[0], names[0], on_circ), OP_EQ, 0);
+  tt_int_op(stub_resolve(conns[1], names[1], on_circ), OP_EQ, 0);
+  stub_wait_for_resolves(2);
+  tt_assert(stub_is_cached(names[0]));
+  tt_assert(stub_is_cached(names[1]));
+  size_of_two = dns_cache_total_allocation();
+  tt_int_op(size_of_two, OP_GE, empty_size + 2 * sizeof(cached_resolve_t));
+
+  /* Once the cache is full, a new answer that no stream has used yet goes
+   * before the ones that streams have used. */
+  stub_options.ServerDNSCacheMaxSize = size_of_two;
+  tt_int_op(stub_resolve(conns[2], names[0], on_circ), OP_EQ, 1);
+  tt_int_op(stub_resolve(conns[3], names[1], on_circ), OP_EQ, 1);
+  tt_int_op(stub_resolve(conns[4], names[2], on_circ), OP_EQ, 0);
+  stub_wait_for_resolves(3);
+  tt_assert(stub_is_cached(names[0]));
+  tt_assert(stub_is_cached(names[1]));
+  tt_assert(!stub_is_cached(names[2]));
+  tt_int_op(dns_cache_total_allocation(), OP_LE, size_of_two);
+
+  /* Without a budget, the cache grows. Then, under memory pressure, the
+   * answers that streams used the least recently go first. */
+  stub_options.ServerDNSCacheMaxSize = 0;
+  tt_int_op(stub_resolve(conns[5], names[3], on_circ), OP_EQ, 0);
+  stub_wait_for_resolves(4);
+  tt_assert(stub_is_cached(names[3]));
+  tt_int_op(stub_resolve(conns[6], names[0], on_circ), OP_EQ, 1);
+  tt_int_op(dns_cache_handle_oom(time(NULL), 1), OP_GE,
+            sizeof(cached_resolve_t));
+  tt_assert(stub_is_cached(names[0]));
+  tt_int_op(stub_is_cached(names[1]) + stub_is_cached(names[3]), OP_EQ, 1);
+  tt_int_op(cached_resolve_clock_evict_one(), OP_EQ, 1);
+  tt_int_op(cached_resolve_clock_evict_one(), OP_EQ, 1);
+  tt_int_op(cached_resolve_clock_evict_one(), OP_EQ, 0);
+  tt_assert(!stub_is_cached(names[0]));
+
+  dns_get_stats(&stats);
+  tt_u64_op(stats.n_evicted, OP_EQ, 4);
+
+  /* The accounting balances. */
+  dns_free_all();
+  tt_int_op(dns_cache_total_allocation(), OP_EQ, empty_size);
+
+ done:
+  stub_nameserver_stop(port);
+  for (i = 0; i < (int) ARRAY_LENGTH(conns); ++i) {
+    tor_free(TO_CONN(conns[i])->address);
+    tor_free(conns[i]);
+  }
+  tor_free(on_circ);
+}
+
 struct testcase_t dns_tests[] = {
 #ifdef HAVE_EVDNS_BASE_GET_NAMESERVER_ADDR
    { "configure_ns_fallback", test_dns_configure_ns_fallback,
@@ -790,5 +1159,9 @@ struct testcase_t dns_tests[] = {
    { "impl_cache_hit_cached", test_dns_impl_cache_hit_cached,
      TT_FORK, NULL, NULL },
    { "impl_cache_miss", test_dns_impl_cache_miss, TT_FORK, NULL, NULL },
+   { "cache_ttl", test_dns_cache_ttl, TT_FORK, NULL, NULL },
+   { "cache_stub_nameserver", test_dns_cache_stub_nameserver,
+     TT_FORK, NULL, NULL },
+   { "cache_eviction", test_dns_cache_eviction, TT_FORK, NULL, NULL },
    END_OF_TESTCASES
 };
@@ -2,11 +2,13 @@
 /* See LICENSE for licensing information */
 
 #define DOS_PRIVATE
+#define DOS_PREFIX_PRIVATE
 #define CHANNEL_OBJECT_PRIVATE
 #define CIRCUITLIST_PRIVATE
 
 #include "core/or/or.h"
 #include "core/or/dos.h"
+#include "core/or/dos_prefix.h"
 #include "core/or/circuitlist.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/stats/geoip_stats.h"
@@ -17,6 +19,7 @@
 #include "feature/nodelist/routerlist.h"
 
 #include "feature/nodelist/networkstatus_st.h"
+#include "core/or/or_circuit_st.h"
 #include "core/or/or_connection_st.h"
 #include "feature/nodelist/routerstatus_st.h"
 
@@ -496,11 +499,332 @@ test_known_relay(void *arg)
   UNMOCK(get_param_cc_enabled);
 }
 
+/** Test that the prefix tracker marks a busy network whose addresses are
+ * each quiet, and only that network. */
+static void
+test_dos_prefix_tracker(void *arg)
+{
+  dos_prefix_tracker_t *tracker = dos_prefix_tracker_new();
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  tor_addr_t addr;
+  char buf[TOR_ADDR_BUF_LEN];
+  char *top = NULL;
+  int i;
+
+  (void) arg;
+
+  /* Nothing gets marked before we have a threshold. */
+  tt_int_op(AF_INET, OP_EQ, tor_addr_parse(&addr, "10.1.2.3"));
+  for (i = 0; i < 1000; i++) {
+    tt_int_op(0, OP_EQ, dos_prefix_tracker_note(tracker, &addr, now,
+                                                now + 60));
+  }
+  tt_int_op(0, OP_EQ, dos_prefix_tracker_is_marked(tracker, &addr, now));
+  dos_prefix_tracker_free(tracker);
+
+  /* 100 events from a /24, each from a different address, mark the /24 on
+   * the 100th. The /16 gets 8 times as much room. */
+  tracker = dos_prefix_tracker_new();
+  dos_prefix_tracker_set_threshold(tracker, 100);
+  for (i = 0; i < 100; i++) {
+    tor_snprintf(buf, sizeof(buf), "10.1.2.%d", i);
+    tt_int_op(AF_INET, OP_EQ, tor_addr_parse(&addr, buf));
+    tt_int_op(i == 99, OP_EQ,
+              dos_prefix_tracker_note(tracker, &addr, now, now + 60));
+  }
+  tt_uint_op(100, OP_EQ, dos_prefix_tracker_estimate(tracker, &addr, 24));
+  tt_uint_op(100, OP_EQ, dos_prefix_tracker_estimate(tracker, &addr, 16));
+  tt_int_op(AF_INET, OP_EQ, tor_addr_parse(&addr, "10.1.2.200"));
+  tt_int_op(1, OP_EQ, dos_prefix_tracker_is_marked(tracker, &addr, now));
+  tt_int_op(AF_INET, OP_EQ, tor_addr_parse(&addr, "10.1.3.1"));
+  tt_int_op(0, OP_EQ, dos_prefix_tracker_is_marked(tracker, &addr, now));
+  tt_int_op(AF_INET6, OP_EQ, tor_addr_parse(&addr, "[::a01:203]"));
+  tt_int_op(0, OP_EQ, dos_prefix_tracker_is_marked(tracker, &addr, now));
+
+  /* Same for a /64, with random interface identifiers. */
+  for (i = 0; i < 100; i++) {
+    uint8_t a6[16] = { 0x20, 0x01, 0x0d, 0xb8, 0, 1, 0, 2 };
+    crypto_rand((char *) a6 + 8, 8);
+    tor_addr_from_ipv6_bytes(&addr, a6);
+    dos_prefix_tracker_note(tracker, &addr, now, now + 60);
+  }
+  tt_int_op(AF_INET6, OP_EQ, tor_addr_parse(&addr, "[2001:db8:1:2::1]"));
+  tt_int_op(1, OP_EQ, dos_prefix_tracker_is_marked(tracker, &addr, now));
+  tt_int_op(AF_INET6, OP_EQ, tor_addr_parse(&addr, "[2001:db8:1:3::1]"));
+  tt_int_op(0, OP_EQ, dos_prefix_tracker_is_marked(tracker, &addr, now));
+
+  /* The heartbeat lists the busiest networks first. */
+  top = dos_prefix_tracker_format_top(tracker, 4, now, 0);
+  tt_assert(top);
+  tt_assert(strstr(top, "10.1.2.0/24 (~100) marked"));
+  tt_assert(strstr(top, "10.1.0.0/16 (~100)"));
+  tor_free(top);
+  top = dos_prefix_tracker_format_top(tracker, 4, now, 1);
+  tt_assert(top);
+  tt_assert(!strstr(top, "10.1.2.0"));
+  tt_assert(strstr(top, "[scrubbed]/24 (~100) marked"));
+  tor_free(top);
+
+  /* Marks expire, and counts halve every period. */
+  tt_int_op(AF_INET, OP_EQ, tor_addr_parse(&addr, "10.1.2.1"));
+  tt_int_op(0, OP_EQ, dos_prefix_tracker_is_marked(tracker, &addr,
+                                                   now + 61));
+  dos_prefix_tracker_note(tracker, &addr, now + DOS_PREFIX_DECAY_PERIOD,
+                          now + DOS_PREFIX_DECAY_PERIOD);
+  tt_uint_op(51, OP_EQ, dos_prefix_tracker_estimate(tracker, &addr, 24));
+  dos_prefix_tracker_note(tracker, &addr, now + 10 * DOS_PREFIX_DECAY_PERIOD,
+                          now + 10 * DOS_PREFIX_DECAY_PERIOD);
+  tt_uint_op(1, OP_EQ, dos_prefix_tracker_estimate(tracker, &addr, 24));
+  now += 10 * DOS_PREFIX_DECAY_PERIOD;
+
+  /* A spray from many networks doesn't grow the tracker, and doesn't hide
+   * a busy network among them. */
+  for (i = 0; i < 20000; i++) {
+    if (i % 10 == 0) {
+      tor_snprintf(buf, sizeof(buf), "192.0.2.%d", i % 256);
+      tt_int_op(AF_INET, OP_EQ, tor_addr_parse(&addr, buf));
+    } else {
+      tor_addr_from_ipv4h(&addr, crypto_rand_u32());
+    }
+    dos_prefix_tracker_note(tracker, &addr, now, now + 60);
+  }
+  tt_int_op(dos_prefix_tracker_get_n_top(tracker), OP_LE, DOS_PREFIX_N_TOP);
+  tt_int_op(AF_INET, OP_EQ, tor_addr_parse(&addr, "192.0.2.255"));
+  tt_int_op(1, OP_EQ, dos_prefix_tracker_is_marked(tracker, &addr, now));
+  tt_int_op(AF_INET, OP_EQ, tor_addr_parse(&addr, "198.51.100.1"));
+  tt_int_op(0, OP_EQ, dos_prefix_tracker_is_marked(tracker, &addr, now));
+
+ done:
+  tor_free(top);
+  dos_prefix_tracker_free(tracker);
+}
+
+/** Address that mock_channel_get_prefix_addr() gives to every channel. */
+static tor_addr_t prefix_test_addr;
+
+/** Helper mock: Place prefix_test_addr in <b>addr_out</b>. */
+static int
+mock_channel_get_prefix_addr(const channel_t *chan, tor_addr_t *addr_out)
+{
+  (void)chan;
+  tor_addr_copy(addr_out, &prefix_test_addr);
+  return 1;
+}
+
+/** Test that the circuit creation mitigation refuses circuits from a
+ * network whose addresses each stay under the per-address limits. */
+static void
+test_dos_prefix_circuit_creation(void *arg)
+{
+  uint64_t threshold, i;
+  char buf[TOR_ADDR_BUF_LEN];
+
+  (void) arg;
+
+  MOCK(get_param_cc_enabled, mock_enable_dos_protection);
+  MOCK(get_param_prefix_enabled, mock_enable_dos_protection);
+  MOCK(channel_get_addr_if_possible, mock_channel_get_prefix_addr);
+
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  channel_init(chan);
+  chan->is_client = 1;
+
+  dos_init();
+  threshold = (get_param_cc_circuit_burst(NULL) +
+               2 * get_circuit_rate_per_second() * DOS_PREFIX_DECAY_PERIOD) *
+              DOS_PREFIX_MAX_ADDRESSES_DEFAULT;
+
+  /* None of these addresses is in the geoip cache, so only the prefix
+   * tracker can see them. */
+  for (i = 0; i < threshold - 1; i++) {
+    tor_snprintf(buf, sizeof(buf), "18.0.0.%d", (int) (i % 250) + 1);
+    tt_int_op(AF_INET, OP_EQ, tor_addr_parse(&prefix_test_addr, buf));
+    dos_cc_new_create_cell(chan);
+  }
+  tt_int_op(DOS_CC_DEFENSE_NONE, OP_EQ, dos_cc_get_defense_type(chan));
+
+  dos_cc_new_create_cell(chan);
+  tt_int_op(DOS_CC_DEFENSE_REFUSE_CELL, OP_EQ, dos_cc_get_defense_type(chan));
+
+  /* The whole /24 is refused, and nothing else. */
+  tt_int_op(AF_INET, OP_EQ, tor_addr_parse(&prefix_test_addr, "18.0.0.254"));
+  tt_int_op(DOS_CC_DEFENSE_REFUSE_CELL, OP_EQ, dos_cc_get_defense_type(chan));
+  tt_int_op(AF_INET, OP_EQ, tor_addr_parse(&prefix_test_addr, "18.0.1.1"));
+  tt_int_op(DOS_CC_DEFENSE_NONE, OP_EQ, dos_cc_get_defense_type(chan));
+
+  /* And the heartbeat tells us about it. */
+  setup_full_capture_of_logs(LOG_NOTICE);
+  dos_log_heartbeat();
+  expect_log_msg_containing("1 networks marked for circuits");
+  expect_log_msg_containing("Busiest networks creating circuits: ");
+
+ done:
+  teardown_capture_of_logs();
+  tor_free(chan);
+  dos_free_all();
+  UNMOCK(get_param_cc_enabled);
+  UNMOCK(get_param_prefix_enabled);
+  UNMOCK(channel_get_addr_if_possible);
+}
+
+/** Test that a known relay inside a network marked by the connection prefix
+ * tracker can still connect to us. */
+static void
+test_dos_prefix_known_relay(void *arg)
+{
+  routerstatus_t *rs = NULL;
+  or_connection_t or_conn;
+  tor_addr_t relay_addr;
+  char buf[TOR_ADDR_BUF_LEN];
+  uint64_t i;
+
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(networkstatus_get_latest_consensus_by_flavor,
+       mock_networkstatus_get_latest_consensus_by_flavor);
+  MOCK(get_estimated_address_per_node,
+       mock_get_estimated_address_per_node);
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+  MOCK(get_param_prefix_enabled, mock_enable_dos_protection);
+
+  dos_init();
+
+  dummy_ns = tor_malloc_zero(sizeof(*dummy_ns));
+  dummy_ns->flavor = FLAV_MICRODESC;
+  dummy_ns->routerstatus_list = smartlist_new();
+
+  memset(&or_conn, 0, sizeof(or_conn));
+  tor_addr_parse(&relay_addr, "42.42.42.42");
+  rs = tor_malloc_zero(sizeof(*rs));
+  tor_addr_copy(&rs->ipv4_addr, &relay_addr);
+  crypto_rand(rs->identity_digest, sizeof(rs->identity_digest));
+  smartlist_add(dummy_ns->routerstatus_list, rs);
+  addr_per_node = 1024;
+  nodelist_set_consensus(dummy_ns);
+
+  /* Clients of the relay's /24 open enough connections to mark it, while
+   * each of them stays under the per-address limit. */
+  for (i = 0; i < 2 * (uint64_t) DOS_CONN_MAX_CONCURRENT_COUNT_DEFAULT *
+                  DOS_PREFIX_MAX_ADDRESSES_DEFAULT; i++) {
+    tor_snprintf(buf, sizeof(buf), "42.42.42.%d", (int) (i % 200) + 50);
+    tor_addr_parse(&TO_CONN(&or_conn)->addr, buf);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &TO_CONN(&or_conn)->addr,
+                           NULL, 0);
+    dos_new_client_conn(&or_conn, NULL);
+  }
+  tt_int_op(DOS_CONN_DEFENSE_CLOSE, OP_EQ,
+            dos_conn_addr_get_defense_type(&TO_CONN(&or_conn)->addr));
+
+  /* The relay itself is still welcome. */
+  tt_int_op(DOS_CONN_DEFENSE_NONE, OP_EQ,
+            dos_conn_addr_get_defense_type(&relay_addr));
+
+ done:
+  routerstatus_free(rs);
+  if (dummy_ns) {
+    smartlist_clear(dummy_ns->routerstatus_list);
+    networkstatus_vote_free(dummy_ns);
+  }
+  dos_free_all();
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(networkstatus_get_latest_consensus_by_flavor);
+  UNMOCK(get_estimated_address_per_node);
+  UNMOCK(get_param_conn_enabled);
+  UNMOCK(get_param_prefix_enabled);
+}
+
+/** Test the stream creation token bucket of OR circuits, and its response to
+ * new parameters. */
+static void
+test_dos_stream_creation(void *arg)
+{
+  or_circuit_t *circ = NULL;
+  dos_stream_stats_t stats;
+  networkstatus_t ns;
+  int i;
+
+  (void) arg;
+
+  memset(&ns, 0, sizeof(ns));
+  MOCK(get_param_stream_enabled, mock_enable_dos_protection);
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  update_approx_time(1000000);
+  dos_init();
+  circ = or_circuit_new(0, NULL);
+
+  /* The whole burst goes through, and then streams are refused. */
+  for (i = 0; i < DOS_STREAM_BURST_DEFAULT; i++) {
+    tt_int_op(DOS_STREAM_DEFENSE_NONE, OP_EQ,
+              dos_stream_new_begin_or_resolve_cell(circ));
+  }
+  tt_int_op(DOS_STREAM_DEFENSE_REFUSE_STREAM, OP_EQ,
+            dos_stream_new_begin_or_resolve_cell(circ));
+
+  /* One second later, we get one second worth of streams. */
+  update_approx_time(1000001);
+  for (i = 0; i < DOS_STREAM_RATE_DEFAULT; i++) {
+    tt_int_op(DOS_STREAM_DEFENSE_NONE, OP_EQ,
+              dos_stream_new_begin_or_resolve_cell(circ));
+  }
+  tt_int_op(DOS_STREAM_DEFENSE_REFUSE_STREAM, OP_EQ,
+            dos_stream_new_begin_or_resolve_cell(circ));
+
+  dos_stream_get_stats(&stats);
+  tt_u64_op(stats.n_refused_streams, OP_EQ, 2);
+  tt_u64_op(stats.n_closed_circuits, OP_EQ, 0);
+
+  /* New parameters apply to the circuits that already exist. */
+  ns.net_params = smartlist_new();
+  smartlist_add(ns.net_params, (void *) "DoSStreamCreationBurst=5");
+  smartlist_add(ns.net_params, (void *) "DoSStreamCreationDefenseType=3");
+  dummy_ns = &ns;
+  dos_init();
+
+  update_approx_time(1000010);
+  for (i = 0; i < 5; i++) {
+    tt_int_op(DOS_STREAM_DEFENSE_NONE, OP_EQ,
+              dos_stream_new_begin_or_resolve_cell(circ));
+  }
+  tt_int_op(DOS_STREAM_DEFENSE_CLOSE_CIRCUIT, OP_EQ,
+            dos_stream_new_begin_or_resolve_cell(circ));
+
+  dos_stream_get_stats(&stats);
+  tt_u64_op(stats.n_refused_streams, OP_EQ, 2);
+  tt_u64_op(stats.n_closed_circuits, OP_EQ, 1);
+
+  /* Nothing is limited when the mitigation is disabled. */
+  UNMOCK(get_param_stream_enabled);
+  dos_init();
+  for (i = 0; i < 10; i++) {
+    tt_int_op(DOS_STREAM_DEFENSE_NONE, OP_EQ,
+              dos_stream_new_begin_or_resolve_cell(circ));
+  }
+
+ done:
+  dummy_ns = NULL;
+  smartlist_free(ns.net_params);
+  if (circ)
+    circuit_free_(TO_CIRCUIT(circ));
+  dos_free_all();
+  UNMOCK(get_param_stream_enabled);
+  UNMOCK(networkstatus_get_latest_consensus);
+}
+
 struct testcase_t dos_tests[] = {
   { "conn_creation", test_dos_conn_creation, TT_FORK, NULL, NULL },
   { "circuit_creation", test_dos_circuit_creation, TT_FORK, NULL, NULL },
   { "bucket_refill", test_dos_bucket_refill, TT_FORK, NULL, NULL },
   { "known_relay" , test_known_relay, TT_FORK,
     NULL, NULL },
+  { "prefix_tracker", test_dos_prefix_tracker, TT_FORK, NULL, NULL },
+  { "prefix_circuit_creation", test_dos_prefix_circuit_creation, TT_FORK,
+    NULL, NULL },
+  { "prefix_known_relay", test_dos_prefix_known_relay, TT_FORK,
+    NULL, NULL },
+  { "stream_creation", test_dos_stream_creation, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -10,6 +10,7 @@
 #define GEOIP_PRIVATE
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/geoip/geoip.h"
 #include "feature/stats/geoip_stats.h"
 #include "test/test.h"
@@ -564,6 +565,282 @@ test_geoip_load_2nd_file(void *arg)
   tor_free(fname_empty);
 }
 
+/** Binary IPv4 GeoIP table with some of the ranges of GEOIP_CONTENT, as
+ * src/config/geoip-compile.py would write it, except that it claims an
+ * arbitrary digest, and has a bad country index in its last range. */
+static const uint8_t GEOIP_BINARY_CONTENT[] = {
+  'T', 'O', 'R', 'G', 'E', 'O', 'I', 'P',
+  1, 4, 0, 3, 0, 0, 0, 4,
+  /* Digest */
+  0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x01, 0x23,
+  0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x01, 0x23, 0x45, 0x67,
+  0, 0, 0, 0,
+  /* Countries */
+  'C', 'A', 'G', 'U', 'M', 'P',
+  /* 134445936,134445939,MP */
+  0x08, 0x03, 0x7b, 0x70, 0x08, 0x03, 0x7b, 0x73, 0, 2,
+  /* 134445940,134447103,GU */
+  0x08, 0x03, 0x7b, 0x74, 0x08, 0x03, 0x7f, 0xff, 0, 1,
+  /* 134738944,134739199,CA */
+  0x08, 0x07, 0xf4, 0x00, 0x08, 0x07, 0xf4, 0xff, 0, 0,
+  /* 134739200,135192575 */
+  0x08, 0x07, 0xf5, 0x00, 0x08, 0x0e, 0xdf, 0xff, 0, 9,
+};
+
+static void
+test_geoip_load_binary_file(void *arg)
+{
+  (void)arg;
+  char *fname = tor_strdup(get_fname("geoip_binary"));
+  char *fname_text = tor_strdup(get_fname("geoip_text"));
+  uint8_t *bad = NULL;
+
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname,
+                                          (const char *)GEOIP_BINARY_CONTENT,
+                                          sizeof(GEOIP_BINARY_CONTENT), 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+  tt_int_op(1, OP_EQ, geoip_is_loaded(AF_INET));
+  tt_int_op(0, OP_EQ, geoip_is_loaded(AF_INET6));
+  tt_int_op(geoip_get_n_countries(), OP_EQ, 4);
+
+  /* The edges of each range, and the gaps between them. */
+  tt_str_op("mp", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(134445936)));
+  tt_str_op("mp", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(134445939)));
+  tt_str_op("gu", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(134445940)));
+  tt_str_op("gu", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(134447103)));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(134447104));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(134445935));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(0));
+  tt_str_op("ca", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(134739000)));
+  /* A bad country index doesn't take us out of the file. */
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(0x08080808));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(0xffffffff));
+
+  /* We report the digest of the text file that the binary came from. */
+  tt_str_op("0123456789ABCDEF0123456789ABCDEF01234567", OP_EQ,
+            geoip_db_digest(AF_INET));
+
+  /* A text file replaces the binary one. */
+  tt_int_op(0, OP_EQ, write_str_to_file(fname_text, GEOIP_CONTENT, 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname_text, LOG_WARN));
+  tt_str_op("us", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(0x08080808)));
+
+  /* We can't use a binary file for the wrong family... */
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET6, fname, LOG_INFO));
+  tt_int_op(0, OP_EQ, geoip_is_loaded(AF_INET6));
+
+  /* ... or with the wrong length, or version. */
+  bad = tor_memdup(GEOIP_BINARY_CONTENT, sizeof(GEOIP_BINARY_CONTENT));
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, (const char *)bad,
+                                          sizeof(GEOIP_BINARY_CONTENT) - 1,
+                                          1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname, LOG_INFO));
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, (const char *)bad, 20, 1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname, LOG_INFO));
+  bad[8] = 2;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, (const char *)bad,
+                                          sizeof(GEOIP_BINARY_CONTENT), 1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname, LOG_INFO));
+
+  /* The text table we had is still there. */
+  tt_str_op("us", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(0x08080808)));
+
+ done:
+  tor_free(fname);
+  tor_free(fname_text);
+  tor_free(bad);
+}
+
+static void
+test_geoip6_load_binary_file(void *arg)
+{
+  (void)arg;
+  char *fname = tor_strdup(get_fname("geoip6_binary"));
+  struct in6_addr iaddr6;
+  uint8_t content[40 + 2 + 34];
+
+  memset(content, 0, sizeof(content));
+  memcpy(content, "TORGEOIP", 8);
+  content[8] = 1;
+  content[9] = 6;
+  content[11] = 1; /* One country */
+  content[15] = 1; /* One range */
+  memcpy(content + 40, "US", 2);
+  /* 2001:4860::,2001:4860:ffff:ffff:ffff:ffff:ffff:ffff,US */
+  tor_inet_pton(AF_INET6, "2001:4860::", content + 42);
+  tor_inet_pton(AF_INET6, "2001:4860:ffff:ffff:ffff:ffff:ffff:ffff",
+                content + 58);
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, (const char *)content,
+                                          sizeof(content), 1));
+
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, fname, LOG_WARN));
+  tt_int_op(1, OP_EQ, geoip_is_loaded(AF_INET6));
+  tor_inet_pton(AF_INET6, "2001:4860:4860::8888", &iaddr6);
+  tt_str_op("us", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv6(&iaddr6)));
+  tor_inet_pton(AF_INET6, "2001:4861::", &iaddr6);
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv6(&iaddr6));
+  tor_inet_pton(AF_INET6, "2001:485f:ffff::", &iaddr6);
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv6(&iaddr6));
+
+  geoip_free_all();
+  tt_int_op(0, OP_EQ, geoip_is_loaded(AF_INET6));
+  tt_int_op(-1, OP_EQ, geoip_get_country_by_ipv6(&iaddr6));
+
+ done:
+  tor_free(fname);
+}
+
+/** qsort helper: compare two uint32_t. */
+static int
+compare_uint32s_(const void *a, const void *b)
+{
+  const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/** qsort helper: compare two in6_addr by their bytes. */
+static int
+compare_in6_addrs_(const void *a, const void *b)
+{
+  return fast_memcmp(a, b, sizeof(struct in6_addr));
+}
+
+/** Number of range boundaries to generate in the geoip index tests. */
+#define N_INDEX_BOUNDS 4000
+
+static void
+test_geoip_index_differential(void *arg)
+{
+  (void)arg;
+  uint32_t *bounds = tor_calloc(N_INDEX_BOUNDS, sizeof(uint32_t));
+  smartlist_t *lines = smartlist_new();
+  char *contents = NULL;
+  int i, n = 0;
+
+  /* Half of the boundaries land in two /16s, so that some buckets have long
+   * tails to search.  Boundaries are distinct, so ranges are disjoint. */
+  for (i = 0; i < N_INDEX_BOUNDS; ++i) {
+    uint32_t b = crypto_rand_u32();
+    if (i & 1)
+      b = ((i & 2) ? 0x0a0b0000 : 0x0a0c0000) | (b & 0xffff);
+    bounds[i] = b;
+  }
+  qsort(bounds, N_INDEX_BOUNDS, sizeof(uint32_t), compare_uint32s_);
+  for (i = 0; i < N_INDEX_BOUNDS; ++i) {
+    if (n == 0 || bounds[n-1] != bounds[i])
+      bounds[n++] = bounds[i];
+  }
+  for (i = 0; i + 1 < n; i += 2) {
+    smartlist_add_asprintf(lines, "%u,%u,%c%c\n", bounds[i], bounds[i+1],
+                           'a' + crypto_rand_int(26),
+                           'a' + crypto_rand_int(26));
+  }
+  contents = smartlist_join_strings(lines, "", 0, NULL);
+  const char *fname = get_fname("geoip_index");
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, contents, 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+
+  /* The index and the plain binary search agree at every boundary, either
+   * side of it, and anywhere else. */
+#define CHECK_V4(a) tt_int_op(geoip_get_country_by_ipv4(a), OP_EQ, \
+                              geoip_get_country_by_ipv4_bsearch(a))
+  for (i = 0; i < n; ++i) {
+    CHECK_V4(bounds[i]);
+    CHECK_V4(bounds[i] - 1);
+    CHECK_V4(bounds[i] + 1);
+  }
+  for (i = 0; i < 10000; ++i) {
+    uint32_t a = crypto_rand_u32();
+    CHECK_V4(a);
+  }
+  CHECK_V4(0);
+  CHECK_V4(UINT32_MAX);
+#undef CHECK_V4
+
+ done:
+  tor_free(bounds);
+  tor_free(contents);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+}
+
+static void
+test_geoip6_index_differential(void *arg)
+{
+  (void)arg;
+  struct in6_addr *bounds = tor_calloc(N_INDEX_BOUNDS,
+                                       sizeof(struct in6_addr));
+  smartlist_t *lines = smartlist_new();
+  char *contents = NULL;
+  char low[TOR_ADDR_BUF_LEN], high[TOR_ADDR_BUF_LEN];
+  struct in6_addr a;
+  int i, n = 0;
+
+  /* Real IPv6 tables are crowded into a few prefixes: put most of our
+   * boundaries in two /32s of one /16, so that many entries share their
+   * top 32 bits. */
+  for (i = 0; i < N_INDEX_BOUNDS; ++i) {
+    crypto_rand((char *)bounds[i].s6_addr, sizeof(struct in6_addr));
+    if (i % 4) {
+      set_uint32(bounds[i].s6_addr, htonl((i & 1) ? 0x20010db8 : 0x20010db9));
+    }
+  }
+  qsort(bounds, N_INDEX_BOUNDS, sizeof(struct in6_addr), compare_in6_addrs_);
+  for (i = 0; i < N_INDEX_BOUNDS; ++i) {
+    if (n == 0 || fast_memneq(&bounds[n-1], &bounds[i], sizeof(a)))
+      bounds[n++] = bounds[i];
+  }
+  for (i = 0; i + 1 < n; i += 2) {
+    tor_inet_ntop(AF_INET6, &bounds[i], low, sizeof(low));
+    tor_inet_ntop(AF_INET6, &bounds[i+1], high, sizeof(high));
+    smartlist_add_asprintf(lines, "%s,%s,%c%c\n", low, high,
+                           'a' + crypto_rand_int(26),
+                           'a' + crypto_rand_int(26));
+  }
+  contents = smartlist_join_strings(lines, "", 0, NULL);
+  const char *fname = get_fname("geoip6_index");
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, contents, 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, fname, LOG_WARN));
+
+#define CHECK_V6(a) tt_int_op(geoip_get_country_by_ipv6(a), OP_EQ, \
+                              geoip_get_country_by_ipv6_bsearch(a))
+  for (i = 0; i < n; ++i) {
+    CHECK_V6(&bounds[i]);
+    /* Step one address either side of the boundary. */
+    a = bounds[i];
+    a.s6_addr[15]++;
+    CHECK_V6(&a);
+    a = bounds[i];
+    a.s6_addr[15]--;
+    CHECK_V6(&a);
+  }
+  for (i = 0; i < 10000; ++i) {
+    crypto_rand((char *)a.s6_addr, sizeof(a));
+    if (i & 1)
+      set_uint32(a.s6_addr, htonl(0x20010db8));
+    CHECK_V6(&a);
+  }
+  memset(&a, 0, sizeof(a));
+  CHECK_V6(&a);
+  memset(&a, 0xff, sizeof(a));
+  CHECK_V6(&a);
+#undef CHECK_V6
+
+ done:
+  tor_free(bounds);
+  tor_free(contents);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -575,6 +852,12 @@ struct testcase_t geoip_tests[] = {
   { "load_file", test_geoip_load_file, TT_FORK, NULL, NULL },
   { "load_file6", test_geoip6_load_file, TT_FORK, NULL, NULL },
   { "load_2nd_file", test_geoip_load_2nd_file, TT_FORK, NULL, NULL },
+  { "load_binary_file", test_geoip_load_binary_file, TT_FORK, NULL, NULL },
+  { "load_binary_file6", test_geoip6_load_binary_file, TT_FORK, NULL, NULL },
+  { "index_differential", test_geoip_index_differential, TT_FORK,
+    NULL, NULL },
+  { "index_differential6", test_geoip6_index_differential, TT_FORK,
+    NULL, NULL },
 
   END_OF_TESTCASES
 };
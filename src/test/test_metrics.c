@@ -24,6 +24,7 @@
 #include "core/or/port_cfg_st.h"
 
 #include "feature/metrics/metrics.h"
+#include "feature/relay/relay_metrics.h"
 
 #include "lib/encoding/confline.h"
 #include "lib/metrics/metrics_store.h"
@@ -261,16 +262,83 @@ test_store(void *arg)
   tt_assert(entries);
   tt_int_op(smartlist_len(entries), OP_EQ, 2);
 
+  /* Resetting the store removes everything. */
+  metrics_store_reset(store);
+  tt_assert(!metrics_store_get_all(store, TEST_METRICS_ENTRY_NAME));
+
  done:
   metrics_store_free(store);
 }
 
+static void
+test_relay(void *arg)
+{
+  const smartlist_t *stores;
+  buf_t *buf = buf_new();
+  char *output = NULL;
+  const char *line;
+  const char *packed_max = "tor_relay_cell_pool_used_max{pool=\"packed\"} ";
+
+  (void) arg;
+
+  stores = relay_metrics_get_stores();
+  tt_assert(stores);
+  tt_int_op(smartlist_len(stores), OP_EQ, 1);
+
+  SMARTLIST_FOREACH(stores, const metrics_store_t *, store,
+            metrics_store_get_output(METRICS_FORMAT_PROMETHEUS, store, buf));
+  output = buf_extract(buf, NULL);
+  tt_assert(strstr(output, "tor_relay_cell_pool_used{pool=\"packed\"} "));
+  tt_assert(strstr(output, "tor_relay_cell_pool_used{pool=\"destroy\"} "));
+  tt_assert(strstr(output, "tor_relay_cell_pool_bytes{pool=\"packed\"} "));
+  tt_assert(strstr(output,
+                   "tor_relay_cell_pool_reclaim_total{pool=\"packed\"} "));
+  tt_assert(strstr(output, "tor_relay_kist_run_total "));
+  tt_assert(strstr(output,
+                   "tor_relay_kist_socket_syscall_total{state=\"made\"} "));
+  tt_assert(strstr(output,
+                   "tor_relay_kist_socket_syscall_total{state=\"saved\"} "));
+  tt_assert(strstr(output, "tor_relay_buf_read_call_total "));
+  tt_assert(strstr(output, "tor_relay_buf_read_bytes_total "));
+  tt_assert(strstr(output, "tor_relay_cpuworker_job_total 0"));
+  tt_assert(strstr(output, "tor_relay_cpuworker_onionskin_total 0"));
+  tt_assert(strstr(output, "tor_relay_onionskin_latency_usec"
+                   "{type=\"ntor\",phase=\"roundtrip\"} 0"));
+  tt_assert(strstr(output, "tor_relay_onion_queue_delay_msec"
+                   "{quantile=\"0.99\"} 0"));
+  tt_assert(strstr(output, "tor_relay_onion_queue_drop_total"
+                   "{reason=\"codel\"} 0"));
+  tt_assert(strstr(output, "tor_relay_dns_cache_lookup_total"
+                   "{result=\"hit\"} 0"));
+  tt_assert(strstr(output, "tor_relay_dns_prefetch_total"
+                   "{state=\"launched\"} 0"));
+  tt_assert(strstr(output, "tor_relay_dns_resolve_latency_msec 0"));
+  tt_assert(strstr(output, "tor_relay_dos_stream_reject_total"
+                   "{defense=\"refuse_stream\"} 0"));
+  tor_free(output);
+  buf_clear(buf);
+
+  /* Collecting again doesn't duplicate the entries. */
+  stores = relay_metrics_get_stores();
+  SMARTLIST_FOREACH(stores, const metrics_store_t *, store,
+            metrics_store_get_output(METRICS_FORMAT_PROMETHEUS, store, buf));
+  output = buf_extract(buf, NULL);
+  line = strstr(output, packed_max);
+  tt_assert(line);
+  tt_ptr_op(strstr(line + 1, packed_max), OP_EQ, NULL);
+
+ done:
+  buf_free(buf);
+  tor_free(output);
+}
+
 struct testcase_t metrics_tests[] = {
 
   { "config", test_config, TT_FORK, NULL, NULL },
   { "connection", test_connection, TT_FORK, NULL, NULL },
   { "prometheus", test_prometheus, TT_FORK, NULL, NULL },
   { "store", test_store, TT_FORK, NULL, NULL },
+  { "relay", test_relay, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
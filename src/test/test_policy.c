@@ -7,12 +7,14 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/or/circuitbuild.h"
+#include "core/or/compiled_policy.h"
 #include "core/or/policies.h"
 #include "core/or/extendinfo.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_descriptor.h"
 #include "feature/relay/router.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
 #include "test/test.h"
 #include "test/log_test_helpers.h"
@@ -2673,6 +2675,227 @@ test_policies_fascist_firewall_choose_address(void *arg)
 #undef CHECK_CHOSEN_ADDR_NODE
 #undef CHECK_CHOSEN_ADDR_RN
 
+/** Return a random address of <b>family</b> that is near <b>base</b>:
+ * either <b>base</b> itself, or <b>base</b> with a few low or high bits
+ * flipped.  Picking addresses like this puts many policy entries and probes
+ * next to each other, which is where a compiled policy could go wrong. */
+static void
+random_addr_near(tor_addr_t *out, sa_family_t family, const uint8_t *base)
+{
+  uint8_t b[16];
+  size_t len = family == AF_INET ? 4 : 16;
+  memcpy(b, base, len);
+  switch (crypto_rand_int(4)) {
+    case 0:
+      break;
+    case 1:
+      b[len - 1] ^= (uint8_t) crypto_rand_int(256);
+      break;
+    case 2:
+      b[crypto_rand_int((int)len)] ^= (uint8_t) (1 << crypto_rand_int(8));
+      break;
+    default:
+      crypto_rand((char *)b, len);
+      break;
+  }
+  if (family == AF_INET)
+    tor_addr_from_ipv4n(out, get_uint32(b));
+  else
+    tor_addr_from_ipv6_bytes(out, b);
+}
+
+/** Return a random port, biased towards the edges of the port space. */
+static uint16_t
+random_policy_port(void)
+{
+  switch (crypto_rand_int(6)) {
+    case 0: return 1;
+    case 1: return 65535;
+    case 2: return (uint16_t) (79 + crypto_rand_int(4));
+    default: return (uint16_t) (1 + crypto_rand_int(65535));
+  }
+}
+
+static void
+test_policies_compiled_differential(void *arg)
+{
+  const uint8_t base4[4] = { 10, 1, 2, 3 };
+  const uint8_t base6[16] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0,
+                              0, 0, 0, 0, 0, 0, 0, 1 };
+  smartlist_t *policy = NULL;
+  compiled_addr_policy_t *compiled = NULL;
+  int round, i;
+
+  (void)arg;
+
+  for (round = 0; round < 200; ++round) {
+    const int n_entries = crypto_rand_int(40);
+
+    policy = smartlist_new();
+    for (i = 0; i < n_entries; ++i) {
+      addr_policy_t *p = tor_malloc_zero(sizeof(addr_policy_t));
+      const sa_family_t family = crypto_rand_int(2) ? AF_INET : AF_INET6;
+      uint16_t a = random_policy_port(), b = random_policy_port();
+      p->refcnt = 1;
+      p->policy_type = crypto_rand_int(2) ?
+        ADDR_POLICY_ACCEPT : ADDR_POLICY_REJECT;
+      random_addr_near(&p->addr, family, family == AF_INET ? base4 : base6);
+      /* Include mask lengths longer than the address. */
+      p->maskbits = (maskbits_t)
+        crypto_rand_int(family == AF_INET ? 40 : 136);
+      if (crypto_rand_int(8) == 0) {
+        /* An empty port range, which never matches. */
+        p->prt_min = MAX(a, b);
+        p->prt_max = MIN(a, b) - 1;
+      } else {
+        p->prt_min = MIN(a, b);
+        p->prt_max = MAX(a, b);
+      }
+      smartlist_add(policy, p);
+    }
+
+    compiled = addr_policy_compile(policy);
+    tt_assert(compiled);
+
+    for (i = 0; i < 400; ++i) {
+      tor_addr_t addr;
+      const sa_family_t family = (i & 1) ? AF_INET : AF_INET6;
+      const uint16_t port = random_policy_port();
+      random_addr_near(&addr, family, family == AF_INET ? base4 : base6);
+      if (tor_addr_is_null(&addr))
+        continue;
+      tt_int_op(compare_tor_addr_to_compiled_addr_policy(&addr, port,
+                                                         compiled), OP_EQ,
+                compare_tor_addr_to_addr_policy(&addr, port, policy));
+    }
+
+    addr_policy_list_free(policy);
+    compiled_addr_policy_free(compiled);
+  }
+
+ done:
+  addr_policy_list_free(policy);
+  compiled_addr_policy_free(compiled);
+}
+
+static void
+test_policies_compiled_basic(void *arg)
+{
+  smartlist_t *policy = NULL;
+  compiled_addr_policy_t *compiled = NULL;
+  tor_addr_t addr;
+
+  (void)arg;
+
+  /* No policy, and an accept-everything policy, need one range each. */
+  compiled = addr_policy_compile(NULL);
+  tt_int_op(compiled_addr_policy_get_n_ranges(compiled, AF_INET), OP_EQ, 1);
+  tt_int_op(compiled_addr_policy_get_n_ranges(compiled, AF_INET6), OP_EQ, 1);
+  tor_addr_parse(&addr, "192.0.2.1");
+  tt_int_op(compare_tor_addr_to_compiled_addr_policy(&addr, 80, compiled),
+            OP_EQ, ADDR_POLICY_ACCEPTED);
+  compiled_addr_policy_free(compiled);
+
+  append_exit_policy_string(&policy,
+                            "reject 192.0.2.0/24:*,accept 192.0.2.128/25:80,"
+                            "accept *4:80-443,reject [2001:db8::]/32:25,"
+                            "accept *6:25,reject *:*");
+  tt_ptr_op(policy, OP_NE, NULL);
+  compiled = addr_policy_compile(policy);
+
+  /* 0.0.0.0, 192.0.2.0, and 192.0.3.0.  The accept for 192.0.2.128/25 is
+   * shadowed, so it doesn't get a range of its own. */
+  tt_int_op(compiled_addr_policy_get_n_ranges(compiled, AF_INET), OP_EQ, 3);
+  tt_int_op(compiled_addr_policy_get_n_ranges(compiled, AF_INET6), OP_EQ, 3);
+
+  tor_addr_parse(&addr, "192.0.2.200");
+  tt_int_op(compare_tor_addr_to_compiled_addr_policy(&addr, 80, compiled),
+            OP_EQ, ADDR_POLICY_REJECTED);
+  tor_addr_parse(&addr, "192.0.3.0");
+  tt_int_op(compare_tor_addr_to_compiled_addr_policy(&addr, 80, compiled),
+            OP_EQ, ADDR_POLICY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_compiled_addr_policy(&addr, 443, compiled),
+            OP_EQ, ADDR_POLICY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_compiled_addr_policy(&addr, 444, compiled),
+            OP_EQ, ADDR_POLICY_REJECTED);
+  tor_addr_parse(&addr, "[2001:db8::1]");
+  tt_int_op(compare_tor_addr_to_compiled_addr_policy(&addr, 25, compiled),
+            OP_EQ, ADDR_POLICY_REJECTED);
+  tor_addr_parse(&addr, "[2001:db9::1]");
+  tt_int_op(compare_tor_addr_to_compiled_addr_policy(&addr, 25, compiled),
+            OP_EQ, ADDR_POLICY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_compiled_addr_policy(&addr, 80, compiled),
+            OP_EQ, ADDR_POLICY_REJECTED);
+
+ done:
+  addr_policy_list_free(policy);
+  compiled_addr_policy_free(compiled);
+}
+
+static void
+test_policies_compiled_short(void *arg)
+{
+  const char *summaries[] = {
+    "accept 80,443",
+    "reject 1-65535",
+    "accept 1-65535",
+    "reject 25,119,135-139,445,563,1214,4661-4666,6346-6429,6699,6881-6999",
+    "accept 20-23,43,53,79-81,88,110,143,194,220,389,443,464,531,543-544,"
+      "554,563,636,706,749,873,902-904,981,989-995,1194,1220,1293,1500,"
+      "1533,1677,1723,1755,1863,2082-2083,2086-2087,2095-2096,2102-2104,"
+      "3128,3389,3690,4321,4643,5050,5190,5222-5223,5228,5900,6660-6669,"
+      "6679,6697,8000,8008,8074,8080,8087-8088,8332-8333,8443,8888,9418,"
+      "9999-10000,11371,12350,19294,19638,23456,33033,64738",
+    "accept 1,255-257,65535",
+  };
+  short_policy_t *policy = NULL, *policy2 = NULL;
+  unsigned i;
+  int port;
+
+  (void)arg;
+
+  for (i = 0; i < ARRAY_LENGTH(summaries); ++i) {
+    policy = parse_short_policy(summaries[i]);
+    tt_assert(policy);
+    tt_assert(policy->compiled);
+    for (port = 1; port <= 65535; ++port) {
+      int listed = 0, j;
+      for (j = 0; j < policy->n_entries; ++j) {
+        if (policy->entries[j].min_port <= port &&
+            port <= policy->entries[j].max_port)
+          listed = 1;
+      }
+      tt_int_op(compiled_short_policy_lists_port(policy->compiled,
+                                                 (uint16_t)port),
+                OP_EQ, listed);
+    }
+    short_policy_free(policy);
+  }
+
+  /* Identical port lists share their compiled form, whether they accept or
+   * reject. */
+  policy = parse_short_policy("accept 80,443");
+  policy2 = parse_short_policy("reject 80,443");
+  tt_ptr_op(policy->compiled, OP_EQ, policy2->compiled);
+  /* Port 80 and 443 are in the first two blocks, and those are the only
+   * ones that aren't uniform. */
+  tt_int_op(compiled_short_policy_get_n_blocks(policy->compiled), OP_EQ, 4);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 443, policy), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 443, policy2), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 444, policy2), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  short_policy_free(policy);
+  tt_assert(policy2->compiled);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 80, policy2), OP_EQ,
+            ADDR_POLICY_REJECTED);
+
+ done:
+  short_policy_free(policy);
+  short_policy_free(policy2);
+}
+
 struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
@@ -2687,5 +2910,9 @@ struct testcase_t policy_tests[] = {
     test_policies_fascist_firewall_allows_address, 0, NULL, NULL },
   { "reachable_addr_choose",
     test_policies_fascist_firewall_choose_address, 0, NULL, NULL },
+  { "compiled_basic", test_policies_compiled_basic, 0, NULL, NULL },
+  { "compiled_differential", test_policies_compiled_differential, 0,
+    NULL, NULL },
+  { "compiled_short", test_policies_compiled_short, 0, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -4,18 +4,26 @@
 #define CIRCUITBUILD_PRIVATE
 #define RELAY_PRIVATE
 #define BWHIST_PRIVATE
+#define CONNECTION_PRIVATE
 #include "core/or/or.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/mainloop/connection.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/channeltls.h"
 #include "feature/stats/bwhist.h"
 #include "core/or/relay.h"
+#include "lib/buf/buffers.h"
 #include "lib/container/order.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
 /* For init/free stuff */
 #include "core/or/scheduler.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
+#include "core/or/edge_connection_st.h"
 #include "core/or/or_circuit_st.h"
 
 #define RESOLVE_ADDR_PRIVATE
@@ -210,6 +218,129 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+static void
+test_relay_package_raw_inbuf_batch(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  edge_connection_t *exitconn = NULL;
+  relay_crypto_t client_crypto;
+  char key[CPATH_KEY_MATERIAL_LEN];
+  char *data = NULL;
+  const size_t datalen = 40 * RELAY_PAYLOAD_SIZE + 100;
+  size_t offset = 0;
+  int n_cells, old_count, i;
+
+  (void)arg;
+  memset(&client_crypto, 0, sizeof(client_crypto));
+
+  nchan = new_fake_channel();
+  tt_assert(nchan);
+  pchan = new_fake_channel();
+  tt_assert(pchan);
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+
+  /* Use keys that we know, so that we can check the cells as the client
+   * would. */
+  crypto_rand(key, sizeof(key));
+  relay_crypto_clear(&orcirc->crypto);
+  tt_int_op(relay_crypto_init(&orcirc->crypto, key, sizeof(key), 0, 0),
+            OP_EQ, 0);
+  tt_int_op(relay_crypto_init(&client_crypto, key, sizeof(key), 0, 0),
+            OP_EQ, 0);
+
+  /* The 10th cell that we send is the last one before a SENDME. */
+  TO_CIRCUIT(orcirc)->package_window = CIRCWINDOW_START - 90;
+
+  exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  exitconn->stream_id = 42;
+  exitconn->package_window = STREAMWINDOW_START;
+  exitconn->on_circuit = TO_CIRCUIT(orcirc);
+  data = tor_malloc(datalen);
+  crypto_rand(data, datalen);
+  buf_add(TO_CONN(exitconn)->inbuf, data, datalen);
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+
+  old_count = get_mock_scheduler_has_waiting_cells_count();
+  tt_int_op(connection_edge_package_raw_inbuf(exitconn, 1, NULL), OP_EQ, 0);
+  tt_int_op(buf_datalen(TO_CONN(exitconn)->inbuf), OP_EQ, 0);
+
+  /* The cells were queued in batches, and the scheduler heard of each batch
+   * once. */
+  n_cells = orcirc->p_chan_cells.n;
+  tt_int_op(n_cells, OP_GE, 41);
+  tt_int_op(get_mock_scheduler_has_waiting_cells_count(), OP_EQ,
+            old_count + 2);
+  tt_int_op(TO_CIRCUIT(orcirc)->package_window, OP_EQ,
+            CIRCWINDOW_START - 90 - n_cells);
+  tt_int_op(exitconn->package_window, OP_EQ, STREAMWINDOW_START - n_cells);
+  tt_assert(TO_CIRCUIT(orcirc)->sendme_last_digests);
+  tt_int_op(smartlist_len(TO_CIRCUIT(orcirc)->sendme_last_digests),
+            OP_EQ, 1);
+
+  /* Decrypt the cells in order, as the client would, and check them. */
+  for (i = 0; i < n_cells; ++i) {
+    packed_cell_t *packed = cell_queue_pop(&orcirc->p_chan_cells);
+    uint8_t payload[CELL_PAYLOAD_SIZE], copy[CELL_PAYLOAD_SIZE];
+    uint8_t digest[DIGEST_LEN];
+    relay_header_t rh;
+
+    memcpy(payload, packed->body + (pchan->wide_circ_ids ? 5 : 3),
+           CELL_PAYLOAD_SIZE);
+    packed_cell_free(packed);
+    relay_crypt_one_payload(client_crypto.b_crypto, payload);
+
+    relay_header_unpack(&rh, payload);
+    tt_int_op(rh.command, OP_EQ, RELAY_COMMAND_DATA);
+    tt_int_op(rh.stream_id, OP_EQ, 42);
+    tt_int_op(rh.recognized, OP_EQ, 0);
+    tt_uint_op(offset + rh.length, OP_LE, datalen);
+    tt_mem_op(payload + RELAY_HEADER_SIZE, OP_EQ, data + offset, rh.length);
+    offset += rh.length;
+
+    memcpy(copy, payload, sizeof(copy));
+    memset(copy + 5, 0, 4); /* integrity */
+    crypto_digest_add_bytes(client_crypto.b_digest, (char *)copy,
+                            sizeof(copy));
+    crypto_digest_get_digest(client_crypto.b_digest, (char *)digest,
+                             sizeof(digest));
+    tt_mem_op(payload + 5, OP_EQ, digest, 4);
+    if (i == 9) {
+      tt_mem_op(smartlist_get(TO_CIRCUIT(orcirc)->sendme_last_digests, 0),
+                OP_EQ, digest, DIGEST_LEN);
+    }
+  }
+  tt_uint_op(offset, OP_EQ, datalen);
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  if (exitconn) {
+    exitconn->on_circuit = NULL;
+    connection_free_minimal(TO_CONN(exitconn));
+  }
+  relay_crypto_clear(&client_crypto);
+  tor_free(data);
+  if (orcirc) {
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+    if (TO_CIRCUIT(orcirc)->sendme_last_digests) {
+      SMARTLIST_FOREACH(TO_CIRCUIT(orcirc)->sendme_last_digests, uint8_t *,
+                        d, tor_free(d));
+      smartlist_free(TO_CIRCUIT(orcirc)->sendme_last_digests);
+    }
+  }
+  free_fake_orcirc(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
 static void
 test_suggested_address(void *arg)
 {
@@ -379,6 +510,8 @@ struct testcase_t relay_tests[] = {
     TT_FORK, NULL, NULL },
   { "close_circ_rephist", test_relay_close_circuit,
     TT_FORK, NULL, NULL },
+  { "package_raw_inbuf_batch", test_relay_package_raw_inbuf_batch,
+    TT_FORK, NULL, NULL },
   { "suggested_address", test_suggested_address,
     TT_FORK, NULL, NULL },
   { "find_addr_to_publish", test_find_addr_to_publish,
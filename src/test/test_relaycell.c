@@ -7,6 +7,8 @@
 #define CIRCUITLIST_PRIVATE
 #define CONNECTION_EDGE_PRIVATE
 #define CONNECTION_PRIVATE
+#define CRYPT_PATH_PRIVATE
+#define DOS_PRIVATE
 
 #include "core/or/or.h"
 #include "core/mainloop/mainloop.h"
@@ -14,20 +16,30 @@
 #include "core/mainloop/connection.h"
 #include "lib/crypt_ops/crypto_cipher.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/or/channel.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/command.h"
 #include "core/or/connection_edge.h"
+#include "core/or/crypt_path.h"
+#include "core/or/dos.h"
 #include "core/or/sendme.h"
 #include "core/or/relay.h"
+#include "feature/nodelist/networkstatus.h"
+#include "test/fakecircs.h"
 #include "test/test.h"
 #include "test/log_test_helpers.h"
 
 #include "core/or/cell_st.h"
 #include "core/or/crypt_path_st.h"
 #include "core/or/entry_connection_st.h"
+#include "core/or/or_circuit_st.h"
 #include "core/or/origin_circuit_st.h"
 #include "core/or/socks_request_st.h"
 #include "core/or/half_edge_st.h"
+#include "feature/nodelist/networkstatus_st.h"
 
 #include "feature/client/circpathbias.h"
 
@@ -1043,10 +1055,234 @@ test_relaycell_resolved(void *arg)
   UNMOCK(connection_ap_handshake_socks_resolved);
 }
 
+/* Stream creation DoS mitigation at the exit. */
+
+static channel_t stream_dos_chan;
+static networkstatus_t stream_dos_ns;
+
+static int stream_dos_n_sent;
+static uint8_t stream_dos_last_command;
+static uint8_t stream_dos_last_payload0;
+static int stream_dos_circ_close_reason;
+static int stream_dos_n_conn_free;
+
+static unsigned int
+mock_stream_dos_enabled(const networkstatus_t *ns)
+{
+  (void) ns;
+  return 1;
+}
+
+static networkstatus_t *
+mock_stream_dos_get_latest_consensus(void)
+{
+  return &stream_dos_ns;
+}
+
+static void
+mock_stream_dos_cmux_attach(circuitmux_t *cmux, circuit_t *circ,
+                            cell_direction_t direction)
+{
+  (void) cmux;
+  (void) circ;
+  (void) direction;
+}
+
+/* Mock replacement for relay_send_command_from_edge_(): remember the
+ * command and the first byte of the payload of the last cell we sent. */
+static int
+mock_stream_dos_send_command(streamid_t stream_id, circuit_t *circ,
+                             uint8_t relay_command, const char *payload,
+                             size_t payload_len, crypt_path_t *cpath_layer,
+                             const char *filename, int lineno)
+{
+  (void) stream_id; (void) circ; (void) cpath_layer;
+  (void) filename; (void) lineno;
+
+  ++stream_dos_n_sent;
+  stream_dos_last_command = relay_command;
+  stream_dos_last_payload0 = payload_len ? (uint8_t) payload[0] : 0;
+  return 0;
+}
+
+static void
+mock_stream_dos_mark_circ_for_close(circuit_t *circ, int reason, int line,
+                                    const char *file)
+{
+  (void) line; (void) file;
+
+  circ->marked_for_close = 1;
+  stream_dos_circ_close_reason = reason;
+}
+
+static void
+mock_stream_dos_connection_free(connection_t *conn)
+{
+  ++stream_dos_n_conn_free;
+  connection_free_minimal(conn);
+}
+
+/* Helper: enable the stream creation DoS mitigation with a burst of one
+ * stream and the defense <b>defense_type</b>, and return an exit circuit
+ * whose bucket is already empty. */
+static or_circuit_t *
+stream_dos_setup(const char *defense_type)
+{
+  or_circuit_t *orcirc;
+
+  MOCK(get_param_stream_enabled, mock_stream_dos_enabled);
+  MOCK(networkstatus_get_latest_consensus,
+       mock_stream_dos_get_latest_consensus);
+  MOCK(circuitmux_attach_circuit, mock_stream_dos_cmux_attach);
+  MOCK(relay_send_command_from_edge_, mock_stream_dos_send_command);
+  MOCK(connection_free_, mock_stream_dos_connection_free);
+
+  get_options_mutable()->ORPort_set = 1;
+  get_options_mutable()->RefuseUnknownExits = 0;
+
+  memset(&stream_dos_ns, 0, sizeof(stream_dos_ns));
+  stream_dos_ns.routerstatus_list = smartlist_new();
+  stream_dos_ns.net_params = smartlist_new();
+  smartlist_add(stream_dos_ns.net_params,
+                (void *) "DoSStreamCreationBurst=1");
+  smartlist_add(stream_dos_ns.net_params, (void *) defense_type);
+  update_approx_time(1000000);
+  dos_init();
+
+  stream_dos_chan.cmux = circuitmux_alloc();
+  orcirc = new_fake_orcirc(&stream_dos_chan, &stream_dos_chan);
+  tor_assert(orcirc);
+  dos_stream_init_circ_tbf(orcirc);
+  tor_assert(dos_stream_new_begin_or_resolve_cell(orcirc) ==
+             DOS_STREAM_DEFENSE_NONE);
+  return orcirc;
+}
+
+static void
+stream_dos_teardown(or_circuit_t *orcirc)
+{
+  free_fake_orcirc(orcirc);
+  circuitmux_free(stream_dos_chan.cmux);
+  stream_dos_chan.cmux = NULL;
+  smartlist_free(stream_dos_ns.routerstatus_list);
+  smartlist_free(stream_dos_ns.net_params);
+  dos_free_all();
+  UNMOCK(get_param_stream_enabled);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(circuitmux_attach_circuit);
+  UNMOCK(relay_send_command_from_edge_);
+  UNMOCK(connection_free_);
+}
+
+static void
+test_relaycell_stream_dos_refuse(void *arg)
+{
+  cell_t cell;
+  relay_header_t rh;
+  or_circuit_t *orcirc;
+  dos_stream_stats_t stats;
+
+  (void) arg;
+
+  orcirc = stream_dos_setup("DoSStreamCreationDefenseType=2");
+
+  /* A refused BEGIN gets an END with reason MISC, and no stream. */
+  PACK_CELL(1, RELAY_COMMAND_BEGIN, "127.0.0.1:80\x00");
+  tt_int_op(connection_exit_begin_conn(&cell, TO_CIRCUIT(orcirc)), OP_EQ, 0);
+  tt_int_op(stream_dos_n_sent, OP_EQ, 1);
+  tt_int_op(stream_dos_last_command, OP_EQ, RELAY_COMMAND_END);
+  tt_int_op(stream_dos_last_payload0, OP_EQ, END_STREAM_REASON_MISC);
+  tt_ptr_op(orcirc->n_streams, OP_EQ, NULL);
+  tt_ptr_op(orcirc->resolving_streams, OP_EQ, NULL);
+
+  /* A refused RESOLVE gets a transient error, and its dummy connection is
+   * freed exactly once. */
+  PACK_CELL(2, RELAY_COMMAND_RESOLVE, "www.example.com\x00");
+  tt_int_op(connection_exit_begin_resolve(&cell, orcirc), OP_EQ, 0);
+  tt_int_op(stream_dos_n_sent, OP_EQ, 2);
+  tt_int_op(stream_dos_last_command, OP_EQ, RELAY_COMMAND_RESOLVED);
+  tt_int_op(stream_dos_last_payload0, OP_EQ, RESOLVED_TYPE_ERROR_TRANSIENT);
+  tt_int_op(stream_dos_n_conn_free, OP_EQ, 1);
+  tt_ptr_op(orcirc->resolving_streams, OP_EQ, NULL);
+
+  /* Both were refused by the mitigation, and nothing else. */
+  dos_stream_get_stats(&stats);
+  tt_u64_op(stats.n_refused_streams, OP_EQ, 2);
+  tt_assert(!TO_CIRCUIT(orcirc)->marked_for_close);
+
+ done:
+  stream_dos_teardown(orcirc);
+}
+
+static void
+test_relaycell_stream_dos_close(void *arg)
+{
+  cell_t cell;
+  relay_header_t rh;
+  or_circuit_t *orcirc;
+  origin_circuit_t *client = NULL;
+  crypt_path_t *hop;
+  char key[CPATH_KEY_MATERIAL_LEN];
+  dos_stream_stats_t stats;
+
+  (void) arg;
+
+  orcirc = stream_dos_setup("DoSStreamCreationDefenseType=3");
+  MOCK(circuit_mark_for_close_, mock_stream_dos_mark_circ_for_close);
+
+  /* A RESOLVE asks for the circuit to be closed, without answering, and
+   * still frees its dummy connection once. */
+  PACK_CELL(2, RELAY_COMMAND_RESOLVE, "www.example.com\x00");
+  tt_int_op(connection_exit_begin_resolve(&cell, orcirc), OP_EQ,
+            -END_CIRC_REASON_RESOURCELIMIT);
+  tt_int_op(stream_dos_n_sent, OP_EQ, 0);
+  tt_int_op(stream_dos_n_conn_free, OP_EQ, 1);
+
+  /* A BEGIN that arrives on the channel closes the circuit. Encrypt it the
+   * way a client would, so that it goes all the way through command.c and
+   * relay.c. */
+  memset(key, 'k', sizeof(key));
+  relay_crypto_clear(&orcirc->crypto);
+  tt_int_op(0, OP_EQ, relay_crypto_init(&orcirc->crypto, key, sizeof(key),
+                                        0, 0));
+  client = origin_circuit_new();
+  client->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  hop = tor_malloc_zero(sizeof(*hop));
+  hop->magic = CRYPT_PATH_MAGIC;
+  hop->state = CPATH_STATE_OPEN;
+  tt_int_op(0, OP_EQ, relay_crypto_init(&hop->pvt_crypto, key, sizeof(key),
+                                        0, 0));
+  cpath_extend_linked_list(&client->cpath, hop);
+
+  PACK_CELL(1, RELAY_COMMAND_BEGIN, "127.0.0.1:80\x00");
+  relay_encrypt_cell_outbound(&cell, client, hop);
+  cell.command = CELL_RELAY;
+  cell.circ_id = orcirc->p_circ_id;
+  command_process_cell(&stream_dos_chan, &cell);
+
+  tt_assert(TO_CIRCUIT(orcirc)->marked_for_close);
+  tt_int_op(stream_dos_circ_close_reason, OP_EQ,
+            END_CIRC_REASON_RESOURCELIMIT);
+  tt_int_op(stream_dos_n_sent, OP_EQ, 0);
+  tt_ptr_op(orcirc->n_streams, OP_EQ, NULL);
+  dos_stream_get_stats(&stats);
+  tt_u64_op(stats.n_closed_circuits, OP_EQ, 2);
+
+ done:
+  if (client)
+    circuit_free_(TO_CIRCUIT(client));
+  UNMOCK(circuit_mark_for_close_);
+  stream_dos_teardown(orcirc);
+}
+
 struct testcase_t relaycell_tests[] = {
   { "resolved", test_relaycell_resolved, TT_FORK, NULL, NULL },
   { "circbw", test_circbw_relay, TT_FORK, NULL, NULL },
   { "halfstream", test_halfstream_insertremove, TT_FORK, NULL, NULL },
   { "streamwrap", test_halfstream_wrap, TT_FORK, NULL, NULL },
+  { "stream_dos_refuse", test_relaycell_stream_dos_refuse, TT_FORK,
+    NULL, NULL },
+  { "stream_dos_close", test_relaycell_stream_dos_close, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
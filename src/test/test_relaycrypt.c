@@ -181,12 +181,129 @@ test_relaycrypt_inbound(void *arg)
   ;
 }
 
+#define N_BATCH_CELLS 17
+
+/* Fill <b>cells</b> with random cells whose recognized and integrity fields
+ * are cleared, and keep a copy of them in <b>orig</b>. */
+static void
+make_batch_cells(cell_t *orig, cell_t **cells, int n)
+{
+  relay_header_t rh;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    crypto_rand((char *)&orig[i], sizeof(orig[i]));
+    relay_header_unpack(&rh, orig[i].payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig[i].payload, &rh);
+    memcpy(cells[i], &orig[i], sizeof(orig[i]));
+  }
+}
+
+/* Encrypt batches of cells to the final hop and decrypt them in batches at
+ * each hop: we must recognize them in order, at the last hop only, and the
+ * state must stay in sync with the one-cell-at-a-time path. */
+static void
+test_relaycrypt_outbound_batch(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  tt_assert(cs);
+
+  cell_t orig[N_BATCH_CELLS];
+  cell_t encrypted[N_BATCH_CELLS];
+  cell_t *cells[N_BATCH_CELLS];
+  int i, j, k;
+
+  for (k = 0; k < N_BATCH_CELLS; ++k)
+    cells[k] = &encrypted[k];
+
+  for (i = 1; i <= N_BATCH_CELLS; ++i) {
+    make_batch_cells(orig, cells, i);
+
+    relay_encrypt_cells_outbound(cells, i, cs->origin_circ,
+                                 cs->origin_circ->cpath->prev);
+
+    for (j = 0; j < 3; ++j) {
+      relay_crypt_cells(cs->or_circ[j], cells, i, CELL_DIRECTION_OUT);
+      for (k = 0; k < i; ++k) {
+        tt_int_op(relay_cell_is_recognized(cs->or_circ[j], cells[k],
+                                           CELL_DIRECTION_OUT), OP_EQ,
+                  j == 2);
+      }
+    }
+
+    for (k = 0; k < i; ++k) {
+      tt_mem_op(orig[k].payload, OP_EQ, encrypted[k].payload,
+                CELL_PAYLOAD_SIZE);
+    }
+  }
+
+  /* The single cell path must still agree with the state we left. */
+  test_relaycrypt_outbound(arg);
+
+ done:
+  ;
+}
+
+/* As above, but simulate batches of inbound cells from the last hop. */
+static void
+test_relaycrypt_inbound_batch(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  tt_assert(cs);
+
+  cell_t orig[N_BATCH_CELLS];
+  cell_t encrypted[N_BATCH_CELLS];
+  cell_t *cells[N_BATCH_CELLS];
+  int i, j, k;
+
+  for (k = 0; k < N_BATCH_CELLS; ++k)
+    cells[k] = &encrypted[k];
+
+  for (i = 1; i <= N_BATCH_CELLS; ++i) {
+    make_batch_cells(orig, cells, i);
+
+    relay_encrypt_cells_inbound(cells, i, cs->or_circ[2]);
+
+    for (j = 1; j >= 0; --j) {
+      relay_crypt_cells(cs->or_circ[j], cells, i, CELL_DIRECTION_IN);
+      for (k = 0; k < i; ++k) {
+        tt_int_op(relay_cell_is_recognized(cs->or_circ[j], cells[k],
+                                           CELL_DIRECTION_IN), OP_EQ, 0);
+      }
+    }
+
+    for (k = 0; k < i; ++k) {
+      crypt_path_t *layer_hint = NULL;
+      char recognized = 0;
+      int r = relay_decrypt_cell(TO_CIRCUIT(cs->origin_circ),
+                                 cells[k],
+                                 CELL_DIRECTION_IN,
+                                 &layer_hint, &recognized);
+      tt_int_op(r, OP_EQ, 0);
+      tt_int_op(recognized, OP_EQ, 1);
+      tt_ptr_op(layer_hint, OP_EQ, cs->origin_circ->cpath->prev);
+      tt_mem_op(orig[k].payload, OP_EQ, encrypted[k].payload,
+                CELL_PAYLOAD_SIZE);
+    }
+  }
+
+  /* The single cell path must still agree with the state we left. */
+  test_relaycrypt_inbound(arg);
+
+ done:
+  ;
+}
+
 #define TEST(name) \
   { # name, test_relaycrypt_ ## name, 0, &relaycrypt_setup, NULL }
 
 struct testcase_t relaycrypt_tests[] = {
   TEST(outbound),
   TEST(inbound),
+  TEST(outbound_batch),
+  TEST(inbound_batch),
   END_OF_TESTCASES
 };
 
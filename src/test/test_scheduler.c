@@ -1265,6 +1265,115 @@ test_scheduler_kist_pending_list(void *arg)
   UNMOCK(channel_should_write_to_kernel);
 }
 
+static int mock_update_socket_info_calls = 0;
+
+static void
+update_socket_info_impl_mock_count(socket_table_ent_t *ent)
+{
+  ++mock_update_socket_info_calls;
+  update_socket_info_impl_mock_var(ent);
+}
+
+static void
+test_scheduler_kist_adaptive_sampling(void *arg)
+{
+  channel_t *chan = NULL;
+  socket_table_ent_t ent;
+  kist_stats_t stats;
+  uint64_t now_msec;
+  int i;
+
+  (void) arg;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  /* Whether a sample can be reused. */
+  kist_adaptive_sampling = 1;
+  now_msec = monotime_coarse_absolute_msec();
+  memset(&ent, 0, sizeof(ent));
+  ent.limit = 10000;
+  ent.written = 1000;
+  ent.runs_until_sample = 1;
+  ent.last_sample_msec = now_msec;
+  tt_assert(socket_info_is_fresh(&ent, now_msec));
+  /* Not once the sample interval is over... */
+  ent.runs_until_sample = 0;
+  tt_assert(!socket_info_is_fresh(&ent, now_msec));
+  ent.runs_until_sample = 1;
+  /* ... nor once half of the limit is used... */
+  ent.written = 5000;
+  tt_assert(!socket_info_is_fresh(&ent, now_msec));
+  ent.written = 1000;
+  /* ... nor once the sample is too old. */
+  tt_assert(!socket_info_is_fresh(&ent, now_msec + 1000));
+  /* And never without adaptive sampling. */
+  kist_adaptive_sampling = 0;
+  tt_assert(!socket_info_is_fresh(&ent, now_msec));
+
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock_var);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock_var);
+  MOCK(update_socket_info_impl, update_socket_info_impl_mock_count);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+
+  mocked_options.KISTSchedRunInterval = 10;
+  mocked_options.KISTAdaptiveSampling = 1;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+  tt_int_op(the_scheduler->type, OP_EQ, SCHEDULER_KIST);
+
+  chan = new_fake_channel();
+  tt_assert(chan);
+  chan->magic = TLS_CHAN_MAGIC;
+  channel_register(chan);
+  scheduler_channel_wants_writes(chan);
+
+  /* The socket has plenty of room: we sample it on the first two runs, then
+   * every 2 runs, then every 4 runs. */
+  mock_update_socket_info_limit = INT_MAX;
+  mock_more_to_flush = 0;
+  mock_flush_some_cells_num = 1;
+  for (i = 0; i < 7; ++i) {
+    scheduler_channel_has_waiting_cells(chan);
+    the_scheduler->run();
+  }
+  tt_int_op(mock_update_socket_info_calls, OP_EQ, 3);
+  kist_get_stats(&stats);
+  tt_u64_op(stats.n_runs, OP_EQ, 7);
+  tt_u64_op(stats.n_syscalls, OP_EQ, 3 * 2);
+  tt_u64_op(stats.n_syscalls_saved, OP_EQ, 4 * 2);
+
+  /* The socket gets congested: one cell uses more than half of its limit,
+   * so we sample it on every run. */
+  mock_update_socket_info_limit = 600;
+  for (i = 0; i < 4; ++i) {
+    scheduler_channel_has_waiting_cells(chan);
+    the_scheduler->run();
+  }
+  tt_int_op(mock_update_socket_info_calls, OP_EQ, 7);
+  kist_get_stats(&stats);
+  tt_u64_op(stats.n_runs, OP_EQ, 11);
+  tt_u64_op(stats.n_syscalls_saved, OP_EQ, 4 * 2);
+
+ done:
+  if (chan) {
+    chan->state = CHANNEL_STATE_CLOSED;
+    chan->registered = 0;
+    channel_free(chan);
+  }
+  scheduler_free_all();
+
+  UNMOCK(get_options);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_should_write_to_kernel);
+}
+
 struct testcase_t scheduler_tests[] = {
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
@@ -1276,6 +1385,8 @@ struct testcase_t scheduler_tests[] = {
   { "should_use_kist", test_scheduler_can_use_kist, TT_FORK, NULL, NULL },
   { "kist_pending_list", test_scheduler_kist_pending_list, TT_FORK,
     NULL, NULL },
+  { "kist_adaptive_sampling", test_scheduler_kist_adaptive_sampling,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
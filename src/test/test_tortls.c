@@ -23,7 +23,10 @@
 #include "lib/tls/tortls.h"
 #include "lib/tls/tortls_st.h"
 #include "lib/tls/tortls_internal.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/pem.h"
+#include "lib/net/socketpair.h"
+#include "lib/time/compat_time.h"
 #include "app/config/or_state_st.h"
 
 #include "test/test.h"
@@ -588,6 +591,97 @@ test_tortls_cert_matches_key(void *ignored)
 #define LOCAL_TEST_CASE(name, flags)                            \
   { #name, test_tortls_##name, (flags|TT_FORK), NULL, NULL }
 
+/* Run a TLS handshake and send data both ways between two tor_tls_t over a
+ * loopback TCP connection, with kernel TLS offload requested.  Whether or
+ * not the kernel takes over the record layer, the data must go through
+ * unchanged. */
+static void
+test_tortls_kernel_offload_loopback(void *arg)
+{
+  (void)arg;
+  crypto_pk_t *pk1 = NULL, *pk2 = NULL;
+  tor_tls_t *client = NULL, *server = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  char msg[4096], got[4096];
+  bool client_done = false, server_done = false;
+  bool ktls_send, ktls_recv;
+  int i, r;
+  size_t n;
+
+  pk1 = pk_generate(2);
+  pk2 = pk_generate(0);
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER|
+                                 TOR_TLS_CTX_USE_KTLS, pk1, pk2, 86400),
+            OP_EQ, 0);
+
+  /* Kernel TLS only works on TCP sockets: the ersatz socketpair gives us a
+   * pair of them over the loopback interface. */
+  if (tor_ersatz_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    tt_skip();
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);
+  client = tor_tls_new(fds[0], 0);
+  server = tor_tls_new(fds[1], 1);
+  tt_assert(client);
+  tt_assert(server);
+  /* The tor_tls_t objects own the sockets now. */
+  fds[0] = fds[1] = TOR_INVALID_SOCKET;
+
+  for (i = 0; i < 1000 && !(client_done && server_done); ++i) {
+    if (!client_done) {
+      r = tor_tls_handshake(client);
+      tt_assert(r == TOR_TLS_DONE || r == TOR_TLS_WANTREAD ||
+                r == TOR_TLS_WANTWRITE);
+      client_done = (r == TOR_TLS_DONE);
+    }
+    if (!server_done) {
+      r = tor_tls_handshake(server);
+      tt_assert(r == TOR_TLS_DONE || r == TOR_TLS_WANTREAD ||
+                r == TOR_TLS_WANTWRITE);
+      server_done = (r == TOR_TLS_DONE);
+    }
+    if (!(client_done && server_done))
+      tor_sleep_msec(1);
+  }
+  tt_assert(client_done);
+  tt_assert(server_done);
+
+  /* Either answer is fine: it depends on the kernel and the library. */
+  tor_tls_get_kernel_offload(client, &ktls_send, &ktls_recv);
+  TT_BLATHER(("Client: kTLS send %d, recv %d", ktls_send, ktls_recv));
+  tor_tls_get_kernel_offload(server, &ktls_send, &ktls_recv);
+  TT_BLATHER(("Server: kTLS send %d, recv %d", ktls_send, ktls_recv));
+
+  crypto_rand(msg, sizeof(msg));
+  for (int dir = 0; dir < 2; ++dir) {
+    tor_tls_t *from = dir ? server : client;
+    tor_tls_t *to = dir ? client : server;
+    tt_int_op(tor_tls_write(from, msg, sizeof(msg)), OP_EQ, sizeof(msg));
+    n = 0;
+    for (i = 0; i < 1000 && n < sizeof(got); ++i) {
+      r = tor_tls_read(to, got + n, sizeof(got) - n);
+      if (r > 0) {
+        n += r;
+      } else {
+        tt_int_op(r, OP_EQ, TOR_TLS_WANTREAD);
+        tor_sleep_msec(1);
+      }
+    }
+    tt_int_op(n, OP_EQ, sizeof(msg));
+    tt_mem_op(got, OP_EQ, msg, sizeof(msg));
+  }
+
+ done:
+  tor_tls_free(client);
+  tor_tls_free(server);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  crypto_pk_free(pk1);
+  crypto_pk_free(pk2);
+}
+
 struct testcase_t tortls_tests[] = {
   LOCAL_TEST_CASE(errno_to_tls_error, 0),
   LOCAL_TEST_CASE(err_to_string, 0),
@@ -606,5 +700,6 @@ struct testcase_t tortls_tests[] = {
   LOCAL_TEST_CASE(bridge_init, TT_FORK),
   LOCAL_TEST_CASE(verify, TT_FORK),
   LOCAL_TEST_CASE(cert_matches_key, 0),
+  LOCAL_TEST_CASE(kernel_offload_loopback, TT_FORK),
   END_OF_TESTCASES
 };
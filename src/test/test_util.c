@@ -40,6 +40,7 @@
 #include "lib/encoding/confline.h"
 #include "lib/net/socketpair.h"
 #include "lib/malloc/map_anon.h"
+#include "lib/malloc/slab.h"
 
 #ifdef HAVE_PWD_H
 #include <pwd.h>
@@ -6825,6 +6826,88 @@ test_util_log_mallinfo(void *arg)
   tor_free(mem);
 }
 
+static void
+test_util_slab_pool(void *arg)
+{
+  (void)arg;
+  slab_pool_t *pool = NULL;
+  slab_pool_stats_t st;
+  char *items[20];
+  int i;
+
+  /* Slabs of 4 objects, keep at most one empty slab. */
+  pool = slab_pool_new(37, 4, 1);
+  slab_pool_get_stats(pool, &st);
+  tt_u64_op(st.n_used, OP_EQ, 0);
+  tt_u64_op(st.n_slabs, OP_EQ, 0);
+  tt_u64_op(st.n_bytes, OP_EQ, 0);
+
+  for (i = 0; i < 20; ++i) {
+    items[i] = slab_pool_alloc(pool);
+    tt_assert(fast_mem_is_zero(items[i], 37));
+    memset(items[i], i+1, 37);
+  }
+  slab_pool_get_stats(pool, &st);
+  tt_u64_op(st.n_used, OP_EQ, 20);
+  tt_u64_op(st.n_used_max, OP_EQ, 20);
+  tt_u64_op(st.n_slabs, OP_EQ, 5);
+  tt_u64_op(st.n_slots, OP_EQ, 20);
+  tt_u64_op(st.n_empty_slabs, OP_EQ, 0);
+  tt_u64_op(st.n_bytes, OP_GT, 20*37);
+
+  /* Objects don't overlap. */
+  for (i = 0; i < 20; ++i) {
+    char expected[37];
+    memset(expected, i+1, sizeof(expected));
+    tt_mem_op(items[i], OP_EQ, expected, sizeof(expected));
+  }
+
+  /* Empty the first two slabs: we keep one of them, free the other. */
+  for (i = 0; i < 8; ++i) {
+    slab_pool_release(pool, items[i]);
+    items[i] = NULL;
+  }
+  slab_pool_get_stats(pool, &st);
+  tt_u64_op(st.n_used, OP_EQ, 12);
+  tt_u64_op(st.n_used_max, OP_EQ, 20);
+  tt_u64_op(st.n_slabs, OP_EQ, 4);
+  tt_u64_op(st.n_empty_slabs, OP_EQ, 1);
+  tt_u64_op(st.n_reclaims, OP_EQ, 1);
+  tt_u64_op(st.n_slabs_reclaimed, OP_EQ, 1);
+
+  /* Free one object of a full slab, and allocate again: we reuse its slot
+   * and don't touch the empty slab. */
+  slab_pool_release(pool, items[10]);
+  items[10] = slab_pool_alloc(pool);
+  tt_assert(fast_mem_is_zero(items[10], 37));
+  slab_pool_get_stats(pool, &st);
+  tt_u64_op(st.n_used, OP_EQ, 12);
+  tt_u64_op(st.n_empty_slabs, OP_EQ, 1);
+
+  /* Releasing NULL is fine. */
+  slab_pool_release(pool, NULL);
+
+  /* Reclaim the empty slab. */
+  tt_u64_op(slab_pool_reclaim(pool, 1), OP_EQ, 0);
+  tt_u64_op(slab_pool_reclaim(pool, 0), OP_GT, 0);
+  slab_pool_get_stats(pool, &st);
+  tt_u64_op(st.n_slabs, OP_EQ, 3);
+  tt_u64_op(st.n_empty_slabs, OP_EQ, 0);
+  tt_u64_op(st.n_reclaims, OP_EQ, 2);
+  tt_u64_op(st.n_slabs_reclaimed, OP_EQ, 2);
+
+  /* The freed slab gets replaced when we need it again. */
+  for (i = 0; i < 8; ++i) {
+    items[i] = slab_pool_alloc(pool);
+  }
+  slab_pool_get_stats(pool, &st);
+  tt_u64_op(st.n_used, OP_EQ, 20);
+  tt_u64_op(st.n_slabs, OP_EQ, 5);
+
+ done:
+  slab_pool_free(pool);
+}
+
 static void
 test_util_map_anon(void *arg)
 {
@@ -7097,6 +7180,7 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(htonll, 0),
   UTIL_TEST(get_unquoted_path, 0),
   UTIL_TEST(log_mallinfo, 0),
+  UTIL_TEST(slab_pool, 0),
   UTIL_TEST(map_anon, 0),
   UTIL_TEST(map_anon_nofork, 0),
   END_OF_TESTCASES
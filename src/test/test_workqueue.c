@@ -13,6 +13,7 @@
 #include "lib/evloop/compat_libevent.h"
 #include "lib/intmath/weakrng.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "lib/time/compat_time.h"
 
 #include <stdio.h>
 
@@ -25,6 +26,8 @@ static int opt_n_inflight = 1000;
 static int opt_n_lowwater = 250;
 static int opt_n_cancel = 0;
 static int opt_ratio_rsa = 5;
+static int opt_empty = 0;
+static int opt_bench = 0;
 
 #ifdef TRACK_RESPONSES
 tor_mutex_t bitmap_mutex;
@@ -122,6 +125,19 @@ workqueue_do_ecdh(void *state, void *work)
   return WQ_RPL_REPLY;
 }
 
+static workqueue_reply_t
+workqueue_do_nothing(void *state, void *work)
+{
+  rsa_work_t *rw = work; /* Naughty cast, but only looking at serial. */
+  state_t *st = state;
+
+  tor_assert(st->magic == 13371337);
+
+  ++st->n_handled;
+  mark_handled(rw->serial);
+  return WQ_RPL_REPLY;
+}
+
 static workqueue_reply_t
 workqueue_shutdown_error(void *state, void *work)
 {
@@ -193,6 +209,12 @@ handle_reply_shutdown(void *arg)
 static workqueue_entry_t *
 add_work(threadpool_t *tp)
 {
+  if (opt_empty) {
+    rsa_work_t *w = tor_malloc_zero(sizeof(*w));
+    w->serial = n_sent++;
+    return threadpool_queue_work(tp, workqueue_do_nothing, handle_reply, w);
+  }
+
   int add_rsa =
     opt_ratio_rsa == 0 ||
     tor_weak_random_range(&weak_rng, opt_ratio_rsa) == 0;
@@ -263,6 +285,8 @@ add_n_work_items(threadpool_t *tp, int n)
 }
 
 static int shutting_down = 0;
+/** When we queued the first item, and when we got the last reply. */
+static monotime_t time_started, time_finished;
 
 static void
 replysock_readable_cb(threadpool_t *tp)
@@ -294,7 +318,8 @@ replysock_readable_cb(threadpool_t *tp)
 #endif /* defined(TRACK_RESPONSES) */
 
   if (n_sent - (n_received+n_successful_cancel) < opt_n_lowwater) {
-    int n_to_send = n_received + opt_n_inflight - n_sent;
+    int n_to_send = n_received + n_successful_cancel + opt_n_inflight -
+      n_sent;
     if (n_to_send > opt_n_items - n_sent)
       n_to_send = opt_n_items - n_sent;
     add_n_work_items(tp, n_to_send);
@@ -304,6 +329,7 @@ replysock_readable_cb(threadpool_t *tp)
       n_received+n_successful_cancel == n_sent &&
       n_sent >= opt_n_items) {
     shutting_down = 1;
+    monotime_get(&time_finished);
     threadpool_queue_update(tp, NULL,
                              workqueue_do_shutdown, NULL, NULL);
     // Anything we add after starting the shutdown must not be executed.
@@ -329,6 +355,9 @@ help(void)
      "  -L <lowwater> Add items whenever fewer than this many are pending\n"
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
      "  -R <ratio>    Make one out of this many items be a slow (RSA) one\n"
+     "  -E            Make every item empty, to measure only the overhead\n"
+     "                of the thread pool\n"
+     "  -B            Report how many items per second we handled\n"
      "  --no-{eventfd2,eventfd,pipe2,pipe,socketpair}\n"
      "                Disable one of the alert_socket backends.");
 }
@@ -355,6 +384,10 @@ main(int argc, char **argv)
       opt_n_lowwater = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-R") && i+1<argc) {
       opt_ratio_rsa = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-E")) {
+      opt_empty = 1;
+    } else if (!strcmp(argv[i], "-B")) {
+      opt_bench = 1;
     } else if (!strcmp(argv[i], "-C") && i+1<argc) {
       opt_n_cancel = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "--no-eventfd2")) {
@@ -426,6 +459,8 @@ main(int argc, char **argv)
   handled_len = opt_n_items;
 #endif /* defined(TRACK_RESPONSES) */
 
+  monotime_init();
+  monotime_get(&time_started);
   for (i = 0; i < opt_n_inflight; ++i) {
     if (! add_work(tp)) {
       puts("Couldn't add work.");
@@ -449,6 +484,12 @@ main(int argc, char **argv)
     puts("Accepted work after shutdown\n");
     puts("FAIL");
   } else {
+    if (opt_bench) {
+      int64_t usec = monotime_diff_usec(&time_started, &time_finished);
+      printf("%d items with %d threads in %.3f sec: %.0f items/sec\n",
+             n_received, opt_n_threads, usec / 1e6,
+             usec ? n_received * 1e6 / usec : 0.0);
+    }
     puts("OK");
     return 0;
   }